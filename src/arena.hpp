@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Bump allocator. Memory comes from large blocks and is only released all at once,
+ * so objects must be trivially destructible.
+ * Not thread-safe; use one arena per thread.
+ */
+struct Arena {
+    static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    explicit Arena(const size_t blockSize)
+        : blockSize(std::clamp(blockSize, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE)) {}
+
+    Arena(const Arena &)            = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /**
+     * Allocates uninitialized memory
+     * @param size number of bytes
+     * @param align alignment (power of two, at most alignof(std::max_align_t))
+     * @return pointer to memory owned by the arena
+     */
+    void *allocate(const size_t size, const size_t align) {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(current) % align) % align;
+        if (current == nullptr || padding + size > remaining) {
+            // Blocks from new[] are suitably aligned for any fundamental type
+            const size_t newBlockSize = std::max(blockSize, size);
+            blocks.emplace_back(new std::byte[newBlockSize]);
+            current   = blocks.back().get();
+            remaining = newBlockSize;
+            padding   = 0;
+        }
+
+        void *p = current + padding;
+        current += padding + size;
+        remaining -= padding + size;
+        bytesUsed += size;
+        return p;
+    }
+
+    template<typename T, typename... Args>
+    T *create(Args &&...args) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Creates n contiguous default-constructed objects
+     */
+    template<typename T>
+    T *createArray(const size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed");
+        T *p = static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < n; ++i) new (p + i) T();
+        return p;
+    }
+
+    [[nodiscard]]
+    size_t bytesAllocated() const { return bytesUsed; }
+
+private:
+    size_t blockSize;
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::byte *current = nullptr;
+    size_t remaining   = 0;
+    size_t bytesUsed   = 0;
+};
+
+/**
+ * Owns a set of per-thread arenas for a single build.
+ * Creating an arena is thread-safe; everything is released when the set is destroyed.
+ */
+struct ArenaSet {
+    ArenaSet() = default;
+
+    ArenaSet(const ArenaSet &)            = delete;
+    ArenaSet &operator=(const ArenaSet &) = delete;
+
+    /**
+     * Creates a new arena
+     * @param blockSize size hint for the arena's blocks, in bytes
+     * @return arena, valid for the lifetime of this set
+     */
+    Arena &createArena(const size_t blockSize) {
+        std::lock_guard lock(mutex);
+        arenas.push_back(std::make_unique<Arena>(blockSize));
+        return *arenas.back();
+    }
+
+    [[nodiscard]]
+    size_t bytesAllocated() {
+        std::lock_guard lock(mutex);
+        size_t total = 0;
+        for (const auto &arena: arenas) total += arena->bytesAllocated();
+        return total;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Arena>> arenas;
+};
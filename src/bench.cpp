@@ -0,0 +1,373 @@
+// simd_bvh_bench: builds BVH2, BVH4 and BVH8 over a scene, traces primary, ambient occlusion, diffuse bounce
+// and shadow rays by image tile on a work-stealing thread pool, and writes the results as JSON.
+//
+// Usage: simd_bvh_bench [--scene=path] [--width=N] [--height=N] [--tile=N] [--seed=N] [--threads=N] [--out=path]
+//                       [--stats=1] [--heatmap=prefix] [--layout=depthfirst|treelets]
+//
+// --layout sets the BVH2 and BVH4 node order (BVHNodeLayout). Each trace also reports L1D, last-level cache and dTLB
+// read misses from Linux perf events, or -1 where they are unavailable.
+// --stats adds an instrumented pass per ray set (traversal counter histograms); --heatmap also writes
+// the nodes visited by each primary ray as <prefix>_BVH2.ppm, <prefix>_BVH4.ppm and <prefix>_BVH8.ppm.
+
+#include "benchmarks.hpp"
+#include "bvhn.hpp"
+#include "parallel.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+struct BenchOptions {
+    std::string scenePath = SHADERBALL_PATH;
+    int width             = 512;
+    int height            = 512;
+    int tileSize          = 16;
+    unsigned seed         = 1337;
+    // Highest thread count to measure; 0 uses all hardware threads
+    int maxThreads      = 0;
+    std::string outPath = "simd_bvh_bench.json";
+    bool stats          = false;
+    // Empty disables the heatmap
+    std::string heatmapPrefix;
+    BVHNodeLayout nodeLayout = BVHNodeLayout::DepthFirst;
+};
+
+static BenchOptions parseOptions(const int argc, char **argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg   = argv[i];
+        const char *value = std::strchr(arg, '=');
+        if (!value) {
+            std::cerr << "Ignoring argument " << arg << "\n";
+            continue;
+        }
+
+        const std::string key(arg, value++);
+        if (key == "--scene") options.scenePath = value;
+        else if (key == "--width") options.width = std::atoi(value);
+        else if (key == "--height") options.height = std::atoi(value);
+        else if (key == "--tile") options.tileSize = std::atoi(value);
+        else if (key == "--seed") options.seed = static_cast<unsigned>(std::atoll(value));
+        else if (key == "--threads") options.maxThreads = std::atoi(value);
+        else if (key == "--out") options.outPath = value;
+        else if (key == "--stats") options.stats = std::atoi(value) != 0;
+        else if (key == "--heatmap") options.heatmapPrefix = value;
+        else if (key == "--layout" && std::strcmp(value, "depthfirst") == 0) options.nodeLayout = BVHNodeLayout::DepthFirst;
+        else if (key == "--layout" && std::strcmp(value, "treelets") == 0) options.nodeLayout = BVHNodeLayout::Treelets;
+        else std::cerr << "Ignoring argument " << arg << "\n";
+    }
+    return options;
+}
+
+/**
+ * One ray per pixel (where valid), traced with a shared interval
+ */
+struct RaySet {
+    const char *name;
+    // Occlusion rays use anyHit, the rest closestHit
+    bool occlusion;
+    Interval t;
+    std::vector<Ray> rays;
+    std::vector<char> valid;
+
+    [[nodiscard]]
+    long numRays() const {
+        long n = 0;
+        for (const char v: valid) n += v;
+        return n;
+    }
+};
+
+/**
+ * Generates every ray set from the primary hits, with a fixed seed so every run traces the same rays
+ */
+static std::vector<RaySet> makeRaySets(const BenchOptions &options, const Scene &scene, const BVH4 &bvh) {
+    const int numPixels = options.width * options.height;
+    const AABB bounds   = sceneBounds(scene);
+    const Vec3f extent  = bounds.pmax - bounds.pmin;
+    const float radius  = 0.5f * std::sqrt(jtx::dot(extent, extent));
+    const float epsilon = 1e-4f * radius;
+    const BenchCamera camera(bounds);
+
+    std::mt19937 rng(options.seed);
+    std::uniform_real_distribution<float> jitter(0.0f, 1.0f);
+
+    RaySet primary{"primary", false, Interval(0, INF), std::vector<Ray>(numPixels), std::vector<char>(numPixels, 1)};
+    for (int y = 0; y < options.height; ++y) {
+        for (int x = 0; x < options.width; ++x) {
+            primary.rays[y * options.width + x] = camera.ray((x + jitter(rng)) / options.width, (y + jitter(rng)) / options.height);
+        }
+    }
+
+    RaySet ao{"ao", true, Interval(epsilon, 0.1f * radius), std::vector<Ray>(numPixels), std::vector<char>(numPixels, 0)};
+    RaySet diffuse{"diffuse", false, Interval(epsilon, INF), std::vector<Ray>(numPixels), std::vector<char>(numPixels, 0)};
+    // Shadow rays span [origin, light], so t = 1 is the light
+    RaySet shadow{"shadow", true, Interval(epsilon, 1 - 1e-4f), std::vector<Ray>(numPixels), std::vector<char>(numPixels, 0)};
+
+    const Vec3f center = 0.5f * bounds.pmin + 0.5f * bounds.pmax;
+    const Vec3f light  = center + Vec3f(0.5f * radius, 2 * radius, 0.5f * radius);
+    for (int i = 0; i < numPixels; ++i) {
+        SurfaceIntersection record;
+        if (!bvh.closestHit(primary.rays[i], primary.t, record)) continue;
+
+        ao.rays[i]      = Ray{record.point, cosineHemisphere(record.normal, rng)};
+        diffuse.rays[i] = Ray{record.point, cosineHemisphere(record.normal, rng)};
+        shadow.rays[i]  = Ray{record.point, light - record.point};
+        ao.valid[i] = diffuse.valid[i] = shadow.valid[i] = 1;
+    }
+
+    std::vector<RaySet> sets;
+    sets.push_back(std::move(primary));
+    sets.push_back(std::move(ao));
+    sets.push_back(std::move(diffuse));
+    sets.push_back(std::move(shadow));
+    return sets;
+}
+
+/**
+ * Traces a ray set tile by tile on numThreads threads
+ * @return number of rays that hit (closest hit) or are occluded (any hit)
+ */
+template<typename BVH>
+static long traceRaySet(const BVH &bvh, const RaySet &set, const BenchOptions &options, const int numThreads) {
+    const int tilesX   = (options.width + options.tileSize - 1) / options.tileSize;
+    const int tilesY   = (options.height + options.tileSize - 1) / options.tileSize;
+    const int numTiles = tilesX * tilesY;
+
+    // Padded so threads don't share cache lines
+    struct alignas(64) ThreadHits {
+        long hits = 0;
+    };
+    std::vector<ThreadHits> hits(numThreads);
+
+    parallelForStealing(numTiles, numThreads, [&](const int tile, const int thread) {
+        const int x0 = (tile % tilesX) * options.tileSize;
+        const int y0 = (tile / tilesX) * options.tileSize;
+        const int x1 = std::min(x0 + options.tileSize, options.width);
+        const int y1 = std::min(y0 + options.tileSize, options.height);
+
+        long tileHits = 0;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                const int i = y * options.width + x;
+                if (!set.valid[i]) continue;
+
+                if (set.occlusion) {
+                    tileHits += bvh.anyHit(set.rays[i], set.t);
+                } else {
+                    PrimitiveHit hit;
+                    tileHits += bvh.closestHit(set.rays[i], set.t, hit);
+                }
+            }
+        }
+        hits[thread].hits += tileHits;
+    });
+
+    long total = 0;
+    for (const auto &h: hits) total += h.hits;
+    return total;
+}
+
+/**
+ * Traces a ray set tile by tile with traversal statistics. Each thread accumulates its own stats.
+ * @param nodesPerPixel if not null, receives the nodes (interior and leaf) visited by each pixel's ray
+ */
+template<typename BVH>
+static TraversalStatsAccumulator traceRaySetStats(const BVH &bvh, const RaySet &set, const BenchOptions &options, const int numThreads,
+                                                  std::vector<uint32_t> *nodesPerPixel) {
+    const int tilesX   = (options.width + options.tileSize - 1) / options.tileSize;
+    const int tilesY   = (options.height + options.tileSize - 1) / options.tileSize;
+    const int numTiles = tilesX * tilesY;
+
+    std::vector<TraversalStatsAccumulator> threadStats(numThreads);
+    parallelForStealing(numTiles, numThreads, [&](const int tile, const int thread) {
+        const int x0 = (tile % tilesX) * options.tileSize;
+        const int y0 = (tile / tilesX) * options.tileSize;
+        const int x1 = std::min(x0 + options.tileSize, options.width);
+        const int y1 = std::min(y0 + options.tileSize, options.height);
+
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                const int i = y * options.width + x;
+                if (!set.valid[i]) continue;
+
+                TraversalStats stats;
+                if (set.occlusion) {
+                    bvh.anyHit(set.rays[i], set.t, stats);
+                } else {
+                    PrimitiveHit hit;
+                    bvh.closestHit(set.rays[i], set.t, hit, stats);
+                }
+                threadStats[thread].add(stats);
+                if (nodesPerPixel) (*nodesPerPixel)[i] = stats.nodesVisited + stats.leavesVisited;
+            }
+        }
+    });
+
+    TraversalStatsAccumulator total;
+    for (const auto &stats: threadStats) total.merge(stats);
+    return total;
+}
+
+/**
+ * Writes a per-pixel count as a binary PPM, from black (0) through red and yellow to white (max)
+ */
+static void writeHeatmap(const std::string &path, const std::vector<uint32_t> &values, const int width, const int height) {
+    const uint32_t maxValue = std::max(1u, *std::max_element(values.begin(), values.end()));
+
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << width << " " << height << "\n255\n";
+    // Image rows go top to bottom, camera rows bottom to top
+    for (int y = height - 1; y >= 0; --y) {
+        for (int x = 0; x < width; ++x) {
+            const float v = static_cast<float>(values[y * width + x]) / static_cast<float>(maxValue);
+            const unsigned char rgb[3] = {
+                    static_cast<unsigned char>(255 * std::clamp(3 * v, 0.0f, 1.0f)),
+                    static_cast<unsigned char>(255 * std::clamp(3 * v - 1, 0.0f, 1.0f)),
+                    static_cast<unsigned char>(255 * std::clamp(3 * v - 2, 0.0f, 1.0f)),
+            };
+            out.write(reinterpret_cast<const char *>(rgb), 3);
+        }
+    }
+}
+
+static void writeHistogramJSON(std::ostream &json, const char *name, const TraversalHistogram &histogram, const uint64_t numRays) {
+    // Trailing empty buckets are dropped
+    int numBuckets = TraversalHistogram::NUM_BUCKETS;
+    while (numBuckets > 1 && histogram.buckets[numBuckets - 1] == 0) --numBuckets;
+
+    json << "\"" << name << "\": {\"mean\": " << (numRays ? static_cast<double>(histogram.total) / numRays : 0.0) << ", \"histogram\": [";
+    for (int i = 0; i < numBuckets; ++i) json << (i == 0 ? "" : ", ") << histogram.buckets[i];
+    json << "]}";
+}
+
+static std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (const char c: s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+int main(const int argc, char **argv) {
+    const BenchOptions options = parseOptions(argc, argv);
+    const int maxThreads       = resolveThreadCount(options.maxThreads);
+
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    const Scene scene = loadBenchScene(options.scenePath);
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .nodeLayout = options.nodeLayout};
+    BVH4 bvh4{.scene = scene, .nodeLayout = options.nodeLayout};
+    BVH8 bvh8{.scene = scene};
+
+    auto start = BenchClock::now();
+    bvh2.build();
+    const double bvh2BuildMs = elapsedMs(start);
+
+    start = BenchClock::now();
+    bvh4.build();
+    const double bvh4BuildMs = elapsedMs(start);
+
+    start = BenchClock::now();
+    bvh8.build();
+    const double bvh8BuildMs = elapsedMs(start);
+
+    const std::vector<RaySet> sets = makeRaySets(options, scene, bvh4);
+
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"scene\": {\"path\": " << jsonString(options.scenePath) << ", \"triangles\": " << scene.numPrimitives() << "},\n";
+    json << "  \"config\": {\"width\": " << options.width << ", \"height\": " << options.height << ", \"tileSize\": " << options.tileSize
+         << ", \"seed\": " << options.seed << ", \"maxThreads\": " << maxThreads
+         << ", \"nodeLayout\": \"" << (options.nodeLayout == BVHNodeLayout::Treelets ? "treelets" : "depthfirst") << "\"},\n";
+    json << "  \"builds\": [\n";
+    json << "    {\"bvh\": \"BVH2\", \"buildMs\": " << bvh2BuildMs << ", \"nodes\": " << bvh2.numNodes << ", \"sah\": " << computeSAHCost(bvh2.nodes) << "},\n";
+    json << "    {\"bvh\": \"BVH4\", \"buildMs\": " << bvh4BuildMs << ", \"nodes\": " << bvh4.numNodes << ", \"sah\": " << computeSAHCost(bvh4.nodes)
+         << ", \"fillRate\": " << computeBVH4FillRate(bvh4.nodes, bvh4.numNodes) << "},\n";
+    json << "    {\"bvh\": \"BVH8\", \"buildMs\": " << bvh8BuildMs << ", \"nodes\": " << bvh8.numNodes << ", \"sah\": " << computeSAHCost(bvh8.nodes)
+         << ", \"fillRate\": " << computeBVHNFillRate(bvh8.nodes, bvh8.numNodes) << "}\n";
+    json << "  ],\n";
+    json << "  \"traces\": [\n";
+
+    bool firstTrace = true;
+    const auto benchBVH = [&](const char *bvhName, const auto &bvh) {
+        for (const auto &set: sets) {
+            const long numRays = set.numRays();
+
+            json << (firstTrace ? "" : ",\n") << "    {\"bvh\": \"" << bvhName << "\", \"rays\": \"" << set.name << "\", \"numRays\": " << numRays << ", \"results\": [";
+            firstTrace = false;
+
+            double baselineMs = 0;
+            for (size_t k = 0; k < threadCounts.size(); ++k) {
+                const int threads = threadCounts[k];
+
+                long hits             = 0;
+                double ms             = 0;
+                const CacheCounters c = countCacheEvents([&] {
+                    const auto traceStart = BenchClock::now();
+                    hits                  = traceRaySet(bvh, set, options, threads);
+                    ms                    = elapsedMs(traceStart);
+                });
+                if (k == 0) baselineMs = ms;
+
+                const double mrays = numRays / (ms * 1e3);
+                json << (k == 0 ? "" : ", ") << "{\"threads\": " << threads << ", \"ms\": " << ms << ", \"mraysPerSec\": " << mrays << ", \"speedup\": " << baselineMs / ms
+                     << ", \"hits\": " << hits << ", \"l1dMisses\": " << c.l1dMisses << ", \"llcMisses\": " << c.llcMisses << ", \"dtlbMisses\": " << c.dtlbMisses << "}";
+                std::cout << "[bench] " << bvhName << " " << set.name << " " << threads << " thread(s): " << mrays << " Mrays/s\n";
+            }
+            json << "]}";
+        }
+    };
+    benchBVH("BVH2", bvh2);
+    benchBVH("BVH4", bvh4);
+    benchBVH("BVH8", bvh8);
+    json << "\n  ]";
+
+    if (options.stats || !options.heatmapPrefix.empty()) {
+        // Histogram bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i)
+        json << ",\n  \"stats\": [\n";
+        bool firstStats     = true;
+        const auto statsBVH = [&](const char *bvhName, const auto &bvh) {
+            for (const auto &set: sets) {
+                const bool heatmap = !options.heatmapPrefix.empty() && std::strcmp(set.name, "primary") == 0;
+                std::vector<uint32_t> nodesPerPixel(heatmap ? options.width * options.height : 0);
+
+                const auto stats = traceRaySetStats(bvh, set, options, maxThreads, heatmap ? &nodesPerPixel : nullptr);
+                if (heatmap) writeHeatmap(options.heatmapPrefix + "_" + bvhName + ".ppm", nodesPerPixel, options.width, options.height);
+
+                json << (firstStats ? "" : ",\n") << "    {\"bvh\": \"" << bvhName << "\", \"rays\": \"" << set.name << "\", \"numRays\": " << stats.numRays << ", ";
+                firstStats = false;
+                writeHistogramJSON(json, "nodesVisited", stats.nodesVisited, stats.numRays);
+                json << ", ";
+                writeHistogramJSON(json, "boxesTested", stats.boxesTested, stats.numRays);
+                json << ", ";
+                writeHistogramJSON(json, "leavesVisited", stats.leavesVisited, stats.numRays);
+                json << ", ";
+                writeHistogramJSON(json, "trianglesTested", stats.trianglesTested, stats.numRays);
+                json << ", ";
+                writeHistogramJSON(json, "maxStackDepth", stats.maxStackDepth, stats.numRays);
+                json << ", ";
+                writeHistogramJSON(json, "earlyOuts", stats.earlyOuts, stats.numRays);
+                json << "}";
+            }
+        };
+        statsBVH("BVH2", bvh2);
+        statsBVH("BVH4", bvh4);
+        statsBVH("BVH8", bvh8);
+        json << "\n  ]";
+    }
+    json << "\n}\n";
+
+    std::ofstream out(options.outPath);
+    out << json.str();
+    std::cout << "Wrote " << options.outPath << "\n";
+
+    bvh2.destroy();
+    bvh4.destroy();
+    bvh8.destroy();
+    scene.destroy();
+}
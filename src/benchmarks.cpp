@@ -0,0 +1,1056 @@
+#include "benchmarks.hpp"
+#include "bvhcache.hpp"
+#include "parallel.hpp"
+#include "testscene.hpp"
+#include "tlas.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Peak resident set size of the process so far, in MiB (0 if unsupported)
+ */
+static double peakRSSMiB() {
+#if defined(__APPLE__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#elif defined(__unix__)
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return 0;
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * Opens a disabled hardware cache read-miss counter for this thread and the threads it starts
+ * @return file descriptor, or -1 if the kernel refuses the counter
+ */
+static int openCacheCounter(const uint64_t cache) {
+    perf_event_attr attr{};
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.config         = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.inherit        = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+CacheCounters countCacheEvents(const std::function<void()> &f) {
+#if defined(__linux__)
+    const uint64_t caches[3] = {PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_DTLB};
+    int fds[3];
+    for (int i = 0; i < 3; ++i) {
+        fds[i] = openCacheCounter(caches[i]);
+        if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    f();
+
+    // Inherited counts from threads that have exited are included in the parent's
+    int64_t counts[3] = {-1, -1, -1};
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] < 0) continue;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) counts[i] = -1;
+        close(fds[i]);
+    }
+    return {counts[0], counts[1], counts[2]};
+#else
+    f();
+    return {};
+#endif
+}
+
+static AABB randomBox(std::mt19937 &rng) {
+    std::uniform_real_distribution<float> center(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> extent(0.1f, 2.0f);
+    const Vec3f c{center(rng), center(rng), center(rng)};
+    const Vec3f e{extent(rng), extent(rng), extent(rng)};
+    return {c - e, c + e};
+}
+
+static Ray randomRay(std::mt19937 &rng) {
+    std::uniform_real_distribution<float> origin(-20.0f, 20.0f);
+    std::uniform_real_distribution<float> target(-5.0f, 5.0f);
+    const Vec3f o{origin(rng), origin(rng), origin(rng)};
+    const Vec3f t{target(rng), target(rng), target(rng)};
+    return {o, t - o};
+}
+
+Scene loadBenchScene(const std::string &path) {
+    Scene scene;
+    if (std::filesystem::exists(path)) scene.loadMesh(path);
+    if (scene.triangles.empty()) {
+        std::cout << "[bench] " << path << " not found, using a random scene\n";
+        scene = makeRandomScene(1 << 18, 7, BENCH_SCENE_EXTENT, 0.5f);
+    }
+    return scene;
+}
+
+AABB sceneBounds(const Scene &scene) {
+    AABB bounds;
+    for (const auto &triangle: scene.triangles) bounds.expand(scene.meshes[triangle.meshIndex].tBounds(triangle.index));
+    return bounds;
+}
+
+BenchCamera::BenchCamera(const AABB &bounds) {
+    const Vec3f center = 0.5f * bounds.pmin + 0.5f * bounds.pmax;
+    const Vec3f extent = bounds.pmax - bounds.pmin;
+    const float radius = 0.5f * std::sqrt(jtx::dot(extent, extent));
+
+    origin             = center + Vec3f(0, 0.5f * radius, 2.5f * radius);
+    const Vec3f w      = jtx::normalize(origin - center);
+    const Vec3f u      = jtx::normalize(jtx::cross(Vec3f(0, 1, 0), w));
+    const Vec3f v      = jtx::cross(w, u);
+    const float height = 2 * std::tan(0.5f * 40.0f * 3.14159265f / 180.0f);
+
+    horizontal = u * height;
+    vertical   = v * height;
+    lowerLeft  = -0.5f * horizontal - 0.5f * vertical - w;
+}
+
+Vec3f cosineHemisphere(const Vec3f &n, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    const float r   = std::sqrt(uniform(rng));
+    const float phi = 2 * 3.14159265f * uniform(rng);
+
+    const Vec3f tangent   = jtx::normalize(jtx::cross(std::abs(n.x) > 0.9f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0), n));
+    const Vec3f bitangent = jtx::cross(n, tangent);
+    return tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + n * std::sqrt(std::max(0.0f, 1 - r * r));
+}
+
+/**
+ * 4-wide slab test (AABB4::hit4) against four calls to the scalar AABB::hit
+ */
+void bench_AABB4_hit4() {
+    constexpr int NUM_NODES = 1 << 12;
+    constexpr int NUM_RAYS  = 1 << 10;
+
+    std::mt19937 rng(1234);
+    std::vector<AABB> boxes(NUM_NODES * 4);
+    std::vector<AABB4> boxes4(NUM_NODES);
+    for (int n = 0; n < NUM_NODES; ++n) {
+        for (int i = 0; i < 4; ++i) {
+            const AABB box   = randomBox(rng);
+            boxes[n * 4 + i] = box;
+            for (int a = 0; a < 3; ++a) {
+                boxes4[n].pmin[a][i] = box.pmin[a];
+                boxes4[n].pmax[a][i] = box.pmax[a];
+            }
+        }
+    }
+
+    std::vector<Ray> rays(NUM_RAYS);
+    for (auto &r: rays) r = randomRay(rng);
+
+    const Interval t(0, INF);
+
+    auto start      = BenchClock::now();
+    long hitsScalar = 0;
+    for (const auto &r: rays) {
+        for (const auto &box: boxes) hitsScalar += box.hit(r.origin, r.dir, t);
+    }
+    const double scalarMs = elapsedMs(start);
+
+    start         = BenchClock::now();
+    long hitsSimd = 0;
+    for (const auto &r: rays) {
+        const PrecomputedRay ray(r);
+        for (const auto &box4: boxes4) {
+            float4 tEntry;
+            hitsSimd += std::popcount(static_cast<unsigned>(box4.hit4(ray, t.min, t.max, tEntry)));
+        }
+    }
+    const double simdMs = elapsedMs(start);
+
+    const double tests = static_cast<double>(NUM_NODES) * NUM_RAYS;
+    std::cout << "[bench] AABB4::hit4    " << simdMs * 1e6 / tests << " ns / 4 boxes (" << hitsSimd << " hits)\n";
+    std::cout << "[bench] 4x AABB::hit   " << scalarMs * 1e6 / tests << " ns / 4 boxes (" << hitsScalar << " hits)\n";
+    std::cout << "[bench] speedup        " << scalarMs / simdMs << "x\n";
+}
+
+/**
+ * BVH2 build time from 1 to N threads. The SAH cost must be the same for every thread count.
+ */
+void bench_BVH2_buildScaling() {
+    constexpr int NUM_TRIANGLES = 1 << 21;
+    const Scene scene           = makeRandomScene(NUM_TRIANGLES, 99, BENCH_SCENE_EXTENT, 0.5f);
+
+    const int maxThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    double baselineMs = 0;
+    for (const int threads: threadCounts) {
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .numBuildThreads = threads};
+
+        const auto start = BenchClock::now();
+        bvh2.build();
+        const double ms = elapsedMs(start);
+        if (threads == 1) baselineMs = ms;
+
+        std::cout << "[bench] BVH2 build " << threads << " thread(s): " << ms << " ms (" << baselineMs / ms << "x), SAH " << computeSAHCost(bvh2.nodes)
+                  << ", peak RSS " << peakRSSMiB() << " MiB\n";
+        bvh2.destroy();
+    }
+
+    scene.destroy();
+}
+
+/**
+ * Build time and SAH cost of the binned SAH builder against the Morton-code LBVH builders
+ */
+void bench_LBVH_vs_SAH() {
+    constexpr int NUM_TRIANGLES = 1 << 21;
+    const Scene scene           = makeRandomScene(NUM_TRIANGLES, 99, BENCH_SCENE_EXTENT, 0.5f);
+
+    const std::pair<BVHBuildMethod, const char *> methods[] = {
+        {BVHBuildMethod::SAH, "SAH   "},
+        {BVHBuildMethod::LBVH30, "LBVH30"},
+        {BVHBuildMethod::LBVH63, "LBVH63"},
+    };
+
+    for (const auto &[method, name]: methods) {
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .buildMethod = method};
+
+        const auto start = BenchClock::now();
+        bvh2.build();
+        const double ms = elapsedMs(start);
+
+        std::cout << "[bench] " << name << " build: " << ms << " ms, SAH " << computeSAHCost(bvh2.nodes) << "\n";
+        bvh2.destroy();
+    }
+
+    scene.destroy();
+}
+
+/**
+ * Binned SAH against SBVH (spatial splits) on a scene of large, overlapping triangles:
+ * build time, SAH cost, primitive references and camera-ray throughput on BVH2 and BVH4
+ */
+void bench_SBVH_longTriangles() {
+    constexpr int NUM_TRIANGLES = 1 << 16;
+    constexpr int WIDTH         = 512;
+    constexpr int HEIGHT        = 512;
+
+    const Scene scene = makeRandomScene(NUM_TRIANGLES, 5, BENCH_SCENE_EXTENT, 6.0f);
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(0.0f, INF);
+
+    std::vector<Ray> rays;
+    rays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            rays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+        }
+    }
+
+    const auto trace = [&](const auto &bvh, int &hits) {
+        hits             = 0;
+        const auto start = BenchClock::now();
+        for (const auto &r: rays) {
+            PrimitiveHit hit;
+            hits += bvh.closestHit(r, t, hit);
+        }
+        return rays.size() / (1000.0 * elapsedMs(start));
+    };
+
+    struct Config {
+        BVHBuildMethod method;
+        float duplicationBudget;
+        const char *name;
+    };
+    const Config configs[] = {
+        {BVHBuildMethod::SAH, 0.0f, "SAH         "},
+        {BVHBuildMethod::SBVH, 0.3f, "SBVH (+30%) "},
+        {BVHBuildMethod::SBVH, 1.0f, "SBVH (+100%)"},
+    };
+
+    for (const auto &[method, duplicationBudget, name]: configs) {
+        const SBVHSettings sbvh{.duplicationBudget = duplicationBudget};
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .buildMethod = method, .sbvh = sbvh};
+        BVH4 bvh4{.scene = scene, .buildMethod = method, .sbvh = sbvh};
+
+        auto start = BenchClock::now();
+        bvh2.build();
+        const double ms2 = elapsedMs(start);
+        start            = BenchClock::now();
+        bvh4.build();
+        const double ms4 = elapsedMs(start);
+
+        int hits2, hits4;
+        const double mrays2 = trace(bvh2, hits2);
+        const double mrays4 = trace(bvh4, hits4);
+
+        std::cout << "[bench] " << name << " BVH2 build: " << ms2 << " ms, SAH " << computeSAHCost(bvh2.nodes) << ", refs " << bvh2.primIndices.size() << ", "
+                  << mrays2 << " Mrays/s (" << hits2 << " hits)\n";
+        std::cout << "[bench] " << name << " BVH4 build: " << ms4 << " ms, SAH " << computeSAHCost(bvh4.nodes) << ", " << mrays4 << " Mrays/s (" << hits4
+                  << " hits)\n";
+
+        bvh2.destroy();
+        bvh4.destroy();
+    }
+
+    scene.destroy();
+}
+
+/**
+ * Full-precision against compressed (8-bit quantized) BVH4 nodes on a scene whose node array does not fit in cache:
+ * node memory and single-ray closest-hit throughput for coherent camera rays and incoherent random rays
+ */
+void bench_BVH4_compressedNodes() {
+    constexpr int NUM_TRIANGLES = 1 << 21;
+    constexpr int WIDTH         = 1024;
+    constexpr int HEIGHT        = 1024;
+    constexpr int NUM_RANDOM    = 1 << 20;
+
+    const Scene scene = makeRandomScene(NUM_TRIANGLES, 17, BENCH_SCENE_EXTENT, 0.5f);
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(0.0f, INF);
+
+    std::vector<Ray> cameraRays, randomRays;
+    cameraRays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) cameraRays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+    std::mt19937 rng(18);
+    randomRays.reserve(NUM_RANDOM);
+    for (int i = 0; i < NUM_RANDOM; ++i) randomRays.push_back(randomRay(rng));
+
+    for (const bool compress: {false, true}) {
+        BVH4 bvh4{.scene = scene, .compressNodes = compress};
+        bvh4.build();
+        const char *name = compress ? "compressed" : "full      ";
+        std::cout << "[bench] " << name << " nodes: " << bvh4.numNodes << ", " << bvh4.nodeBytes() / (1024.0 * 1024.0) << " MiB\n";
+
+        for (const auto &[rays, rayName]: {std::pair{&cameraRays, "camera"}, std::pair{&randomRays, "random"}}) {
+            long hits        = 0;
+            const auto start = BenchClock::now();
+            for (const auto &r: *rays) {
+                PrimitiveHit hit;
+                hits += bvh4.closestHit(r, t, hit);
+            }
+            std::cout << "[bench] " << name << " " << rayName << ": " << rays->size() / (1000.0 * elapsedMs(start)) << " Mrays/s (" << hits << " hits)\n";
+        }
+
+        bvh4.destroy();
+    }
+
+    scene.destroy();
+}
+
+/**
+ * BVH2 leaf triangle layouts on a scene whose mesh does not fit in cache: extra memory, and closest-hit and
+ * any-hit throughput for coherent camera rays and incoherent random rays
+ */
+void bench_BVH2_triangleLayout() {
+    constexpr int NUM_TRIANGLES = 1 << 21;
+    constexpr int WIDTH         = 1024;
+    constexpr int HEIGHT        = 1024;
+    constexpr int NUM_RANDOM    = 1 << 20;
+
+    const Scene scene = makeRandomScene(NUM_TRIANGLES, 23, BENCH_SCENE_EXTENT, 0.5f);
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(0.0f, INF);
+
+    std::vector<Ray> cameraRays, randomRays;
+    cameraRays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) cameraRays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+    std::mt19937 rng(24);
+    randomRays.reserve(NUM_RANDOM);
+    for (int i = 0; i < NUM_RANDOM; ++i) randomRays.push_back(randomRay(rng));
+
+    for (const auto &[layout, name]: {std::pair{BVHTriangleLayout::Indexed, "indexed "}, std::pair{BVHTriangleLayout::Vertices, "vertices"},
+                                      std::pair{BVHTriangleLayout::Edges, "edges   "}}) {
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .triangleLayout = layout};
+        bvh2.build();
+        std::cout << "[bench] " << name << " leaf triangles: " << bvh2.leafTriangles.size_bytes() / (1024.0 * 1024.0) << " MiB\n";
+
+        for (const auto &[rays, rayName]: {std::pair{&cameraRays, "camera"}, std::pair{&randomRays, "random"}}) {
+            long hits  = 0;
+            auto start = BenchClock::now();
+            for (const auto &r: *rays) {
+                PrimitiveHit hit;
+                hits += bvh2.closestHit(r, t, hit);
+            }
+            const double closestMs = elapsedMs(start);
+
+            long occluded = 0;
+            start         = BenchClock::now();
+            for (const auto &r: *rays) occluded += bvh2.anyHit(r, t);
+            const double anyMs = elapsedMs(start);
+
+            std::cout << "[bench] " << name << " " << rayName << ": closest " << rays->size() / (1000.0 * closestMs) << " Mrays/s, any "
+                      << rays->size() / (1000.0 * anyMs) << " Mrays/s (" << hits << " hits, " << occluded << " occluded)\n";
+        }
+
+        bvh2.destroy();
+    }
+
+    scene.destroy();
+}
+
+/**
+ * Per-frame cost of keeping a BVH4 up to date on a twisting mesh: full rebuild against refit, with and without
+ * rebuilding degraded subtrees, and the camera-ray throughput each leaves behind
+ */
+void bench_BVH_refit() {
+    constexpr int NUM_TRIANGLES     = 1 << 20;
+    constexpr int NUM_FRAMES        = 8;
+    constexpr int WIDTH             = 512;
+    constexpr int HEIGHT            = 512;
+    constexpr float MAX_SAH_GROWTH  = 1.5f;
+    constexpr float TWIST_PER_FRAME = 0.02f;
+
+    const Scene scene = makeRandomScene(NUM_TRIANGLES, 53, BENCH_SCENE_EXTENT, 0.5f);
+    const Mesh &mesh  = scene.meshes[0];
+    const std::vector rest(mesh.vertices, mesh.vertices + mesh.numVertices);
+
+    BVH4 rebuilt{.scene = scene};
+    BVH4 refit{.scene = scene};
+    BVH4 refitRebuild{.scene = scene};
+    rebuilt.build();
+    refit.build();
+    refitRebuild.build();
+
+    const BenchCamera camera(sceneBounds(scene));
+    std::vector<Ray> rays;
+    rays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) rays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+    const auto cameraMrays = [&](const BVH4 &bvh4) {
+        const auto start = BenchClock::now();
+        for (const auto &r: rays) {
+            PrimitiveHit hit;
+            bvh4.closestHit(r, Interval(0.0f, INF), hit);
+        }
+        return rays.size() / (1000.0 * elapsedMs(start));
+    };
+
+    for (int frame = 1; frame <= NUM_FRAMES; ++frame) {
+        // Twist about the y axis: nearby vertices move together, but the tree drifts further from its build each frame
+        for (int i = 0; i < mesh.numVertices; ++i) {
+            const Vec3f &p    = rest[i];
+            const float angle = TWIST_PER_FRAME * frame * p.y;
+            mesh.vertices[i]  = Vec3f(p.x * std::cos(angle) - p.z * std::sin(angle), p.y, p.x * std::sin(angle) + p.z * std::cos(angle));
+        }
+
+        rebuilt.destroy();
+        auto start = BenchClock::now();
+        rebuilt.build();
+        const double buildMs = elapsedMs(start);
+
+        start                          = BenchClock::now();
+        const BVHRefitResult refitOnly = refit.refit();
+        const double refitMs           = elapsedMs(start);
+
+        start                             = BenchClock::now();
+        const BVHRefitResult withRebuilds = refitRebuild.refit(MAX_SAH_GROWTH);
+        const double refitRebuildMs       = elapsedMs(start);
+
+        std::cout << "[bench] frame " << frame << ": build " << buildMs << " ms, refit " << refitMs << " ms (SAH x" << refitOnly.sahGrowth << "), refit+rebuild "
+                  << refitRebuildMs << " ms (SAH x" << withRebuilds.sahGrowth << ", " << withRebuilds.rebuiltSubtrees << " subtrees)\n";
+    }
+
+    std::cout << "[bench] camera after " << NUM_FRAMES << " frames: build " << cameraMrays(rebuilt) << " Mrays/s, refit " << cameraMrays(refit)
+              << " Mrays/s, refit+rebuild " << cameraMrays(refitRebuild) << " Mrays/s\n";
+
+    rebuilt.destroy();
+    refit.destroy();
+    refitRebuild.destroy();
+    scene.destroy();
+}
+
+static size_t meshBytes(const Scene &scene) {
+    size_t total = scene.triangles.size() * sizeof(Triangle);
+    for (const auto &mesh: scene.meshes) {
+        total += mesh.numIndices * sizeof(Vec3i) + mesh.numVertices * (2 * sizeof(Vec3f) + (mesh.uvs ? sizeof(Vec2f) : 0));
+    }
+    return total;
+}
+
+/**
+ * Heavy instancing (a few meshes placed many times): memory, build time and camera-ray throughput of a two-level BVH
+ * against one BVH4 over the flattened scene
+ */
+void bench_TLAS_instancing() {
+    constexpr int NUM_MESHES         = 16;
+    constexpr int TRIANGLES_PER_MESH = 2048;
+    constexpr int NUM_INSTANCES      = 1024;
+    constexpr int WIDTH              = 512;
+    constexpr int HEIGHT             = 512;
+
+    Scene scene;
+    for (int m = 0; m < NUM_MESHES; ++m) {
+        const Scene part = makeRandomScene(TRIANGLES_PER_MESH, 31 + m, BENCH_SCENE_EXTENT, 0.5f);
+        scene.meshes.push_back(part.meshes[0]);
+    }
+
+    std::mt19937 rng(47);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Instance> instances;
+    for (int i = 0; i < NUM_INSTANCES; ++i) {
+        const float scale = 0.5f + 0.5f * unit(rng);
+        const Vec3f axis  = jtx::normalize(Vec3f(unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f));
+        const Vec3f translation{200 * unit(rng) - 100, 200 * unit(rng) - 100, 200 * unit(rng) - 100};
+        instances.push_back(Instance{i % NUM_MESHES, AffineTransform::fromScaleRotateTranslate(Vec3f(scale, scale, scale), axis, 6.28f * unit(rng), translation)});
+    }
+
+    auto start = BenchClock::now();
+    TLAS<BVH4> tlas{.instances = instances, .scene = scene};
+    tlas.build();
+    const double tlasMs = elapsedMs(start);
+
+    start            = BenchClock::now();
+    const Scene flat = flattenInstances(scene, instances);
+    BVH4 flatBVH{.scene = flat};
+    flatBVH.build();
+    const double flatMs = elapsedMs(start);
+
+    constexpr double MiB = 1024.0 * 1024.0;
+    std::cout << "[bench] instanced: " << flat.numPrimitives() << " triangles from " << NUM_MESHES << " meshes x " << TRIANGLES_PER_MESH << " in "
+              << NUM_INSTANCES << " instances\n";
+    std::cout << "[bench] two-level build: " << tlasMs << " ms, " << (tlas.bytes() + meshBytes(scene)) / MiB << " MiB\n";
+    std::cout << "[bench] flattened build: " << flatMs << " ms (incl. flattening), "
+              << (flatBVH.nodeBytes() + flatBVH.triangles4.size_bytes() + meshBytes(flat)) / MiB << " MiB\n";
+
+    const BenchCamera camera(sceneBounds(flat));
+    std::vector<Ray> rays;
+    rays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) rays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+
+    long hits = 0;
+    start     = BenchClock::now();
+    for (const auto &r: rays) {
+        InstanceHit hit;
+        hits += tlas.closestHit(r, Interval(0.0f, INF), hit);
+    }
+    std::cout << "[bench] two-level camera: " << rays.size() / (1000.0 * elapsedMs(start)) << " Mrays/s (" << hits << " hits)\n";
+
+    hits  = 0;
+    start = BenchClock::now();
+    for (const auto &r: rays) {
+        PrimitiveHit hit;
+        hits += flatBVH.closestHit(r, Interval(0.0f, INF), hit);
+    }
+    std::cout << "[bench] flattened camera: " << rays.size() / (1000.0 * elapsedMs(start)) << " Mrays/s (" << hits << " hits)\n";
+
+    tlas.destroy();
+    flatBVH.destroy();
+    flat.destroy();
+    scene.destroy();
+}
+
+/**
+ * Asks the OS to evict a file from the page cache, so it is read from disk again (best effort, Linux/BSD only)
+ */
+static void dropFromPageCache(const std::string &path) {
+#if defined(__unix__)
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void) path;
+#endif
+}
+
+/**
+ * Startup time to the first traced frame: importing the mesh and building BVH2 + BVH4, against mapping both from
+ * the BVH cache with the files evicted from the page cache (cold) and resident (warm).
+ * Falls back to a random scene (generated instead of imported) without the shaderball.
+ */
+void bench_Scene_loadMesh() {
+    // Without the asset, the random bench scene is written out so the same import path is timed
+    const bool haveSource = std::filesystem::exists(SHADERBALL_PATH);
+    const std::string path = haveSource ? SHADERBALL_PATH : (std::filesystem::temp_directory_path() / "simd_bvh_bench_import.obj").string();
+    if (!haveSource) {
+        const Scene generated = loadBenchScene();
+        writeSceneObj(generated, path);
+        generated.destroy();
+    }
+
+    const auto timeImport = [&](const char *name, const MeshImportSettings &settings) {
+        Scene scene;
+        const auto start = BenchClock::now();
+        scene.loadMesh(path, settings);
+        const double ms = elapsedMs(start);
+        std::cout << "[bench] loadMesh " << name << ": " << ms << " ms, " << scene.triangles.size() << " triangles\n";
+        scene.destroy();
+    };
+
+    // The first import also pulls the file into the page cache
+    timeImport("warm-up", {});
+    timeImport("default", {});
+    timeImport("single thread", {.numThreads = 1});
+    timeImport("no triangulation or UV flip", {.triangulate = false, .flipUVs = false});
+
+    if (!haveSource) std::filesystem::remove(path);
+}
+
+void bench_BVHCache_startup() {
+    constexpr int WIDTH  = 256;
+    constexpr int HEIGHT = 256;
+
+    const bool haveSource       = std::filesystem::exists(SHADERBALL_PATH);
+    const std::string cachePath = (std::filesystem::temp_directory_path() / "simd_bvh_bench.bvhcache").string();
+
+    // The first frame touches the mapped pages a real run needs
+    const auto traceFrame = [&](const Scene &scene, const BVH2 &bvh2, const BVH4 &bvh4) {
+        const BenchCamera camera(sceneBounds(scene));
+        long hits = 0;
+        for (int y = 0; y < HEIGHT; ++y) {
+            for (int x = 0; x < WIDTH; ++x) {
+                const Ray r = camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT);
+                PrimitiveHit hit;
+                hits += bvh2.closestHit(r, Interval(0.0f, INF), hit);
+                hits += bvh4.closestHit(r, Interval(0.0f, INF), hit);
+            }
+        }
+        return hits;
+    };
+
+    if (haveSource) dropFromPageCache(SHADERBALL_PATH);
+    auto start = BenchClock::now();
+    Scene scene;
+    if (haveSource) scene.loadMesh(SHADERBALL_PATH);
+    else scene = makeRandomScene(1 << 20, 7, BENCH_SCENE_EXTENT, 0.5f);
+    const double importMs = elapsedMs(start);
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    BVH4 bvh4{.scene = scene};
+    bvh2.build();
+    bvh4.build();
+    const long hits            = traceFrame(scene, bvh2, bvh4);
+    const double importFrameMs = elapsedMs(start);
+
+    const auto sourceHash = [&] { return hashFile(SHADERBALL_PATH).value_or(7); };
+    start                 = BenchClock::now();
+    saveBVHCache(cachePath, bvhCacheKey(sourceHash(), &bvh2, &bvh4), scene, &bvh2, &bvh4);
+    const double saveMs = elapsedMs(start);
+    std::cout << "[bench] " << (haveSource ? "import" : "generate") << " + build + frame: " << importFrameMs << " ms (import " << importMs << " ms), cache write "
+              << saveMs << " ms, " << std::filesystem::file_size(cachePath) / (1024.0 * 1024.0) << " MiB\n";
+
+    for (const bool cold: {true, false}) {
+        if (cold) {
+            dropFromPageCache(cachePath);
+            if (haveSource) dropFromPageCache(SHADERBALL_PATH);
+        }
+
+        start = BenchClock::now();
+        Scene cached;
+        BVH2 cachedBVH2{.maxPrimsInNode = 4, .scene = cached};
+        BVH4 cachedBVH4{.scene = cached};
+        const bool loaded     = loadBVHCache(cachePath, bvhCacheKey(sourceHash(), &cachedBVH2, &cachedBVH4), cached, &cachedBVH2, &cachedBVH4);
+        const double loadMs   = elapsedMs(start);
+        const long cachedHits = loaded ? traceFrame(cached, cachedBVH2, cachedBVH4) : 0;
+        std::cout << "[bench] cache " << (cold ? "cold" : "warm") << " load + frame: " << elapsedMs(start) << " ms (load " << loadMs << " ms)"
+                  << (cachedHits == hits ? "" : ", HIT MISMATCH") << "\n";
+    }
+
+    std::filesystem::remove(cachePath);
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+}
+
+/**
+ * Packet traversal (RayPacket4/8) against single rays on BVH4, for pinhole camera rays and ambient occlusion rays
+ */
+void bench_BVH4_packets() {
+    constexpr int WIDTH       = 1024;
+    constexpr int HEIGHT      = 1024;
+    constexpr int AO_SAMPLES  = 8;
+    constexpr float AO_RADIUS = 0.1f;
+
+    const Scene scene = loadBenchScene();
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    const AABB bounds = sceneBounds(scene);
+    const BenchCamera camera(bounds);
+    const Interval primaryT(0.0f, INF);
+
+    const auto report = [](const char *name, const double ms, const long numRays, const long numHits) {
+        std::cout << "[bench] " << name << numRays / (ms * 1e3) << " Mrays/s (" << numHits << " hits)\n";
+    };
+    const auto pixelRay = [&](const int x, const int y) {
+        return camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT);
+    };
+
+    // Primary rays
+    std::vector<SurfaceIntersection> primaryHits(WIDTH * HEIGHT);
+    std::vector<char> primaryHit(WIDTH * HEIGHT);
+
+    auto start = BenchClock::now();
+    long hits  = 0;
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            const int i   = y * WIDTH + x;
+            primaryHit[i] = bvh4.closestHit(pixelRay(x, y), primaryT, primaryHits[i]);
+            hits += primaryHit[i];
+        }
+    }
+    report("primary single   ", elapsedMs(start), WIDTH * HEIGHT, hits);
+
+    // 2x2 and 4x2 pixel tiles
+    const auto tracePackets = [&]<int N>(const char *name) {
+        constexpr int TILE_WIDTH = N / 2;
+
+        const auto tileStart = BenchClock::now();
+        long packetHits      = 0;
+        for (int y = 0; y < HEIGHT; y += 2) {
+            for (int x = 0; x < WIDTH; x += TILE_WIDTH) {
+                RayPacket<N> packet;
+                for (int i = 0; i < N; ++i) packet.setRay(i, pixelRay(x + i % TILE_WIDTH, y + i / TILE_WIDTH), primaryT);
+
+                PrimitiveHit packetHit[N];
+                if constexpr (N == 4) {
+                    packetHits += std::popcount(static_cast<unsigned>(bvh4.closestHit4(packet, packetHit)));
+                } else {
+                    packetHits += std::popcount(static_cast<unsigned>(bvh4.closestHit8(packet, packetHit)));
+                }
+            }
+        }
+        report(name, elapsedMs(tileStart), WIDTH * HEIGHT, packetHits);
+    };
+    tracePackets.operator()<4>("primary packet4  ");
+    tracePackets.operator()<8>("primary packet8  ");
+
+    // Ambient occlusion: AO_SAMPLES rays per primary hit, all sharing its origin
+    const float aoDistance = AO_RADIUS * std::sqrt(jtx::dot(bounds.pmax - bounds.pmin, bounds.pmax - bounds.pmin));
+    std::vector<Ray> aoRays;
+    std::mt19937 rng(4321);
+    for (int i = 0; i < WIDTH * HEIGHT; ++i) {
+        if (!primaryHit[i]) continue;
+        const SurfaceIntersection &record = primaryHits[i];
+        for (int s = 0; s < AO_SAMPLES; ++s) aoRays.push_back(Ray{record.point, cosineHemisphere(record.normal, rng)});
+    }
+    const Interval aoT(1e-4f * aoDistance, aoDistance);
+    const long numAORays = static_cast<long>(aoRays.size());
+
+    start = BenchClock::now();
+    hits  = 0;
+    for (const auto &r: aoRays) hits += bvh4.anyHit(r, aoT);
+    report("AO single        ", elapsedMs(start), numAORays, hits);
+
+    const auto traceAOPackets = [&]<int N>(const char *name) {
+        const auto packetStart = BenchClock::now();
+        long occluded          = 0;
+        for (size_t first = 0; first < aoRays.size(); first += N) {
+            RayPacket<N> packet;
+            for (int i = 0; i < N && first + i < aoRays.size(); ++i) packet.setRay(i, aoRays[first + i], aoT);
+
+            if constexpr (N == 4) {
+                occluded += std::popcount(static_cast<unsigned>(bvh4.anyHit4(packet)));
+            } else {
+                occluded += std::popcount(static_cast<unsigned>(bvh4.anyHit8(packet)));
+            }
+        }
+        report(name, elapsedMs(packetStart), numAORays, occluded);
+    };
+    traceAOPackets.operator()<4>("AO packet4       ");
+    traceAOPackets.operator()<8>("AO packet8       ");
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+/**
+ * Batched BVH2 occlusion (BVH2::occluded) against a loop over BVH2::anyHit, for shadow rays from every primary hit to
+ * a point light. Both are run on one thread and on all threads; they must agree on the number of occluded rays.
+ */
+void bench_BVH2_shadowRays() {
+    constexpr int WIDTH  = 1024;
+    constexpr int HEIGHT = 1024;
+
+    const Scene scene = loadBenchScene();
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    bvh2.build();
+
+    const AABB bounds = sceneBounds(scene);
+    const BenchCamera camera(bounds);
+    const Vec3f extent = bounds.pmax - bounds.pmin;
+    const Vec3f light  = 0.5f * bounds.pmin + 0.5f * bounds.pmax + Vec3f(0.25f * extent.x, extent.y, 0.25f * extent.z);
+
+    // Shadow rays in pixel order, so neighbouring rays tend to share an occluder
+    std::vector<Ray> rays;
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            const Ray r = camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT);
+            SurfaceIntersection record;
+            if (bvh2.closestHit(r, Interval(0.0f, INF), record)) rays.push_back(Ray{record.point, light - record.point});
+        }
+    }
+    // Directions run to the light, so the light sits at t = 1
+    const Interval t(1e-4f, 1 - 1e-4f);
+    const double numRays = static_cast<double>(rays.size());
+    const int maxThreads = resolveThreadCount(0);
+
+    const auto report = [&](const char *name, const int threads, const double ms, const long occluded) {
+        std::cout << "[bench] " << name << threads << " thread(s): " << numRays / (ms * 1e3) << " Mrays/s (" << occluded << " of " << rays.size()
+                  << " occluded)\n";
+    };
+
+    for (const int threads: {1, maxThreads}) {
+        std::vector<char> anyHits(rays.size());
+        auto start = BenchClock::now();
+        parallelForStealing(static_cast<int>(occlusionMaskWords(rays.size())), threads, [&](const int task, int) {
+            const size_t first = static_cast<size_t>(task) * 64;
+            for (size_t i = first; i < std::min(rays.size(), first + 64); ++i) anyHits[i] = bvh2.anyHit(rays[i], t);
+        });
+        report("anyHit loop ", threads, elapsedMs(start), std::count(anyHits.begin(), anyHits.end(), 1));
+
+        std::vector<uint64_t> mask(occlusionMaskWords(rays.size()));
+        start = BenchClock::now();
+        bvh2.occluded(rays, t, mask, threads);
+        const double ms = elapsedMs(start);
+
+        long occluded = 0;
+        for (const uint64_t word: mask) occluded += std::popcount(word);
+        report("occluded    ", threads, ms, occluded);
+    }
+
+    bvh2.destroy();
+    scene.destroy();
+}
+
+/**
+ * BVH2 short-stack traversal against the full-stack traversal, for camera rays and one diffuse bounce
+ */
+void bench_BVH2_shortStack() {
+    constexpr int WIDTH  = 1024;
+    constexpr int HEIGHT = 1024;
+
+    const Scene scene = loadBenchScene();
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    bvh2.build();
+    std::cout << "[bench] BVH2 depth " << bvh2.maxDepth << ", stack per ray: full " << BVH2_STACK_SIZE * sizeof(int) << " B, short "
+              << BVH2_SHORT_STACK_SIZE * sizeof(int) << " B, parent links " << bvh2.parentIndices.size() * sizeof(int) / 1024 << " KiB\n";
+
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(1e-4f, INF);
+
+    std::vector<Ray> cameraRays;
+    cameraRays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) cameraRays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+
+    std::mt19937 rng(77);
+    std::vector<Ray> bounceRays;
+    for (const auto &r: cameraRays) {
+        SurfaceIntersection record;
+        if (bvh2.closestHit(r, t, record)) bounceRays.push_back(Ray{record.point, cosineHemisphere(record.normal, rng)});
+    }
+
+    const auto run = [&](const char *name, const std::vector<Ray> &rays, const auto &trace) {
+        const auto start = BenchClock::now();
+        long hits        = 0;
+        for (const auto &r: rays) hits += trace(r);
+        const double ms = elapsedMs(start);
+        std::cout << "[bench] " << name << rays.size() / (ms * 1e3) << " Mrays/s (" << hits << " hits)\n";
+    };
+    const auto closestFull = [&](const Ray &r) {
+        PrimitiveHit hit;
+        return bvh2.closestHit(r, t, hit);
+    };
+    const auto closestShort = [&](const Ray &r) {
+        PrimitiveHit hit;
+        return bvh2.closestHitShortStack(r, t, hit);
+    };
+    const auto anyFull = [&](const Ray &r) {
+        return bvh2.anyHit(r, t);
+    };
+    const auto anyShort = [&](const Ray &r) {
+        return bvh2.anyHitShortStack(r, t);
+    };
+
+    run("camera closest full  ", cameraRays, closestFull);
+    run("camera closest short ", cameraRays, closestShort);
+    run("bounce closest full  ", bounceRays, closestFull);
+    run("bounce closest short ", bounceRays, closestShort);
+    run("bounce any full      ", bounceRays, anyFull);
+    run("bounce any short     ", bounceRays, anyShort);
+
+    bvh2.destroy();
+    scene.destroy();
+}
+
+/**
+ * Depth-first against treelet node layouts on BVH2 and BVH4, for camera rays and one diffuse bounce on a large scene,
+ * with single-thread throughput and cache misses per ray
+ */
+void bench_BVH_nodeLayout() {
+    constexpr int NUM_TRIANGLES = 1 << 22;
+    constexpr int WIDTH         = 1024;
+    constexpr int HEIGHT        = 1024;
+
+    // Large enough that the node arrays are far bigger than the last-level cache
+    const Scene scene = makeRandomScene(NUM_TRIANGLES, 61, BENCH_SCENE_EXTENT, 0.5f);
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(1e-4f, INF);
+
+    std::vector<Ray> cameraRays;
+    cameraRays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) cameraRays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+
+    const auto run = [&]<typename BVH>(const char *name, const BVHNodeLayout layout) {
+        BVH bvh{.scene = scene, .nodeLayout = layout};
+        if constexpr (std::is_same_v<BVH, BVH2>) bvh.maxPrimsInNode = 4;
+        const auto start = BenchClock::now();
+        bvh.build();
+        const double buildMs = elapsedMs(start);
+
+        std::mt19937 rng(67);
+        std::vector<Ray> bounceRays;
+        for (const auto &r: cameraRays) {
+            SurfaceIntersection record;
+            if (bvh.closestHit(r, t, record)) bounceRays.push_back(Ray{record.point, cosineHemisphere(record.normal, rng)});
+        }
+
+        std::cout << "[bench] " << name << " build " << buildMs << " ms\n";
+        const auto trace = [&](const char *raysName, const std::vector<Ray> &rays) {
+            long hits             = 0;
+            double ms             = 0;
+            const CacheCounters c = countCacheEvents([&] {
+                const auto traceStart = BenchClock::now();
+                for (const auto &r: rays) {
+                    PrimitiveHit hit;
+                    hits += bvh.closestHit(r, t, hit);
+                }
+                ms = elapsedMs(traceStart);
+            });
+
+            const double numRays = static_cast<double>(rays.size());
+            const auto perRay    = [&](const int64_t count) {
+                return count < 0 ? std::string("n/a") : std::to_string(count / numRays);
+            };
+            std::cout << "[bench] " << name << " " << raysName << ": " << numRays / (ms * 1e3) << " Mrays/s, misses per ray: L1D " << perRay(c.l1dMisses) << ", LLC "
+                      << perRay(c.llcMisses) << ", dTLB " << perRay(c.dtlbMisses) << " (" << hits << " hits)\n";
+        };
+        trace("camera", cameraRays);
+        trace("bounce", bounceRays);
+        bvh.destroy();
+    };
+    run.operator()<BVH2>("BVH2 depth first", BVHNodeLayout::DepthFirst);
+    run.operator()<BVH2>("BVH2 treelets   ", BVHNodeLayout::Treelets);
+    run.operator()<BVH4>("BVH4 depth first", BVHNodeLayout::DepthFirst);
+    run.operator()<BVH4>("BVH4 treelets   ", BVHNodeLayout::Treelets);
+
+    scene.destroy();
+}
+
+/**
+ * Stream traversal against single rays on BVH4, for diffuse path-tracing bounces 1 to 4.
+ * Each depth bounces the rays that hit at the previous depth, so both paths trace the same rays.
+ */
+void bench_BVH4_stream() {
+    constexpr int WIDTH     = 256;
+    constexpr int HEIGHT    = 256;
+    constexpr int MAX_DEPTH = 4;
+
+    const Scene scene = loadBenchScene();
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    const BenchCamera camera(sceneBounds(scene));
+    const Interval t(1e-4f, INF);
+
+    // One wavefront of primary rays
+    std::vector<Ray> rays;
+    rays.reserve(WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) rays.push_back(camera.ray((x + 0.5f) / WIDTH, (y + 0.5f) / HEIGHT));
+    }
+
+    std::mt19937 rng(2024);
+    std::vector<PrimitiveHit> hits(rays.size());
+    for (int depth = 0; depth <= MAX_DEPTH; ++depth) {
+        hits.resize(rays.size());
+
+        auto start = BenchClock::now();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (!bvh4.closestHit(rays[i], t, hits[i])) hits[i].primIndex = -1;
+        }
+        const double singleMs = elapsedMs(start);
+
+        start = BenchClock::now();
+        bvh4.closestHitStream(rays, t, hits);
+        const double streamMs = elapsedMs(start);
+
+        // Depth 0 (camera rays) only seeds the first bounce
+        if (depth > 0) {
+            const double numRays = static_cast<double>(rays.size());
+            std::cout << "[bench] bounce " << depth << ": " << rays.size() << " rays, single " << numRays / (singleMs * 1e3) << " Mrays/s, stream "
+                      << numRays / (streamMs * 1e3) << " Mrays/s (" << singleMs / streamMs << "x)\n";
+        }
+
+        std::vector<Ray> bounces;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (hits[i].primIndex < 0) continue;
+            SurfaceIntersection record;
+            scene.finalizeIntersection(rays[i], hits[i], record);
+            bounces.push_back(Ray{record.point, cosineHemisphere(record.normal, rng)});
+        }
+        rays.swap(bounces);
+        if (rays.empty()) break;
+    }
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+const BenchFnPtr BENCH_FN_PTRS[] = {
+    bench_AABB4_hit4,
+    bench_BVH2_buildScaling,
+    bench_LBVH_vs_SAH,
+    bench_SBVH_longTriangles,
+    bench_BVH4_compressedNodes,
+    bench_BVH2_triangleLayout,
+    bench_BVH_refit,
+    bench_TLAS_instancing,
+    bench_Scene_loadMesh,
+    bench_BVHCache_startup,
+    bench_BVH4_packets,
+    bench_BVH2_shadowRays,
+    bench_BVH2_shortStack,
+    bench_BVH_nodeLayout,
+    bench_BVH4_stream,
+};
+
+const std::size_t BENCH_FN_PTRS_SIZE = sizeof(BENCH_FN_PTRS) / sizeof(BenchFnPtr);
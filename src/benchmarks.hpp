@@ -0,0 +1,74 @@
+#pragma once
+
+#include "bvh4.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using BenchClock = std::chrono::steady_clock;
+
+inline double elapsedMs(const BenchClock::time_point start) {
+    return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+// Same asset as main.cpp, relative to the build directory
+static constexpr auto SHADERBALL_PATH = "../src/assets/shaderball_hsd.obj";
+
+// Random benchmark scenes (makeRandomScene) are centered in [-10, 10]^3
+static constexpr float BENCH_SCENE_EXTENT = 10;
+
+/**
+ * Loads a mesh, or falls back to a random scene if it is not available
+ */
+Scene loadBenchScene(const std::string &path = SHADERBALL_PATH);
+
+AABB sceneBounds(const Scene &scene);
+
+/**
+ * Pinhole camera looking at the center of the scene bounds from the front, slightly above
+ */
+struct BenchCamera {
+    Vec3f origin, lowerLeft, horizontal, vertical;
+
+    explicit BenchCamera(const AABB &bounds);
+
+    /**
+     * Ray through a point on the image plane
+     * @param s horizontal image coordinate [0, 1]
+     * @param t vertical image coordinate [0, 1]
+     */
+    [[nodiscard]]
+    Ray ray(const float s, const float t) const {
+        return {origin, lowerLeft + s * horizontal + t * vertical};
+    }
+};
+
+/**
+ * Cosine-weighted direction about a normal
+ */
+Vec3f cosineHemisphere(const Vec3f &n, std::mt19937 &rng);
+
+/**
+ * Hardware cache event counts; -1 where the counter is unavailable
+ */
+struct CacheCounters {
+    // L1 data cache read misses, i.e. loads served by L2 or beyond
+    int64_t l1dMisses = -1;
+    // Last-level cache read misses, i.e. loads served by memory
+    int64_t llcMisses  = -1;
+    int64_t dtlbMisses = -1;
+};
+
+/**
+ * Runs f while counting cache events on the calling thread and the threads it starts (Linux perf events).
+ * Counters the kernel refuses, e.g. under perf_event_paranoid or in a virtual machine, read as -1.
+ */
+CacheCounters countCacheEvents(const std::function<void()> &f);
+
+using BenchFnPtr = void (*)();
+extern const BenchFnPtr BENCH_FN_PTRS[];
+extern const std::size_t BENCH_FN_PTRS_SIZE;
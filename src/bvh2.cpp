@@ -1,4 +1,11 @@
 #include "bvh2.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "parallel.hpp"
+
+#include <array>
+#include <atomic>
+#include <thread>
 
 struct BVH2Bucket {
     int count = 0;
@@ -6,46 +13,145 @@ struct BVH2Bucket {
 };
 
 
-void BVH2::build() {
-    primitives.resize(scene.numPrimitives());
+BVH2Node *buildSceneBVH2Tree(ArenaSet &arenas, const Scene &scene, const BVHBuildMethod method, const SBVHSettings &sbvh, int *totalNodes, std::vector<Primitive> &orderedPrimitives,
+                             const int maxPrimsInNode, const int numThreads) {
+    if (scene.triangles.empty()) return nullptr;
 
-    std::vector<Primitive> bvhPrimitives(primitives.size());
+    std::vector<Primitive> bvhPrimitives(scene.numPrimitives());
     for (size_t i = 0; i < scene.triangles.size(); ++i) {
-        primitives[i]   = Primitive{Primitive::TRIANGLE, i, scene.meshes[scene.triangles[i].meshIndex].tBounds(scene.triangles[i].index)};
-        bvhPrimitives[i] = Primitive{Primitive::TRIANGLE, i, scene.meshes[scene.triangles[i].meshIndex].tBounds(scene.triangles[i].index)};
+        bvhPrimitives[i] = Primitive{Primitive::TRIANGLE, static_cast<uint32_t>(i), scene.meshes[scene.triangles[i].meshIndex].tBounds(scene.triangles[i].index)};
     }
 
-    std::vector<Primitive> orderedPrimitives(primitives.size());
-
-    int totalNodes             = 1;
+    orderedPrimitives.resize(bvhPrimitives.size());
     int orderedPrimitiveOffset = 0;
 
-    const BVH2Node *root = buildBVH2Tree(bvhPrimitives, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode);
-    primitives.swap(orderedPrimitives);
+    switch (method) {
+        case BVHBuildMethod::LBVH30:
+        case BVHBuildMethod::LBVH63:
+            return buildLBVH2Tree(arenas, bvhPrimitives, totalNodes, &orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode, numThreads, method == BVHBuildMethod::LBVH63);
+        case BVHBuildMethod::SBVH:
+            return buildSBVH2Tree(arenas, scene, bvhPrimitives, totalNodes, &orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode, sbvh);
+        default:
+            return buildBVH2Tree(arenas, bvhPrimitives, totalNodes, &orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode, numThreads);
+    }
+}
 
-    bvhPrimitives.resize(0);
-    bvhPrimitives.shrink_to_fit();
+void BVH2::build() {
+    std::vector<Primitive> orderedPrimitives;
+    int totalNodes = 0;
+
+    // Intermediate tree is released with the arenas at the end of the build.
+    // The build-only bounds of the input primitives are dropped as soon as the tree exists.
+    ArenaSet arenas;
+    const BVH2Node *root = buildSceneBVH2Tree(arenas, scene, buildMethod, sbvh, &totalNodes, orderedPrimitives, maxPrimsInNode, numBuildThreads);
+
+    // Traversal only needs the triangle index
+    primIndices = {new uint32_t[orderedPrimitives.size()], orderedPrimitives.size()};
+    for (size_t i = 0; i < orderedPrimitives.size(); ++i) primIndices[i] = orderedPrimitives[i].index;
+    orderedPrimitives.resize(0);
+    orderedPrimitives.shrink_to_fit();
+
+    if (triangleLayout != BVHTriangleLayout::Indexed) {
+        leafTriangles = {new LeafTriangle[primIndices.size()], primIndices.size()};
+        for (size_t i = 0; i < primIndices.size(); ++i) updateLeafTriangle(i);
+    }
 
-    nodes     = new LBVH2Node[totalNodes];
+    nodes      = allocateBVHNodes<LBVH2Node>(totalNodes);
+    numNodes   = totalNodes;
     int offset = 0;
-    flattenBVH2toLBVH2(root, nodes, &offset);
+    if (root) flattenBVH2toLBVH2(root, nodes, &offset);
+    // Bounds only match the vertices until they next move, so refit measures its cost growth from here
+    computeRefitReferenceCosts();
+    if (nodeLayout != BVHNodeLayout::DepthFirst) layoutLBVH2Nodes(nodes, numNodes, nodeLayout);
+    linkParents();
+}
+
+void BVH2::linkParents() {
+    parentIndices.assign(numNodes, -1);
+    maxDepth = 0;
+    if (numNodes == 0) return;
+
+    // Growable stack, as the tree may be deeper than any fixed traversal stack
+    std::vector<std::pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        const auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+
+        const LBVH2Node &node = nodes[nodeIndex];
+        if (node.numPrimitives > 0) {
+            maxDepth = std::max(maxDepth, depth);
+            continue;
+        }
+        parentIndices[nodeIndex + 1]          = nodeIndex;
+        parentIndices[node.secondChildOffset] = nodeIndex;
+        stack.push_back({nodeIndex + 1, depth + 1});
+        stack.push_back({node.secondChildOffset, depth + 1});
+    }
+}
+
+bool BVH2::closestHit(const Ray &r, const Interval t, SurfaceIntersection &record) const {
+    PrimitiveHit hit;
+    if (!closestHit(r, t, hit)) return false;
+    scene.finalizeIntersection(r, hit, record);
+    return true;
+}
+
+bool BVH2::closestHit(const Ray &r, const Interval t, PrimitiveHit &hit) const {
+    NoTraversalStats stats;
+    return closestHit(r, t, hit, stats);
+}
+
+bool BVH2::anyHit(const Ray &r, const Interval t) const {
+    NoTraversalStats stats;
+    return anyHit(r, t, stats);
+}
 
-    // Clean-up the tree
-    root->destroy();
-    delete root;
+bool BVH2::closestHitShortStack(const Ray &r, const Interval t, PrimitiveHit &hit) const {
+    NoTraversalStats stats;
+    return closestHitShortStack(r, t, hit, stats);
 }
 
-bool BVH2::closestHit(const Ray &r, Interval t, SurfaceIntersection &record) const {
+bool BVH2::anyHitShortStack(const Ray &r, const Interval t) const {
+    NoTraversalStats stats;
+    return anyHitShortStack(r, t, stats);
+}
+
+bool BVH2::occluded(const Ray &r, const Interval t, int &occluderLeaf) const {
+    NoTraversalStats stats;
+    return occluded(r, t, occluderLeaf, stats);
+}
+
+void BVH2::occluded(const std::span<const Ray> rays, const Interval t, const std::span<uint64_t> occludedMask, const int numThreads) const {
+    const int numTasks = static_cast<int>(occlusionMaskWords(rays.size()));
+    parallelForStealing(numTasks, numThreads, [&](const int task, int) {
+        // Each task owns one mask word, and a shadow cache that starts cold
+        const size_t first = static_cast<size_t>(task) * 64;
+        const size_t last  = std::min(rays.size(), first + 64);
+        int occluderLeaf   = -1;
+        uint64_t word      = 0;
+        for (size_t i = first; i < last; ++i) {
+            if (occluded(rays[i], t, occluderLeaf)) word |= uint64_t{1} << (i - first);
+        }
+        occludedMask[task] = word;
+    });
+}
+
+template<typename Stats>
+bool BVH2::closestHit(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const {
+    if (numNodes == 0) return false;
+    if (maxDepth > BVH2_STACK_SIZE) return closestHitShortStack(r, t, hit, stats);
+
     const auto invDir     = 1 / r.dir;
     const int dirIsNeg[3] = {static_cast<int>(invDir.x < 0), static_cast<int>(invDir.y < 0), static_cast<int>(invDir.z < 0)};
 
     int toVisitOffset    = 0;
     int currentNodeIndex = 0;
-    int stack[64];
+    int stack[BVH2_STACK_SIZE];
     bool hitAnything = false;
 
     while (true) {
         const LBVH2Node *node = &nodes[currentNodeIndex];
+        stats.boxes(1);
         // 1. Check the ray intersects the current node
         //    If it doesn't, pop the stack and continue
         if (node->bbox.hit(r.origin, r.dir, t)) {
@@ -53,29 +159,23 @@ bool BVH2::closestHit(const Ray &r, Interval t, SurfaceIntersection &record) con
             //    Otherwise, push the children onto the stack
             if (node->numPrimitives > 0) {
                 // Leaf node
+                stats.leaf(node->numPrimitives);
                 for (int i = 0; i < node->numPrimitives; ++i) {
-                    const auto primitive = primitives[node->primitivesOffset + i];
-                    bool closestHitPrim = false;
-
-                    switch(primitive.type) {
-                        case Primitive::TRIANGLE: {
-                            const Triangle &triangle = scene.triangles[primitive.index];
-                            float u, v;
-                            closestHitPrim =  scene.meshes[triangle.meshIndex].tClosestHit(r, t, record, triangle.index, u, v);
-                        }
-                        default:
-                            break;
-                    }
-
-                    if (closestHitPrim) {
-                        hitAnything = true;
-                        t.max       = record.t;
+                    float tHit, u, v;
+                    if (hitLeafTriangle(r, t, node->primitivesOffset + i, tHit, u, v)) {
+                        hitAnything   = true;
+                        t.max         = tHit;
+                        hit.t         = tHit;
+                        hit.primIndex = static_cast<int>(primIndices[node->primitivesOffset + i]);
+                        hit.b1        = u;
+                        hit.b2        = v;
                     }
                 }
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = stack[--toVisitOffset];
             } else {
                 // Interior node
+                stats.node();
                 if (dirIsNeg[node->axis]) {
                     stack[toVisitOffset++] = currentNodeIndex + 1;
                     currentNodeIndex       = node->secondChildOffset;
@@ -83,6 +183,7 @@ bool BVH2::closestHit(const Ray &r, Interval t, SurfaceIntersection &record) con
                     stack[toVisitOffset++] = node->secondChildOffset;
                     currentNodeIndex       = currentNodeIndex + 1;
                 }
+                stats.stackDepth(toVisitOffset);
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -93,34 +194,37 @@ bool BVH2::closestHit(const Ray &r, Interval t, SurfaceIntersection &record) con
     return hitAnything;
 }
 
-bool BVH2::anyHit(const Ray &r, Interval t) const {
+template<typename Stats>
+bool BVH2::anyHit(const Ray &r, const Interval t, Stats &stats) const {
+    if (numNodes == 0) return false;
+    if (maxDepth > BVH2_STACK_SIZE) return anyHitShortStack(r, t, stats);
+
     const auto invDir     = 1 / r.dir;
     const int dirIsNeg[3] = {static_cast<int>(invDir.x < 0), static_cast<int>(invDir.y < 0), static_cast<int>(invDir.z < 0)};
 
     int toVisitOffset    = 0;
     int currentNodeIndex = 0;
-    int stack[64];
+    int stack[BVH2_STACK_SIZE];
 
     while (true) {
         const LBVH2Node *node = &nodes[currentNodeIndex];
+        stats.boxes(1);
         if (node->bbox.hit(r.origin, r.dir, t)) {
             if (node->numPrimitives > 0) {
                 for (int i = 0; i < node->numPrimitives; ++i) {
-                    bool anyHitPrim = false;
-                    switch (const auto primitive = primitives[node->primitivesOffset + i]; primitive.type) {
-                        case Primitive::TRIANGLE: {
-                            const Triangle &triangle = scene.triangles[primitive.index];
-                            anyHitPrim = scene.meshes[triangle.meshIndex].tAnyHit(r, t, triangle.index);
-                        }
-                        default:
-                            break;
+                    float tHit, u, v;
+                    if (hitLeafTriangle(r, t, node->primitivesOffset + i, tHit, u, v)) {
+                        stats.leaf(i + 1);
+                        stats.earlyOut();
+                        return true;
                     }
-                    if (anyHitPrim) return true;
                 }
+                stats.leaf(node->numPrimitives);
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = stack[--toVisitOffset];
             } else {
                 // Interior node
+                stats.node();
                 if (dirIsNeg[node->axis]) {
                     stack[toVisitOffset++] = currentNodeIndex + 1;
                     currentNodeIndex       = node->secondChildOffset;
@@ -128,6 +232,7 @@ bool BVH2::anyHit(const Ray &r, Interval t) const {
                     stack[toVisitOffset++] = node->secondChildOffset;
                     currentNodeIndex       = currentNodeIndex + 1;
                 }
+                stats.stackDepth(toVisitOffset);
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -138,132 +243,443 @@ bool BVH2::anyHit(const Ray &r, Interval t) const {
     return false;
 }
 
-BVH2Node *buildBVH2Tree(std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode) {
-    const auto node = new BVH2Node();
-    (*totalNodes)++;
+/**
+ * Child order of closestHit and anyHit: the child on the ray's side of the split axis first
+ * @return callable mapping an interior node index to the index of the child visited first
+ */
+static auto directionNearChild(const LBVH2Node *nodes, const Ray &r) {
+    const auto invDir                 = 1 / r.dir;
+    const std::array<int, 3> dirIsNeg = {static_cast<int>(invDir.x < 0), static_cast<int>(invDir.y < 0), static_cast<int>(invDir.z < 0)};
+    return [nodes, dirIsNeg](const int i) {
+        return dirIsNeg[nodes[i].axis] ? nodes[i].secondChildOffset : i + 1;
+    };
+}
 
-    AABB bounds;
-    for (const auto &prim: bvhPrimitives) {
-        bounds.expand(prim.bounds);
-    }
+/**
+ * Child order of occluded: any hit ends the ray, so the child a random ray is likelier to hit (the larger box) first
+ */
+static auto largerBoxNearChild(const LBVH2Node *nodes) {
+    return [nodes](const int i) {
+        const int first  = i + 1;
+        const int second = nodes[i].secondChildOffset;
+        return nodes[second].bbox.surfaceArea() > nodes[first].bbox.surfaceArea() ? second : first;
+    };
+}
 
-    if (bounds.surfaceArea() == 0 || bvhPrimitives.size() == 1) {
-        // CASE: single prim or empty bbox;
-        const int firstOffset = *orderedPrimitiveOffset;
-        *orderedPrimitiveOffset += bvhPrimitives.size();
-        for (size_t i = 0; i < bvhPrimitives.size(); ++i) {
-            // const int index                    = ;
-            orderedPrimitives[firstOffset + i] = bvhPrimitives[i];
+/**
+ * Short-stack traversal shared by closestHitShortStack, anyHitShortStack and occluded on deep trees
+ * @param nearChild child order (directionNearChild or largerBoxNearChild), used both to descend and to find dropped
+ *                  subtrees when climbing parent links, so it must give the same answer for a node every time
+ * @param visitLeaf tests a leaf whose box the ray hits, shrinking t for closest hits; returns true to end the traversal
+ */
+template<typename Stats, typename NearChild, typename VisitLeaf>
+static void traverseShortStack(const BVH2 &bvh2, const Ray &r, Interval &t, Stats &stats, NearChild &&nearChild, VisitLeaf &&visitLeaf) {
+    const LBVH2Node *nodes = bvh2.nodes;
+    const auto farChild    = [&](const int i) {
+        const int near = nearChild(i);
+        return near == i + 1 ? nodes[i].secondChildOffset : i + 1;
+    };
+
+    // Ring buffer; when full, the oldest (shallowest) entry is dropped to make room
+    int stack[BVH2_SHORT_STACK_SIZE];
+    int stackBottom      = 0;
+    int stackSize        = 0;
+    int numDropped       = 0;
+    int currentNodeIndex = 0;
+
+    while (true) {
+        const LBVH2Node &node = nodes[currentNodeIndex];
+        stats.boxes(1);
+        if (node.bbox.hit(r.origin, r.dir, t)) {
+            if (node.numPrimitives > 0) {
+                if (visitLeaf(node)) return;
+            } else {
+                // Interior node
+                stats.node();
+                if (stackSize == BVH2_SHORT_STACK_SIZE) {
+                    stackBottom = (stackBottom + 1) % BVH2_SHORT_STACK_SIZE;
+                    stackSize--;
+                    numDropped++;
+                }
+                stack[(stackBottom + stackSize++) % BVH2_SHORT_STACK_SIZE] = farChild(currentNodeIndex);
+                stats.stackDepth(stackSize);
+                currentNodeIndex = nearChild(currentNodeIndex);
+                continue;
+            }
         }
-        node->initLeaf(firstOffset, bvhPrimitives.size(), bounds);
-        return node;
-    } else {
-        // Chose split dimensions
-        AABB centroidBounds;
-        for (const auto &prim: bvhPrimitives) {
-            centroidBounds.expand(prim.centroid());
+
+        // The current subtree is done
+        if (stackSize > 0) {
+            currentNodeIndex = stack[(stackBottom + --stackSize) % BVH2_SHORT_STACK_SIZE];
+        } else if (numDropped > 0) {
+            // Subtrees are finished in stack order, so every ancestor entered from its near child still has its far child
+            // to visit; the deepest of these is the most recently dropped entry
+            int parent = bvh2.parentIndices[currentNodeIndex];
+            while (currentNodeIndex != nearChild(parent)) {
+                currentNodeIndex = parent;
+                parent           = bvh2.parentIndices[parent];
+            }
+            currentNodeIndex = farChild(parent);
+            numDropped--;
+        } else {
+            return;
         }
-        int dim = centroidBounds.longestAxis();
-
-        if (centroidBounds.pmin[dim] == centroidBounds.pmax[dim]) {
-            // CASE: empty bbox
-            const int firstOffset = *orderedPrimitiveOffset;
-            *orderedPrimitiveOffset += bvhPrimitives.size();
-            for (size_t i = 0; i < bvhPrimitives.size(); ++i) {
-                // const int index                    = bvhPrimitives[i].index;
-                orderedPrimitives[firstOffset + i] = bvhPrimitives[i];
+    }
+}
+
+template<typename Stats>
+bool BVH2::occluded(const Ray &r, const Interval t, int &occluderLeaf, Stats &stats) const {
+    if (numNodes == 0) return false;
+    const auto hitLeaf = [&](const LBVH2Node &leaf) {
+        for (int i = 0; i < leaf.numPrimitives; ++i) {
+            float tHit, u, v;
+            if (hitLeafTriangle(r, t, leaf.primitivesOffset + i, tHit, u, v)) {
+                stats.leaf(i + 1);
+                stats.earlyOut();
+                return true;
             }
-            node->initLeaf(firstOffset, bvhPrimitives.size(), bounds);
-            return node;
         }
+        stats.leaf(leaf.numPrimitives);
+        return false;
+    };
+
+    // Shadow cache: the last occluder often blocks this ray too, and costs no more than one leaf to check
+    if (occluderLeaf >= 0 && hitLeaf(nodes[occluderLeaf])) return true;
+    const auto nearChild = largerBoxNearChild(nodes);
+    if (maxDepth > BVH2_STACK_SIZE) {
+        // Too deep for the full stack; the short stack keeps the child order and still reports the occluder for the next ray
+        bool hitAnything = false;
+        Interval tShort  = t;
+        traverseShortStack(*this, r, tShort, stats, nearChild, [&](const LBVH2Node &leaf) {
+            const int leafIndex = static_cast<int>(&leaf - nodes);
+            if (leafIndex == occluderLeaf || !hitLeaf(leaf)) return false;
+            occluderLeaf = leafIndex;
+            hitAnything  = true;
+            return true;
+        });
+        return hitAnything;
+    }
 
-        int mid = bvhPrimitives.size() / 2;
+    int toVisitOffset    = 0;
+    int currentNodeIndex = 0;
+    int stack[BVH2_STACK_SIZE];
 
-        if (bvhPrimitives.size() == 2) {
-            std::nth_element(
-                    bvhPrimitives.begin(),
-                    bvhPrimitives.begin() + mid,
-                    bvhPrimitives.end(),
-                    [dim](const Primitive &a, const Primitive &b) {
-                        return a.centroid()[dim] < b.centroid()[dim];
-                    });
-        } else {
-            // Setup buckets
-            constexpr int BVH_NUM_BUCKETS = 12;
-            BVH2Bucket buckets[BVH_NUM_BUCKETS];
-
-            for (const auto &prim: bvhPrimitives) {
-                int b = BVH_NUM_BUCKETS * centroidBounds.offset(prim.centroid())[dim];
-                if (b == BVH_NUM_BUCKETS) b = BVH_NUM_BUCKETS - 1;
-                buckets[b].count++;
-                buckets[b].bounds.expand(prim.bounds);
+    while (true) {
+        const LBVH2Node *node = &nodes[currentNodeIndex];
+        stats.boxes(1);
+        if (node->bbox.hit(r.origin, r.dir, t)) {
+            if (node->numPrimitives > 0) {
+                if (currentNodeIndex != occluderLeaf && hitLeaf(*node)) {
+                    occluderLeaf = currentNodeIndex;
+                    return true;
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = stack[--toVisitOffset];
+            } else {
+                // Interior node: any hit ends the ray, so try the child a random ray is likelier to hit first
+                stats.node();
+                const int near         = nearChild(currentNodeIndex);
+                stack[toVisitOffset++] = near == currentNodeIndex + 1 ? node->secondChildOffset : currentNodeIndex + 1;
+                currentNodeIndex       = near;
+                stats.stackDepth(toVisitOffset);
             }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = stack[--toVisitOffset];
+        }
+    }
 
-            // Setup bucket costs
-            constexpr int BVH_NUM_SPLITS = BVH_NUM_BUCKETS - 1;
-            float costs[BVH_NUM_SPLITS]  = {};
-
-            // Forward pass
-            int countBelow = 0;
-            AABB boundsBelow;
-            for (int i = 0; i < BVH_NUM_SPLITS; ++i) {
-                countBelow += buckets[i].count;
-                boundsBelow.expand(buckets[i].bounds);
-                costs[i] += countBelow * boundsBelow.surfaceArea();
-            }
+    return false;
+}
 
-            // Backwards pass
-            int countAbove = 0;
-            AABB boundsAbove;
-            for (int i = BVH_NUM_BUCKETS - 1; i > 0; --i) {
-                countAbove += buckets[i].count;
-                boundsAbove.expand(buckets[i].bounds);
-                costs[i - 1] += countAbove * boundsAbove.surfaceArea();
+template<typename Stats>
+bool BVH2::closestHitShortStack(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const {
+    if (numNodes == 0) return false;
+    bool hitAnything = false;
+    traverseShortStack(*this, r, t, stats, directionNearChild(nodes, r), [&](const LBVH2Node &leaf) {
+        stats.leaf(leaf.numPrimitives);
+        for (int i = 0; i < leaf.numPrimitives; ++i) {
+            float tHit, u, v;
+            if (hitLeafTriangle(r, t, leaf.primitivesOffset + i, tHit, u, v)) {
+                hitAnything   = true;
+                t.max         = tHit;
+                hit.t         = tHit;
+                hit.primIndex = static_cast<int>(primIndices[leaf.primitivesOffset + i]);
+                hit.b1        = u;
+                hit.b2        = v;
             }
+        }
+        return false;
+    });
+    return hitAnything;
+}
 
-            // Find split
-            int minBucket = -1;
-            float minCost = INF;
-            for (int i = 0; i < BVH_NUM_SPLITS; ++i) {
-                if (costs[i] < minCost) {
-                    minCost   = costs[i];
-                    minBucket = i;
-                }
+template<typename Stats>
+bool BVH2::anyHitShortStack(const Ray &r, Interval t, Stats &stats) const {
+    if (numNodes == 0) return false;
+    bool hitAnything = false;
+    traverseShortStack(*this, r, t, stats, directionNearChild(nodes, r), [&](const LBVH2Node &leaf) {
+        for (int i = 0; i < leaf.numPrimitives; ++i) {
+            float tHit, u, v;
+            if (hitLeafTriangle(r, t, leaf.primitivesOffset + i, tHit, u, v)) {
+                stats.leaf(i + 1);
+                stats.earlyOut();
+                hitAnything = true;
+                return true;
             }
+        }
+        stats.leaf(leaf.numPrimitives);
+        return false;
+    });
+    return hitAnything;
+}
+
+template bool BVH2::closestHit(const Ray &, Interval, PrimitiveHit &, TraversalStats &) const;
+template bool BVH2::anyHit(const Ray &, Interval, TraversalStats &) const;
+template bool BVH2::occluded(const Ray &, Interval, int &, TraversalStats &) const;
+template bool BVH2::closestHitShortStack(const Ray &, Interval, PrimitiveHit &, TraversalStats &) const;
+template bool BVH2::anyHitShortStack(const Ray &, Interval, TraversalStats &) const;
+
+static constexpr int BVH_NUM_BUCKETS = 12;
+static constexpr int BVH_NUM_SPLITS  = BVH_NUM_BUCKETS - 1;
+
+// Subtrees smaller than this are always built on the current thread
+static constexpr size_t BVH2_TASK_THRESHOLD = 4096;
+// Nodes larger than this bin and partition their primitives across all of their threads
+static constexpr size_t BVH2_PARALLEL_BIN_THRESHOLD = 1 << 16;
+
+struct BVH2BuildContext {
+    ArenaSet &arenas;
+    std::vector<Primitive> &orderedPrimitives;
+    std::atomic<int> &totalNodes;
+    int maxPrimsInNode;
+};
+
+static std::span<Primitive> chunkOf(const std::span<Primitive> primitives, const int chunk, const int numChunks) {
+    const auto [begin, end] = chunkRange(primitives.size(), chunk, numChunks);
+    return primitives.subspan(begin, end - begin);
+}
+
+static int bucketIndex(const AABB &centroidBounds, const int dim, const Primitive &prim) {
+    int b = BVH_NUM_BUCKETS * centroidBounds.offset(prim.centroid())[dim];
+    if (b == BVH_NUM_BUCKETS) b = BVH_NUM_BUCKETS - 1;
+    return b;
+}
+
+/**
+ * Computes primitive bounds and centroid bounds in a single pass.
+ * Min/max are exact, so the result does not depend on the number of threads.
+ */
+static void computeBounds(const std::span<Primitive> primitives, const int threads, AABB &bounds, AABB &centroidBounds) {
+    const int numChunks = primitives.size() > BVH2_PARALLEL_BIN_THRESHOLD ? threads : 1;
+    std::vector<AABB> chunkBounds(numChunks), chunkCentroidBounds(numChunks);
+
+    parallelFor(numChunks, [&](const int c) {
+        for (const auto &prim: chunkOf(primitives, c, numChunks)) {
+            chunkBounds[c].expand(prim.bounds);
+            chunkCentroidBounds[c].expand(prim.centroid());
+        }
+    });
+
+    for (int c = 0; c < numChunks; ++c) {
+        bounds.expand(chunkBounds[c]);
+        centroidBounds.expand(chunkCentroidBounds[c]);
+    }
+}
+
+static void computeBuckets(const std::span<Primitive> primitives, const int threads, const AABB &centroidBounds, const int dim, BVH2Bucket buckets[BVH_NUM_BUCKETS]) {
+    const int numChunks = primitives.size() > BVH2_PARALLEL_BIN_THRESHOLD ? threads : 1;
+    std::vector<std::array<BVH2Bucket, BVH_NUM_BUCKETS>> chunkBuckets(numChunks);
+
+    parallelFor(numChunks, [&](const int c) {
+        for (const auto &prim: chunkOf(primitives, c, numChunks)) {
+            const int b = bucketIndex(centroidBounds, dim, prim);
+            chunkBuckets[c][b].count++;
+            chunkBuckets[c][b].bounds.expand(prim.bounds);
+        }
+    });
+
+    for (int c = 0; c < numChunks; ++c) {
+        for (int b = 0; b < BVH_NUM_BUCKETS; ++b) {
+            buckets[b].count += chunkBuckets[c][b].count;
+            buckets[b].bounds.expand(chunkBuckets[c][b].bounds);
+        }
+    }
+}
+
+/**
+ * Partitions primitives so those satisfying pred come first.
+ * Large spans are partitioned per chunk and then scattered through a temporary buffer.
+ * @return number of primitives satisfying pred
+ */
+template<typename Pred>
+static size_t partitionPrimitives(const std::span<Primitive> primitives, const int threads, Pred pred) {
+    if (primitives.size() <= BVH2_PARALLEL_BIN_THRESHOLD || threads == 1) {
+        return std::partition(primitives.begin(), primitives.end(), pred) - primitives.begin();
+    }
+
+    std::vector<size_t> leftCounts(threads);
+    parallelFor(threads, [&](const int c) {
+        const auto chunk = chunkOf(primitives, c, threads);
+        leftCounts[c]    = std::partition(chunk.begin(), chunk.end(), pred) - chunk.begin();
+    });
+
+    std::vector<size_t> leftOffsets(threads), rightOffsets(threads);
+    size_t numLeft = 0;
+    for (int c = 0; c < threads; ++c) {
+        leftOffsets[c] = numLeft;
+        numLeft += leftCounts[c];
+    }
+    size_t numRight = numLeft;
+    for (int c = 0; c < threads; ++c) {
+        rightOffsets[c] = numRight;
+        numRight += chunkOf(primitives, c, threads).size() - leftCounts[c];
+    }
+
+    std::vector<Primitive> scratch(primitives.size());
+    parallelFor(threads, [&](const int c) {
+        const auto chunk = chunkOf(primitives, c, threads);
+        std::copy(chunk.begin(), chunk.begin() + leftCounts[c], scratch.begin() + leftOffsets[c]);
+        std::copy(chunk.begin() + leftCounts[c], chunk.end(), scratch.begin() + rightOffsets[c]);
+    });
+    parallelFor(threads, [&](const int c) {
+        const auto chunk  = chunkOf(primitives, c, threads);
+        const auto offset = chunk.data() - primitives.data();
+        std::copy(scratch.begin() + offset, scratch.begin() + offset + chunk.size(), chunk.begin());
+    });
+
+    return numLeft;
+}
 
-            // Calculate split cost
-            const float leafCost = bvhPrimitives.size();
-            minCost              = 0.5f + minCost / bounds.surfaceArea();
-            if (bvhPrimitives.size() > maxPrimsInNode || minCost < leafCost) {
-                // Build interior node
-                auto midIterator = std::partition(bvhPrimitives.begin(), bvhPrimitives.end(), [=](const Primitive &p) {
-                    int b = BVH_NUM_BUCKETS * centroidBounds.offset(p.centroid())[dim];
-                    if (b == BVH_NUM_BUCKETS) b = BVH_NUM_BUCKETS - 1;
-                    return b <= minBucket;
+/**
+ * Recursive binned SAH build.
+ * @param ctx shared build state
+ * @param arena arena owned by the current thread
+ * @param bvhPrimitives primitives of this subtree
+ * @param primOffset position of bvhPrimitives within the full primitive array (leaves are written there)
+ * @param threads number of threads this subtree may use
+ */
+static BVH2Node *buildBVH2Subtree(BVH2BuildContext &ctx, Arena &arena, std::span<Primitive> bvhPrimitives, const size_t primOffset, const int threads) {
+    const auto node = arena.create<BVH2Node>();
+    ctx.totalNodes.fetch_add(1, std::memory_order_relaxed);
+
+    const auto makeLeaf = [&](const AABB &bounds) {
+        std::copy(bvhPrimitives.begin(), bvhPrimitives.end(), ctx.orderedPrimitives.begin() + primOffset);
+        node->initLeaf(static_cast<int>(primOffset), static_cast<int>(bvhPrimitives.size()), bounds);
+        return node;
+    };
+
+    AABB bounds, centroidBounds;
+    computeBounds(bvhPrimitives, threads, bounds, centroidBounds);
+
+    if (bounds.surfaceArea() == 0 || bvhPrimitives.size() == 1) {
+        // CASE: single prim or empty bbox;
+        return makeLeaf(bounds);
+    }
+
+    // Chose split dimensions
+    const int dim = centroidBounds.longestAxis();
+
+    if (centroidBounds.pmin[dim] == centroidBounds.pmax[dim]) {
+        // CASE: empty bbox
+        return makeLeaf(bounds);
+    }
+
+    size_t mid = bvhPrimitives.size() / 2;
+
+    if (bvhPrimitives.size() == 2) {
+        std::nth_element(
+                bvhPrimitives.begin(),
+                bvhPrimitives.begin() + mid,
+                bvhPrimitives.end(),
+                [dim](const Primitive &a, const Primitive &b) {
+                    return a.centroid()[dim] < b.centroid()[dim];
                 });
-                mid              = midIterator - bvhPrimitives.begin();
-            } else {
-                // Build leaf node
-                const int firstOffset = *orderedPrimitiveOffset;
-                *orderedPrimitiveOffset += bvhPrimitives.size();
-                for (size_t i = 0; i < bvhPrimitives.size(); ++i) {
-                    // const int index                    = bvhPrimitives[i].index;
-                    orderedPrimitives[firstOffset + i] = bvhPrimitives[i];
-                }
-                node->initLeaf(firstOffset, bvhPrimitives.size(), bounds);
-                return node;
+    } else {
+        // Setup buckets
+        BVH2Bucket buckets[BVH_NUM_BUCKETS];
+        computeBuckets(bvhPrimitives, threads, centroidBounds, dim, buckets);
+
+        // Setup bucket costs
+        float costs[BVH_NUM_SPLITS] = {};
+
+        // Forward pass
+        int countBelow = 0;
+        AABB boundsBelow;
+        for (int i = 0; i < BVH_NUM_SPLITS; ++i) {
+            countBelow += buckets[i].count;
+            boundsBelow.expand(buckets[i].bounds);
+            costs[i] += countBelow * boundsBelow.surfaceArea();
+        }
+
+        // Backwards pass
+        int countAbove = 0;
+        AABB boundsAbove;
+        for (int i = BVH_NUM_BUCKETS - 1; i > 0; --i) {
+            countAbove += buckets[i].count;
+            boundsAbove.expand(buckets[i].bounds);
+            costs[i - 1] += countAbove * boundsAbove.surfaceArea();
+        }
+
+        // Find split
+        int minBucket = -1;
+        float minCost = INF;
+        for (int i = 0; i < BVH_NUM_SPLITS; ++i) {
+            if (costs[i] < minCost) {
+                minCost   = costs[i];
+                minBucket = i;
             }
         }
 
-        BVH2Node *children[2];
-        children[0] = buildBVH2Tree(bvhPrimitives.subspan(0, mid), totalNodes, orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode);
-        children[1] = buildBVH2Tree(bvhPrimitives.subspan(mid), totalNodes, orderedPrimitiveOffset, orderedPrimitives, maxPrimsInNode);
-        node->initBranch(dim, children[0], children[1]);
+        // Calculate split cost
+        const float leafCost = bvhPrimitives.size();
+        minCost              = 0.5f + minCost / bounds.surfaceArea();
+        if (bvhPrimitives.size() > static_cast<size_t>(ctx.maxPrimsInNode) || minCost < leafCost) {
+            // Build interior node
+            mid = partitionPrimitives(bvhPrimitives, threads, [=](const Primitive &p) {
+                return bucketIndex(centroidBounds, dim, p) <= minBucket;
+            });
+        } else {
+            // Build leaf node
+            return makeLeaf(bounds);
+        }
     }
 
+    BVH2Node *children[2];
+    if (threads > 1 && bvhPrimitives.size() > BVH2_TASK_THRESHOLD) {
+        // Build the left subtree as a separate task, splitting this subtree's threads between the two
+        // The new thread gets its own arena, so allocation never needs a lock
+        const int leftThreads = threads / 2;
+        Arena &leftArena      = ctx.arenas.createArena(bvh2ArenaSize(mid));
+        std::thread leftTask([&] {
+            children[0] = buildBVH2Subtree(ctx, leftArena, bvhPrimitives.subspan(0, mid), primOffset, leftThreads);
+        });
+        children[1] = buildBVH2Subtree(ctx, arena, bvhPrimitives.subspan(mid), primOffset + mid, threads - leftThreads);
+        leftTask.join();
+    } else {
+        children[0] = buildBVH2Subtree(ctx, arena, bvhPrimitives.subspan(0, mid), primOffset, 1);
+        children[1] = buildBVH2Subtree(ctx, arena, bvhPrimitives.subspan(mid), primOffset + mid, 1);
+    }
+    node->initBranch(dim, children[0], children[1]);
+
     return node;
 }
 
+BVH2Node *buildBVH2Tree(ArenaSet &arenas, std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode, int numThreads) {
+    numThreads = resolveThreadCount(numThreads);
+
+    std::atomic<int> nodeCount = *totalNodes;
+    BVH2BuildContext ctx{arenas, orderedPrimitives, nodeCount, maxPrimsInNode};
+
+    // Leaves are written at their position in bvhPrimitives, which matches the depth-first order
+    Arena &arena   = arenas.createArena(bvh2ArenaSize(bvhPrimitives.size()));
+    BVH2Node *root = buildBVH2Subtree(ctx, arena, bvhPrimitives, *orderedPrimitiveOffset, numThreads);
+
+    *totalNodes = nodeCount.load();
+    *orderedPrimitiveOffset += static_cast<int>(bvhPrimitives.size());
+    return root;
+}
+
 int flattenBVH2toLBVH2(const BVH2Node *node, LBVH2Node *nodes, int *offset) {
     LBVH2Node *linearNode = &nodes[*offset];
     linearNode->bbox          = node->bbox;
@@ -278,4 +694,28 @@ int flattenBVH2toLBVH2(const BVH2Node *node, LBVH2Node *nodes, int *offset) {
         linearNode->secondChildOffset = flattenBVH2toLBVH2(node->children[1], nodes, offset);
     }
     return nodeOffset;
-}
\ No newline at end of file
+}
+
+float computeSAHCost(const LBVH2Node *nodes) {
+    const float rootArea = nodes[0].bbox.surfaceArea();
+    if (rootArea == 0) return 0;
+
+    // Not on a hot path, so use a growable stack to handle arbitrarily deep trees
+    float cost = 0;
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const int nodeIndex = stack.back();
+        stack.pop_back();
+
+        const LBVH2Node &node = nodes[nodeIndex];
+        const float area      = node.bbox.surfaceArea() / rootArea;
+        if (node.numPrimitives > 0) {
+            cost += area * node.numPrimitives;
+        } else {
+            cost += area * 0.5f;
+            stack.push_back(nodeIndex + 1);
+            stack.push_back(node.secondChildOffset);
+        }
+    }
+    return cost;
+}
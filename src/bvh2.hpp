@@ -1,11 +1,16 @@
 #pragma once
 
 #include "aabb.hpp"
+#include "arena.hpp"
 #include "common.hpp"
 #include "mesh.hpp"
 #include "primitives.hpp"
 #include "scene.hpp"
+#include "stats.hpp"
 
+#include <memory>
+#include <new>
+#include <type_traits>
 
 struct alignas(32) LBVH2Node {
     AABB bbox;
@@ -46,31 +51,287 @@ struct BVH2Node {
     bool isBranch() const {
         return !isLeaf();
     }
+};
 
-    void destroy() const {
-        if (isBranch()) {
-            children[0]->destroy();
-            children[1]->destroy();
+/**
+ * Number of bytes to reserve in a build arena for a subtree over numPrimitives primitives
+ */
+inline size_t bvh2ArenaSize(const size_t numPrimitives) {
+    // A binary tree over n primitives has at most 2n - 1 nodes
+    return 2 * numPrimitives * sizeof(BVH2Node);
+}
 
-            delete children[0];
-            delete children[1];
-        }
-    }
+/**
+ * Builder used for the intermediate binary tree
+ *  - SAH: top-down binned SAH (best trees)
+ *  - LBVH30/LBVH63: Morton-code linear BVH with 30/63-bit codes (fastest builds)
+ *  - SBVH: binned SAH with spatial splits, which duplicate references to straddling primitives
+ *          (best trees for scenes with long or thin triangles, slowest builds)
+ */
+enum class BVHBuildMethod {
+    SAH,
+    LBVH30,
+    LBVH63,
+    SBVH,
+};
+
+/**
+ * Spatial split settings, used by BVHBuildMethod::SBVH
+ */
+struct SBVHSettings {
+    // Spatial splits are only tried where the best object split's children overlap by more than this fraction of the root's surface area
+    float overlapThreshold = 1e-5f;
+    // Extra primitive references allowed, as a fraction of the number of primitives
+    float duplicationBudget = 0.3f;
+};
+
+/**
+ * How BVH2 leaves store their triangles
+ *  - Indexed: read through Scene::triangles and the mesh index buffer (no extra memory, up to four scattered loads per test)
+ *  - Vertices: de-indexed (v0, v1, v2) copies in leaf order, read linearly (48 bytes per leaf primitive)
+ *  - Edges: de-indexed (v0, v1 - v0, v2 - v0) copies in leaf order, which also saves the edge subtractions per test
+ * The indexed mesh is still used for shading with every layout.
+ */
+enum class BVHTriangleLayout {
+    Indexed,
+    Vertices,
+    Edges,
+};
+
+/**
+ * Order of a flat node array
+ *  - DepthFirst: preorder, as flattened from the build (every subtree is a contiguous range)
+ *  - Treelets: treelets grown from each treelet root by adding the child with the largest box, i.e. the likeliest
+ *              to be visited next, up to the next BVH_TREELET_BYTES boundary of the (page-aligned) node array; each
+ *              treelet is contiguous, with its likeliest nodes first. Nodes a ray visits together then share pages
+ *              and neighbouring cache lines.
+ * Traversal results do not depend on the layout.
+ */
+enum class BVHNodeLayout {
+    DepthFirst,
+    Treelets,
 };
 
+// Treelet size for BVHNodeLayout::Treelets: one 4 KiB page
+static constexpr size_t BVH_TREELET_BYTES = 4096;
+
+/**
+ * Allocates a node array aligned to BVH_TREELET_BYTES, so that treelets, which end on multiples of
+ * BVH_TREELET_BYTES from the start of the array, line up with pages. Free with freeBVHNodes().
+ */
+template<typename Node>
+Node *allocateBVHNodes(const size_t count) {
+    static_assert(std::is_trivially_destructible_v<Node>);
+    Node *nodes = static_cast<Node *>(::operator new(count * sizeof(Node), std::align_val_t(BVH_TREELET_BYTES)));
+    std::uninitialized_default_construct_n(nodes, count);
+    return nodes;
+}
+
+template<typename Node>
+void freeBVHNodes(Node *nodes) {
+    ::operator delete(nodes, std::align_val_t(BVH_TREELET_BYTES));
+}
+
+/**
+ * De-indexed leaf triangle, each point padded to 16 bytes.
+ * p1 and p2 hold v1 and v2, or the edges from v0 with BVHTriangleLayout::Edges.
+ */
+struct alignas(16) LeafTriangle {
+    Vec3f v0;
+    float pad0;
+    Vec3f p1;
+    float pad1;
+    Vec3f p2;
+    float pad2;
+};
+
+/**
+ * Result of refitting a BVH
+ */
+struct BVHRefitResult {
+    // SAH cost relative to the cost when built (1 when the tree is as good as new), after any rebuilds
+    float sahGrowth;
+    // Number of subtrees rebuilt
+    int rebuiltSubtrees;
+};
+
+// Entries in the per-ray stack of closestHit and anyHit; deeper trees are traversed with the short stack instead
+static constexpr int BVH2_STACK_SIZE = 64;
+// Entries in the per-ray stack of closestHitShortStack and anyHitShortStack
+static constexpr int BVH2_SHORT_STACK_SIZE = 8;
+
+/**
+ * Number of 64-bit words in an occlusion mask over numRays rays
+ */
+inline size_t occlusionMaskWords(const size_t numRays) {
+    return (numRays + 63) / 64;
+}
+
 struct BVH2 {
     int maxPrimsInNode = 0;
-    std::vector<Primitive> primitives;
+    // Scene::triangles index of each leaf primitive, in leaf order
+    std::span<uint32_t> primIndices;
+    // Leaf triangles in the same order as primIndices; empty with BVHTriangleLayout::Indexed
+    std::span<LeafTriangle> leafTriangles;
     LBVH2Node *nodes = nullptr;
+    int numNodes     = 0;
     const Scene &scene;
+    // Threads used by build(); 0 uses all hardware threads
+    int numBuildThreads = 0;
+    BVHBuildMethod buildMethod = BVHBuildMethod::SAH;
+    SBVHSettings sbvh;
+    BVHTriangleLayout triangleLayout = BVHTriangleLayout::Indexed;
+    // Order of nodes after build() and refit()
+    BVHNodeLayout nodeLayout = BVHNodeLayout::DepthFirst;
+    // Set when nodes, primIndices and leafTriangles point into a mapped cache file, which then owns them
+    std::shared_ptr<const MappedFile> mapping;
+    // SAH cost of each node's subtree relative to its own area when built, indexed in depth-first order;
+    // set by build(), stored in the BVH cache, kept by refit rebuilds and cleared by destroy()
+    std::vector<float> refitReferenceCosts;
+    // Parent node index of each node (-1 for the root), set by linkParents()
+    std::vector<int> parentIndices;
+    // Most interior nodes on any root-to-leaf path, set by linkParents()
+    int maxDepth = 0;
 
     void build();
-    void destroy() const { if (nodes) delete[] nodes; }
+
+    /**
+     * Fills parentIndices and maxDepth from the node array. Called by build(), cache loads and refit rebuilds;
+     * only needed again after nodes is replaced by hand.
+     */
+    void linkParents();
+
+    /**
+     * Recomputes every bound bottom-up from the current mesh vertices without changing the tree, in parallel over subtrees.
+     * Subtrees whose SAH cost has grown by more than maxSAHGrowth since they were built are then rebuilt with binned SAH.
+     * Trees mapped from a cache file are only refit. Treelet layouts are refit in depth-first order, so they pay two
+     * extra passes over the nodes to reorder them there and back.
+     * @param maxSAHGrowth cost ratio above which a subtree is rebuilt; 0 never rebuilds
+     */
+    BVHRefitResult refit(float maxSAHGrowth = 0);
+
+    /**
+     * Sets refitReferenceCosts from the current bounds and mesh vertices, which must agree (as at the end of a build).
+     * Nodes must be in depth-first order.
+     */
+    void computeRefitReferenceCosts();
+
+    /**
+     * Rewrites a de-indexed leaf triangle from the mesh (no-op with BVHTriangleLayout::Indexed)
+     * @param leafIndex position in primIndices
+     */
+    void updateLeafTriangle(const size_t leafIndex) const {
+        if (leafTriangles.empty()) return;
+
+        const Triangle &triangle = scene.triangles[primIndices[leafIndex]];
+        Vec3f v0, v1, v2;
+        scene.meshes[triangle.meshIndex].getVertices(triangle.index, v0, v1, v2);
+        leafTriangles[leafIndex] = triangleLayout == BVHTriangleLayout::Edges ? LeafTriangle{v0, 0, v1 - v0, 0, v2 - v0, 0} : LeafTriangle{v0, 0, v1, 0, v2, 0};
+    }
+    void destroy() {
+        refitReferenceCosts.clear();
+        if (mapping) return;
+        freeBVHNodes(nodes);
+        delete[] primIndices.data();
+        delete[] leafTriangles.data();
+    }
+
+    /**
+     * Tests a ray against the triangle at a position in leaf order, using the layout it was built with
+     * @param leafIndex position in primIndices
+     */
+    bool hitLeafTriangle(const Ray &r, const Interval t, const int leafIndex, float &tHit, float &b1, float &b2) const {
+        switch (triangleLayout) {
+            case BVHTriangleLayout::Vertices: {
+                const LeafTriangle &triangle = leafTriangles[leafIndex];
+                return intersectTriangle(r, t, triangle.v0, triangle.p1 - triangle.v0, triangle.p2 - triangle.v0, tHit, b1, b2);
+            }
+            case BVHTriangleLayout::Edges: {
+                const LeafTriangle &triangle = leafTriangles[leafIndex];
+                return intersectTriangle(r, t, triangle.v0, triangle.p1, triangle.p2, tHit, b1, b2);
+            }
+            default: {
+                const Triangle &triangle = scene.triangles[primIndices[leafIndex]];
+                return scene.meshes[triangle.meshIndex].tClosestHit(r, t, triangle.index, tHit, b1, b2);
+            }
+        }
+    }
 
     bool closestHit(const Ray &r, Interval t, SurfaceIntersection &record) const;
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit) const;
     bool anyHit(const Ray &r, Interval t) const;
+
+    /**
+     * Traversals with a BVH2_SHORT_STACK_SIZE-entry stack (32 bytes per ray, instead of 256 for closestHit and anyHit).
+     * When the short stack is full its oldest entry is dropped; once the stack runs dry, the next dropped subtree is
+     * found by climbing parentIndices from the last node visited. Works on trees of any depth, so closestHit and anyHit
+     * fall back to it when maxDepth exceeds BVH2_STACK_SIZE.
+     */
+    bool closestHitShortStack(const Ray &r, Interval t, PrimitiveHit &hit) const;
+    bool anyHitShortStack(const Ray &r, Interval t) const;
+
+    /**
+     * Occlusion test for a batch of shadow rays, spread over threads in tasks of 64 consecutive rays.
+     * Unlike anyHit, children are visited larger box first, as the larger child is the likelier to occlude.
+     * Each task remembers the leaf that occluded its last ray (a shadow cache) and tests it first, which
+     * pays off when neighbouring rays are blocked by the same geometry, e.g. adjacent pixels towards one light.
+     * @param rays rays to test, ideally ordered so that neighbours are coherent
+     * @param t interval shared by every ray
+     * @param occludedMask output mask, ray i -> bit i % 64 of word i / 64; needs occlusionMaskWords(rays.size()) words
+     * @param numThreads threads to use; 0 uses all hardware threads
+     */
+    void occluded(std::span<const Ray> rays, Interval t, std::span<uint64_t> occludedMask, int numThreads = 0) const;
+
+    /**
+     * Single-ray occlusion traversal used by occluded()
+     * @param occluderLeaf node index of a leaf to test before traversing, or -1; set to the occluding leaf on a hit
+     */
+    bool occluded(const Ray &r, Interval t, int &occluderLeaf) const;
+
+    /**
+     * Instrumented traversals; instantiated for TraversalStats
+     * @param stats counters for this ray, added to
+     */
+    template<typename Stats>
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const;
+    template<typename Stats>
+    bool anyHit(const Ray &r, Interval t, Stats &stats) const;
+    template<typename Stats>
+    bool occluded(const Ray &r, Interval t, int &occluderLeaf, Stats &stats) const;
+    template<typename Stats>
+    bool closestHitShortStack(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const;
+    template<typename Stats>
+    bool anyHitShortStack(const Ray &r, Interval t, Stats &stats) const;
 };
 
-BVH2Node *buildBVH2Tree(std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode);
+/**
+ * Builds a binned SAH tree over bvhPrimitives, which are reordered in place.
+ * Subtrees and the binning of large nodes are spread over numThreads threads;
+ * the resulting tree does not depend on the number of threads.
+ * Nodes are allocated from per-thread arenas in arenas, and live as long as it does.
+ * @param numThreads threads to use; 0 uses all hardware threads
+ */
+BVH2Node *buildBVH2Tree(ArenaSet &arenas, std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode, int numThreads = 1);
+
+/**
+ * Builds the intermediate binary tree over every triangle in a scene with the given method
+ * @param totalNodes incremented by the number of nodes created
+ * @param orderedPrimitives output primitives in leaf order; with SBVH a triangle may appear in several leaves
+ * @param numThreads threads to use; 0 uses all hardware threads
+ * @return root, or nullptr (and no nodes) if the scene has no triangles
+ */
+BVH2Node *buildSceneBVH2Tree(ArenaSet &arenas, const Scene &scene, BVHBuildMethod method, const SBVHSettings &sbvh, int *totalNodes, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode, int numThreads);
+
+/**
+ * Computes the SAH cost of a flattened tree, using the same constants as the builder
+ * (0.5 per traversal step, 1 per primitive test).
+ */
+float computeSAHCost(const LBVH2Node *nodes);
+
+int flattenBVH2toLBVH2(const BVH2Node *node, LBVH2Node *nodes, int *offset);
 
-int flattenBVH2toLBVH2(const BVH2Node *node, LBVH2Node *nodes, int *offset);
\ No newline at end of file
+/**
+ * Reorders a flat node array in place and rewrites the child offsets. Every first child stays right after its parent,
+ * so treelets are grown a first-child chain at a time.
+ */
+void layoutLBVH2Nodes(LBVH2Node *nodes, int numNodes, BVHNodeLayout layout);
\ No newline at end of file
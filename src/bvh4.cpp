@@ -1,63 +1,193 @@
 #include "bvh4.hpp"
 
-inline int encodeBVH4Leaf(const BVH2Node *leaf) {
-    return -((leaf->numPrimitives << 27) | (leaf->firstPrimOffset & BVH4_INDICES_MASK));
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+
+inline void setEmptyBVH4Child(LBVH4Node *node, const int i) {
+    // Inverted bounds never pass the slab test
+    for (int a = 0; a < 3; ++a) {
+        node->bbox.pmin[a][i] = INF;
+        node->bbox.pmax[a][i] = -INF;
+    }
+    node->children[i] = BVH4_INT_MIN;
 }
 
 void BVH4::build() {
-    primitives.resize(scene.numPrimitives());
+    std::vector<Primitive> orderedPrimitives;
+    int totalNodes = 0;
 
-    std::vector<Primitive> bvhPrimitives(primitives.size());
-    for (size_t i = 0; i < scene.triangles.size(); ++i) {
-        primitives[i]    = Primitive{Primitive::TRIANGLE, i, scene.meshes[scene.triangles[i].meshIndex].tBounds(scene.triangles[i].index)};
-        bvhPrimitives[i] = Primitive{Primitive::TRIANGLE, i, scene.meshes[scene.triangles[i].meshIndex].tBounds(scene.triangles[i].index)};
+    ArenaSet arenas;
+    BVH2Node *root = buildSceneBVH2Tree(arenas, scene, buildMethod, sbvh, &totalNodes, orderedPrimitives, BVH4_MAX_PRIMS_IN_NODE, numBuildThreads);
+    if (!root) {
+        // Empty scene: traversals return before looking at the node array
+        numNodes = 0;
+        nodes    = allocateBVHNodes<LBVH4Node>(0);
+        refitReferenceCosts.clear();
+        computeStackSize();
+        return;
     }
 
-    std::vector<Primitive> orderedPrimitives(primitives.size());
+    // Triangle4 blocks carry their own triangle indices, so no primitive list outlives the build
+    std::vector<Primitive> paddedPrimitives;
+    paddedPrimitives.reserve(orderedPrimitives.size() + orderedPrimitives.size() / 2);
+    padBVH2LeavesForBVH4(root, orderedPrimitives, paddedPrimitives, &totalNodes, arenas.createArena(0));
+    orderedPrimitives.resize(0);
+    orderedPrimitives.shrink_to_fit();
+    triangles4 = packTriangle4(scene, paddedPrimitives);
 
-    int totalNodes             = 1;
-    int orderedPrimitiveOffset = 0;
+    // Leaves are encoded in their parents, so the BVH4 needs far fewer nodes than the BVH2
+    const auto collapse = computeBVHCollapse<4>(root);
+    numNodes            = countBVH4Nodes(root, collapse);
+    nodes               = allocateBVHNodes<LBVH4Node>(numNodes);
+    flattenBVH2toLBVH4(root, collapse, nodes);
+    // Bounds only match the vertices until they next move, so refit measures its cost growth from here.
+    // Compressed nodes are rebuilt rather than refit.
+    if (compressNodes) refitReferenceCosts.clear();
+    else computeRefitReferenceCosts();
+    if (nodeLayout != BVHNodeLayout::DepthFirst) layoutLBVH4Nodes(nodes, numNodes, nodeLayout);
+    computeStackSize();
+
+    if (compressNodes) {
+        compressedNodes = allocateBVHNodes<CompressedLBVH4Node>(numNodes);
+        compressLBVH4Nodes(nodes, numNodes, compressedNodes);
+        freeBVHNodes(nodes);
+        nodes = nullptr;
+    }
+}
 
-    const BVH2Node *root = buildBVH2Tree(bvhPrimitives, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, BVH4_MAX_PRIMS_IN_NODE);
-    primitives.swap(orderedPrimitives);
+void padBVH2LeavesForBVH4(BVH2Node *node, const std::vector<Primitive> &primitives, std::vector<Primitive> &paddedPrimitives, int *totalNodes, Arena &arena) {
+    if (node->isBranch()) {
+        padBVH2LeavesForBVH4(node->children[0], primitives, paddedPrimitives, totalNodes, arena);
+        padBVH2LeavesForBVH4(node->children[1], primitives, paddedPrimitives, totalNodes, arena);
+        return;
+    }
 
-    bvhPrimitives.resize(0);
-    bvhPrimitives.shrink_to_fit();
+    const int first = node->firstPrimOffset;
+    const int n     = node->numPrimitives;
 
-    nodes      = new LBVH4Node[totalNodes];
-    int offset = 0;
-    flattenBVH2toLBVH4(root, nodes, &offset);
+    if (n > BVH4_MAX_LEAF_PRIMITIVES) {
+        // Too many primitives to encode, so split into two leaves with the same bounds
+        const auto left  = arena.create<BVH2Node>();
+        const auto right = arena.create<BVH2Node>();
+        left->initLeaf(first, n / 2, node->bbox);
+        right->initLeaf(first + n / 2, n - n / 2, node->bbox);
+        node->initBranch(node->bbox.longestAxis(), left, right);
+        *totalNodes += 2;
 
-    root->destroy();
-    delete root;
+        padBVH2LeavesForBVH4(node, primitives, paddedPrimitives, totalNodes, arena);
+        return;
+    }
+
+    node->firstPrimOffset = static_cast<int>(paddedPrimitives.size());
+    for (int i = 0; i < n; ++i) {
+        paddedPrimitives.push_back(primitives[first + i]);
+    }
+    // Duplicates of the last primitive never change the closest hit
+    while (paddedPrimitives.size() % 4 != 0) {
+        paddedPrimitives.push_back(primitives[first + n - 1]);
+    }
+    node->numPrimitives = static_cast<int>(paddedPrimitives.size()) - node->firstPrimOffset;
 }
 
-int flattenBVH2toLBVH4(const BVH2Node *node, LBVH4Node *nodes, int *offset) {
-    const int nodeOffset  = (*offset)++;
-    LBVH4Node *linearNode = &nodes[nodeOffset];
+std::span<Triangle4> packTriangle4(const Scene &scene, const std::vector<Primitive> &paddedPrimitives) {
+    const std::span triangles4(new Triangle4[paddedPrimitives.size() / 4], paddedPrimitives.size() / 4);
+
+    for (size_t b = 0; b < triangles4.size(); ++b) {
+        Triangle4 &block = triangles4[b];
+        for (int i = 0; i < 4; ++i) {
+            const Primitive &primitive = paddedPrimitives[4 * b + i];
+
+            // A primitive appears at most once per leaf (SBVH may reference it from several leaves), so a repeat within a block is padding
+            if (primitive.type != Primitive::TRIANGLE || (i > 0 && primitive.index == paddedPrimitives[4 * b + i - 1].index)) {
+                block.setPadding(i);
+                continue;
+            }
 
-    // Check if this node is a leaf
-    // In this case, we encode it as so in the parent node
-    if (node->numPrimitives > 0) {
-        return encodeBVH4Leaf(node);
+            const Triangle &triangle = scene.triangles[primitive.index];
+            Vec3f v0, v1, v2;
+            scene.meshes[triangle.meshIndex].getVertices(triangle.index, v0, v1, v2);
+            block.setLane(i, v0, v1, v2, static_cast<int>(primitive.index));
+        }
     }
+    return triangles4;
+}
+
+/**
+ * Chooses the BVH2 descendants that become the children of the BVH4 node for an interior BVH2 node,
+ * and arranges them so orderBVH4Children still gives a front-to-back order.
+ * The order is exact when each child subtree is opened at most once, and approximate when one is opened twice.
+ * @param n output children; empty slots have a null node
+ * @param axis output split axes in the LBVH4Node::axis layout
+ */
+static void collapseBVH4Children(const std::vector<BVH4CollapseCost> &collapse, const BVHCollapseEntry entry, BVHCollapseEntry n[4], int axis[3]) {
+    const BVH2Node *node         = entry.node;
+    const BVHCollapseEntry left  = {node->children[0], entry.index + 1};
+    const BVHCollapseEntry right = {node->children[1], entry.index + 1 + collapse[entry.index + 1].size};
+    const int split              = collapse[entry.index].split[3] > 0 ? collapse[entry.index].split[3] : 2;
 
-    // Otherwise, we have an inner node, in which case we need to collapse two levels
-    const BVH2Node *left  = node->children[0];
-    const BVH2Node *right = node->children[1];
+    BVHCollapseEntry l[3], r[3];
+    const int numLeft  = collectBVHCollapseChildren(collapse, left, split, l);
+    const int numRight = collectBVHCollapseChildren(collapse, right, 4 - split, r);
 
-    const BVH2Node *n[4];
+    const auto assign = [&](const std::array<BVHCollapseEntry, 4> &children, const std::array<int, 3> &axes) {
+        std::copy(children.begin(), children.end(), n);
+        std::copy(axes.begin(), axes.end(), axis);
+    };
+    const BVHCollapseEntry empty = {nullptr, -1};
 
-    // If a child is a leaf, we use the parent as the node to be encoded (as the left child)
-    n[0] = left->isLeaf() ? left : left->children[0];
-    n[1] = left->isLeaf() ? nullptr : left->children[1];
-    n[2] = right->isLeaf() ? right : right->children[0];
-    n[3] = right->isLeaf() ? nullptr : right->children[1];
+    if (numLeft <= 2 && numRight <= 2) {
+        // Each side is a single child or a pair
+        assign({l[0], numLeft == 2 ? l[1] : empty, r[0], numRight == 2 ? r[1] : empty},
+               {node->splitAxis, numLeft == 2 ? left.node->splitAxis : -1, numRight == 2 ? right.node->splitAxis : -1});
+        return;
+    }
+
+    // One side was opened twice: the inner pair (a grandchild's children) and the outer pair (its sibling and
+    // the other side) are ordered by that side's axis, and the outer pair by the root axis
+    const bool deepLeft             = numLeft == 3;
+    const BVHCollapseEntry *deep    = deepLeft ? l : r;
+    const BVH2Node *deepNode        = deepLeft ? left.node : right.node;
+    const bool innerFirst           = deep[0].node != deepNode->children[0];
+    const BVHCollapseEntry inner[2] = {innerFirst ? deep[0] : deep[1], innerFirst ? deep[1] : deep[2]};
+    const BVHCollapseEntry sibling  = innerFirst ? deep[2] : deep[0];
+    const BVHCollapseEntry outer[2] = {deepLeft ? sibling : l[0], deepLeft ? r[0] : sibling};
+    const int innerAxis             = innerFirst ? deepNode->children[0]->splitAxis : deepNode->children[1]->splitAxis;
+
+    if (innerFirst) {
+        assign({inner[0], inner[1], outer[0], outer[1]}, {deepNode->splitAxis, innerAxis, node->splitAxis});
+    } else {
+        assign({outer[0], outer[1], inner[0], inner[1]}, {deepNode->splitAxis, node->splitAxis, innerAxis});
+    }
+}
+
+int countBVH4Nodes(const BVH2Node *root, const std::vector<BVH4CollapseCost> &collapse) {
+    const auto visit = [&](const auto &self, const BVHCollapseEntry entry) -> int {
+        BVHCollapseEntry n[4];
+        int axis[3];
+        collapseBVH4Children(collapse, entry, n, axis);
+
+        int count = 1;
+        for (const auto &child: n) {
+            if (child.node != nullptr && !child.node->isLeaf()) count += self(self, child);
+        }
+        return count;
+    };
+    return root->isLeaf() ? 1 : visit(visit, {root, 0});
+}
+
+static int flattenBVH4Node(const std::vector<BVH4CollapseCost> &collapse, const BVHCollapseEntry entry, LBVH4Node *nodes, int *offset) {
+    const int nodeOffset  = (*offset)++;
+    LBVH4Node *linearNode = &nodes[nodeOffset];
+
+    BVHCollapseEntry n[4];
+    collapseBVH4Children(collapse, entry, n, linearNode->axis);
 
     for (size_t i = 0; i < 4; ++i) {
-        if (n[i] != nullptr) {
+        if (n[i].node != nullptr) {
             // Load bbox in SoA format
-            const auto bbox             = n[i]->bbox;
+            const auto bbox             = n[i].node->bbox;
             linearNode->bbox.pmax[0][i] = bbox.pmax.x;
             linearNode->bbox.pmax[1][i] = bbox.pmax.y;
             linearNode->bbox.pmax[2][i] = bbox.pmax.z;
@@ -66,58 +196,802 @@ int flattenBVH2toLBVH4(const BVH2Node *node, LBVH4Node *nodes, int *offset) {
             linearNode->bbox.pmin[2][i] = bbox.pmin.z;
 
             // Encode leaf or recurse
-            if (n[i]->isLeaf()) {
-                linearNode->children[i] = encodeBVH4Leaf(n[i]);
+            if (n[i].node->isLeaf()) {
+                linearNode->children[i] = encodeBVH4Leaf(n[i].node);
             } else {
-                linearNode->children[i] = flattenBVH2toLBVH4(n[i], nodes, offset);
+                linearNode->children[i] = flattenBVH4Node(collapse, n[i], nodes, offset);
             }
         } else {
-            // This is a leaf node, and has already been encoded on the left
-            linearNode->children[i] = BVH4_INT_MIN;
+            // The subtree has fewer than 4 leaves
+            setEmptyBVH4Child(linearNode, i);
         }
     }
 
-    // Update split axes
-    linearNode->axis[0] = node->splitAxis;
-    linearNode->axis[1] = (left->isLeaf() ? -1 : left->splitAxis);
-    linearNode->axis[2] = (right->isLeaf() ? -1 : right->splitAxis);
-
     return nodeOffset;
 }
 
-bool BVH4::closestHit(const Ray &r, const Interval t, SurfaceIntersection &record) const {
-    float4 tMin = simd::broadcast(t.min);
-    float4 tMax = simd::broadcast(t.max);
+int flattenBVH2toLBVH4(const BVH2Node *root, const std::vector<BVH4CollapseCost> &collapse, LBVH4Node *nodes) {
+    int offset = 0;
+    if (root->isLeaf()) {
+        // A leaf root gets a node of its own so traversal can always start at node 0
+        LBVH4Node *linearNode = &nodes[offset++];
+        for (int i = 1; i < 4; ++i) setEmptyBVH4Child(linearNode, i);
+        for (int a = 0; a < 3; ++a) {
+            linearNode->bbox.pmin[a][0] = root->bbox.pmin[a];
+            linearNode->bbox.pmax[a][0] = root->bbox.pmax[a];
+            linearNode->axis[a]         = a == 0 ? 0 : -1;
+        }
+        linearNode->children[0] = encodeBVH4Leaf(root);
+    } else {
+        flattenBVH4Node(collapse, {root, 0}, nodes, &offset);
+    }
+    return offset;
+}
 
-    float4 origin[3];
-    bool dirIsPos[3];
-    Vec3f invDir;
-    float4 invDir_4[3];
+static AABB childBounds(const LBVH4Node &node, const int c) {
+    return {Vec3f(node.bbox.pmin[0][c], node.bbox.pmin[1][c], node.bbox.pmin[2][c]), Vec3f(node.bbox.pmax[0][c], node.bbox.pmax[1][c], node.bbox.pmax[2][c])};
+}
 
-    for (auto i = 0; i < 3; ++i) {
-        origin[i]   = simd::broadcast(r.origin[i]);
-        invDir[i]   = 1 / r.dir[i];
-        invDir_4[i] = simd::broadcast(invDir[i]);
-        dirIsPos[i] = invDir[i] > 0.0f;
+float computeSAHCost(const LBVH4Node *nodes) {
+    AABB rootBounds;
+    for (int c = 0; c < 4; ++c) {
+        if (nodes[0].children[c] != BVH4_INT_MIN) rootBounds.expand(childBounds(nodes[0], c));
     }
+    const float rootArea = rootBounds.surfaceArea();
+    if (rootArea == 0) return 0;
+
+    // The root is always visited; every other node is visited when its box in the parent is hit
+    float cost             = 0.5f;
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const LBVH4Node &node = nodes[stack.back()];
+        stack.pop_back();
 
-    int toVisitOffset    = 0;
-    int currentNodeIndex = 0;
-    int stack[64];
+        for (int c = 0; c < 4; ++c) {
+            if (node.children[c] == BVH4_INT_MIN) continue;
+
+            const float area = childBounds(node, c).surfaceArea() / rootArea;
+            if (node.isLeaf(c)) {
+                cost += area * node.getNumPrimitives(c);
+            } else {
+                cost += area * 0.5f;
+                stack.push_back(node.children[c]);
+            }
+        }
+    }
+    return cost;
+}
+
+float computeBVH4FillRate(const LBVH4Node *nodes, const int numNodes) {
+    if (numNodes == 0) return 0;
+
+    int used = 0;
+    for (int i = 0; i < numNodes; ++i) {
+        for (int c = 0; c < 4; ++c) used += nodes[i].children[c] != BVH4_INT_MIN;
+    }
+    return static_cast<float>(used) / (4.0f * numNodes);
+}
+
+void compressLBVH4Nodes(const LBVH4Node *nodes, const int numNodes, CompressedLBVH4Node *compressed) {
+    for (int n = 0; n < numNodes; ++n) {
+        const LBVH4Node &node  = nodes[n];
+        CompressedLBVH4Node &q = compressed[n];
+
+        AABB bounds;
+        for (int c = 0; c < 4; ++c) {
+            if (node.children[c] != BVH4_INT_MIN) bounds.expand(childBounds(node, c));
+        }
+
+        for (int a = 0; a < 3; ++a) {
+            q.origin[a] = bounds.pmin[a];
+
+            // Smallest power of two that spans the node in 255 steps, found from the exponent of extent / 255
+            const float extent = bounds.pmax[a] - bounds.pmin[a];
+            int exponent       = 0;
+            if (extent > 0) {
+                std::frexp(extent / 255.0f, &exponent);
+                exponent = std::clamp(exponent, -100, 127);
+            }
+            q.exponent[a] = static_cast<int8_t>(exponent);
+            while (q.exponent[a] < 127 && q.origin[a] + 255.0f * q.scale(a) < bounds.pmax[a]) q.exponent[a]++;
+            const float scale = q.scale(a);
+
+            // Round outwards, checking against the same expression the traversal evaluates
+            const auto dequantize = [&](const int v) { return q.origin[a] + static_cast<float>(v) * scale; };
+            for (int c = 0; c < 4; ++c) {
+                if (node.children[c] == BVH4_INT_MIN) {
+                    // Inverted bounds never pass the slab test
+                    q.bounds[0][a][c] = 255;
+                    q.bounds[1][a][c] = 0;
+                    continue;
+                }
+
+                int lo = std::clamp(static_cast<int>(std::floor((node.bbox.pmin[a][c] - q.origin[a]) / scale)), 0, 255);
+                int hi = std::clamp(static_cast<int>(std::ceil((node.bbox.pmax[a][c] - q.origin[a]) / scale)), 0, 255);
+                while (lo > 0 && dequantize(lo) > node.bbox.pmin[a][c]) lo--;
+                while (hi < 255 && dequantize(hi) < node.bbox.pmax[a][c]) hi++;
+                q.bounds[0][a][c] = static_cast<uint8_t>(lo);
+                q.bounds[1][a][c] = static_cast<uint8_t>(hi);
+            }
+        }
+
+        for (int c = 0; c < 4; ++c) q.children[c] = node.children[c];
+        for (int a = 0; a < 3; ++a) q.axis[a] = static_cast<int8_t>(node.axis[a]);
+    }
+}
+
+/**
+ * Computes the front-to-back visiting order of a node's children from its split axes.
+ * axis[0] separates {0, 1} from {2, 3}; axis[1] and axis[2] split each pair.
+ */
+template<typename Node>
+inline void orderBVH4Children(const Node *node, const int dirIsNeg[3], int order[4]) {
+    const int firstPair  = dirIsNeg[node->axis[0]] ? 2 : 0;
+    const int secondPair = 2 - firstPair;
+
+    const auto pairOrder = [&](const int pair, int *out) {
+        const int axis = node->axis[1 + pair / 2];
+        const bool swap = axis >= 0 && dirIsNeg[axis];
+        out[0] = pair + (swap ? 1 : 0);
+        out[1] = pair + (swap ? 0 : 1);
+    };
+
+    pairOrder(firstPair, order);
+    pairOrder(secondPair, order + 2);
+}
+
+bool BVH4::closestHit(const Ray &r, const Interval t, SurfaceIntersection &record) const {
+    PrimitiveHit hit;
+    if (!closestHit(r, t, hit)) return false;
+    scene.finalizeIntersection(r, hit, record);
+    return true;
+}
+
+bool BVH4::closestHit(const Ray &r, const Interval t, PrimitiveHit &hit) const {
+    return closestHit(PrecomputedRay(r), 0, t, hit);
+}
+
+bool BVH4::closestHit(const PrecomputedRay &ray, const int root, const Interval t, PrimitiveHit &hit) const {
+    NoTraversalStats stats;
+    return closestHit(ray, root, t, hit, stats);
+}
+
+template<typename Stats>
+bool BVH4::closestHit(const Ray &r, const Interval t, PrimitiveHit &hit, Stats &stats) const {
+    return closestHit(PrecomputedRay(r), 0, t, hit, stats);
+}
+
+/**
+ * Single-ray closest-hit traversal over either node format
+ */
+template<typename Node, typename Stats>
+static bool traverseClosestHit(const Node *nodes, const int stackSize, const std::span<const Triangle4> triangles4, const PrecomputedRay &ray, const int root, Interval t,
+                               PrimitiveHit &hit, Stats &stats) {
+    // Stack holds encoded children (node index or leaf) and their entry distances
+    int toVisitOffset = 0;
+    TraversalStack<int, BVH4_STACK_SIZE> stack(stackSize);
+    TraversalStack<float, BVH4_STACK_SIZE> stackT(stackSize);
     bool hitAnything = false;
 
-    while (true) {
-        const LBVH4Node *node = &nodes[currentNodeIndex];
-        const auto [pmin, pmax]       = node->bbox;
+    stack[toVisitOffset]    = root;
+    stackT[toVisitOffset++] = t.min;
+
+    while (toVisitOffset > 0) {
+        const int current  = stack[--toVisitOffset];
+        if (stackT[toVisitOffset] > t.max) {
+            stats.earlyOut();
+            continue;
+        }
+
+        if (current < 0) {
+            // Leaf: intersect packed triangles 4 at a time
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            stats.leaf(4 * n);
+            for (int i = 0; i < n; ++i) {
+                const Triangle4 &block = triangles4[first + i];
+
+                float tHit, u, v;
+                const int lane = block.closestHit(ray, t.min, t.max, tHit, u, v);
+                if (lane >= 0) {
+                    hitAnything   = true;
+                    t.max         = tHit;
+                    hit.t         = tHit;
+                    hit.primIndex = block.primIndex[lane];
+                    hit.b1        = u;
+                    hit.b2        = v;
+                }
+            }
+            continue;
+        }
+
+        // Interior node: 4-wide slab test against the current interval
+        const Node *node = &nodes[current];
+        stats.node();
+        stats.boxes(4);
+
+        float4 tNear;
+        const int mask = node->hit4(ray, t.min, t.max, tNear);
+        if (mask == 0) continue;
+
+        float tEntry[4];
+        simd::store(tEntry, tNear);
+
+        // Push in reverse so the nearest child is popped first
+        int order[4];
+        orderBVH4Children(node, ray.dirIsNeg, order);
+        for (int i = 3; i >= 0; --i) {
+            const int c = order[i];
+            if (!(mask & (1 << c)) || node->children[c] == BVH4_INT_MIN) continue;
+            stack[toVisitOffset]    = node->children[c];
+            stackT[toVisitOffset++] = tEntry[c];
+        }
+        stats.stackDepth(toVisitOffset);
+    }
+
+    return hitAnything;
+}
+
+template<typename Stats>
+bool BVH4::closestHit(const PrecomputedRay &ray, const int root, const Interval t, PrimitiveHit &hit, Stats &stats) const {
+    if (numNodes == 0) return false;
+    return compressedNodes ? traverseClosestHit(compressedNodes, stackSize, triangles4, ray, root, t, hit, stats)
+                           : traverseClosestHit(nodes, stackSize, triangles4, ray, root, t, hit, stats);
+}
+
+bool BVH4::anyHit(const Ray &r, const Interval t) const {
+    return anyHit(PrecomputedRay(r), 0, t);
+}
 
-        for (auto i = 0; i < 3; ++i) {
-            tMin = simd::max(simd::mul(simd::sub(dirIsPos[i] ? simd::load(pmin[i]) : simd::load(pmax[i]), origin[i]), invDir_4[i]), tMin);
-            tMax = simd::min(simd::mul(simd::sub(dirIsPos[i] ? simd::load(pmax[i]) : simd::load(pmin[i]), origin[i]), invDir_4[i]), tMax);
+bool BVH4::anyHit(const PrecomputedRay &ray, const int root, const Interval t) const {
+    NoTraversalStats stats;
+    return anyHit(ray, root, t, stats);
+}
+
+template<typename Stats>
+bool BVH4::anyHit(const Ray &r, const Interval t, Stats &stats) const {
+    return anyHit(PrecomputedRay(r), 0, t, stats);
+}
+
+/**
+ * Single-ray occlusion traversal over either node format
+ */
+template<typename Node, typename Stats>
+static bool traverseAnyHit(const Node *nodes, const int stackSize, const std::span<const Triangle4> triangles4, const PrecomputedRay &ray, const int root, const Interval t,
+                           Stats &stats) {
+    int toVisitOffset = 0;
+    TraversalStack<int, BVH4_STACK_SIZE> stack(stackSize);
+
+    stack[toVisitOffset++] = root;
+
+    while (toVisitOffset > 0) {
+        const int current = stack[--toVisitOffset];
+
+        if (current < 0) {
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            for (int i = 0; i < n; ++i) {
+                if (triangles4[first + i].anyHit(ray, t.min, t.max)) {
+                    stats.leaf(4 * (i + 1));
+                    stats.earlyOut();
+                    return true;
+                }
+            }
+            stats.leaf(4 * n);
+            continue;
         }
 
-        const auto mask = simd::leq(tMin, tMax);
-        break;
+        const Node *node = &nodes[current];
+        stats.node();
+        stats.boxes(4);
+
+        float4 tNear;
+        const int mask = node->hit4(ray, t.min, t.max, tNear);
+        if (mask == 0) continue;
+
+        int order[4];
+        orderBVH4Children(node, ray.dirIsNeg, order);
+        for (int i = 3; i >= 0; --i) {
+            const int c = order[i];
+            if (!(mask & (1 << c)) || node->children[c] == BVH4_INT_MIN) continue;
+            stack[toVisitOffset++] = node->children[c];
+        }
+        stats.stackDepth(toVisitOffset);
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+template<typename Stats>
+bool BVH4::anyHit(const PrecomputedRay &ray, const int root, const Interval t, Stats &stats) const {
+    if (numNodes == 0) return false;
+    return compressedNodes ? traverseAnyHit(compressedNodes, stackSize, triangles4, ray, root, t, stats) : traverseAnyHit(nodes, stackSize, triangles4, ray, root, t, stats);
+}
+
+template bool BVH4::closestHit(const Ray &, Interval, PrimitiveHit &, TraversalStats &) const;
+template bool BVH4::anyHit(const Ray &, Interval, TraversalStats &) const;
+
+/**
+ * Per-packet traversal state: per-ray data for the box and triangle tests,
+ * and the bounds of the whole packet for the interval test
+ */
+template<int N>
+struct PacketTraversal {
+    static constexpr int NUM_GROUPS = N / 4;
+
+    PrecomputedRay rays[N];
+    float4 origin[3][NUM_GROUPS];
+    float4 invDir[3][NUM_GROUPS];
+    alignas(16) float tMin[N];
+    alignas(16) float tMax[N];
+
+    // Rays only share nodes if they agree on the direction sign of every axis
+    bool coherent = true;
+    int dirIsNeg[3];
+
+    // Bounds of the packet's origins, inverse directions and intervals
+    float4 originMin[3], originMax[3];
+    float4 invDirMin[3], invDirMax[3];
+    float4 packetTMin, packetTMax;
+
+    explicit PacketTraversal(const RayPacket<N> &packet) {
+        const int first = std::countr_zero(static_cast<unsigned>(packet.validMask));
+
+        float pTMin = INF, pTMax = -INF;
+        for (int i = 0; i < N; ++i) {
+            rays[i] = PrecomputedRay(packet.ray(i));
+            tMin[i] = packet.tMin[i];
+            tMax[i] = packet.tMax[i];
+            if (packet.validMask & (1 << i)) {
+                pTMin = std::min(pTMin, tMin[i]);
+                pTMax = std::max(pTMax, tMax[i]);
+            }
+        }
+        packetTMin = simd::broadcast(pTMin);
+        packetTMax = simd::broadcast(pTMax);
+
+        for (int a = 0; a < 3; ++a) {
+            dirIsNeg[a] = first < N ? rays[first].dirIsNeg[a] : 0;
+
+            float oMin = INF, oMax = -INF, iMin = INF, iMax = -INF;
+            for (int i = 0; i < N; ++i) {
+                if (!(packet.validMask & (1 << i))) continue;
+                const float inv = 1 / packet.dir[a][i];
+                // Infinite inverse directions would poison the interval products with NaNs
+                coherent &= rays[i].dirIsNeg[a] == dirIsNeg[a] && std::isfinite(inv);
+                oMin = std::min(oMin, packet.origin[a][i]);
+                oMax = std::max(oMax, packet.origin[a][i]);
+                iMin = std::min(iMin, inv);
+                iMax = std::max(iMax, inv);
+            }
+            originMin[a] = simd::broadcast(oMin);
+            originMax[a] = simd::broadcast(oMax);
+            invDirMin[a] = simd::broadcast(iMin);
+            invDirMax[a] = simd::broadcast(iMax);
+
+            for (int g = 0; g < NUM_GROUPS; ++g) {
+                origin[a][g] = simd::load(&packet.origin[a][4 * g]);
+                invDir[a][g] = simd::div(simd::broadcast(1.0f), simd::load(&packet.dir[a][4 * g]));
+            }
+        }
+    }
+
+    /**
+     * Conservative interval-arithmetic test of the whole packet against all 4 boxes.
+     * A box is culled only if no combination of the packet's origins and directions can hit it.
+     * @return mask of boxes that may be hit by some ray in the packet
+     */
+    [[nodiscard]]
+    int intervalHit4(const AABB4 &bbox) const {
+        const float *planes = &bbox.pmin[0][0];
+
+        // Bounds of (plane - origin) * invDir over the packet's intervals
+        const auto productMin = [](const float4 lo, const float4 hi, const float4 invLo, const float4 invHi) {
+            return simd::min(simd::min(simd::mul(lo, invLo), simd::mul(lo, invHi)), simd::min(simd::mul(hi, invLo), simd::mul(hi, invHi)));
+        };
+        const auto productMax = [](const float4 lo, const float4 hi, const float4 invLo, const float4 invHi) {
+            return simd::max(simd::max(simd::mul(lo, invLo), simd::mul(lo, invHi)), simd::max(simd::mul(hi, invLo), simd::mul(hi, invHi)));
+        };
+
+        float4 t0 = packetTMin;
+        float4 t1 = packetTMax;
+        for (int a = 0; a < 3; ++a) {
+            const float4 nearPlane = simd::load(planes + (dirIsNeg[a] ? 12 : 0) + 4 * a);
+            const float4 farPlane  = simd::load(planes + (dirIsNeg[a] ? 0 : 12) + 4 * a);
+
+            t0 = simd::max(t0, productMin(simd::sub(nearPlane, originMax[a]), simd::sub(nearPlane, originMin[a]), invDirMin[a], invDirMax[a]));
+            t1 = simd::min(t1, productMax(simd::sub(farPlane, originMax[a]), simd::sub(farPlane, originMin[a]), invDirMin[a], invDirMax[a]));
+        }
+        return simd::moveMask(simd::leq(t0, t1));
+    }
+
+    /**
+     * Slab test of the given rays against one box, 4 rays at a time
+     * @param bbox node bounds
+     * @param c box within the node
+     * @param rayMask rays to test
+     * @return mask of rays in rayMask that hit the box
+     */
+    [[nodiscard]]
+    int rayHit(const AABB4 &bbox, const int c, const int rayMask) const {
+        int mask = 0;
+        for (int g = 0; g < NUM_GROUPS; ++g) {
+            if (((rayMask >> (4 * g)) & 0xF) == 0) continue;
+
+            float4 t0 = simd::load(tMin + 4 * g);
+            float4 t1 = simd::load(tMax + 4 * g);
+            for (int a = 0; a < 3; ++a) {
+                const float4 nearPlane = simd::broadcast(dirIsNeg[a] ? bbox.pmax[a][c] : bbox.pmin[a][c]);
+                const float4 farPlane  = simd::broadcast(dirIsNeg[a] ? bbox.pmin[a][c] : bbox.pmax[a][c]);
+                t0                     = simd::max(simd::mul(simd::sub(nearPlane, origin[a][g]), invDir[a][g]), t0);
+                t1                     = simd::min(simd::mul(simd::sub(farPlane, origin[a][g]), invDir[a][g]), t1);
+            }
+            mask |= simd::moveMask(simd::leq(t0, t1)) << (4 * g);
+        }
+        return mask & rayMask;
+    }
+};
+
+template<int N>
+int BVH4::closestHitPacket(const RayPacket<N> &packet, PrimitiveHit *hits) const {
+    if (numNodes == 0) return 0;
+
+    PacketTraversal<N> traversal(packet);
+    int hitMask = 0;
+
+    // Trace a ray on its own from an encoded child, keeping its interval up to date
+    const auto traceSingle = [&](const int i, const int root) {
+        if (closestHit(traversal.rays[i], root, Interval(traversal.tMin[i], traversal.tMax[i]), hits[i])) {
+            traversal.tMax[i] = hits[i].t;
+            hitMask |= 1 << i;
+        }
+    };
+
+    // Compressed nodes are only traversed by single rays
+    if (!traversal.coherent || compressedNodes) {
+        for (int i = 0; i < N; ++i) {
+            if (packet.validMask & (1 << i)) traceSingle(i, 0);
+        }
+        return hitMask;
+    }
+
+    // Stack holds encoded children and the rays that reached them
+    int toVisitOffset = 0;
+    TraversalStack<int, BVH4_STACK_SIZE> stack(stackSize);
+    TraversalStack<int, BVH4_STACK_SIZE> stackMask(stackSize);
+
+    stack[toVisitOffset]       = 0;
+    stackMask[toVisitOffset++] = packet.validMask;
+
+    while (toVisitOffset > 0) {
+        const int current = stack[--toVisitOffset];
+        const int mask    = stackMask[toVisitOffset];
+
+        // Too few rays left to be worth sharing nodes
+        if (std::popcount(static_cast<unsigned>(mask)) <= N / 4) {
+            for (int i = 0; i < N; ++i) {
+                if (mask & (1 << i)) traceSingle(i, current);
+            }
+            continue;
+        }
+
+        if (current < 0) {
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            for (int b = 0; b < n; ++b) {
+                const Triangle4 &block = triangles4[first + b];
+                for (int i = 0; i < N; ++i) {
+                    if (!(mask & (1 << i))) continue;
+
+                    float tHit, u, v;
+                    const int lane = block.closestHit(traversal.rays[i], traversal.tMin[i], traversal.tMax[i], tHit, u, v);
+                    if (lane >= 0) {
+                        hitMask |= 1 << i;
+                        traversal.tMax[i] = tHit;
+                        hits[i].t         = tHit;
+                        hits[i].primIndex = block.primIndex[lane];
+                        hits[i].b1        = u;
+                        hits[i].b2        = v;
+                    }
+                }
+            }
+            continue;
+        }
+
+        const LBVH4Node *node = &nodes[current];
+        const int boxMask     = traversal.intervalHit4(node->bbox);
+        if (boxMask == 0) continue;
+
+        int order[4];
+        orderBVH4Children(node, traversal.dirIsNeg, order);
+        for (int i = 3; i >= 0; --i) {
+            const int c = order[i];
+            if (!(boxMask & (1 << c)) || node->children[c] == BVH4_INT_MIN) continue;
+
+            const int childMask = traversal.rayHit(node->bbox, c, mask);
+            if (childMask == 0) continue;
+            stack[toVisitOffset]       = node->children[c];
+            stackMask[toVisitOffset++] = childMask;
+        }
+    }
+
+    return hitMask;
+}
+
+template<int N>
+int BVH4::anyHitPacket(const RayPacket<N> &packet) const {
+    if (numNodes == 0) return 0;
+
+    PacketTraversal<N> traversal(packet);
+    int occludedMask = 0;
+
+    const auto traceSingle = [&](const int i, const int root) {
+        if (anyHit(traversal.rays[i], root, Interval(traversal.tMin[i], traversal.tMax[i]))) occludedMask |= 1 << i;
+    };
+
+    if (!traversal.coherent || compressedNodes) {
+        for (int i = 0; i < N; ++i) {
+            if (packet.validMask & (1 << i)) traceSingle(i, 0);
+        }
+        return occludedMask;
+    }
+
+    int toVisitOffset = 0;
+    TraversalStack<int, BVH4_STACK_SIZE> stack(stackSize);
+    TraversalStack<int, BVH4_STACK_SIZE> stackMask(stackSize);
+
+    stack[toVisitOffset]       = 0;
+    stackMask[toVisitOffset++] = packet.validMask;
+
+    while (toVisitOffset > 0) {
+        const int current = stack[--toVisitOffset];
+        // Occluded rays are done, wherever they were pushed
+        const int mask = stackMask[toVisitOffset] & ~occludedMask;
+        if (mask == 0) continue;
+
+        if (std::popcount(static_cast<unsigned>(mask)) <= N / 4) {
+            for (int i = 0; i < N; ++i) {
+                if (mask & (1 << i)) traceSingle(i, current);
+            }
+            continue;
+        }
+
+        if (current < 0) {
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            for (int i = 0; i < N; ++i) {
+                if (!(mask & (1 << i))) continue;
+                for (int b = 0; b < n; ++b) {
+                    if (triangles4[first + b].anyHit(traversal.rays[i], traversal.tMin[i], traversal.tMax[i])) {
+                        occludedMask |= 1 << i;
+                        break;
+                    }
+                }
+            }
+            if (occludedMask == packet.validMask) break;
+            continue;
+        }
+
+        const LBVH4Node *node = &nodes[current];
+        const int boxMask     = traversal.intervalHit4(node->bbox);
+        if (boxMask == 0) continue;
+
+        int order[4];
+        orderBVH4Children(node, traversal.dirIsNeg, order);
+        for (int i = 3; i >= 0; --i) {
+            const int c = order[i];
+            if (!(boxMask & (1 << c)) || node->children[c] == BVH4_INT_MIN) continue;
+
+            const int childMask = traversal.rayHit(node->bbox, c, mask);
+            if (childMask == 0) continue;
+            stack[toVisitOffset]       = node->children[c];
+            stackMask[toVisitOffset++] = childMask;
+        }
+    }
+
+    return occludedMask;
+}
+
+int BVH4::closestHit4(const RayPacket4 &packet, PrimitiveHit hits[4]) const {
+    return closestHitPacket(packet, hits);
+}
+
+int BVH4::closestHit8(const RayPacket8 &packet, PrimitiveHit hits[8]) const {
+    return closestHitPacket(packet, hits);
+}
+
+int BVH4::anyHit4(const RayPacket4 &packet) const {
+    return anyHitPacket(packet);
+}
+
+int BVH4::anyHit8(const RayPacket8 &packet) const {
+    return anyHitPacket(packet);
+}
+
+struct RayStreamEntry {
+    // Encoded child (node index or leaf)
+    int child;
+    // Range of the entry's ray list in the ray ID buffer
+    size_t begin, end;
+};
+
+// Rays tested against one box per SIMD op by the stream traversal
+#ifdef USE_AVX2
+using StreamFloat = simd::float8;
+using StreamMask  = simd::uint8;
+static constexpr int STREAM_WIDTH = 8;
+static StreamFloat streamBroadcast(const float x) { return simd::broadcast8(x); }
+static StreamFloat streamGather(const float *base, const int32_t *ids) { return simd::gather8(base, ids); }
+#else
+using StreamFloat = float4;
+using StreamMask  = simd::uint4;
+static constexpr int STREAM_WIDTH = 4;
+static StreamFloat streamBroadcast(const float x) { return simd::broadcast(x); }
+static StreamFloat streamGather(const float *base, const int32_t *ids) { return simd::gather(base, ids); }
+#endif
+
+void BVH4::closestHitStream(const std::span<const Ray> rays, const Interval t, const std::span<PrimitiveHit> hits) const {
+    if (numNodes == 0) {
+        for (PrimitiveHit &hit: hits) hit.primIndex = -1;
+        return;
+    }
+
+    const size_t n = rays.size();
+
+    // Compressed nodes are only traversed by single rays
+    if (compressedNodes) {
+        for (size_t i = 0; i < n; ++i) {
+            hits[i].primIndex = -1;
+            closestHit(rays[i], t, hits[i]);
+        }
+        return;
+    }
+
+    // Single-ray data for leaves and short lists, and SoA copies gathered by the box tests
+    std::vector<PrecomputedRay> precomputed(n);
+    std::vector<float> origin[3], invDir[3];
+    std::vector<float> tMax(n, t.max);
+    // Ray lists live in one buffer, in the same LIFO order as the stack
+    std::vector<int32_t> rayIds(n);
+    // Child hit masks of each group of STREAM_WIDTH rays of the node being visited
+    std::vector<uint8_t> groupMasks;
+
+    for (int a = 0; a < 3; ++a) {
+        origin[a].resize(n);
+        invDir[a].resize(n);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        precomputed[i]    = PrecomputedRay(rays[i]);
+        hits[i].primIndex = -1;
+        rayIds[i]         = static_cast<int32_t>(i);
+        for (int a = 0; a < 3; ++a) {
+            origin[a][i] = rays[i].origin[a];
+            invDir[a][i] = 1 / rays[i].dir[a];
+        }
+    }
+
+    const StreamFloat streamTMin = streamBroadcast(t.min);
+
+    std::vector<RayStreamEntry> stack;
+    stack.push_back({0, 0, n});
+
+    while (!stack.empty()) {
+        const RayStreamEntry entry = stack.back();
+        stack.pop_back();
+
+        // Lists above this one belonged to entries that are already done
+        rayIds.resize(entry.end);
+        const size_t count = entry.end - entry.begin;
+
+        if (count < BVH4_STREAM_MIN_RAYS) {
+            for (size_t k = entry.begin; k < entry.end; ++k) {
+                const int32_t i = rayIds[k];
+                if (closestHit(precomputed[i], entry.child, Interval(t.min, tMax[i]), hits[i])) tMax[i] = hits[i].t;
+            }
+            continue;
+        }
+
+        if (entry.child < 0) {
+            const int first     = LBVH4Node::leafPrimitiveIndices(entry.child) / 4;
+            const int numBlocks = LBVH4Node::leafNumPrimitives(entry.child) / 4;
+            for (int b = 0; b < numBlocks; ++b) {
+                const Triangle4 &block = triangles4[first + b];
+                for (size_t k = entry.begin; k < entry.end; ++k) {
+                    const int32_t i = rayIds[k];
+
+                    float tHit, u, v;
+                    const int lane = block.closestHit(precomputed[i], t.min, tMax[i], tHit, u, v);
+                    if (lane >= 0) {
+                        tMax[i]           = tHit;
+                        hits[i].t         = tHit;
+                        hits[i].primIndex = block.primIndex[lane];
+                        hits[i].b1        = u;
+                        hits[i].b2        = v;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Test each of the node's boxes against STREAM_WIDTH rays at a time
+        const LBVH4Node *node = &nodes[entry.child];
+        StreamFloat pmin[4][3], pmax[4][3];
+        int numChildren = 0;
+        int children[4];
+        for (int c = 0; c < 4; ++c) {
+            if (node->children[c] == BVH4_INT_MIN) continue;
+            children[numChildren++] = c;
+            for (int a = 0; a < 3; ++a) {
+                pmin[c][a] = streamBroadcast(node->bbox.pmin[a][c]);
+                pmax[c][a] = streamBroadcast(node->bbox.pmax[a][c]);
+            }
+        }
+
+        const size_t numGroups = (count + STREAM_WIDTH - 1) / STREAM_WIDTH;
+        groupMasks.resize(4 * numGroups);
+        size_t childCounts[4] = {};
+        int numNegative[3]    = {};
+        for (size_t g = 0; g < numGroups; ++g) {
+            const size_t k  = entry.begin + g * STREAM_WIDTH;
+            const int lanes = static_cast<int>(std::min<size_t>(STREAM_WIDTH, entry.end - k));
+            const int valid = (1 << lanes) - 1;
+
+            // The last group is padded with copies of a live ray
+            alignas(32) int32_t padded[STREAM_WIDTH];
+            const int32_t *ids = &rayIds[k];
+            if (lanes < STREAM_WIDTH) {
+                for (int l = 0; l < STREAM_WIDTH; ++l) padded[l] = rayIds[k + (l < lanes ? l : 0)];
+                ids = padded;
+            }
+
+            StreamFloat o[3], inv[3];
+            StreamMask negative[3];
+            for (int a = 0; a < 3; ++a) {
+                o[a]        = streamGather(origin[a].data(), ids);
+                inv[a]      = streamGather(invDir[a].data(), ids);
+                negative[a] = simd::ltZero(inv[a]);
+                numNegative[a] += std::popcount(static_cast<unsigned>(simd::moveMask(negative[a]) & valid));
+            }
+            const StreamFloat rayTMax = streamGather(tMax.data(), ids);
+
+            uint8_t *masks = &groupMasks[4 * g];
+            for (int c = 0; c < 4; ++c) masks[c] = 0;
+            for (int j = 0; j < numChildren; ++j) {
+                const int c = children[j];
+
+                // Same slab test as AABB4::hit4, with the near and far planes swapped per ray
+                StreamFloat t0 = streamTMin;
+                StreamFloat t1 = rayTMax;
+                for (int a = 0; a < 3; ++a) {
+                    const StreamFloat tLo = simd::mul(simd::sub(pmin[c][a], o[a]), inv[a]);
+                    const StreamFloat tHi = simd::mul(simd::sub(pmax[c][a], o[a]), inv[a]);
+                    t0                    = simd::max(simd::bitwiseSelect(negative[a], tHi, tLo), t0);
+                    t1                    = simd::min(simd::bitwiseSelect(negative[a], tLo, tHi), t1);
+                }
+                masks[c] = static_cast<uint8_t>(simd::moveMask(simd::leq(t0, t1)) & valid);
+                childCounts[c] += std::popcount(static_cast<unsigned>(masks[c]));
+            }
+        }
+
+        // Visit children front-to-back for the majority direction
+        int dirIsNeg[3];
+        for (int a = 0; a < 3; ++a) dirIsNeg[a] = 2 * static_cast<size_t>(numNegative[a]) > count;
+        int order[4];
+        orderBVH4Children(node, dirIsNeg, order);
+
+        // Partition the ray IDs into a list per child, pushed far to near so the nearest is on top
+        for (int j = 3; j >= 0; --j) {
+            const int c = order[j];
+            if (childCounts[c] == 0) continue;
+
+            const size_t begin = rayIds.size();
+            rayIds.resize(begin + childCounts[c]);
+            size_t out = begin;
+            for (size_t g = 0; g < numGroups; ++g) {
+                const size_t k = entry.begin + g * STREAM_WIDTH;
+                for (unsigned mask = groupMasks[4 * g + c]; mask != 0; mask &= mask - 1) rayIds[out++] = rayIds[k + std::countr_zero(mask)];
+            }
+            stack.push_back({node->children[c], begin, out});
+        }
+    }
+}
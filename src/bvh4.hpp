@@ -1,8 +1,14 @@
 #pragma once
 
 #include "bvh2.hpp"
+#include "bvhcollapse.hpp"
+#include "raypacket.hpp"
 #include "simd.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <vector>
+
 // QBVH: https://www.uni-ulm.de/fileadmin/website_uni_ulm/iui.inst.100/institut/Papers/QBVH.pdf
 
 using float4 = simd::float4;
@@ -11,6 +17,41 @@ static constexpr int BVH4_PRIMITIVE_MASK = 0xF;
 static constexpr int BVH4_INDICES_MASK = 0x7FFFFFF;
 static constexpr int BVH4_INT_MIN = 0x80000000;
 static constexpr int BVH4_MAX_PRIMS_IN_NODE = 64;
+// Leaf sizes are stored as a 4-bit count of groups of 4
+static constexpr int BVH4_MAX_LEAF_PRIMITIVES = BVH4_PRIMITIVE_MASK * 4;
+// Ray streams smaller than this continue with single-ray traversal
+static constexpr size_t BVH4_STREAM_MIN_RAYS = 16;
+
+/**
+ * Ray data for 4-wide box tests, computed once per ray
+ */
+struct PrecomputedRay {
+    float4 origin[3];
+    float4 dir[3];
+    float4 invDir[3];
+
+    // Offsets (in floats) of the near and far planes of each axis within an AABB4
+    int nearOffset[3];
+    int farOffset[3];
+
+    int dirIsNeg[3];
+
+    PrecomputedRay() = default;
+
+    explicit PrecomputedRay(const Ray &r) {
+        for (int i = 0; i < 3; ++i) {
+            const float inv = 1 / r.dir[i];
+            origin[i]       = simd::broadcast(r.origin[i]);
+            dir[i]          = simd::broadcast(r.dir[i]);
+            invDir[i]       = simd::broadcast(inv);
+
+            // pmax follows pmin in memory, so a negative direction swaps the planes
+            dirIsNeg[i]   = inv < 0;
+            nearOffset[i] = (dirIsNeg[i] ? 12 : 0) + 4 * i;
+            farOffset[i]  = (dirIsNeg[i] ? 0 : 12) + 4 * i;
+        }
+    }
+};
 
 struct AABB4 {
     // Min
@@ -18,6 +59,141 @@ struct AABB4 {
 
     // Max
     float pmax[3][4];
+
+    /**
+     * Tests a ray against all 4 boxes at once.
+     * Each box is clipped against the interval independently; nothing is carried between calls.
+     * @param r precomputed ray
+     * @param tMin interval start
+     * @param tMax interval end
+     * @param tEntry entry distance per box (only meaningful for hit lanes)
+     * @return 4-bit mask of boxes hit (lane i -> bit i)
+     */
+    int hit4(const PrecomputedRay &r, const float tMin, const float tMax, float4 &tEntry) const {
+        const float *planes = &pmin[0][0];
+
+        float4 t0 = simd::broadcast(tMin);
+        float4 t1 = simd::broadcast(tMax);
+        for (int i = 0; i < 3; ++i) {
+            const float4 tNear = simd::mul(simd::sub(simd::load(planes + r.nearOffset[i]), r.origin[i]), r.invDir[i]);
+            const float4 tFar  = simd::mul(simd::sub(simd::load(planes + r.farOffset[i]), r.origin[i]), r.invDir[i]);
+            t0                 = simd::max(tNear, t0);
+            t1                 = simd::min(tFar, t1);
+        }
+
+        tEntry = t0;
+        return simd::moveMask(simd::leq(t0, t1));
+    }
+};
+
+/**
+ * 4 triangles in SoA format, packed from a BVH4 leaf.
+ * Stores v0 and the two edges so the Möller–Trumbore test needs no index lookups.
+ * Padding lanes are degenerate (zero edges) and never hit.
+ */
+struct alignas(16) Triangle4 {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+
+    // Index into Scene::triangles, or -1 for padding
+    int primIndex[4];
+
+    void setLane(const int i, const Vec3f &p0, const Vec3f &p1, const Vec3f &p2, const int index) {
+        const Vec3f edge1 = p1 - p0;
+        const Vec3f edge2 = p2 - p0;
+        for (int a = 0; a < 3; ++a) {
+            v0[a][i] = p0[a];
+            e1[a][i] = edge1[a];
+            e2[a][i] = edge2[a];
+        }
+        primIndex[i] = index;
+    }
+
+    void setPadding(const int i) {
+        for (int a = 0; a < 3; ++a) {
+            v0[a][i] = e1[a][i] = e2[a][i] = 0;
+        }
+        primIndex[i] = -1;
+    }
+
+    /**
+     * Möller–Trumbore test of one ray against all 4 triangles
+     * @param r precomputed ray
+     * @param tMin interval start (exclusive)
+     * @param tMax interval end (exclusive)
+     * @param t hit distance per lane
+     * @param b1 barycentric coordinate of v1 per lane
+     * @param b2 barycentric coordinate of v2 per lane
+     * @return 4-bit mask of triangles hit (lane i -> bit i)
+     */
+    int hit4(const PrecomputedRay &r, const float tMin, const float tMax, float4 &t, float4 &b1, float4 &b2) const {
+        const float4 e1x = simd::load(e1[0]), e1y = simd::load(e1[1]), e1z = simd::load(e1[2]);
+        const float4 e2x = simd::load(e2[0]), e2y = simd::load(e2[1]), e2z = simd::load(e2[2]);
+
+        // pvec = dir x e2
+        const float4 px = simd::sub(simd::mul(r.dir[1], e2z), simd::mul(r.dir[2], e2y));
+        const float4 py = simd::sub(simd::mul(r.dir[2], e2x), simd::mul(r.dir[0], e2z));
+        const float4 pz = simd::sub(simd::mul(r.dir[0], e2y), simd::mul(r.dir[1], e2x));
+
+        const float4 det    = simd::add(simd::add(simd::mul(e1x, px), simd::mul(e1y, py)), simd::mul(e1z, pz));
+        const float4 invDet = simd::div(simd::broadcast(1.0f), det);
+        auto valid          = simd::gt(simd::abs(det), simd::broadcast(1e-8f));
+
+        // tvec = o - v0
+        const float4 tx = simd::sub(r.origin[0], simd::load(v0[0]));
+        const float4 ty = simd::sub(r.origin[1], simd::load(v0[1]));
+        const float4 tz = simd::sub(r.origin[2], simd::load(v0[2]));
+
+        b1    = simd::mul(simd::add(simd::add(simd::mul(tx, px), simd::mul(ty, py)), simd::mul(tz, pz)), invDet);
+        valid = simd::maskAnd(valid, simd::maskAnd(simd::geqZero(b1), simd::leq(b1, simd::broadcast(1.0f))));
+
+        // qvec = tvec x e1
+        const float4 qx = simd::sub(simd::mul(ty, e1z), simd::mul(tz, e1y));
+        const float4 qy = simd::sub(simd::mul(tz, e1x), simd::mul(tx, e1z));
+        const float4 qz = simd::sub(simd::mul(tx, e1y), simd::mul(ty, e1x));
+
+        b2    = simd::mul(simd::add(simd::add(simd::mul(r.dir[0], qx), simd::mul(r.dir[1], qy)), simd::mul(r.dir[2], qz)), invDet);
+        valid = simd::maskAnd(valid, simd::maskAnd(simd::geqZero(b2), simd::leq(simd::add(b1, b2), simd::broadcast(1.0f))));
+
+        t     = simd::mul(simd::add(simd::add(simd::mul(e2x, qx), simd::mul(e2y, qy)), simd::mul(e2z, qz)), invDet);
+        valid = simd::maskAnd(valid, simd::maskAnd(simd::gt(t, simd::broadcast(tMin)), simd::lt(t, simd::broadcast(tMax))));
+
+        return simd::moveMask(valid);
+    }
+
+    /**
+     * Finds the closest of the 4 triangles hit within (tMin, tMax)
+     * @return lane of the closest hit, or -1 if none
+     */
+    int closestHit(const PrecomputedRay &r, const float tMin, const float tMax, float &tHit, float &b1, float &b2) const {
+        float4 t4, b1_4, b2_4;
+        const int mask = hit4(r, tMin, tMax, t4, b1_4, b2_4);
+        if (mask == 0) return -1;
+
+        float t[4], u[4], v[4];
+        simd::store(t, t4);
+        simd::store(u, b1_4);
+        simd::store(v, b2_4);
+
+        int lane = -1;
+        tHit     = tMax;
+        for (int i = 0; i < 4; ++i) {
+            if ((mask & (1 << i)) && t[i] < tHit) {
+                tHit = t[i];
+                lane = i;
+            }
+        }
+        b1 = u[lane];
+        b2 = v[lane];
+        return lane;
+    }
+
+    [[nodiscard]]
+    bool anyHit(const PrecomputedRay &r, const float tMin, const float tMax) const {
+        float4 t, b1, b2;
+        return hit4(r, tMin, tMax, t, b1, b2) != 0;
+    }
 };
 
 /**
@@ -35,6 +211,13 @@ struct alignas(128) LBVH4Node {
     // Split axes
     int axis[3];
 
+    /**
+     * Tests a ray against the 4 child boxes; see AABB4::hit4
+     */
+    int hit4(const PrecomputedRay &r, const float tMin, const float tMax, float4 &tEntry) const {
+        return bbox.hit4(r, tMin, tMax, tEntry);
+    }
+
     /**
      * Checks if the child at the given index is a leaf.
      * @param child child index [0, 4)
@@ -62,8 +245,7 @@ struct alignas(128) LBVH4Node {
      * @return number of primitives in leaf
      */
     int getNumPrimitives(const int child) const {
-        // # of primitives is always a multiple of 4 (via padding if needed)
-        return ((children[child] >> 27) & BVH4_PRIMITIVE_MASK) * 4;
+        return leafNumPrimitives(children[child]);
     }
 
     /**
@@ -75,21 +257,347 @@ struct alignas(128) LBVH4Node {
      * @return primitive indices
      */
     int getPrimitiveIndices(const int child) const {
-        return children[child] & BVH4_INDICES_MASK;
+        return leafPrimitiveIndices(children[child]);
+    }
+
+    /**
+     * Decodes the number of primitives from an encoded leaf
+     * @param encoded encoded child entry
+     * @return number of primitives in leaf
+     */
+    static int leafNumPrimitives(const int encoded) {
+        // # of primitives is always a multiple of 4 (via padding if needed)
+        return ((encoded >> 27) & BVH4_PRIMITIVE_MASK) * 4;
+    }
+
+    /**
+     * Decodes the primitive offset from an encoded leaf
+     * @param encoded encoded child entry
+     * @return primitive indices
+     */
+    static int leafPrimitiveIndices(const int encoded) {
+        return encoded & BVH4_INDICES_MASK;
     }
 };
 
+/**
+ * LBVH4Node with quantized child bounds, in a single 64-byte cache line.
+ * Child bounds are stored as 8-bit offsets from the node's own bounds (its box in the parent),
+ * in steps of a power-of-two scale per axis. Quantized bounds are rounded outwards,
+ * so they always contain the full-precision bounds.
+ */
+struct alignas(64) CompressedLBVH4Node {
+    // Min corner of the node's bounds
+    float origin[3];
+    // Quantization step per axis is 2^exponent
+    int8_t exponent[3];
+    int8_t axis[3];
+
+    // Quantized child bounds, laid out like AABB4 (min, then max) so PrecomputedRay offsets apply
+    uint8_t bounds[2][3][4];
+
+    // Same encoding as LBVH4Node
+    int children[4];
+
+    /**
+     * Quantization step of an axis, built directly from the exponent bits
+     * @param axis axis [0, 3)
+     */
+    [[nodiscard]]
+    float scale(const int axis) const {
+        return std::bit_cast<float>(static_cast<uint32_t>(exponent[axis] + 127) << 23);
+    }
+
+    /**
+     * Dequantizes the child bounds and tests a ray against all 4 boxes at once
+     * @param r precomputed ray
+     * @param tMin interval start
+     * @param tMax interval end
+     * @param tEntry entry distance per box (only meaningful for hit lanes)
+     * @return 4-bit mask of boxes hit (lane i -> bit i)
+     */
+    int hit4(const PrecomputedRay &r, const float tMin, const float tMax, float4 &tEntry) const {
+        const uint8_t *planes = &bounds[0][0][0];
+
+        float4 t0 = simd::broadcast(tMin);
+        float4 t1 = simd::broadcast(tMax);
+        for (int i = 0; i < 3; ++i) {
+            // origin + q * scale is rounded once, exactly as when the bounds were quantized
+            const float4 o         = simd::broadcast(origin[i]);
+            const float4 s         = simd::broadcast(scale(i));
+            const float4 nearPlane = simd::fma(simd::loadBytes(planes + r.nearOffset[i]), s, o);
+            const float4 farPlane  = simd::fma(simd::loadBytes(planes + r.farOffset[i]), s, o);
+            const float4 tNear     = simd::mul(simd::sub(nearPlane, r.origin[i]), r.invDir[i]);
+            const float4 tFar      = simd::mul(simd::sub(farPlane, r.origin[i]), r.invDir[i]);
+            t0                     = simd::max(tNear, t0);
+            t1                     = simd::min(tFar, t1);
+        }
+
+        tEntry = t0;
+        return simd::moveMask(simd::leq(t0, t1));
+    }
+};
+
+static_assert(sizeof(CompressedLBVH4Node) == 64, "compressed nodes must fit in a cache line");
+
+// Entries in the fixed per-ray stack of the BVH4 traversals; trees that need more use a heap stack
+static constexpr int BVH4_STACK_SIZE = 64;
+
+/**
+ * Per-ray traversal stack: a Size-entry array, or a heap array when the tree needs more entries than that
+ */
+template<typename T, int Size>
+struct TraversalStack {
+    T fixed[Size];
+    std::vector<T> heap;
+    T *data = fixed;
+
+    explicit TraversalStack(const int size) {
+        if (size > Size) {
+            heap.resize(size);
+            data = heap.data();
+        }
+    }
+    TraversalStack(const TraversalStack &)            = delete;
+    TraversalStack &operator=(const TraversalStack &) = delete;
+
+    T &operator[](const int i) {
+        return data[i];
+    }
+};
+
+/**
+ * Most entries a depth-first traversal stack holds over a tree of nodes with LBVH4Node-encoded children, starting
+ * from the root alone. Each node pops itself and pushes up to one entry per child, and its other children may still
+ * be on the stack while one child's subtree is traversed. Subtrees never need more than the whole tree.
+ */
+template<typename Node>
+int computeTraversalStackSize(const Node *nodes, const int numNodes) {
+    if (numNodes == 0) return 0;
+
+    // Parents before children, with a growable stack as the tree may be deep
+    std::vector<int> order;
+    order.reserve(numNodes);
+    std::vector<int> pending = {0};
+    while (!pending.empty()) {
+        const int i = pending.back();
+        pending.pop_back();
+        order.push_back(i);
+        for (const int child: nodes[i].children) {
+            if (child >= 0) pending.push_back(child);
+        }
+    }
+
+    // Then children before parents; a leaf entry needs only itself
+    std::vector<int> need(numNodes, 1);
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        int numChildren = 0;
+        int deepest     = 1;
+        for (const int child: nodes[*it].children) {
+            if (child == BVH4_INT_MIN) continue;
+            ++numChildren;
+            if (child >= 0) deepest = std::max(deepest, need[child]);
+        }
+        need[*it] = numChildren - 1 + deepest;
+    }
+    return need[0];
+}
+
 struct BVH4 {
-    std::vector<Primitive> primitives;
+    // Leaf triangles packed 4 at a time; block i holds primitives [4i, 4i + 4)
+    std::span<Triangle4> triangles4;
     LBVH4Node *nodes = nullptr;
+    int numNodes     = 0;
     const Scene &scene;
+    // Threads used by build(); 0 uses all hardware threads
+    int numBuildThreads = 0;
+    BVHBuildMethod buildMethod = BVHBuildMethod::SAH;
+    SBVHSettings sbvh;
+    // Replaces nodes with half-size CompressedLBVH4Nodes after the build.
+    // Packet and stream traversals then trace their rays one at a time.
+    bool compressNodes = false;
+    CompressedLBVH4Node *compressedNodes = nullptr;
+    // Order of nodes (full-precision or compressed) after build() and refit()
+    BVHNodeLayout nodeLayout = BVHNodeLayout::DepthFirst;
+    // Set when the node and triangle arrays point into a mapped cache file, which then owns them
+    std::shared_ptr<const MappedFile> mapping;
+
+    // SAH cost of each node's subtree relative to its own area when built, indexed in depth-first order;
+    // set by build() (empty with compressed nodes), stored in the BVH cache, kept by refit rebuilds and cleared by destroy()
+    std::vector<float> refitReferenceCosts;
+    // Most entries a traversal stack needs on this tree, set by computeStackSize(); traversals switch to a heap stack
+    // when it exceeds BVH4_STACK_SIZE
+    int stackSize = 0;
 
     void build();
-    void destroy() const { if (nodes) delete[] nodes; }
+
+    /**
+     * Sets stackSize from the node array (either format). Called by build(), cache loads and refit rebuilds;
+     * only needed again after nodes is replaced by hand.
+     */
+    void computeStackSize() {
+        stackSize = compressedNodes ? computeTraversalStackSize(compressedNodes, numNodes) : computeTraversalStackSize(nodes, numNodes);
+    }
+
+    /**
+     * Recomputes every bound and Triangle4 block bottom-up from the current mesh vertices without changing the tree,
+     * in parallel over subtrees. Subtrees whose SAH cost has grown by more than maxSAHGrowth since they were built are
+     * then rebuilt with binned SAH. Trees mapped from a cache file are only refit; compressed nodes cannot be refit and
+     * are rebuilt in full. Treelet layouts are reordered to depth first and back around the refit.
+     * @param maxSAHGrowth cost ratio above which a subtree is rebuilt; 0 never rebuilds
+     */
+    BVHRefitResult refit(float maxSAHGrowth = 0);
+
+    /**
+     * Sets refitReferenceCosts from the current bounds and mesh vertices, which must agree (as at the end of a build).
+     * Needs full-precision nodes in depth-first order.
+     */
+    void computeRefitReferenceCosts();
+
+    void destroy() {
+        refitReferenceCosts.clear();
+        if (mapping) return;
+        freeBVHNodes(nodes);
+        freeBVHNodes(compressedNodes);
+        delete[] triangles4.data();
+    }
+
+    /**
+     * Size of the node array in bytes
+     */
+    [[nodiscard]]
+    size_t nodeBytes() const {
+        return numNodes * (compressedNodes ? sizeof(CompressedLBVH4Node) : sizeof(LBVH4Node));
+    }
 
     bool closestHit(const Ray &r, Interval t, SurfaceIntersection &record) const;
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit) const;
     bool anyHit(const Ray &r, Interval t) const;
+
+    /**
+     * Single-ray traversal of the subtree rooted at an encoded child (node index or leaf)
+     * @param ray precomputed ray
+     * @param root encoded child to start from (0 for the whole tree)
+     * @param t interval to search
+     * @param hit closest hit, only written if something is hit
+     * @return true if anything is hit
+     */
+    bool closestHit(const PrecomputedRay &ray, int root, Interval t, PrimitiveHit &hit) const;
+    bool anyHit(const PrecomputedRay &ray, int root, Interval t) const;
+
+    /**
+     * Instrumented traversals; instantiated for TraversalStats
+     * @param stats counters for this ray, added to
+     */
+    template<typename Stats>
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const;
+    template<typename Stats>
+    bool anyHit(const Ray &r, Interval t, Stats &stats) const;
+    template<typename Stats>
+    bool closestHit(const PrecomputedRay &ray, int root, Interval t, PrimitiveHit &hit, Stats &stats) const;
+    template<typename Stats>
+    bool anyHit(const PrecomputedRay &ray, int root, Interval t, Stats &stats) const;
+
+    /**
+     * Traces a packet of coherent rays together, so each node is fetched once for the whole packet.
+     * Interior nodes are culled with a conservative interval test over the whole packet before the
+     * per-ray box tests, and rays that have stopped hitting a subtree are masked out.
+     * Packets whose rays disagree on direction signs, and subtrees reached by a quarter of the
+     * rays or fewer, fall back to single-ray traversal.
+     * @param packet rays to trace
+     * @param hits closest hit per ray, only written for rays that hit
+     * @return mask of rays that hit something (lane i -> bit i)
+     */
+    int closestHit4(const RayPacket4 &packet, PrimitiveHit hits[4]) const;
+    int closestHit8(const RayPacket8 &packet, PrimitiveHit hits[8]) const;
+
+    /**
+     * Occlusion test for a packet of coherent rays; rays leave the packet as soon as they are occluded
+     * @param packet rays to trace
+     * @return mask of occluded rays (lane i -> bit i)
+     */
+    int anyHit4(const RayPacket4 &packet) const;
+    int anyHit8(const RayPacket8 &packet) const;
+
+    /**
+     * Traces a large batch of incoherent rays (e.g. a wavefront of bounce rays) breadth-first.
+     * Each node is visited once for all of the rays that reach it: each of the node's boxes is
+     * tested against 4 rays per SIMD op (8 with AVX2), gathered from the node's ray list, and the
+     * ray IDs are partitioned into one list per child (DRST-style).
+     * Streams that shrink below BVH4_STREAM_MIN_RAYS continue with single-ray traversal.
+     * @param rays rays to trace
+     * @param t interval shared by every ray
+     * @param hits closest hit per ray; primIndex is -1 for rays that miss
+     */
+    void closestHitStream(std::span<const Ray> rays, Interval t, std::span<PrimitiveHit> hits) const;
+
+    template<int N>
+    int closestHitPacket(const RayPacket<N> &packet, PrimitiveHit *hits) const;
+    template<int N>
+    int anyHitPacket(const RayPacket<N> &packet) const;
 };
 
-// BVH4 construction collapses a BVH2 tree on every 2 levels
-int flattenBVH2toLBVH4(const BVH2Node *node, LBVH4Node *nodes, int *offset);
\ No newline at end of file
+/**
+ * Encodes a padded BVH2 leaf as a child of a BVH4 (or N-wide) node
+ */
+inline int encodeBVH4Leaf(const BVH2Node *leaf) {
+    return BVH4_INT_MIN | ((leaf->numPrimitives / 4) << 27) | (leaf->firstPrimOffset & BVH4_INDICES_MASK);
+}
+
+/**
+ * Prepares BVH2 leaves for BVH4 encoding: leaves larger than BVH4_MAX_LEAF_PRIMITIVES are split,
+ * and every leaf is padded to a multiple of 4 by repeating its last primitive.
+ * @param node BVH2 subtree root
+ * @param primitives primitives ordered by the BVH2 build
+ * @param paddedPrimitives output primitives, in padded leaf order
+ * @param totalNodes incremented for every node added by splitting
+ * @param arena arena for nodes added by splitting
+ */
+void padBVH2LeavesForBVH4(BVH2Node *node, const std::vector<Primitive> &primitives, std::vector<Primitive> &paddedPrimitives, int *totalNodes, Arena &arena);
+
+/**
+ * Packs padded leaf primitives into Triangle4 blocks.
+ * Padding lanes (repeats of the previous lane) become degenerate triangles.
+ * @param scene scene owning the triangles
+ * @param paddedPrimitives primitives in padded leaf order
+ * @return blocks, allocated with new[]
+ */
+std::span<Triangle4> packTriangle4(const Scene &scene, const std::vector<Primitive> &paddedPrimitives);
+
+/**
+ * Number of nodes flattenBVH2toLBVH4 writes for a collapsed BVH2 tree
+ */
+int countBVH4Nodes(const BVH2Node *root, const std::vector<BVH4CollapseCost> &collapse);
+
+/**
+ * Flattens a collapsed BVH2 tree into BVH4 nodes, root first
+ * @param nodes output array with room for countBVH4Nodes(root, collapse) nodes
+ * @return number of nodes written
+ */
+int flattenBVH2toLBVH4(const BVH2Node *root, const std::vector<BVH4CollapseCost> &collapse, LBVH4Node *nodes);
+
+/**
+ * Quantizes full-precision nodes, rounding child bounds outwards
+ * @param nodes full-precision nodes
+ * @param numNodes number of nodes
+ * @param compressed output array with room for numNodes nodes; children keep their indices
+ */
+void compressLBVH4Nodes(const LBVH4Node *nodes, int numNodes, CompressedLBVH4Node *compressed);
+
+/**
+ * Reorders a flat node array in place and rewrites the child indices; leaves and Triangle4 blocks are unchanged.
+ * Depth-first order visits children in slot order, as flattenBVH2toLBVH4 writes them.
+ */
+void layoutLBVH4Nodes(LBVH4Node *nodes, int numNodes, BVHNodeLayout layout);
+
+/**
+ * Computes the SAH cost of a BVH4 with the same constants as the BVH2 version
+ * (0.5 per node visited, 1 per primitive test). Leaves count their padding lanes,
+ * since those are tested too.
+ */
+float computeSAHCost(const LBVH4Node *nodes);
+
+/**
+ * Fraction of child slots holding a child or leaf, over all nodes (1 when every node is full)
+ */
+float computeBVH4FillRate(const LBVH4Node *nodes, int numNodes);
@@ -0,0 +1,352 @@
+#include "bvhcache.hpp"
+
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char BVH_CACHE_MAGIC[8] = {'S', 'I', 'M', 'D', 'B', 'V', 'H', 'C'};
+
+enum BVHCacheFlags : uint32_t {
+    BVH_CACHE_HAS_BVH2        = 1,
+    BVH_CACHE_HAS_BVH4        = 2,
+    BVH_CACHE_BVH4_COMPRESSED = 4,
+};
+
+/**
+ * Position (in bytes from the start of the file) and element count of an array
+ */
+struct BVHCacheSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct BVHCacheMesh {
+    int32_t numVertices;
+    int32_t numIndices;
+    BVHCacheSection indices;
+    BVHCacheSection vertices;
+    BVHCacheSection normals;
+    // Empty if the mesh has no UVs
+    BVHCacheSection uvs;
+};
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t key;
+    uint64_t fileSize;
+    // sizeof of every stored type, so a build with another layout never reads the file
+    uint32_t typeSizes[9];
+
+    BVHCacheSection meshes;
+    BVHCacheSection triangles;
+    BVHCacheSection bvh2Nodes;
+    BVHCacheSection bvh2PrimIndices;
+    // Empty with BVHTriangleLayout::Indexed
+    BVHCacheSection bvh2Triangles;
+    // LBVH4Node, or CompressedLBVH4Node with BVH_CACHE_BVH4_COMPRESSED
+    BVHCacheSection bvh4Nodes;
+    BVHCacheSection bvh4Triangles;
+    // Refit reference costs, one float per node; taken at build time, when bounds and vertices still agree
+    BVHCacheSection bvh2RefitCosts;
+    // Empty with BVH_CACHE_BVH4_COMPRESSED
+    BVHCacheSection bvh4RefitCosts;
+};
+
+static constexpr uint32_t BVH_CACHE_TYPE_SIZES[9] = {
+        sizeof(Vec3i),     sizeof(Vec3f),     sizeof(Vec2f),               sizeof(Triangle),
+        sizeof(LBVH2Node), sizeof(LBVH4Node), sizeof(CompressedLBVH4Node), sizeof(Triangle4),
+        sizeof(LeafTriangle),
+};
+
+static_assert(alignof(LBVH4Node) <= BVH_CACHE_ALIGNMENT && alignof(LBVH2Node) <= BVH_CACHE_ALIGNMENT && alignof(Triangle4) <= BVH_CACHE_ALIGNMENT);
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+#else
+    if (data) munmap(data, size);
+#endif
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string &path) {
+    auto mapped = std::make_shared<MappedFile>();
+#ifdef _WIN32
+    mapped->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        mapped->file = nullptr;
+        return nullptr;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0) return nullptr;
+    mapped->mapping = CreateFileMappingA(mapped->file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (!mapped->mapping) return nullptr;
+    mapped->data = static_cast<std::byte *>(MapViewOfFile(mapped->mapping, FILE_MAP_COPY, 0, 0, 0));
+    if (!mapped->data) return nullptr;
+    mapped->size = static_cast<size_t>(size.QuadPart);
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping holds its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    mapped->data = static_cast<std::byte *>(data);
+    mapped->size = static_cast<size_t>(st.st_size);
+#endif
+    return mapped;
+}
+
+static constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+
+/**
+ * FNV-1a step over a whole word, followed by an xorshift so high bits feed back into low ones
+ */
+static uint64_t mixHash(uint64_t h, const uint64_t v) {
+    h = (h ^ v) * 0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+static uint64_t hashBytes(const std::byte *data, const size_t size) {
+    uint64_t h = FNV_OFFSET;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        h = mixHash(h, word);
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    return mixHash(mixHash(h, tail), size);
+}
+
+std::optional<uint64_t> hashFile(const std::string &path) {
+    const auto file = MappedFile::open(path);
+    if (!file) return std::nullopt;
+    return hashBytes(file->data, file->size);
+}
+
+static uint64_t mixSBVHSettings(const uint64_t h, const SBVHSettings &settings) {
+    return mixHash(mixHash(h, std::bit_cast<uint32_t>(settings.overlapThreshold)), std::bit_cast<uint32_t>(settings.duplicationBudget));
+}
+
+uint64_t bvhCacheKey(const uint64_t sourceHash, const BVH2 *bvh2, const BVH4 *bvh4) {
+    uint64_t h = mixHash(FNV_OFFSET, sourceHash);
+    if (bvh2) {
+        h = mixHash(h, BVH_CACHE_HAS_BVH2);
+        h = mixHash(h, static_cast<uint64_t>(bvh2->buildMethod));
+        h = mixHash(h, static_cast<uint64_t>(bvh2->maxPrimsInNode));
+        h = mixSBVHSettings(h, bvh2->sbvh);
+        h = mixHash(h, static_cast<uint64_t>(bvh2->triangleLayout));
+        h = mixHash(h, static_cast<uint64_t>(bvh2->nodeLayout));
+    }
+    if (bvh4) {
+        h = mixHash(h, BVH_CACHE_HAS_BVH4);
+        h = mixHash(h, static_cast<uint64_t>(bvh4->buildMethod));
+        h = mixHash(h, bvh4->compressNodes);
+        h = mixSBVHSettings(h, bvh4->sbvh);
+        h = mixHash(h, static_cast<uint64_t>(bvh4->nodeLayout));
+    }
+    return h;
+}
+
+/**
+ * Appends arrays to a cache file, each starting on a multiple of BVH_CACHE_ALIGNMENT (or a larger alignment)
+ */
+struct BVHCacheWriter {
+    std::ofstream out;
+    uint64_t offset = 0;
+
+    template<typename T>
+    BVHCacheSection write(const T *data, const size_t count, const size_t alignment = BVH_CACHE_ALIGNMENT) {
+        static constexpr char padding[BVH_TREELET_BYTES] = {};
+
+        const uint64_t start = (offset + alignment - 1) / alignment * alignment;
+        out.write(padding, static_cast<std::streamsize>(start - offset));
+        out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(count * sizeof(T)));
+        offset = start + count * sizeof(T);
+        return {start, count};
+    }
+};
+
+bool saveBVHCache(const std::string &path, const uint64_t key, const Scene &scene, const BVH2 *bvh2, const BVH4 *bvh4) {
+    const std::string tmpPath = path + ".tmp";
+
+    BVHCacheWriter writer{std::ofstream(tmpPath, std::ios::binary)};
+    if (!writer.out) return false;
+
+    BVHCacheHeader header{};
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.key     = key;
+    std::memcpy(header.typeSizes, BVH_CACHE_TYPE_SIZES, sizeof(header.typeSizes));
+
+    // The header is rewritten once every section's position is known
+    writer.write(&header, 1);
+
+    std::vector<BVHCacheMesh> meshes(scene.meshes.size());
+    for (size_t m = 0; m < scene.meshes.size(); ++m) {
+        const Mesh &mesh      = scene.meshes[m];
+        meshes[m].numVertices = mesh.numVertices;
+        meshes[m].numIndices  = mesh.numIndices;
+        meshes[m].indices     = writer.write(mesh.indices, mesh.numIndices);
+        meshes[m].vertices    = writer.write(mesh.vertices, mesh.numVertices);
+        meshes[m].normals     = writer.write(mesh.normals, mesh.numVertices);
+        meshes[m].uvs         = mesh.uvs ? writer.write(mesh.uvs, mesh.numVertices) : BVHCacheSection{0, 0};
+    }
+    header.meshes    = writer.write(meshes.data(), meshes.size());
+    header.triangles = writer.write(scene.triangles.data(), scene.triangles.size());
+
+    if (bvh2) {
+        header.flags |= BVH_CACHE_HAS_BVH2;
+        // Node sections start on a page, as allocateBVHNodes() arrays do, so mapped treelets line up with pages
+        header.bvh2Nodes       = writer.write(bvh2->nodes, bvh2->numNodes, BVH_TREELET_BYTES);
+        header.bvh2PrimIndices = writer.write(bvh2->primIndices.data(), bvh2->primIndices.size());
+        header.bvh2Triangles   = writer.write(bvh2->leafTriangles.data(), bvh2->leafTriangles.size());
+        header.bvh2RefitCosts  = writer.write(bvh2->refitReferenceCosts.data(), bvh2->refitReferenceCosts.size());
+    }
+    if (bvh4) {
+        header.flags |= BVH_CACHE_HAS_BVH4;
+        if (bvh4->compressedNodes) {
+            header.flags |= BVH_CACHE_BVH4_COMPRESSED;
+            header.bvh4Nodes = writer.write(bvh4->compressedNodes, bvh4->numNodes, BVH_TREELET_BYTES);
+        } else {
+            header.bvh4Nodes = writer.write(bvh4->nodes, bvh4->numNodes, BVH_TREELET_BYTES);
+        }
+        header.bvh4Triangles  = writer.write(bvh4->triangles4.data(), bvh4->triangles4.size());
+        header.bvh4RefitCosts = writer.write(bvh4->refitReferenceCosts.data(), bvh4->refitReferenceCosts.size());
+    }
+
+    header.fileSize = writer.offset;
+    writer.out.seekp(0);
+    writer.out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    writer.out.close();
+    if (!writer.out) return false;
+
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    return !error;
+}
+
+template<typename T>
+static bool sectionInFile(const MappedFile &file, const BVHCacheSection &section) {
+    return section.offset % BVH_CACHE_ALIGNMENT == 0 && section.offset <= file.size && section.count <= (file.size - section.offset) / sizeof(T);
+}
+
+template<typename T>
+static T *sectionData(const MappedFile &file, const BVHCacheSection &section) {
+    return section.count == 0 ? nullptr : reinterpret_cast<T *>(file.data + section.offset);
+}
+
+bool loadBVHCache(const std::string &path, const uint64_t key, Scene &scene, BVH2 *bvh2, BVH4 *bvh4) {
+    const auto file = MappedFile::open(path);
+    if (!file || file->size < sizeof(BVHCacheHeader)) return false;
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file->data, sizeof(header));
+    if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_CACHE_VERSION || header.key != key ||
+        header.fileSize != file->size || std::memcmp(header.typeSizes, BVH_CACHE_TYPE_SIZES, sizeof(header.typeSizes)) != 0) {
+        return false;
+    }
+    if ((bvh2 && !(header.flags & BVH_CACHE_HAS_BVH2)) || (bvh4 && !(header.flags & BVH_CACHE_HAS_BVH4))) return false;
+
+    // Reject anything pointing outside the file before touching the scene or the BVHs
+    const bool compressed = header.flags & BVH_CACHE_BVH4_COMPRESSED;
+    if (!sectionInFile<BVHCacheMesh>(*file, header.meshes) || !sectionInFile<Triangle>(*file, header.triangles) ||
+        !sectionInFile<LBVH2Node>(*file, header.bvh2Nodes) || !sectionInFile<uint32_t>(*file, header.bvh2PrimIndices) ||
+        !sectionInFile<LeafTriangle>(*file, header.bvh2Triangles) ||
+        !(compressed ? sectionInFile<CompressedLBVH4Node>(*file, header.bvh4Nodes) : sectionInFile<LBVH4Node>(*file, header.bvh4Nodes)) ||
+        !sectionInFile<Triangle4>(*file, header.bvh4Triangles) || !sectionInFile<float>(*file, header.bvh2RefitCosts) ||
+        !sectionInFile<float>(*file, header.bvh4RefitCosts)) {
+        return false;
+    }
+    if ((bvh2 && header.bvh2RefitCosts.count != header.bvh2Nodes.count) || (bvh4 && header.bvh4RefitCosts.count != (compressed ? 0 : header.bvh4Nodes.count))) {
+        return false;
+    }
+    const auto *meshes = sectionData<const BVHCacheMesh>(*file, header.meshes);
+    for (size_t m = 0; m < header.meshes.count; ++m) {
+        if (!sectionInFile<Vec3i>(*file, meshes[m].indices) || !sectionInFile<Vec3f>(*file, meshes[m].vertices) ||
+            !sectionInFile<Vec3f>(*file, meshes[m].normals) || !sectionInFile<Vec2f>(*file, meshes[m].uvs)) {
+            return false;
+        }
+    }
+
+    scene.meshes.resize(header.meshes.count);
+    for (size_t m = 0; m < header.meshes.count; ++m) {
+        scene.meshes[m] = Mesh{meshes[m].numVertices,
+                               meshes[m].numIndices,
+                               sectionData<Vec3i>(*file, meshes[m].indices),
+                               sectionData<Vec3f>(*file, meshes[m].vertices),
+                               sectionData<Vec3f>(*file, meshes[m].normals),
+                               sectionData<Vec2f>(*file, meshes[m].uvs)};
+    }
+    // Scene::triangles is a vector, so the (small) triangle list is the one array that is copied
+    const Triangle *triangles = sectionData<const Triangle>(*file, header.triangles);
+    scene.triangles.assign(triangles, triangles + header.triangles.count);
+    scene.mapping = file;
+
+    if (bvh2) {
+        bvh2->nodes         = sectionData<LBVH2Node>(*file, header.bvh2Nodes);
+        bvh2->numNodes      = static_cast<int>(header.bvh2Nodes.count);
+        bvh2->primIndices   = {sectionData<uint32_t>(*file, header.bvh2PrimIndices), header.bvh2PrimIndices.count};
+        bvh2->leafTriangles = {sectionData<LeafTriangle>(*file, header.bvh2Triangles), header.bvh2Triangles.count};
+        bvh2->mapping       = file;
+        // Reference costs live in a vector, like Scene::triangles, so they are copied out of the mapping
+        const float *refitCosts = sectionData<const float>(*file, header.bvh2RefitCosts);
+        bvh2->refitReferenceCosts.assign(refitCosts, refitCosts + header.bvh2RefitCosts.count);
+        // Parent links are derived rather than stored
+        bvh2->linkParents();
+    }
+    if (bvh4) {
+        bvh4->nodes           = compressed ? nullptr : sectionData<LBVH4Node>(*file, header.bvh4Nodes);
+        bvh4->compressedNodes = compressed ? sectionData<CompressedLBVH4Node>(*file, header.bvh4Nodes) : nullptr;
+        bvh4->numNodes        = static_cast<int>(header.bvh4Nodes.count);
+        bvh4->triangles4      = {sectionData<Triangle4>(*file, header.bvh4Triangles), header.bvh4Triangles.count};
+        bvh4->mapping         = file;
+        const float *refitCosts = sectionData<const float>(*file, header.bvh4RefitCosts);
+        bvh4->refitReferenceCosts.assign(refitCosts, refitCosts + header.bvh4RefitCosts.count);
+        // Like parent links, the stack size is derived rather than stored
+        bvh4->computeStackSize();
+    }
+    return true;
+}
+
+bool loadSceneCached(const std::string &sourcePath, const std::string &cachePath, Scene &scene, BVH2 *bvh2, BVH4 *bvh4) {
+    // Without a source hash there is no key that could tell a stale cache from a fresh one
+    const std::optional<uint64_t> sourceHash = hashFile(sourcePath);
+    const uint64_t key                       = sourceHash ? bvhCacheKey(*sourceHash, bvh2, bvh4) : 0;
+    if (sourceHash && loadBVHCache(cachePath, key, scene, bvh2, bvh4)) return true;
+
+    scene.loadMesh(sourcePath);
+    if (scene.triangles.empty()) return false;
+    if (bvh2) bvh2->build();
+    if (bvh4) bvh4->build();
+
+    if (!sourceHash) return false;
+    if (!saveBVHCache(cachePath, key, scene, bvh2, bvh4)) std::cerr << "Could not write BVH cache " << cachePath << "\n";
+    return false;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "bvh2.hpp"
+#include "bvh4.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+
+// Binary cache of a scene's meshes and its flattened BVHs, loaded by mapping the file:
+// mesh buffers, nodes, leaf primitive indices and Triangle4 blocks point straight into the mapping.
+//
+// Layout (version 3): a BVHCacheHeader, then each array in its own section starting on a multiple of
+// BVH_CACHE_ALIGNMENT. Files written by a build with different type sizes are rejected, as are files
+// whose key does not match; neither is ever partially loaded.
+
+static constexpr uint32_t BVH_CACHE_VERSION = 3;
+// Sections start on a multiple of this, which covers the alignment of every stored type
+static constexpr size_t BVH_CACHE_ALIGNMENT = 128;
+
+/**
+ * A whole file mapped into memory. Pages are private and copy-on-write, so writes through pointers
+ * into the mapping never reach the file. Unmapped when the last reference goes away.
+ */
+struct MappedFile {
+    std::byte *data = nullptr;
+    size_t size     = 0;
+#ifdef _WIN32
+    void *file    = nullptr;
+    void *mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    /**
+     * @return the mapping, or null if the file cannot be opened or is empty
+     */
+    static std::shared_ptr<MappedFile> open(const std::string &path);
+};
+
+/**
+ * Hash of a file's contents
+ * @return hash, or nothing if the file cannot be read
+ */
+std::optional<uint64_t> hashFile(const std::string &path);
+
+/**
+ * Key of a cache entry: the source hash combined with the build settings of each BVH stored (either may be null).
+ * Thread counts are left out, since they do not change the tree.
+ */
+uint64_t bvhCacheKey(uint64_t sourceHash, const BVH2 *bvh2, const BVH4 *bvh4);
+
+/**
+ * Writes a scene and its built BVHs (either may be null) to a cache file.
+ * The file is written next to its final path and renamed into place, so readers never see a partial file.
+ * @return false if the file cannot be written
+ */
+bool saveBVHCache(const std::string &path, uint64_t key, const Scene &scene, const BVH2 *bvh2, const BVH4 *bvh4);
+
+/**
+ * Maps a cache file and points an empty scene's meshes and the BVHs' arrays into it. The mapping is shared by
+ * everything loaded and released with the last of them; destroy() leaves mapped arrays alone.
+ * @param bvh2 BVH2 to load (may be null); must hold the same kind of BVH as when saved
+ * @param bvh4 BVH4 to load (may be null)
+ * @return false, leaving everything untouched, if the file is missing, stale, or from another version or build
+ */
+bool loadBVHCache(const std::string &path, uint64_t key, Scene &scene, BVH2 *bvh2, BVH4 *bvh4);
+
+/**
+ * Loads a mesh and its BVHs through a cache file: on a hit everything is mapped from the cache, otherwise the
+ * mesh is imported, the BVHs are built and the cache is rewritten. A source that cannot be hashed bypasses the
+ * cache entirely.
+ * @param scene empty scene, referenced by the BVHs
+ * @param bvh2 BVH2 with its build settings set (may be null)
+ * @param bvh4 BVH4 with its build settings set (may be null)
+ * @return true if the cache was used
+ */
+bool loadSceneCached(const std::string &sourcePath, const std::string &cachePath, Scene &scene, BVH2 *bvh2, BVH4 *bvh4);
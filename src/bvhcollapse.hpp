@@ -0,0 +1,105 @@
+#pragma once
+
+#include "bvh2.hpp"
+
+#include <vector>
+
+/**
+ * Collapse choice for one BVH2 subtree, filled in by computeBVHCollapse
+ */
+template<int N>
+struct BVHCollapseCost {
+    // SAH cost (absolute surface area) of the subtree when it may take up to j + 1 slots of its N-wide parent
+    float cost[N];
+    // Slots given to the left child when the subtree is opened into up to j + 1 slots; 0 keeps it in one slot
+    int8_t split[N];
+    // BVH2 nodes in the subtree
+    int size;
+};
+
+using BVH4CollapseCost = BVHCollapseCost<4>;
+
+/**
+ * A BVH2 node that becomes a child of an N-wide node, with its pre-order index
+ */
+struct BVHCollapseEntry {
+    const BVH2Node *node;
+    int index;
+};
+
+/**
+ * Chooses which BVH2 nodes become children of each N-wide node, minimizing the SAH cost
+ * with a bottom-up pass over the number of slots (1-N) each subtree may take in its parent.
+ * Children are no longer always grandchildren, so a leaf child does not leave a slot empty
+ * while its sibling's subtree could fill it. Leaves must already be padded.
+ * @return one entry per BVH2 node, in pre-order
+ */
+template<int N>
+std::vector<BVHCollapseCost<N>> computeBVHCollapse(const BVH2Node *root) {
+    std::vector<BVHCollapseCost<N>> collapse;
+
+    const auto visit = [&](const auto &self, const BVH2Node *node) -> void {
+        const size_t index = collapse.size();
+        collapse.emplace_back();
+
+        const float area = node->bbox.surfaceArea();
+        if (node->isLeaf()) {
+            BVHCollapseCost<N> result{{}, {}, 1};
+            for (int j = 0; j < N; ++j) result.cost[j] = area * node->numPrimitives;
+            collapse[index] = result;
+            return;
+        }
+
+        self(self, node->children[0]);
+        const size_t rightIndex = collapse.size();
+        self(self, node->children[1]);
+
+        const BVHCollapseCost<N> &left  = collapse[index + 1];
+        const BVHCollapseCost<N> &right = collapse[rightIndex];
+
+        // Cost of spreading the children over at most j + 1 slots, and the slots given to the left child
+        float open[N];
+        int8_t openSplit[N] = {};
+        for (int j = 0; j < N; ++j) open[j] = INF;
+        for (int j = 1; j < N; ++j) {
+            for (int k = 1; k <= j; ++k) {
+                const float cost = left.cost[k - 1] + right.cost[j - k];
+                if (cost < open[j]) {
+                    open[j]      = cost;
+                    openSplit[j] = static_cast<int8_t>(k);
+                }
+            }
+        }
+
+        // A single slot holds a node of its own, which spreads the children over its N slots
+        BVHCollapseCost<N> result{{0.5f * area + open[N - 1]}, {0}, 1 + left.size + right.size};
+        for (int j = 1; j < N; ++j) {
+            const bool opened = open[j] < result.cost[0];
+            result.cost[j]    = opened ? open[j] : result.cost[0];
+            result.split[j]   = opened ? openSplit[j] : 0;
+        }
+        collapse[index] = result;
+    };
+    visit(visit, root);
+
+    return collapse;
+}
+
+/**
+ * Children of a BVH2 subtree when given the slots chosen by the collapse
+ * @param out output entries, with room for slots entries
+ * @return number of entries (1 if the subtree takes a single slot)
+ */
+template<int N>
+int collectBVHCollapseChildren(const std::vector<BVHCollapseCost<N>> &collapse, const BVHCollapseEntry entry, const int slots, BVHCollapseEntry *out) {
+    const int split = collapse[entry.index].split[slots - 1];
+    if (split == 0) {
+        out[0] = entry;
+        return 1;
+    }
+
+    const BVHCollapseEntry left  = {entry.node->children[0], entry.index + 1};
+    const BVHCollapseEntry right = {entry.node->children[1], entry.index + 1 + collapse[entry.index + 1].size};
+    const int numLeft            = collectBVHCollapseChildren(collapse, left, split, out);
+    return numLeft + collectBVHCollapseChildren(collapse, right, slots - split, out + numLeft);
+}
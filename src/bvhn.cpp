@@ -0,0 +1,342 @@
+#include "bvhn.hpp"
+
+template<int N>
+void BVHN<N>::build() {
+    std::vector<Primitive> orderedPrimitives;
+    int totalNodes = 0;
+
+    ArenaSet arenas;
+    BVH2Node *root = buildSceneBVH2Tree(arenas, scene, buildMethod, sbvh, &totalNodes, orderedPrimitives, BVH4_MAX_PRIMS_IN_NODE, numBuildThreads);
+    if (!root) {
+        // Empty scene: traversals return before looking at the node array
+        numNodes  = 0;
+        nodes     = new LBVHNNode<N>[0];
+        stackSize = 0;
+        return;
+    }
+
+    // Same leaves as BVH4: padded to multiples of 4 and packed into Triangle4 blocks
+    std::vector<Primitive> paddedPrimitives;
+    paddedPrimitives.reserve(orderedPrimitives.size() + orderedPrimitives.size() / 2);
+    padBVH2LeavesForBVH4(root, orderedPrimitives, paddedPrimitives, &totalNodes, arenas.createArena(0));
+    orderedPrimitives.resize(0);
+    orderedPrimitives.shrink_to_fit();
+    triangles4 = packTriangle4(scene, paddedPrimitives);
+
+    const auto collapse = computeBVHCollapse<N>(root);
+    numNodes            = countBVHNNodes<N>(root, collapse);
+    nodes               = new LBVHNNode<N>[numNodes];
+    flattenBVH2toLBVHN<N>(root, collapse, nodes);
+    stackSize = computeTraversalStackSize(nodes, numNodes);
+}
+
+/**
+ * Children of the N-wide node for an interior BVH2 node
+ * @param out output entries, with room for N entries
+ * @return number of children
+ */
+template<int N>
+static int openBVHNNode(const std::vector<BVHCollapseCost<N>> &collapse, const BVHCollapseEntry entry, BVHCollapseEntry out[N]) {
+    const BVHCollapseEntry left  = {entry.node->children[0], entry.index + 1};
+    const BVHCollapseEntry right = {entry.node->children[1], entry.index + 1 + collapse[entry.index + 1].size};
+    const int split              = collapse[entry.index].split[N - 1] > 0 ? collapse[entry.index].split[N - 1] : N / 2;
+
+    const int numLeft = collectBVHCollapseChildren<N>(collapse, left, split, out);
+    return numLeft + collectBVHCollapseChildren<N>(collapse, right, N - split, out + numLeft);
+}
+
+template<int N>
+int countBVHNNodes(const BVH2Node *root, const std::vector<BVHCollapseCost<N>> &collapse) {
+    const auto visit = [&](const auto &self, const BVHCollapseEntry entry) -> int {
+        BVHCollapseEntry n[N];
+        const int numChildren = openBVHNNode<N>(collapse, entry, n);
+
+        int count = 1;
+        for (int i = 0; i < numChildren; ++i) {
+            if (!n[i].node->isLeaf()) count += self(self, n[i]);
+        }
+        return count;
+    };
+    return root->isLeaf() ? 1 : visit(visit, {root, 0});
+}
+
+template<int N>
+static void setBVHNChild(LBVHNNode<N> *node, const int i, const AABB &bbox, const int child) {
+    for (int a = 0; a < 3; ++a) {
+        node->bbox.pmin[a][i] = bbox.pmin[a];
+        node->bbox.pmax[a][i] = bbox.pmax[a];
+    }
+    node->children[i] = child;
+}
+
+template<int N>
+static int flattenBVHNNode(const std::vector<BVHCollapseCost<N>> &collapse, const BVHCollapseEntry entry, LBVHNNode<N> *nodes, int *offset) {
+    const int nodeOffset     = (*offset)++;
+    LBVHNNode<N> *linearNode = &nodes[nodeOffset];
+
+    BVHCollapseEntry n[N];
+    linearNode->numChildren = openBVHNNode<N>(collapse, entry, n);
+
+    for (int i = 0; i < N; ++i) {
+        if (i >= linearNode->numChildren) {
+            // Inverted bounds never pass the slab test
+            setBVHNChild(linearNode, i, AABB(), BVH4_INT_MIN);
+        } else if (n[i].node->isLeaf()) {
+            setBVHNChild(linearNode, i, n[i].node->bbox, encodeBVH4Leaf(n[i].node));
+        } else {
+            // The offset is only known once the subtree is written
+            const int child = flattenBVHNNode<N>(collapse, n[i], nodes, offset);
+            setBVHNChild(linearNode, i, n[i].node->bbox, child);
+        }
+    }
+
+    return nodeOffset;
+}
+
+template<int N>
+int flattenBVH2toLBVHN(const BVH2Node *root, const std::vector<BVHCollapseCost<N>> &collapse, LBVHNNode<N> *nodes) {
+    int offset = 0;
+    if (root->isLeaf()) {
+        // A leaf root gets a node of its own so traversal can always start at node 0
+        LBVHNNode<N> *linearNode = &nodes[offset++];
+        linearNode->numChildren  = 1;
+        setBVHNChild(linearNode, 0, root->bbox, encodeBVH4Leaf(root));
+        for (int i = 1; i < N; ++i) setBVHNChild(linearNode, i, AABB(), BVH4_INT_MIN);
+    } else {
+        flattenBVHNNode<N>(collapse, {root, 0}, nodes, &offset);
+    }
+    return offset;
+}
+
+template<int N>
+static AABB childBounds(const LBVHNNode<N> &node, const int c) {
+    return {Vec3f(node.bbox.pmin[0][c], node.bbox.pmin[1][c], node.bbox.pmin[2][c]), Vec3f(node.bbox.pmax[0][c], node.bbox.pmax[1][c], node.bbox.pmax[2][c])};
+}
+
+template<int N>
+float computeSAHCost(const LBVHNNode<N> *nodes) {
+    AABB rootBounds;
+    for (int c = 0; c < nodes[0].numChildren; ++c) rootBounds.expand(childBounds(nodes[0], c));
+    const float rootArea = rootBounds.surfaceArea();
+    if (rootArea == 0) return 0;
+
+    // The root is always visited; every other node is visited when its box in the parent is hit
+    float cost             = 0.5f;
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const LBVHNNode<N> &node = nodes[stack.back()];
+        stack.pop_back();
+
+        for (int c = 0; c < node.numChildren; ++c) {
+            const float area = childBounds(node, c).surfaceArea() / rootArea;
+            if (node.isLeaf(c)) {
+                cost += area * LBVH4Node::leafNumPrimitives(node.children[c]);
+            } else {
+                cost += area * 0.5f;
+                stack.push_back(node.children[c]);
+            }
+        }
+    }
+    return cost;
+}
+
+template<int N>
+float computeBVHNFillRate(const LBVHNNode<N> *nodes, const int numNodes) {
+    if (numNodes == 0) return 0;
+
+    int used = 0;
+    for (int i = 0; i < numNodes; ++i) used += nodes[i].numChildren;
+    return static_cast<float>(used) / (static_cast<float>(N) * numNodes);
+}
+
+/**
+ * Moves the children hit by a ray (and their entry distances) to the front of the output arrays.
+ * With AVX2 each group of 8 is written with one compressed store.
+ * @param children output with room for N children
+ * @param t output with room for N distances
+ * @return number of children hit
+ */
+template<int N>
+static int compressHitChildren(const LBVHNNode<N> &node, const int mask, const float tEntry[N], int children[N], float t[N]) {
+#ifdef USE_AVX2
+    if constexpr (N % 8 == 0) {
+        int count = 0;
+        for (int g = 0; g < N; g += 8) {
+            const int groupMask = (mask >> g) & 0xFF;
+            if (groupMask == 0) continue;
+            simd::compressStore(t + count, simd::load8(tEntry + g), groupMask);
+            count += simd::compressStore(children + count, simd::load8(node.children + g), groupMask);
+        }
+        return count;
+    }
+#endif
+
+    int count = 0;
+    for (int m = mask; m != 0; m &= m - 1) {
+        const int c     = std::countr_zero(static_cast<unsigned>(m));
+        children[count] = node.children[c];
+        t[count++]      = tEntry[c];
+    }
+    return count;
+}
+
+template<int N>
+bool BVHN<N>::closestHit(const Ray &r, const Interval t, SurfaceIntersection &record) const {
+    PrimitiveHit hit;
+    if (!closestHit(r, t, hit)) return false;
+    scene.finalizeIntersection(r, hit, record);
+    return true;
+}
+
+template<int N>
+bool BVHN<N>::closestHit(const Ray &r, const Interval t, PrimitiveHit &hit) const {
+    NoTraversalStats stats;
+    return closestHit(r, t, hit, stats);
+}
+
+template<int N>
+template<typename Stats>
+bool BVHN<N>::closestHit(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const {
+    if (numNodes == 0) return false;
+
+    const PrecomputedRayN<N> ray(r);
+
+    // Stack holds encoded children (node index or leaf) and their entry distances
+    int toVisitOffset = 0;
+    TraversalStack<int, STACK_SIZE> stack(stackSize);
+    TraversalStack<float, STACK_SIZE> stackT(stackSize);
+    bool hitAnything = false;
+
+    stack[toVisitOffset]    = 0;
+    stackT[toVisitOffset++] = t.min;
+
+    while (toVisitOffset > 0) {
+        const int current = stack[--toVisitOffset];
+        if (stackT[toVisitOffset] > t.max) {
+            stats.earlyOut();
+            continue;
+        }
+
+        if (current < 0) {
+            // Leaf: intersect packed triangles 4 at a time
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            stats.leaf(4 * n);
+            for (int i = 0; i < n; ++i) {
+                const Triangle4 &block = triangles4[first + i];
+
+                float tHit, u, v;
+                const int lane = block.closestHit(ray.ray, t.min, t.max, tHit, u, v);
+                if (lane >= 0) {
+                    hitAnything   = true;
+                    t.max         = tHit;
+                    hit.t         = tHit;
+                    hit.primIndex = block.primIndex[lane];
+                    hit.b1        = u;
+                    hit.b2        = v;
+                }
+            }
+            continue;
+        }
+
+        const LBVHNNode<N> &node = nodes[current];
+        stats.node();
+        stats.boxes(N);
+
+        alignas(32) float tEntry[N];
+        const int mask = node.hit(ray, t.min, t.max, tEntry);
+        if (mask == 0) continue;
+
+        int hitChildren[N];
+        float hitT[N];
+        const int numHits = compressHitChildren<N>(node, mask, tEntry, hitChildren, hitT);
+
+        // Sort far to near, so the nearest child is popped first
+        for (int i = 1; i < numHits; ++i) {
+            const int child = hitChildren[i];
+            const float tc  = hitT[i];
+            int j           = i;
+            for (; j > 0 && hitT[j - 1] < tc; --j) {
+                hitChildren[j] = hitChildren[j - 1];
+                hitT[j]        = hitT[j - 1];
+            }
+            hitChildren[j] = child;
+            hitT[j]        = tc;
+        }
+
+        for (int i = 0; i < numHits; ++i) {
+            stack[toVisitOffset]    = hitChildren[i];
+            stackT[toVisitOffset++] = hitT[i];
+        }
+        stats.stackDepth(toVisitOffset);
+    }
+
+    return hitAnything;
+}
+
+template<int N>
+bool BVHN<N>::anyHit(const Ray &r, const Interval t) const {
+    NoTraversalStats stats;
+    return anyHit(r, t, stats);
+}
+
+template<int N>
+template<typename Stats>
+bool BVHN<N>::anyHit(const Ray &r, const Interval t, Stats &stats) const {
+    if (numNodes == 0) return false;
+
+    const PrecomputedRayN<N> ray(r);
+
+    int toVisitOffset = 0;
+    TraversalStack<int, STACK_SIZE> stack(stackSize);
+
+    stack[toVisitOffset++] = 0;
+
+    while (toVisitOffset > 0) {
+        const int current = stack[--toVisitOffset];
+
+        if (current < 0) {
+            const int first = LBVH4Node::leafPrimitiveIndices(current) / 4;
+            const int n     = LBVH4Node::leafNumPrimitives(current) / 4;
+            for (int i = 0; i < n; ++i) {
+                if (triangles4[first + i].anyHit(ray.ray, t.min, t.max)) {
+                    stats.leaf(4 * (i + 1));
+                    stats.earlyOut();
+                    return true;
+                }
+            }
+            stats.leaf(4 * n);
+            continue;
+        }
+
+        const LBVHNNode<N> &node = nodes[current];
+        stats.node();
+        stats.boxes(N);
+
+        alignas(32) float tEntry[N];
+        const int mask = node.hit(ray, t.min, t.max, tEntry);
+        if (mask == 0) continue;
+
+        // Any hit ends the traversal, so the children are not sorted
+        int hitChildren[N];
+        float hitT[N];
+        const int numHits = compressHitChildren<N>(node, mask, tEntry, hitChildren, hitT);
+        for (int i = 0; i < numHits; ++i) stack[toVisitOffset++] = hitChildren[i];
+        stats.stackDepth(toVisitOffset);
+    }
+
+    return false;
+}
+
+#define INSTANTIATE_BVHN(N)                                                                                                        \
+    template struct BVHN<N>;                                                                                                       \
+    template bool BVHN<N>::closestHit(const Ray &, Interval, PrimitiveHit &, TraversalStats &) const;                              \
+    template bool BVHN<N>::anyHit(const Ray &, Interval, TraversalStats &) const;                                                  \
+    template int countBVHNNodes<N>(const BVH2Node *, const std::vector<BVHCollapseCost<N>> &);                                     \
+    template int flattenBVH2toLBVHN<N>(const BVH2Node *, const std::vector<BVHCollapseCost<N>> &, LBVHNNode<N> *);                 \
+    template float computeSAHCost<N>(const LBVHNNode<N> *);                                                                        \
+    template float computeBVHNFillRate<N>(const LBVHNNode<N> *, int);
+
+INSTANTIATE_BVHN(4)
+INSTANTIATE_BVHN(8)
+INSTANTIATE_BVHN(16)
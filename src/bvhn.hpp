@@ -0,0 +1,179 @@
+#pragma once
+
+#include "bvh4.hpp"
+
+// Wide BVHs: https://www.embree.org/papers/2008-Wide-BVHs.pdf
+// Children are visited in order of entry distance rather than split axes, since N > 4 children
+// no longer follow a small fixed tree of splits.
+
+/**
+ * Ray data for N-wide box tests, computed once per ray.
+ * Leaves still hold Triangle4 blocks, which use the 4-wide ray.
+ */
+template<int N>
+struct PrecomputedRayN {
+    PrecomputedRay ray;
+#ifdef USE_AVX2
+    simd::float8 origin8[3];
+    simd::float8 invDir8[3];
+#endif
+
+    // Offsets (in floats) of the near and far planes of each axis within an AABBN<N>
+    int nearOffset[3];
+    int farOffset[3];
+
+    explicit PrecomputedRayN(const Ray &r) : ray(r) {
+        for (int i = 0; i < 3; ++i) {
+#ifdef USE_AVX2
+            origin8[i] = simd::broadcast8(r.origin[i]);
+            invDir8[i] = simd::broadcast8(1 / r.dir[i]);
+#endif
+            // pmax follows pmin in memory, so a negative direction swaps the planes
+            nearOffset[i] = (ray.dirIsNeg[i] ? 3 * N : 0) + N * i;
+            farOffset[i]  = (ray.dirIsNeg[i] ? 0 : 3 * N) + N * i;
+        }
+    }
+};
+
+template<int N>
+struct AABBN {
+    // Min
+    float pmin[3][N];
+
+    // Max
+    float pmax[3][N];
+};
+
+/**
+ * N-wide node (N = 4, 8 or 16). Children use the LBVH4Node encoding and are packed to the front:
+ * slots from numChildren on are empty, with inverted bounds.
+ */
+template<int N>
+struct alignas(64) LBVHNNode {
+    static_assert(N == 4 || N == 8 || N == 16, "nodes are tested 4 or 8 boxes at a time");
+
+    AABBN<N> bbox;
+    int children[N];
+    int numChildren;
+
+    /**
+     * Tests a ray against the occupied boxes, 8 at a time with AVX2 and 4 at a time otherwise
+     * @param r precomputed ray
+     * @param tMin interval start
+     * @param tMax interval end
+     * @param tEntry entry distance per box (only meaningful for hit lanes; lanes past numChildren may be unset)
+     * @return N-bit mask of boxes hit (lane i -> bit i)
+     */
+    int hit(const PrecomputedRayN<N> &r, const float tMin, const float tMax, float tEntry[N]) const {
+        const float *planes = &bbox.pmin[0][0];
+        int mask            = 0;
+
+#ifdef USE_AVX2
+        if constexpr (N % 8 == 0) {
+            for (int g = 0; g < numChildren; g += 8) {
+                simd::float8 t0 = simd::broadcast8(tMin);
+                simd::float8 t1 = simd::broadcast8(tMax);
+                for (int i = 0; i < 3; ++i) {
+                    const simd::float8 tNear = simd::mul(simd::sub(simd::load8(planes + g + r.nearOffset[i]), r.origin8[i]), r.invDir8[i]);
+                    const simd::float8 tFar  = simd::mul(simd::sub(simd::load8(planes + g + r.farOffset[i]), r.origin8[i]), r.invDir8[i]);
+                    t0                       = simd::max(tNear, t0);
+                    t1                       = simd::min(tFar, t1);
+                }
+                simd::store(tEntry + g, t0);
+                mask |= simd::moveMask(simd::leq(t0, t1)) << g;
+            }
+            return mask & ((1 << numChildren) - 1);
+        }
+#endif
+
+        for (int g = 0; g < numChildren; g += 4) {
+            float4 t0 = simd::broadcast(tMin);
+            float4 t1 = simd::broadcast(tMax);
+            for (int i = 0; i < 3; ++i) {
+                const float4 tNear = simd::mul(simd::sub(simd::load(planes + g + r.nearOffset[i]), r.ray.origin[i]), r.ray.invDir[i]);
+                const float4 tFar  = simd::mul(simd::sub(simd::load(planes + g + r.farOffset[i]), r.ray.origin[i]), r.ray.invDir[i]);
+                t0                 = simd::max(tNear, t0);
+                t1                 = simd::min(tFar, t1);
+            }
+            simd::store(tEntry + g, t0);
+            mask |= simd::moveMask(simd::leq(t0, t1)) << g;
+        }
+        return mask & ((1 << numChildren) - 1);
+    }
+
+    [[nodiscard]]
+    bool isLeaf(const int child) const {
+        return children[child] < 0;
+    }
+};
+
+/**
+ * BVH with N-wide nodes, collapsed from a BVH2 with the same SAH slot assignment as BVH4.
+ * Single-ray traversal only; BVH4 keeps the axis-ordered node used by packets, streams and compression.
+ */
+template<int N>
+struct BVHN {
+    // Entries in the fixed per-ray stack; trees that need more use a heap stack
+    static constexpr int STACK_SIZE = 16 * N;
+
+    // Leaf triangles packed 4 at a time; block i holds primitives [4i, 4i + 4)
+    std::span<Triangle4> triangles4;
+    LBVHNNode<N> *nodes = nullptr;
+    int numNodes        = 0;
+    const Scene &scene;
+    // Threads used by build(); 0 uses all hardware threads
+    int numBuildThreads        = 0;
+    BVHBuildMethod buildMethod = BVHBuildMethod::SAH;
+    SBVHSettings sbvh;
+    // Most entries a traversal stack needs on this tree, set by build(); traversals switch to a heap stack when it
+    // exceeds STACK_SIZE
+    int stackSize = 0;
+
+    void build();
+    void destroy() const {
+        if (nodes) delete[] nodes;
+        delete[] triangles4.data();
+    }
+
+    bool closestHit(const Ray &r, Interval t, SurfaceIntersection &record) const;
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit) const;
+    bool anyHit(const Ray &r, Interval t) const;
+
+    /**
+     * Instrumented traversals; instantiated for TraversalStats
+     * @param stats counters for this ray, added to
+     */
+    template<typename Stats>
+    bool closestHit(const Ray &r, Interval t, PrimitiveHit &hit, Stats &stats) const;
+    template<typename Stats>
+    bool anyHit(const Ray &r, Interval t, Stats &stats) const;
+};
+
+using BVH8  = BVHN<8>;
+using BVH16 = BVHN<16>;
+
+/**
+ * Number of nodes flattenBVH2toLBVHN writes for a collapsed BVH2 tree
+ */
+template<int N>
+int countBVHNNodes(const BVH2Node *root, const std::vector<BVHCollapseCost<N>> &collapse);
+
+/**
+ * Flattens a BVH2 tree collapsed with computeBVHCollapse<N> into N-wide nodes, root first
+ * @param nodes output array with room for countBVHNNodes(root, collapse) nodes
+ * @return number of nodes written
+ */
+template<int N>
+int flattenBVH2toLBVHN(const BVH2Node *root, const std::vector<BVHCollapseCost<N>> &collapse, LBVHNNode<N> *nodes);
+
+/**
+ * Computes the SAH cost of an N-wide BVH with the same constants as the BVH2 and BVH4 versions
+ */
+template<int N>
+float computeSAHCost(const LBVHNNode<N> *nodes);
+
+/**
+ * Fraction of child slots holding a child or leaf, over all nodes (1 when every node is full)
+ */
+template<int N>
+float computeBVHNFillRate(const LBVHNNode<N> *nodes, int numNodes);
@@ -0,0 +1,269 @@
+#include "lbvh.hpp"
+#include "parallel.hpp"
+
+#include <array>
+#include <atomic>
+#include <bit>
+
+// Arrays smaller than this are sorted/processed on a single thread
+static constexpr size_t LBVH_PARALLEL_THRESHOLD = 1 << 14;
+
+template<typename Key>
+void radixSortPairs(std::vector<Key> &keys, std::vector<uint32_t> &values, const int keyBits, int numThreads) {
+    constexpr int RADIX_BITS = 8;
+    constexpr int RADIX      = 1 << RADIX_BITS;
+
+    const size_t n      = keys.size();
+    const int numChunks = n > LBVH_PARALLEL_THRESHOLD ? resolveThreadCount(numThreads) : 1;
+
+    std::vector<Key> keysScratch(n);
+    std::vector<uint32_t> valuesScratch(n);
+    std::vector<std::array<size_t, RADIX>> histograms(numChunks);
+
+    for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+        parallelFor(numChunks, [&](const int c) {
+            const auto [begin, end] = chunkRange(n, c, numChunks);
+            histograms[c].fill(0);
+            for (size_t i = begin; i < end; ++i) histograms[c][(keys[i] >> shift) & (RADIX - 1)]++;
+        });
+
+        // Exclusive prefix sum over (digit, chunk), which keeps the sort stable
+        bool allSameDigit = false;
+        size_t offset     = 0;
+        for (int d = 0; d < RADIX; ++d) {
+            size_t digitCount = 0;
+            for (int c = 0; c < numChunks; ++c) {
+                const size_t count = histograms[c][d];
+                histograms[c][d]   = offset;
+                offset += count;
+                digitCount += count;
+            }
+            allSameDigit |= digitCount == n;
+        }
+        if (allSameDigit) continue;
+
+        parallelFor(numChunks, [&](const int c) {
+            const auto [begin, end] = chunkRange(n, c, numChunks);
+            for (size_t i = begin; i < end; ++i) {
+                const size_t dst   = histograms[c][(keys[i] >> shift) & (RADIX - 1)]++;
+                keysScratch[dst]   = keys[i];
+                valuesScratch[dst] = values[i];
+            }
+        });
+
+        keys.swap(keysScratch);
+        values.swap(valuesScratch);
+    }
+}
+
+template void radixSortPairs<uint32_t>(std::vector<uint32_t> &, std::vector<uint32_t> &, int, int);
+template void radixSortPairs<uint64_t>(std::vector<uint64_t> &, std::vector<uint32_t> &, int, int);
+
+template<typename Key>
+struct LBVHHierarchy {
+    const std::vector<Key> &codes;
+    int n;
+
+    /**
+     * Length of the common prefix of keys i and j, or -1 if j is out of range.
+     * Duplicate codes are disambiguated by their index.
+     */
+    [[nodiscard]]
+    int delta(const int i, const int j) const {
+        if (j < 0 || j >= n) return -1;
+        if (codes[i] == codes[j]) {
+            return static_cast<int>(sizeof(Key) * 8) + std::countl_zero(static_cast<uint32_t>(i ^ j));
+        }
+        return std::countl_zero(static_cast<Key>(codes[i] ^ codes[j]));
+    }
+
+    /**
+     * Finds the range of keys covered by internal node i, and where it splits
+     * @param first first key in the range
+     * @param last last key in the range
+     * @return split position: the left child covers [first, split], the right [split + 1, last]
+     */
+    int determineRange(const int i, int &first, int &last) const {
+        const int d    = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+        const int dMin = delta(i, i - d);
+
+        // Upper bound on the length of the range
+        int lMax = 2;
+        while (delta(i, i + lMax * d) > dMin) lMax *= 2;
+
+        // Binary search for the other end
+        int l = 0;
+        for (int t = lMax / 2; t >= 1; t /= 2) {
+            if (delta(i, i + (l + t) * d) > dMin) l += t;
+        }
+        const int j = i + l * d;
+
+        // Binary search for the split position
+        const int dNode = delta(i, j);
+        int s           = 0;
+        int step        = l;
+        do {
+            step = (step + 1) >> 1;
+            if (s + step < l && delta(i, i + (s + step) * d) > dNode) s += step;
+        } while (step > 1);
+
+        first = std::min(i, j);
+        last  = std::max(i, j);
+        return i + s * d + std::min(d, 0);
+    }
+
+    /**
+     * Split axis of a range, from the highest bit where its first and last codes differ
+     */
+    [[nodiscard]]
+    int splitAxis(const int first, const int last) const {
+        const Key diff = codes[first] ^ codes[last];
+        if (diff == 0) return 0;
+        const int bit = static_cast<int>(sizeof(Key) * 8) - 1 - std::countl_zero(diff);
+        // Bits are interleaved as (x, y, z) from high to low within each triple
+        return 2 - bit % 3;
+    }
+};
+
+struct LBVHCollapseResult {
+    // SAH cost, weighted by absolute surface area
+    float cost;
+    int numPrimitives;
+    int numNodes;
+};
+
+/**
+ * Collapses subtrees into leaves wherever that lowers their SAH cost.
+ * Interior nodes must hold the first primitive of their range in firstPrimOffset.
+ */
+static LBVHCollapseResult collapseLBVH2(BVH2Node *node, const int maxPrimsInNode) {
+    const float area = node->bbox.surfaceArea();
+    if (node->isLeaf()) return {area * node->numPrimitives, node->numPrimitives, 1};
+
+    const auto left  = collapseLBVH2(node->children[0], maxPrimsInNode);
+    const auto right = collapseLBVH2(node->children[1], maxPrimsInNode);
+
+    const int numPrimitives = left.numPrimitives + right.numPrimitives;
+    const float splitCost   = area * 0.5f + left.cost + right.cost;
+    const float leafCost    = area * numPrimitives;
+
+    // Leaf order is the sorted order, so every subtree covers a contiguous range
+    if (numPrimitives <= maxPrimsInNode && leafCost <= splitCost) {
+        node->initLeaf(node->firstPrimOffset, numPrimitives, node->bbox);
+        return {leafCost, numPrimitives, 1};
+    }
+    return {splitCost, numPrimitives, 1 + left.numNodes + right.numNodes};
+}
+
+template<typename Key>
+static BVH2Node *buildLBVH2Hierarchy(Arena &arena, const std::vector<Key> &codes, const std::vector<uint32_t> &sortedIndices, std::span<Primitive> bvhPrimitives,
+                                     const int primOffset, std::vector<Primitive> &orderedPrimitives, const int numThreads) {
+    const int n         = static_cast<int>(codes.size());
+    const int numChunks = static_cast<size_t>(n) > LBVH_PARALLEL_THRESHOLD ? numThreads : 1;
+
+    // Leaves [0, n) hold one primitive each, in Morton order
+    BVH2Node *leaves = arena.createArray<BVH2Node>(n);
+    parallelFor(numChunks, [&](const int c) {
+        const auto [begin, end] = chunkRange(n, c, numChunks);
+        for (size_t i = begin; i < end; ++i) {
+            const Primitive &prim             = bvhPrimitives[sortedIndices[i]];
+            orderedPrimitives[primOffset + i] = prim;
+            leaves[i].initLeaf(primOffset + static_cast<int>(i), 1, prim.bounds);
+        }
+    });
+    if (n == 1) return leaves;
+
+    // Internal nodes [0, n - 1), root at 0
+    BVH2Node *internal = arena.createArray<BVH2Node>(n - 1);
+    std::vector<int> leafParent(n), internalParent(n - 1, -1);
+
+    const LBVHHierarchy<Key> hierarchy{codes, n};
+    parallelFor(numChunks, [&](const int c) {
+        const auto [begin, end] = chunkRange(n - 1, c, numChunks);
+        for (size_t k = begin; k < end; ++k) {
+            const int i = static_cast<int>(k);
+            int first, last;
+            const int split = hierarchy.determineRange(i, first, last);
+
+            BVH2Node *node = &internal[i];
+            if (first == split) {
+                node->children[0] = &leaves[split];
+                leafParent[split] = i;
+            } else {
+                node->children[0]     = &internal[split];
+                internalParent[split] = i;
+            }
+            if (last == split + 1) {
+                node->children[1]     = &leaves[split + 1];
+                leafParent[split + 1] = i;
+            } else {
+                node->children[1]         = &internal[split + 1];
+                internalParent[split + 1] = i;
+            }
+
+            node->splitAxis       = hierarchy.splitAxis(first, last);
+            node->numPrimitives   = 0;
+            node->firstPrimOffset = primOffset + first;
+        }
+    });
+
+    // Fit bounds bottom-up; the second child to arrive at a node computes its bounds
+    std::vector<std::atomic<int>> arrivals(n - 1);
+    parallelFor(numChunks, [&](const int c) {
+        const auto [begin, end] = chunkRange(n, c, numChunks);
+        for (size_t i = begin; i < end; ++i) {
+            int node = leafParent[i];
+            while (node >= 0 && arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                internal[node].bbox = AABB(internal[node].children[0]->bbox, internal[node].children[1]->bbox);
+                node                = internalParent[node];
+            }
+        }
+    });
+
+    return internal;
+}
+
+BVH2Node *buildLBVH2Tree(ArenaSet &arenas, std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, const int maxPrimsInNode, int numThreads, const bool use63BitMorton) {
+    numThreads          = resolveThreadCount(numThreads);
+    const size_t n      = bvhPrimitives.size();
+    const int numChunks = n > LBVH_PARALLEL_THRESHOLD ? numThreads : 1;
+    const int offset    = *orderedPrimitiveOffset;
+
+    // A leaf cannot hold zero primitives, so there is no tree at all
+    if (n == 0) return nullptr;
+    Arena &arena = arenas.createArena(bvh2ArenaSize(n));
+
+    // Morton codes are relative to the centroid bounds
+    std::vector<AABB> chunkBounds(numChunks);
+    parallelFor(numChunks, [&](const int c) {
+        const auto [begin, end] = chunkRange(n, c, numChunks);
+        for (size_t i = begin; i < end; ++i) chunkBounds[c].expand(bvhPrimitives[i].centroid());
+    });
+    AABB centroidBounds;
+    for (const auto &bounds: chunkBounds) centroidBounds.expand(bounds);
+
+    std::vector<uint32_t> indices(n);
+    BVH2Node *root;
+    const auto encodeAndBuild = [&]<typename Key>(Key (*encode)(const Vec3f &), const int keyBits) {
+        std::vector<Key> codes(n);
+        parallelFor(numChunks, [&](const int c) {
+            const auto [begin, end] = chunkRange(n, c, numChunks);
+            for (size_t i = begin; i < end; ++i) {
+                codes[i]   = encode(centroidBounds.offset(bvhPrimitives[i].centroid()));
+                indices[i] = static_cast<uint32_t>(i);
+            }
+        });
+        radixSortPairs(codes, indices, keyBits, numThreads);
+        root = buildLBVH2Hierarchy(arena, codes, indices, bvhPrimitives, offset, orderedPrimitives, numThreads);
+    };
+    if (use63BitMorton) {
+        encodeAndBuild(encodeMorton63, 63);
+    } else {
+        encodeAndBuild(encodeMorton30, 30);
+    }
+
+    const auto result = collapseLBVH2(root, maxPrimsInNode);
+    *totalNodes += result.numNodes;
+    *orderedPrimitiveOffset += static_cast<int>(n);
+    return root;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "bvh2.hpp"
+
+#include <cstdint>
+
+// Linear BVH: Morton-ordered primitives with a Karras-style hierarchy
+// https://research.nvidia.com/publication/2012-06_maximizing-parallelism-construction-bvhs-octrees-and-k-d-trees
+
+/**
+ * Spreads the lower 10 bits of v so there are two zero bits between each
+ */
+inline uint32_t expandBits10(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * Spreads the lower 21 bits of v so there are two zero bits between each
+ */
+inline uint64_t expandBits21(uint64_t v) {
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8) & 0x100F00F00F00F00Full;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+/**
+ * Computes a 30-bit Morton code for a point in [0, 1]^3 (x in the highest bit of each triple)
+ */
+inline uint32_t encodeMorton30(const Vec3f &p) {
+    const auto quantize = [](const float x) { return static_cast<uint32_t>(jtx::clamp(x * 1024.0f, 0.0f, 1023.0f)); };
+    return (expandBits10(quantize(p.x)) << 2) | (expandBits10(quantize(p.y)) << 1) | expandBits10(quantize(p.z));
+}
+
+/**
+ * Computes a 63-bit Morton code for a point in [0, 1]^3 (x in the highest bit of each triple)
+ */
+inline uint64_t encodeMorton63(const Vec3f &p) {
+    const auto quantize = [](const float x) { return static_cast<uint64_t>(jtx::clamp(x * 2097152.0f, 0.0f, 2097151.0f)); };
+    return (expandBits21(quantize(p.x)) << 2) | (expandBits21(quantize(p.y)) << 1) | expandBits21(quantize(p.z));
+}
+
+/**
+ * Stable parallel LSD radix sort of (key, value) pairs, 8 bits per pass.
+ * Passes where every key shares the same digit are skipped.
+ * @param keys keys to sort
+ * @param values values moved along with their keys
+ * @param keyBits number of significant bits in the keys
+ * @param numThreads threads to use; 0 uses all hardware threads
+ */
+template<typename Key>
+void radixSortPairs(std::vector<Key> &keys, std::vector<uint32_t> &values, int keyBits, int numThreads);
+
+/**
+ * Builds a linear BVH over bvhPrimitives.
+ * Primitives are sorted by the Morton code of their centroid, the hierarchy is emitted with
+ * Karras' split finding, bounds are fitted bottom-up, and subtrees are collapsed into leaves
+ * wherever that lowers the SAH cost (up to maxPrimsInNode primitives).
+ *
+ * Produces the same BVH2Node tree as buildBVH2Tree, so it can be flattened to LBVH2Node or LBVH4Node.
+ * @param use63BitMorton use 63-bit instead of 30-bit Morton codes
+ * @return root, or nullptr (and no nodes) if bvhPrimitives is empty
+ */
+BVH2Node *buildLBVH2Tree(ArenaSet &arenas, std::span<Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset, std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode, int numThreads = 1, bool use63BitMorton = false);
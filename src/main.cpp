@@ -1,4 +1,6 @@
+#include "benchmarks.hpp"
 #include "bvh2.hpp"
+#include "bvhcache.hpp"
 #include "scene.hpp"
 #include "simd.hpp"
 #include "tests.hpp"
@@ -12,13 +14,19 @@ int main() {
     std::cout << "All tests passed" << std::endl;
 #endif
 
-    Scene scene;
-    scene.loadMesh("../src/assets/shaderball_hsd.obj");
+#ifdef RUN_BENCHMARKS
+    std::cout << "Running benchmarks" << std::endl;
+    for (std::size_t i = 0; i < BENCH_FN_PTRS_SIZE; ++i) {
+        BENCH_FN_PTRS[i]();
+    }
+#endif
 
+    Scene scene;
     BVH2 bvh2{
             .maxPrimsInNode = 1,
             .scene          = scene};
-    bvh2.build();
+    // The first run imports and builds; later runs map the scene and BVH from the cache
+    loadSceneCached("../src/assets/shaderball_hsd.obj", "shaderball_hsd.bvhcache", scene, &bvh2, nullptr);
 
     bvh2.destroy();
     scene.destroy();
@@ -22,6 +22,50 @@ struct SurfaceIntersection {
     }
 };
 
+/**
+ * Minimal hit data produced during traversal.
+ * Shading data is filled in once per ray by Scene::finalizeIntersection.
+ */
+struct PrimitiveHit {
+    float t;
+    // Index into Scene::triangles
+    int primIndex = -1;
+    float b1, b2;
+};
+
+/**
+ * Möller–Trumbore hit test against a triangle given by a vertex and its two edges
+ * @param v0 first vertex
+ * @param v0v1 edge v1 - v0
+ * @param v0v2 edge v2 - v0
+ * @param tHit output hit distance
+ * @param b1 output barycentric coordinate of v1
+ * @param b2 output barycentric coordinate of v2
+ * @return true if the ray hits the triangle within t
+ */
+inline bool intersectTriangle(const Ray &r, const Interval t, const Vec3f &v0, const Vec3f &v0v1, const Vec3f &v0v2, float &tHit, float &b1, float &b2) {
+    const auto pvec = jtx::cross(r.dir, v0v2);
+    const auto det  = v0v1.dot(pvec);
+
+    if (fabs(det) < 1e-8) return false;
+
+    const float invDet = 1 / det;
+    const auto tvec    = r.origin - v0;
+
+    b1 = tvec.dot(pvec) * invDet;
+    if (b1 < 0 || b1 > 1) return false;
+
+    const auto qvec = tvec.cross(v0v1);
+    b2              = r.dir.dot(qvec) * invDet;
+    if (b2 < 0 || b1 + b2 > 1) return false;
+
+    const float root = v0v2.dot(qvec) * invDet;
+    if (!t.surrounds(root)) return false;
+
+    tHit = root;
+    return true;
+}
+
 struct Mesh {
     int numVertices;
     int numIndices;
@@ -69,31 +113,28 @@ struct Mesh {
         uv2           = uvs[i[2]];
     }
 
-    bool tClosestHit(const Ray &r, const Interval t, SurfaceIntersection &record, const int index, float &b1, float &b2) const {
+    /**
+     * Möller–Trumbore hit test. Only computes the hit distance and barycentrics;
+     * use tSurfaceInteraction for the shading data.
+     */
+    bool tClosestHit(const Ray &r, const Interval t, const int index, float &tHit, float &b1, float &b2) const {
         Vec3f v0, v1, v2;
         getVertices(index, v0, v1, v2);
-        const auto v0v1 = v1 - v0;
-        const auto v0v2 = v2 - v0;
-        const auto pvec = jtx::cross(r.dir, v0v2);
-        const auto det  = v0v1.dot(pvec);
-
-        if (fabs(det) < 1e-8) return false;
-
-        const float invDet = 1 / det;
-        const auto tvec    = r.origin - v0;
-
-        b1 = tvec.dot(pvec) * invDet;
-        if (b1 < 0 || b1 > 1) return false;
-
-        const auto qvec = tvec.cross(v0v1);
-        b2               = r.dir.dot(qvec) * invDet;
-        if (b2 < 0 || b1 + b2 > 1) return false;
-
-        const float root = v0v2.dot(qvec) * invDet;
-        if (!t.surrounds(root)) return false;
+        return intersectTriangle(r, t, v0, v1 - v0, v2 - v0, tHit, b1, b2);
+    }
 
-        record.t        = root;
-        record.point    = r.at(root);
+    /**
+     * Fills in the shading data for a hit found by an intersection kernel
+     * @param r ray
+     * @param index triangle index
+     * @param t hit distance
+     * @param b1 barycentric coordinate of v1
+     * @param b2 barycentric coordinate of v2
+     * @param record output intersection
+     */
+    void tSurfaceInteraction(const Ray &r, const int index, const float t, const float b1, const float b2, SurfaceIntersection &record) const {
+        record.t     = t;
+        record.point = r.at(t);
 
         Vec3f n0, n1, n2;
         getNormals(index, n0, n1, n2);
@@ -108,35 +149,14 @@ struct Mesh {
         Vec2f uv0, uv1, uv2;
         getUVs(index, uv0, uv1, uv2);
         record.uv = uv0 * b0 + uv1 * b1 + uv2 * b2;
-
-        return true;
     }
 
     [[nodiscard]]
     bool tAnyHit(const Ray &r, const Interval t, const int index) const {
         Vec3f v0, v1, v2;
         getVertices(index, v0, v1, v2);
-        const auto v0v1 = v1 - v0;
-        const auto v0v2 = v2 - v0;
-        const auto pvec = jtx::cross(r.dir, v0v2);
-        const auto det  = v0v1.dot(pvec);
-
-        if (fabs(det) < 1e-8) return false;
-
-        const float invDet = 1 / det;
-        const auto tvec    = r.origin - v0;
-
-        const auto u = tvec.dot(pvec) * invDet;
-        if (u < 0 || u > 1) return false;
-
-        const auto qvec = tvec.cross(v0v1);
-        const auto v    = r.dir.dot(qvec) * invDet;
-        if (v < 0 || u + v > 1) return false;
-
-        const float root = v0v2.dot(qvec) * invDet;
-        if (!t.surrounds(root)) return false;
-
-        return true;
+        float tHit, b1, b2;
+        return intersectTriangle(r, t, v0, v1 - v0, v2 - v0, tHit, b1, b2);
     }
 
     void destroy() const {
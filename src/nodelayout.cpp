@@ -0,0 +1,143 @@
+#include "bvh2.hpp"
+#include "bvh4.hpp"
+
+#include <algorithm>
+#include <queue>
+
+// Node array relayout.
+// A tree is laid out in units: runs of nodes that must stay consecutive (a BVH2 node and its chain of first children,
+// since first children are implicit at index + 1, or a single BVH4 node). Units are placed whole, parents first.
+
+/**
+ * Child unit of a unit, with the surface area of its box (proportional to the chance a ray hitting the parent visits it)
+ */
+struct BVHLayoutChild {
+    int head;
+    float area;
+};
+
+/**
+ * Old index of the node at each new position
+ * @param pageNodes nodes per BVH_TREELET_BYTES page; treelets end on multiples of it from the start of the array
+ * @param unitNodes appends the nodes of the unit starting at a node, in order
+ * @param unitChildren appends the child units of the unit starting at a node, in depth-first order
+ */
+template<typename UnitNodes, typename UnitChildren>
+static std::vector<int> computeNodeOrder(const int numNodes, const BVHNodeLayout layout, const size_t pageNodes, UnitNodes &&unitNodes,
+                                         UnitChildren &&unitChildren) {
+    std::vector<int> order;
+    order.reserve(numNodes);
+    std::vector<BVHLayoutChild> children;
+
+    if (layout == BVHNodeLayout::DepthFirst) {
+        std::vector<int> stack = {0};
+        while (!stack.empty()) {
+            const int head = stack.back();
+            stack.pop_back();
+
+            unitNodes(head, order);
+            children.clear();
+            unitChildren(head, children);
+            for (auto child = children.rbegin(); child != children.rend(); ++child) stack.push_back(child->head);
+        }
+        return order;
+    }
+
+    const auto byArea = [](const BVHLayoutChild &a, const BVHLayoutChild &b) {
+        return a.area < b.area || (a.area == b.area && a.head > b.head);
+    };
+    std::priority_queue<BVHLayoutChild, std::vector<BVHLayoutChild>, decltype(byArea)> frontier(byArea);
+    std::vector<int> treeletRoots = {0};
+    std::vector<int> unit;
+
+    while (!treeletRoots.empty()) {
+        const int root = treeletRoots.back();
+        treeletRoots.pop_back();
+
+        // A treelet ends at the first page boundary after its root, which a BVH2 chain may take past several
+        unitNodes(root, order);
+        const size_t pageEnd = (order.size() + pageNodes - 1) / pageNodes * pageNodes;
+        children.clear();
+        unitChildren(root, children);
+        for (const auto &child: children) frontier.push(child);
+
+        // Grow it by its likeliest child while that fits; a unit that would cross the boundary roots a later treelet
+        while (!frontier.empty()) {
+            const int head = frontier.top().head;
+            unit.clear();
+            unitNodes(head, unit);
+            if (order.size() + unit.size() > pageEnd) break;
+
+            frontier.pop();
+            order.insert(order.end(), unit.begin(), unit.end());
+            children.clear();
+            unitChildren(head, children);
+            for (const auto &child: children) frontier.push(child);
+        }
+
+        // The rest of the frontier roots new treelets, laid out depth first with the likeliest one next
+        const size_t firstRoot = treeletRoots.size();
+        for (; !frontier.empty(); frontier.pop()) treeletRoots.push_back(frontier.top().head);
+        std::reverse(treeletRoots.begin() + static_cast<std::ptrdiff_t>(firstRoot), treeletRoots.end());
+    }
+    return order;
+}
+
+/**
+ * New position of each old node index
+ */
+static std::vector<int> invertNodeOrder(const std::vector<int> &order) {
+    std::vector<int> position(order.size());
+    for (size_t i = 0; i < order.size(); ++i) position[order[i]] = static_cast<int>(i);
+    return position;
+}
+
+void layoutLBVH2Nodes(LBVH2Node *nodes, const int numNodes, const BVHNodeLayout layout) {
+    if (numNodes == 0) return;
+
+    const auto unitNodes = [&](int i, std::vector<int> &out) {
+        out.push_back(i);
+        while (nodes[i].numPrimitives == 0) out.push_back(++i);
+    };
+    const auto unitChildren = [&](const int head, std::vector<BVHLayoutChild> &out) {
+        // The chain's deepest second child is visited first depth first
+        int last = head;
+        while (nodes[last].numPrimitives == 0) ++last;
+        for (int i = last - 1; i >= head; --i) out.push_back({nodes[i].secondChildOffset, nodes[nodes[i].secondChildOffset].bbox.surfaceArea()});
+    };
+    const std::vector<int> order    = computeNodeOrder(numNodes, layout, BVH_TREELET_BYTES / sizeof(LBVH2Node), unitNodes, unitChildren);
+    const std::vector<int> position = invertNodeOrder(order);
+
+    const std::vector<LBVH2Node> old(nodes, nodes + numNodes);
+    for (int i = 0; i < numNodes; ++i) {
+        nodes[i] = old[order[i]];
+        if (nodes[i].numPrimitives == 0) nodes[i].secondChildOffset = position[nodes[i].secondChildOffset];
+    }
+}
+
+void layoutLBVH4Nodes(LBVH4Node *nodes, const int numNodes, const BVHNodeLayout layout) {
+    if (numNodes == 0) return;
+
+    const auto unitNodes = [](const int i, std::vector<int> &out) {
+        out.push_back(i);
+    };
+    const auto unitChildren = [&](const int i, std::vector<BVHLayoutChild> &out) {
+        const LBVH4Node &node = nodes[i];
+        for (int c = 0; c < 4; ++c) {
+            if (node.children[c] < 0) continue;
+
+            const AABB bounds(Vec3f(node.bbox.pmin[0][c], node.bbox.pmin[1][c], node.bbox.pmin[2][c]), Vec3f(node.bbox.pmax[0][c], node.bbox.pmax[1][c], node.bbox.pmax[2][c]));
+            out.push_back({node.children[c], bounds.surfaceArea()});
+        }
+    };
+    const std::vector<int> order    = computeNodeOrder(numNodes, layout, BVH_TREELET_BYTES / sizeof(LBVH4Node), unitNodes, unitChildren);
+    const std::vector<int> position = invertNodeOrder(order);
+
+    const std::vector<LBVH4Node> old(nodes, nodes + numNodes);
+    for (int i = 0; i < numNodes; ++i) {
+        nodes[i] = old[order[i]];
+        for (int &child: nodes[i].children) {
+            if (child >= 0) child = position[child];
+        }
+    }
+}
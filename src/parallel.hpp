@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Resolves a requested thread count, where 0 (or less) means all hardware threads
+ */
+inline int resolveThreadCount(const int numThreads) {
+    if (numThreads > 0) return numThreads;
+    return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+/**
+ * Runs f(0), ..., f(numTasks - 1), each on its own thread
+ */
+template<typename F>
+void parallelFor(const int numTasks, F &&f) {
+    std::vector<std::thread> threads;
+    threads.reserve(numTasks - 1);
+    for (int i = 1; i < numTasks; ++i) threads.emplace_back(f, i);
+    f(0);
+    for (auto &thread: threads) thread.join();
+}
+
+/**
+ * Splits [0, size) into numChunks nearly equal ranges
+ * @return [begin, end) of the given chunk
+ */
+inline std::pair<size_t, size_t> chunkRange(const size_t size, const int chunk, const int numChunks) {
+    const size_t chunkSize = (size + numChunks - 1) / numChunks;
+    const size_t begin     = std::min(size, chunk * chunkSize);
+    const size_t end       = std::min(size, begin + chunkSize);
+    return {begin, end};
+}
+
+/**
+ * Runs f(task, thread) for every task in [0, numTasks) on numThreads threads.
+ * Each thread starts on its own contiguous range of tasks and steals from the other
+ * threads' ranges once it runs out, so tasks of uneven cost (e.g. image tiles) stay balanced.
+ * @param numThreads threads to use; 0 uses all hardware threads
+ */
+template<typename F>
+void parallelForStealing(const int numTasks, int numThreads, F &&f) {
+    numThreads = std::max(1, std::min(resolveThreadCount(numThreads), numTasks));
+
+    struct alignas(64) TaskRange {
+        std::atomic<int> next;
+        int end;
+    };
+    std::vector<TaskRange> ranges(numThreads);
+    for (int t = 0; t < numThreads; ++t) {
+        const auto [begin, end] = chunkRange(numTasks, t, numThreads);
+        ranges[t].next          = static_cast<int>(begin);
+        ranges[t].end           = static_cast<int>(end);
+    }
+
+    parallelFor(numThreads, [&](const int thread) {
+        for (int k = 0; k < numThreads; ++k) {
+            TaskRange &range = ranges[(thread + k) % numThreads];
+            for (int task = range.next.fetch_add(1, std::memory_order_relaxed); task < range.end; task = range.next.fetch_add(1, std::memory_order_relaxed)) {
+                f(task, thread);
+            }
+        }
+    });
+}
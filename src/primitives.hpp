@@ -12,10 +12,12 @@ struct Primitive {
     enum Type {
         SPHERE = 0,
         TRIANGLE = 1,
+        INSTANCE = 2,
     };
 
     Type type;
-    size_t index;
+    uint32_t index;
+    // Only needed while building
     AABB bounds;
 
     [[nodiscard]]
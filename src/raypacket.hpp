@@ -0,0 +1,46 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "common.hpp"
+
+/**
+ * N rays in SoA format, traced together through a BVH4.
+ * Rays should be coherent (e.g. neighbouring camera pixels, or shadow rays to the same light)
+ * for the packet to share work; incoherent packets still work, but fall back to single rays.
+ */
+template<int N>
+struct RayPacket {
+    static_assert(N % 4 == 0, "packets are processed in groups of 4 rays");
+
+    float origin[3][N] = {};
+    float dir[3][N]    = {};
+    float tMin[N]      = {};
+    float tMax[N]      = {};
+
+    // Lanes holding a ray (lane i -> bit i); other lanes are ignored
+    int validMask = 0;
+
+    /**
+     * Stores a ray in a lane and marks it valid
+     * @param i lane [0, N)
+     * @param r ray
+     * @param t interval to search
+     */
+    void setRay(const int i, const Ray &r, const Interval t) {
+        for (int a = 0; a < 3; ++a) {
+            origin[a][i] = r.origin[a];
+            dir[a][i]    = r.dir[a];
+        }
+        tMin[i] = t.min;
+        tMax[i] = t.max;
+        validMask |= 1 << i;
+    }
+
+    [[nodiscard]]
+    Ray ray(const int i) const {
+        return {Vec3f(origin[0][i], origin[1][i], origin[2][i]), Vec3f(dir[0][i], dir[1][i], dir[2][i])};
+    }
+};
+
+using RayPacket4 = RayPacket<4>;
+using RayPacket8 = RayPacket<8>;
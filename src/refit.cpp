@@ -0,0 +1,505 @@
+#include "bvh2.hpp"
+#include "bvh4.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+
+// Refit and partial rebuild for deforming meshes.
+// Both node layouts are depth first: a node's subtree is the contiguous range of nodes starting at it, so subtrees can be
+// refit independently from the back of their range, and a rebuilt subtree can be spliced in by re-emitting the tree.
+
+// Subtrees with fewer nodes than this are refit by a single task
+static constexpr int REFIT_TASK_NODES = 1024;
+
+/**
+ * Nodes [begin, end) of a subtree rooted at begin
+ */
+struct BVHNodeRange {
+    int begin, end;
+};
+
+/**
+ * Runs refitNode on every node, children before parents. The top of the tree is split into at least 4 subtrees per
+ * thread, which are refit in parallel; the nodes above them are refit last.
+ * @param innerChildren appends the ranges of a node's interior children, given the node's own range
+ * @param refitNode refits one node from its already refit children
+ */
+template<typename InnerChildren, typename RefitNode>
+static void refitDepthFirst(const int numNodes, int numThreads, InnerChildren &&innerChildren, RefitNode &&refitNode) {
+    numThreads = resolveThreadCount(numThreads);
+
+    std::vector<BVHNodeRange> subtrees = {{0, numNodes}};
+    std::vector<int> top;
+    while (subtrees.size() < 4 * static_cast<size_t>(numThreads)) {
+        const auto largest = std::max_element(subtrees.begin(), subtrees.end(), [](const BVHNodeRange &a, const BVHNodeRange &b) {
+            return a.end - a.begin < b.end - b.begin;
+        });
+        if (largest->end - largest->begin < REFIT_TASK_NODES) break;
+
+        const BVHNodeRange range = *largest;
+        subtrees.erase(largest);
+        top.push_back(range.begin);
+        innerChildren(range, subtrees);
+    }
+
+    parallelForStealing(static_cast<int>(subtrees.size()), numThreads, [&](const int task, int) {
+        for (int i = subtrees[task].end - 1; i >= subtrees[task].begin; --i) refitNode(i);
+    });
+
+    // Parents always come before their children
+    std::sort(top.begin(), top.end(), std::greater());
+    for (const int i: top) refitNode(i);
+}
+
+/**
+ * SAH cost of a subtree in absolute area units (0.5 per node plus 1 per primitive, each weighted by the area it is tested
+ * on), alongside the summed bounds areas of its primitives
+ */
+struct BVHSubtreeCost {
+    float sah           = 0;
+    float primitiveArea = 0;
+
+    /**
+     * Cost relative to the primitives' own areas. Rigid motion and scaling leave it unchanged, as they would a fresh
+     * build's, so its growth measures how far the tree has drifted from the geometry rather than how the geometry moved.
+     */
+    [[nodiscard]]
+    float quality() const {
+        return primitiveArea > 0 ? sah / primitiveArea : 1;
+    }
+};
+
+/**
+ * Finds the topmost subtrees whose cost has grown past maxSAHGrowth times their reference cost
+ * @param eligible whether a subtree is worth rebuilding
+ */
+template<typename InnerChildren, typename Eligible>
+static std::vector<BVHNodeRange> findDegradedSubtrees(const int numNodes, const std::vector<BVHSubtreeCost> &costs, const std::vector<float> &referenceCosts,
+                                                      const float maxSAHGrowth, InnerChildren &&innerChildren, Eligible &&eligible) {
+    std::vector<BVHNodeRange> degraded;
+    std::vector<BVHNodeRange> stack = {{0, numNodes}};
+    while (!stack.empty()) {
+        const BVHNodeRange range = stack.back();
+        stack.pop_back();
+
+        if (costs[range.begin].quality() > maxSAHGrowth * referenceCosts[range.begin] && eligible(range)) {
+            degraded.push_back(range);
+        } else {
+            innerChildren(range, stack);
+        }
+    }
+    return degraded;
+}
+
+/**
+ * Replaces reference costs with the quality of every node's subtree
+ */
+static void setReferenceCosts(std::vector<float> &referenceCosts, const std::vector<BVHSubtreeCost> &costs) {
+    referenceCosts.resize(costs.size());
+    for (size_t i = 0; i < costs.size(); ++i) referenceCosts[i] = costs[i].quality();
+}
+
+/**
+ * Refits a tree, then rebuilds its degraded subtrees if maxSAHGrowth is set, keeping refitReferenceCosts (set by the
+ * build) up to date
+ * @param refitCosts computes every node's subtree cost, refitting the bounds first if its second argument is set
+ * @param rebuild rebuilds the given subtrees, setting the reference costs of rebuilt nodes to -1
+ */
+template<typename BVH, typename RefitCosts, typename InnerChildren, typename Eligible, typename Rebuild>
+static BVHRefitResult refitAndRebuild(BVH &bvh, const float maxSAHGrowth, RefitCosts &&refitCosts, InnerChildren &&innerChildren, Eligible &&eligible,
+                                      Rebuild &&rebuild) {
+    if (bvh.numNodes == 0) return {1, 0};
+
+    std::vector<BVHSubtreeCost> costs;
+    refitCosts(costs, true);
+
+    int rebuiltSubtrees = 0;
+    if (maxSAHGrowth > 0 && !bvh.mapping) {
+        const auto degraded = findDegradedSubtrees(bvh.numNodes, costs, bvh.refitReferenceCosts, maxSAHGrowth, innerChildren, eligible);
+        if (!degraded.empty()) {
+            rebuild(degraded);
+            refitCosts(costs, false);
+            for (int i = 0; i < bvh.numNodes; ++i) {
+                if (bvh.refitReferenceCosts[i] < 0) bvh.refitReferenceCosts[i] = costs[i].quality();
+            }
+            rebuiltSubtrees = static_cast<int>(degraded.size());
+        }
+    }
+    return {costs[0].quality() / bvh.refitReferenceCosts[0], rebuiltSubtrees};
+}
+
+// BVH2
+
+static void bvh2InnerChildren(const LBVH2Node *nodes, const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+    const LBVH2Node &node = nodes[range.begin];
+    if (node.numPrimitives > 0) return;
+    out.push_back({range.begin + 1, node.secondChildOffset});
+    out.push_back({node.secondChildOffset, range.end});
+}
+
+/**
+ * Computes every node's subtree cost, refitting the bounds first if refit is set
+ */
+static void refitBVH2(const BVH2 &bvh2, std::vector<BVHSubtreeCost> &costs, const bool refit) {
+    costs.resize(bvh2.numNodes);
+    LBVH2Node *nodes = bvh2.nodes;
+
+    const auto innerChildren = [&](const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+        bvh2InnerChildren(nodes, range, out);
+    };
+    refitDepthFirst(bvh2.numNodes, bvh2.numBuildThreads, innerChildren, [&](const int i) {
+        LBVH2Node &node = nodes[i];
+        if (node.numPrimitives > 0) {
+            AABB bounds;
+            float primitiveArea = 0;
+            for (int k = node.primitivesOffset; k < node.primitivesOffset + node.numPrimitives; ++k) {
+                const Triangle &triangle = bvh2.scene.triangles[bvh2.primIndices[k]];
+                const AABB primitiveBounds = bvh2.scene.meshes[triangle.meshIndex].tBounds(triangle.index);
+                bounds.expand(primitiveBounds);
+                primitiveArea += primitiveBounds.surfaceArea();
+                if (refit) bvh2.updateLeafTriangle(k);
+            }
+            if (refit) node.bbox = bounds;
+            costs[i] = {node.numPrimitives * node.bbox.surfaceArea(), primitiveArea};
+            return;
+        }
+
+        const BVHSubtreeCost &left  = costs[i + 1];
+        const BVHSubtreeCost &right = costs[node.secondChildOffset];
+        if (refit) node.bbox = AABB(nodes[i + 1].bbox, nodes[node.secondChildOffset].bbox);
+        costs[i] = {0.5f * node.bbox.surfaceArea() + left.sah + right.sah, left.primitiveArea + right.primitiveArea};
+    });
+}
+
+/**
+ * Rebuilds subtrees in place in primIndices, then re-emits the node array with the rebuilt subtrees spliced in
+ */
+static void rebuildBVH2Subtrees(BVH2 &bvh2, const std::vector<BVHNodeRange> &subtrees) {
+    struct RebuiltSubtree {
+        const BVH2Node *root;
+        int primBegin;
+    };
+    std::vector<RebuiltSubtree> rebuilt(subtrees.size());
+    ArenaSet arenas;
+
+    parallelForStealing(static_cast<int>(subtrees.size()), bvh2.numBuildThreads, [&](const int task, int) {
+        // Leaves of a subtree cover a contiguous range of primIndices
+        int primBegin = INT32_MAX, primEnd = 0;
+        for (int i = subtrees[task].begin; i < subtrees[task].end; ++i) {
+            const LBVH2Node &node = bvh2.nodes[i];
+            if (node.numPrimitives == 0) continue;
+            primBegin = std::min(primBegin, node.primitivesOffset);
+            primEnd   = std::max(primEnd, node.primitivesOffset + node.numPrimitives);
+        }
+
+        std::vector<Primitive> primitives(primEnd - primBegin);
+        for (int k = primBegin; k < primEnd; ++k) {
+            const Triangle &triangle    = bvh2.scene.triangles[bvh2.primIndices[k]];
+            primitives[k - primBegin] = Primitive{Primitive::TRIANGLE, bvh2.primIndices[k], bvh2.scene.meshes[triangle.meshIndex].tBounds(triangle.index)};
+        }
+
+        std::vector<Primitive> orderedPrimitives(primitives.size());
+        int totalNodes = 0, orderedPrimitiveOffset = 0;
+        rebuilt[task] = {buildBVH2Tree(arenas, primitives, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, bvh2.maxPrimsInNode, 1), primBegin};
+        for (size_t k = 0; k < orderedPrimitives.size(); ++k) {
+            bvh2.primIndices[primBegin + k] = orderedPrimitives[k].index;
+            bvh2.updateLeafTriangle(primBegin + k);
+        }
+    });
+
+    std::vector<int> replacement(bvh2.numNodes, -1);
+    for (size_t s = 0; s < subtrees.size(); ++s) replacement[subtrees[s].begin] = static_cast<int>(s);
+
+    std::vector<LBVH2Node> nodes;
+    std::vector<float> referenceCosts;
+    nodes.reserve(bvh2.numNodes);
+    referenceCosts.reserve(bvh2.numNodes);
+
+    // Rebuilt nodes have no reference cost yet (-1); they take their cost as built
+    const auto emitRebuilt = [&](const auto &self, const BVH2Node *node, const int primBegin) -> int {
+        const int index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        referenceCosts.push_back(-1);
+        nodes[index].bbox = node->bbox;
+        if (node->isLeaf()) {
+            nodes[index].primitivesOffset = primBegin + node->firstPrimOffset;
+            nodes[index].numPrimitives    = node->numPrimitives;
+        } else {
+            nodes[index].axis          = node->splitAxis;
+            nodes[index].numPrimitives = 0;
+            self(self, node->children[0], primBegin);
+            nodes[index].secondChildOffset = self(self, node->children[1], primBegin);
+        }
+        return index;
+    };
+    const auto emit = [&](const auto &self, const int i) -> int {
+        if (replacement[i] >= 0) return emitRebuilt(emitRebuilt, rebuilt[replacement[i]].root, rebuilt[replacement[i]].primBegin);
+
+        const int index = static_cast<int>(nodes.size());
+        nodes.push_back(bvh2.nodes[i]);
+        referenceCosts.push_back(bvh2.refitReferenceCosts[i]);
+        if (bvh2.nodes[i].numPrimitives == 0) {
+            self(self, i + 1);
+            nodes[index].secondChildOffset = self(self, bvh2.nodes[i].secondChildOffset);
+        }
+        return index;
+    };
+    emit(emit, 0);
+
+    freeBVHNodes(bvh2.nodes);
+    bvh2.nodes    = allocateBVHNodes<LBVH2Node>(nodes.size());
+    bvh2.numNodes = static_cast<int>(nodes.size());
+    std::copy(nodes.begin(), nodes.end(), bvh2.nodes);
+    bvh2.refitReferenceCosts = std::move(referenceCosts);
+    bvh2.linkParents();
+}
+
+void BVH2::computeRefitReferenceCosts() {
+    std::vector<BVHSubtreeCost> costs;
+    refitBVH2(*this, costs, false);
+    setReferenceCosts(refitReferenceCosts, costs);
+}
+
+BVHRefitResult BVH2::refit(const float maxSAHGrowth) {
+    const auto innerChildren = [&](const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+        bvh2InnerChildren(nodes, range, out);
+    };
+    // Refits and rebuilds work on the contiguous subtrees of the depth-first layout
+    if (nodeLayout != BVHNodeLayout::DepthFirst) layoutLBVH2Nodes(nodes, numNodes, BVHNodeLayout::DepthFirst);
+    const BVHRefitResult result = refitAndRebuild(
+            *this, maxSAHGrowth, [&](std::vector<BVHSubtreeCost> &costs, const bool refit) { refitBVH2(*this, costs, refit); }, innerChildren,
+            [&](const BVHNodeRange range) { return nodes[range.begin].numPrimitives == 0; },
+            [&](const std::vector<BVHNodeRange> &subtrees) { rebuildBVH2Subtrees(*this, subtrees); });
+    if (nodeLayout != BVHNodeLayout::DepthFirst) {
+        layoutLBVH2Nodes(nodes, numNodes, nodeLayout);
+        linkParents();
+    }
+    return result;
+}
+
+// BVH4
+
+static AABB bvh4ChildBounds(const LBVH4Node &node, const int c) {
+    return {Vec3f(node.bbox.pmin[0][c], node.bbox.pmin[1][c], node.bbox.pmin[2][c]), Vec3f(node.bbox.pmax[0][c], node.bbox.pmax[1][c], node.bbox.pmax[2][c])};
+}
+
+static AABB bvh4NodeBounds(const LBVH4Node &node) {
+    AABB bounds;
+    for (int c = 0; c < 4; ++c) {
+        if (node.children[c] != BVH4_INT_MIN) bounds.expand(bvh4ChildBounds(node, c));
+    }
+    return bounds;
+}
+
+static void bvh4InnerChildren(const LBVH4Node *nodes, const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+    int inner[4], numInner = 0;
+    for (const int child: nodes[range.begin].children) {
+        if (child >= 0) inner[numInner++] = child;
+    }
+    // Slots are ordered by axis, not by index; insertion sort the at most 4 entries
+    for (int k = 1; k < numInner; ++k) {
+        for (int j = k; j > 0 && inner[j - 1] > inner[j]; --j) std::swap(inner[j - 1], inner[j]);
+    }
+    for (int k = 0; k < numInner; ++k) out.push_back({inner[k], k + 1 < numInner ? inner[k + 1] : range.end});
+}
+
+/**
+ * Triangle4 blocks [begin, end) referenced by the leaves of a subtree, which are contiguous
+ */
+static std::pair<int, int> bvh4SubtreeBlocks(const LBVH4Node *nodes, const BVHNodeRange range) {
+    int begin = INT32_MAX, end = 0;
+    for (int i = range.begin; i < range.end; ++i) {
+        for (int c = 0; c < 4; ++c) {
+            if (nodes[i].children[c] == BVH4_INT_MIN || !nodes[i].isLeaf(c)) continue;
+            begin = std::min(begin, nodes[i].getPrimitiveIndices(c) / 4);
+            end   = std::max(end, (nodes[i].getPrimitiveIndices(c) + nodes[i].getNumPrimitives(c)) / 4);
+        }
+    }
+    return {begin, end};
+}
+
+/**
+ * Computes every node's subtree cost, refitting the child bounds and leaf Triangle4 blocks first if refit is set
+ */
+static void refitBVH4(const BVH4 &bvh4, std::vector<BVHSubtreeCost> &costs, const bool refit) {
+    costs.resize(bvh4.numNodes);
+    LBVH4Node *nodes = bvh4.nodes;
+
+    const auto innerChildren = [&](const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+        bvh4InnerChildren(nodes, range, out);
+    };
+    refitDepthFirst(bvh4.numNodes, bvh4.numBuildThreads, innerChildren, [&](const int i) {
+        LBVH4Node &node = nodes[i];
+        AABB nodeBounds;
+        BVHSubtreeCost cost;
+
+        for (int c = 0; c < 4; ++c) {
+            if (node.children[c] == BVH4_INT_MIN) continue;
+
+            AABB bounds = bvh4ChildBounds(node, c);
+            if (node.isLeaf(c)) {
+                const int first = node.getPrimitiveIndices(c);
+                const int n     = node.getNumPrimitives(c);
+                AABB leafBounds;
+                for (int b = first / 4; b < (first + n) / 4; ++b) {
+                    Triangle4 &block = bvh4.triangles4[b];
+                    for (int lane = 0; lane < 4; ++lane) {
+                        if (block.primIndex[lane] < 0) continue;
+
+                        const Triangle &triangle = bvh4.scene.triangles[block.primIndex[lane]];
+                        Vec3f v0, v1, v2;
+                        bvh4.scene.meshes[triangle.meshIndex].getVertices(triangle.index, v0, v1, v2);
+                        const AABB primitiveBounds = AABB(v0, v1).expand(v2);
+                        leafBounds.expand(primitiveBounds);
+                        cost.primitiveArea += primitiveBounds.surfaceArea();
+                        if (refit) block.setLane(lane, v0, v1, v2, block.primIndex[lane]);
+                    }
+                }
+                if (refit) bounds = leafBounds;
+                cost.sah += n * bounds.surfaceArea();
+            } else {
+                if (refit) bounds = bvh4NodeBounds(nodes[node.children[c]]);
+                cost.sah += costs[node.children[c]].sah;
+                cost.primitiveArea += costs[node.children[c]].primitiveArea;
+            }
+
+            if (refit) {
+                for (int a = 0; a < 3; ++a) {
+                    node.bbox.pmin[a][c] = bounds.pmin[a];
+                    node.bbox.pmax[a][c] = bounds.pmax[a];
+                }
+            }
+            nodeBounds.expand(bounds);
+        }
+        cost.sah += 0.5f * nodeBounds.surfaceArea();
+        costs[i] = cost;
+    });
+}
+
+/**
+ * Rebuilds subtrees from their triangles, then re-emits the node and Triangle4 arrays with the rebuilt subtrees spliced in
+ */
+static void rebuildBVH4Subtrees(BVH4 &bvh4, const std::vector<BVHNodeRange> &subtrees) {
+    struct RebuiltSubtree {
+        LBVH4Node *nodes;
+        std::span<Triangle4> triangles4;
+    };
+    std::vector<RebuiltSubtree> rebuilt(subtrees.size());
+    ArenaSet arenas;
+
+    parallelForStealing(static_cast<int>(subtrees.size()), bvh4.numBuildThreads, [&](const int task, int) {
+        // SBVH may reference a triangle from several leaves; the rebuilt subtree references it once
+        const auto [blockBegin, blockEnd] = bvh4SubtreeBlocks(bvh4.nodes, subtrees[task]);
+        std::vector<uint32_t> indices;
+        for (int b = blockBegin; b < blockEnd; ++b) {
+            for (const int index: bvh4.triangles4[b].primIndex) {
+                if (index >= 0) indices.push_back(index);
+            }
+        }
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+        std::vector<Primitive> primitives(indices.size());
+        for (size_t k = 0; k < indices.size(); ++k) {
+            const Triangle &triangle = bvh4.scene.triangles[indices[k]];
+            primitives[k]            = Primitive{Primitive::TRIANGLE, indices[k], bvh4.scene.meshes[triangle.meshIndex].tBounds(triangle.index)};
+        }
+
+        std::vector<Primitive> orderedPrimitives(primitives.size());
+        int totalNodes = 0, orderedPrimitiveOffset = 0;
+        BVH2Node *root = buildBVH2Tree(arenas, primitives, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, BVH4_MAX_PRIMS_IN_NODE, 1);
+
+        std::vector<Primitive> paddedPrimitives;
+        padBVH2LeavesForBVH4(root, orderedPrimitives, paddedPrimitives, &totalNodes, arenas.createArena(0));
+        rebuilt[task].triangles4 = packTriangle4(bvh4.scene, paddedPrimitives);
+
+        const auto collapse = computeBVHCollapse<4>(root);
+        rebuilt[task].nodes = new LBVH4Node[countBVH4Nodes(root, collapse)];
+        flattenBVH2toLBVH4(root, collapse, rebuilt[task].nodes);
+    });
+
+    std::vector<int> replacement(bvh4.numNodes, -1);
+    for (size_t s = 0; s < subtrees.size(); ++s) replacement[subtrees[s].begin] = static_cast<int>(s);
+
+    std::vector<LBVH4Node> nodes;
+    std::vector<Triangle4> triangles4;
+    std::vector<float> referenceCosts;
+    nodes.reserve(bvh4.numNodes);
+    triangles4.reserve(bvh4.triangles4.size());
+    referenceCosts.reserve(bvh4.numNodes);
+
+    // Copies the subtree at node k of either the old tree or a rebuilt one, moving its leaf blocks along with it.
+    // Rebuilt nodes have no reference cost yet (-1); they take their cost as built.
+    const auto emit = [&](const auto &self, const LBVH4Node *srcNodes, const std::span<const Triangle4> srcTriangles4, const bool old, const int k) -> int {
+        if (old && replacement[k] >= 0) {
+            const RebuiltSubtree &subtree = rebuilt[replacement[k]];
+            return self(self, subtree.nodes, subtree.triangles4, false, 0);
+        }
+
+        const int index = static_cast<int>(nodes.size());
+        nodes.push_back(srcNodes[k]);
+        referenceCosts.push_back(old ? bvh4.refitReferenceCosts[k] : -1);
+        for (int c = 0; c < 4; ++c) {
+            const int child = srcNodes[k].children[c];
+            if (child == BVH4_INT_MIN) continue;
+
+            if (child < 0) {
+                const int first  = LBVH4Node::leafPrimitiveIndices(child);
+                const int n      = LBVH4Node::leafNumPrimitives(child);
+                const int offset = static_cast<int>(triangles4.size()) * 4;
+                triangles4.insert(triangles4.end(), srcTriangles4.begin() + first / 4, srcTriangles4.begin() + (first + n) / 4);
+                nodes[index].children[c] = BVH4_INT_MIN | ((n / 4) << 27) | (offset & BVH4_INDICES_MASK);
+            } else {
+                nodes[index].children[c] = self(self, srcNodes, srcTriangles4, old, child);
+            }
+        }
+        return index;
+    };
+    emit(emit, bvh4.nodes, bvh4.triangles4, true, 0);
+
+    for (const auto &subtree: rebuilt) {
+        delete[] subtree.nodes;
+        delete[] subtree.triangles4.data();
+    }
+    freeBVHNodes(bvh4.nodes);
+    delete[] bvh4.triangles4.data();
+    bvh4.nodes      = allocateBVHNodes<LBVH4Node>(nodes.size());
+    bvh4.numNodes   = static_cast<int>(nodes.size());
+    bvh4.triangles4 = {new Triangle4[triangles4.size()], triangles4.size()};
+    std::copy(nodes.begin(), nodes.end(), bvh4.nodes);
+    std::copy(triangles4.begin(), triangles4.end(), bvh4.triangles4.begin());
+    bvh4.refitReferenceCosts = std::move(referenceCosts);
+    bvh4.computeStackSize();
+}
+
+void BVH4::computeRefitReferenceCosts() {
+    std::vector<BVHSubtreeCost> costs;
+    refitBVH4(*this, costs, false);
+    setReferenceCosts(refitReferenceCosts, costs);
+}
+
+BVHRefitResult BVH4::refit(const float maxSAHGrowth) {
+    if (compressedNodes) {
+        destroy();
+        mapping.reset();
+        compressedNodes = nullptr;
+        triangles4      = {};
+        build();
+        return {1, 1};
+    }
+
+    const auto innerChildren = [&](const BVHNodeRange range, std::vector<BVHNodeRange> &out) {
+        bvh4InnerChildren(nodes, range, out);
+    };
+    // Subtrees that fit in a single leaf cannot get any better
+    const auto eligible = [&](const BVHNodeRange range) {
+        const auto [begin, end] = bvh4SubtreeBlocks(nodes, range);
+        return (end - begin) * 4 > BVH4_MAX_LEAF_PRIMITIVES;
+    };
+    if (nodeLayout != BVHNodeLayout::DepthFirst) layoutLBVH4Nodes(nodes, numNodes, BVHNodeLayout::DepthFirst);
+    const BVHRefitResult result = refitAndRebuild(
+            *this, maxSAHGrowth, [&](std::vector<BVHSubtreeCost> &costs, const bool refit) { refitBVH4(*this, costs, refit); }, innerChildren, eligible,
+            [&](const std::vector<BVHNodeRange> &subtrees) { rebuildBVH4Subtrees(*this, subtrees); });
+    if (nodeLayout != BVHNodeLayout::DepthFirst) layoutLBVH4Nodes(nodes, numNodes, nodeLayout);
+    return result;
+}
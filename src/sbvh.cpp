@@ -0,0 +1,350 @@
+#include "sbvh.hpp"
+
+#include <algorithm>
+
+static constexpr int SBVH_NUM_OBJECT_BUCKETS = 12;
+static constexpr int SBVH_NUM_SPATIAL_BINS   = 32;
+
+struct SBVHBuildContext {
+    const Scene &scene;
+    Arena &arena;
+    std::vector<Primitive> &orderedPrimitives;
+    int totalNodes;
+    int maxPrimsInNode;
+    // Object splits whose children overlap by less than this area are never refined with a spatial split
+    float minOverlapArea;
+    size_t numReferences;
+    size_t maxReferences;
+};
+
+struct SBVHSplit {
+    // Unnormalized SAH cost: SA(left) * numLeft + SA(right) * numRight
+    float cost   = INF;
+    int axis     = -1;
+    bool spatial = false;
+    // Last bucket/bin on the left side
+    int lastLeftBin = 0;
+    AABB leftBounds, rightBounds;
+    int numLeft = 0, numRight = 0;
+};
+
+struct SBVHBin {
+    AABB bounds;
+    int count = 0;
+    // Spatial bins only: references starting/ending in the bin
+    int entries = 0, exits = 0;
+};
+
+static bool isEmpty(const AABB &b) {
+    return b.pmin.x > b.pmax.x || b.pmin.y > b.pmax.y || b.pmin.z > b.pmax.z;
+}
+
+static AABB intersectBounds(const AABB &a, const AABB &b) {
+    AABB result;
+    result.pmin = jtx::max(a.pmin, b.pmin);
+    result.pmax = jtx::min(a.pmax, b.pmax);
+    return isEmpty(result) ? AABB() : result;
+}
+
+AABB clipTriangleToSlab(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const int axis, const float lo, const float hi) {
+    const Vec3f v[3] = {v0, v1, v2};
+
+    AABB result;
+    for (int i = 0; i < 3; ++i) {
+        const Vec3f &a = v[i];
+        const Vec3f &b = v[(i + 1) % 3];
+        const float pa = a[axis];
+        const float pb = b[axis];
+
+        if (pa >= lo && pa <= hi) result.expand(a);
+
+        // Points where the edge crosses either plane
+        for (const float plane: {lo, hi}) {
+            if ((pa < plane && pb > plane) || (pa > plane && pb < plane)) {
+                Vec3f p = a + (b - a) * ((plane - pa) / (pb - pa));
+                p[axis] = plane;
+                result.expand(p);
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Clips a reference to a slab, keeping the result within its current bounds
+ */
+static AABB clipReference(const SBVHBuildContext &ctx, const Primitive &ref, const int axis, const float lo, const float hi) {
+    const Triangle &triangle = ctx.scene.triangles[ref.index];
+    Vec3f v0, v1, v2;
+    ctx.scene.meshes[triangle.meshIndex].getVertices(triangle.index, v0, v1, v2);
+    return intersectBounds(clipTriangleToSlab(v0, v1, v2, axis, lo, hi), ref.bounds);
+}
+
+static int objectBucket(const AABB &centroidBounds, const int axis, const Primitive &ref) {
+    const int b = static_cast<int>(SBVH_NUM_OBJECT_BUCKETS * centroidBounds.offset(ref.centroid())[axis]);
+    return std::clamp(b, 0, SBVH_NUM_OBJECT_BUCKETS - 1);
+}
+
+static int spatialBin(const AABB &bounds, const int axis, const float p) {
+    const float extent = bounds.pmax[axis] - bounds.pmin[axis];
+    const int b        = static_cast<int>(SBVH_NUM_SPATIAL_BINS * (p - bounds.pmin[axis]) / extent);
+    return std::clamp(b, 0, SBVH_NUM_SPATIAL_BINS - 1);
+}
+
+static float binPlane(const AABB &bounds, const int axis, const int b) {
+    const float extent = bounds.pmax[axis] - bounds.pmin[axis];
+    return b == SBVH_NUM_SPATIAL_BINS ? bounds.pmax[axis] : bounds.pmin[axis] + extent * b / SBVH_NUM_SPATIAL_BINS;
+}
+
+/**
+ * Sweeps the bins of one axis for the cheapest split, updating best if one is cheaper
+ * @param spatial true for spatial bins (sides counted from entries/exits), false for object buckets
+ */
+template<int NumBins>
+static void sweepBins(const SBVHBin (&bins)[NumBins], const int axis, const bool spatial, SBVHSplit &best) {
+    AABB rightBounds[NumBins];
+    int rightCounts[NumBins];
+
+    AABB boundsAbove;
+    int countAbove = 0;
+    for (int i = NumBins - 1; i > 0; --i) {
+        boundsAbove.expand(bins[i].bounds);
+        countAbove += spatial ? bins[i].exits : bins[i].count;
+        rightBounds[i] = boundsAbove;
+        rightCounts[i] = countAbove;
+    }
+
+    AABB boundsBelow;
+    int countBelow = 0;
+    for (int i = 0; i < NumBins - 1; ++i) {
+        boundsBelow.expand(bins[i].bounds);
+        countBelow += spatial ? bins[i].entries : bins[i].count;
+        if (countBelow == 0 || rightCounts[i + 1] == 0) continue;
+
+        const float cost = boundsBelow.surfaceArea() * countBelow + rightBounds[i + 1].surfaceArea() * rightCounts[i + 1];
+        if (cost < best.cost) {
+            best.cost        = cost;
+            best.axis        = axis;
+            best.spatial     = spatial;
+            best.lastLeftBin = i;
+            best.leftBounds  = boundsBelow;
+            best.rightBounds = rightBounds[i + 1];
+            best.numLeft     = countBelow;
+            best.numRight    = rightCounts[i + 1];
+        }
+    }
+}
+
+static SBVHSplit findObjectSplit(const std::vector<Primitive> &refs, const AABB &centroidBounds) {
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidBounds.pmin[axis] == centroidBounds.pmax[axis]) continue;
+
+        SBVHBin buckets[SBVH_NUM_OBJECT_BUCKETS];
+        for (const auto &ref: refs) {
+            SBVHBin &bucket = buckets[objectBucket(centroidBounds, axis, ref)];
+            bucket.count++;
+            bucket.bounds.expand(ref.bounds);
+        }
+        sweepBins(buckets, axis, false, best);
+    }
+    return best;
+}
+
+/**
+ * Bins clipped references into spatial bins over the node bounds.
+ * Splits that would duplicate more references than the remaining budget are skipped.
+ */
+static SBVHSplit findSpatialSplit(const SBVHBuildContext &ctx, const std::vector<Primitive> &refs, const AABB &bounds) {
+    const size_t remainingBudget = ctx.maxReferences - ctx.numReferences;
+
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (bounds.pmin[axis] == bounds.pmax[axis]) continue;
+
+        SBVHBin bins[SBVH_NUM_SPATIAL_BINS];
+        for (const auto &ref: refs) {
+            const int first = spatialBin(bounds, axis, ref.bounds.pmin[axis]);
+            const int last  = spatialBin(bounds, axis, ref.bounds.pmax[axis]);
+            if (first == last) {
+                bins[first].bounds.expand(ref.bounds);
+            } else {
+                for (int b = first; b <= last; ++b) {
+                    bins[b].bounds.expand(clipReference(ctx, ref, axis, binPlane(bounds, axis, b), binPlane(bounds, axis, b + 1)));
+                }
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        SBVHSplit axisBest;
+        sweepBins(bins, axis, true, axisBest);
+        if (axisBest.axis >= 0 && axisBest.cost < best.cost && static_cast<size_t>(axisBest.numLeft + axisBest.numRight) - refs.size() <= remainingBudget) {
+            best = axisBest;
+        }
+    }
+    return best;
+}
+
+/**
+ * Distributes references between the children of a spatial split.
+ * Straddling references are split in two, unless keeping them whole on one side is cheaper (reference unsplitting).
+ */
+static void performSpatialSplit(const SBVHBuildContext &ctx, const std::vector<Primitive> &refs, const AABB &bounds, const SBVHSplit &split, std::vector<Primitive> &left,
+                                std::vector<Primitive> &right) {
+    const int axis    = split.axis;
+    const float plane = binPlane(bounds, axis, split.lastLeftBin + 1);
+
+    left.reserve(split.numLeft);
+    right.reserve(split.numRight);
+
+    // Straddling references are handled after the others, so unsplitting sees the final bounds of each side
+    std::vector<Primitive> straddling;
+    AABB leftBounds, rightBounds;
+    for (const auto &ref: refs) {
+        const int first = spatialBin(bounds, axis, ref.bounds.pmin[axis]);
+        const int last  = spatialBin(bounds, axis, ref.bounds.pmax[axis]);
+        if (last <= split.lastLeftBin) {
+            left.push_back(ref);
+            leftBounds.expand(ref.bounds);
+        } else if (first > split.lastLeftBin) {
+            right.push_back(ref);
+            rightBounds.expand(ref.bounds);
+        } else {
+            straddling.push_back(ref);
+        }
+    }
+
+    for (const auto &ref: straddling) {
+        const AABB leftPart  = clipReference(ctx, ref, axis, bounds.pmin[axis], plane);
+        const AABB rightPart = clipReference(ctx, ref, axis, plane, bounds.pmax[axis]);
+        if (isEmpty(leftPart) || isEmpty(rightPart)) {
+            // Touches the plane without crossing it
+            if (isEmpty(rightPart)) {
+                left.push_back(ref);
+                leftBounds.expand(ref.bounds);
+            } else {
+                right.push_back(ref);
+                rightBounds.expand(ref.bounds);
+            }
+            continue;
+        }
+
+        const float numLeft       = static_cast<float>(left.size() + 1);
+        const float numRight      = static_cast<float>(right.size() + 1);
+        const AABB splitLeft      = AABB(leftBounds, leftPart);
+        const AABB splitRight     = AABB(rightBounds, rightPart);
+        const AABB wholeLeft      = AABB(leftBounds, ref.bounds);
+        const AABB wholeRight     = AABB(rightBounds, ref.bounds);
+        const float splitCost     = splitLeft.surfaceArea() * numLeft + splitRight.surfaceArea() * numRight;
+        const float leftOnlyCost  = wholeLeft.surfaceArea() * numLeft + (right.empty() ? 0 : rightBounds.surfaceArea() * (numRight - 1));
+        const float rightOnlyCost = (left.empty() ? 0 : leftBounds.surfaceArea() * (numLeft - 1)) + wholeRight.surfaceArea() * numRight;
+
+        if (splitCost <= leftOnlyCost && splitCost <= rightOnlyCost) {
+            left.push_back(Primitive{ref.type, ref.index, leftPart});
+            right.push_back(Primitive{ref.type, ref.index, rightPart});
+            leftBounds  = splitLeft;
+            rightBounds = splitRight;
+        } else if (leftOnlyCost <= rightOnlyCost) {
+            left.push_back(ref);
+            leftBounds = wholeLeft;
+        } else {
+            right.push_back(ref);
+            rightBounds = wholeRight;
+        }
+    }
+}
+
+/**
+ * Recursive SBVH build; takes ownership of refs, which are released before recursing
+ */
+static BVH2Node *buildSBVH2Subtree(SBVHBuildContext &ctx, std::vector<Primitive> &refs) {
+    const auto node = ctx.arena.create<BVH2Node>();
+    ctx.totalNodes++;
+
+    AABB bounds, centroidBounds;
+    for (const auto &ref: refs) {
+        bounds.expand(ref.bounds);
+        centroidBounds.expand(ref.centroid());
+    }
+
+    const auto makeLeaf = [&] {
+        const int first = static_cast<int>(ctx.orderedPrimitives.size());
+        ctx.orderedPrimitives.insert(ctx.orderedPrimitives.end(), refs.begin(), refs.end());
+        node->initLeaf(first, static_cast<int>(refs.size()), bounds);
+        return node;
+    };
+
+    if (refs.size() <= 1 || bounds.surfaceArea() == 0) {
+        // CASE: single prim or empty bbox
+        return makeLeaf();
+    }
+
+    SBVHSplit split = findObjectSplit(refs, centroidBounds);
+
+    // Spatial splits only pay off where object split children overlap noticeably
+    const AABB overlap = split.axis >= 0 ? intersectBounds(split.leftBounds, split.rightBounds) : bounds;
+    if (!isEmpty(overlap) && overlap.surfaceArea() > ctx.minOverlapArea && ctx.numReferences < ctx.maxReferences) {
+        const SBVHSplit spatial = findSpatialSplit(ctx, refs, bounds);
+        if (spatial.cost < split.cost) split = spatial;
+    }
+
+    if (split.axis < 0) {
+        // CASE: coincident centroids and no spatial split
+        return makeLeaf();
+    }
+
+    const float leafCost  = static_cast<float>(refs.size());
+    const float splitCost = 0.5f + split.cost / bounds.surfaceArea();
+    if (refs.size() <= static_cast<size_t>(ctx.maxPrimsInNode) && splitCost >= leafCost) {
+        return makeLeaf();
+    }
+
+    std::vector<Primitive> left, right;
+    if (split.spatial) {
+        performSpatialSplit(ctx, refs, bounds, split, left, right);
+        ctx.numReferences += left.size() + right.size() - refs.size();
+    } else {
+        left.reserve(split.numLeft);
+        right.reserve(split.numRight);
+        for (const auto &ref: refs) {
+            (objectBucket(centroidBounds, split.axis, ref) <= split.lastLeftBin ? left : right).push_back(ref);
+        }
+    }
+
+    // Unsplitting can move every reference to one side
+    if (left.empty() || right.empty()) return makeLeaf();
+
+    refs.clear();
+    refs.shrink_to_fit();
+
+    BVH2Node *children[2];
+    children[0] = buildSBVH2Subtree(ctx, left);
+    children[1] = buildSBVH2Subtree(ctx, right);
+    node->initBranch(split.axis, children[0], children[1]);
+
+    return node;
+}
+
+BVH2Node *buildSBVH2Tree(ArenaSet &arenas, const Scene &scene, const std::span<const Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset,
+                         std::vector<Primitive> &orderedPrimitives, const int maxPrimsInNode, const SBVHSettings &settings) {
+    std::vector<Primitive> refs(bvhPrimitives.begin(), bvhPrimitives.end());
+
+    AABB rootBounds;
+    for (const auto &ref: refs) rootBounds.expand(ref.bounds);
+
+    const size_t n             = refs.size();
+    const size_t maxReferences = n + static_cast<size_t>(static_cast<double>(n) * std::max(settings.duplicationBudget, 0.0f));
+
+    // References are appended as leaves are created, since duplication makes the final count unknown
+    orderedPrimitives.resize(*orderedPrimitiveOffset);
+    orderedPrimitives.reserve(*orderedPrimitiveOffset + maxReferences);
+
+    Arena &arena = arenas.createArena(bvh2ArenaSize(maxReferences));
+    SBVHBuildContext ctx{scene, arena, orderedPrimitives, *totalNodes, maxPrimsInNode, n > 0 ? settings.overlapThreshold * rootBounds.surfaceArea() : 0, n, maxReferences};
+    BVH2Node *root = buildSBVH2Subtree(ctx, refs);
+
+    *totalNodes             = ctx.totalNodes;
+    *orderedPrimitiveOffset = static_cast<int>(orderedPrimitives.size());
+    return root;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "bvh2.hpp"
+
+// Spatial split BVH
+// https://www.nvidia.com/docs/IO/77714/sbvh.pdf
+
+/**
+ * Builds a binned SAH tree that may also split space: a primitive straddling a spatial split plane
+ * is referenced from both children, each reference clipped to its side of the plane.
+ * Spatial splits are only tried where the children of the best object split overlap by more than
+ * settings.overlapThreshold of the root's surface area, and only while the number of references
+ * stays within (1 + settings.duplicationBudget) times the number of primitives.
+ * The build runs on a single thread.
+ * @param scene scene owning the triangles, used to clip references exactly
+ * @param orderedPrimitives output references in leaf order, resized to hold every reference
+ * @param orderedPrimitiveOffset position of the first reference; advanced by the number of references
+ */
+BVH2Node *buildSBVH2Tree(ArenaSet &arenas, const Scene &scene, std::span<const Primitive> bvhPrimitives, int *totalNodes, int *orderedPrimitiveOffset,
+                         std::vector<Primitive> &orderedPrimitives, int maxPrimsInNode, const SBVHSettings &settings);
+
+/**
+ * Bounds of the part of a triangle with position in [lo, hi] on an axis
+ * @return clipped bounds; empty (inverted) if the triangle does not reach the slab
+ */
+AABB clipTriangleToSlab(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, int axis, float lo, float hi);
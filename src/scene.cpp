@@ -1,75 +1,114 @@
 #include "scene.hpp"
+#include "parallel.hpp"
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 
-void Scene::loadMesh(const std::string &path) {
-    int totalVertices = 0;
-    int totalFaces = 0;
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+// Assimp vectors can be copied into Vec3f arrays wholesale when they share a layout
+static constexpr bool AI_VECTOR_MATCHES_VEC3F = std::is_same_v<ai_real, float> && std::is_trivially_copyable_v<Vec3f> && sizeof(aiVector3D) == sizeof(Vec3f);
+
+void Scene::loadMesh(const std::string &path, const MeshImportSettings &settings) {
+    unsigned int flags = settings.extraPostProcess;
+    if (settings.triangulate) flags |= aiProcess_Triangulate;
+
     Assimp::Importer importer;
-    const aiScene *scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+    const aiScene *scene = importer.ReadFile(path, flags);
     if (!scene || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE) || !scene->mRootNode) {
         std::cerr << "Assimp error: " << importer.GetErrorString() << std::endl;
         return;
     }
 
+    // Allocate every mesh and the triangle list up front, so the conversion below only fills them in
+    const size_t firstMesh     = meshes.size();
+    const size_t firstTriangle = triangles.size();
+    std::vector<size_t> triangleOffsets(scene->mNumMeshes);
+    size_t totalVertices = 0;
+    size_t totalFaces    = 0;
+    meshes.reserve(firstMesh + scene->mNumMeshes);
     for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
-        aiMesh *aiMeshPtr = scene->mMeshes[m];
+        const aiMesh *aiMeshPtr = scene->mMeshes[m];
+        const size_t numVerts   = aiMeshPtr->mNumVertices;
+        const size_t numFaces   = aiMeshPtr->mNumFaces;
 
-        size_t numVerts   = aiMeshPtr->mNumVertices;
-        auto finalVerts   = new Vec3f[numVerts];
-        auto finalNormals = new Vec3f[numVerts];
+        Vec2f *uvs = aiMeshPtr->HasTextureCoords(0) ? new Vec2f[numVerts] : nullptr;
+        meshes.push_back(Mesh{static_cast<int>(numVerts), static_cast<int>(numFaces), new Vec3i[numFaces], new Vec3f[numVerts], new Vec3f[numVerts], uvs});
+
+        triangleOffsets[m] = firstTriangle + totalFaces;
+        totalVertices += numVerts;
+        totalFaces += numFaces;
+    }
+    triangles.resize(firstTriangle + totalFaces);
 
-        Vec2f *finalUVs = nullptr;
-        bool hasUV      = (aiMeshPtr->mTextureCoords[0] != nullptr);
-        if (hasUV) {
-            finalUVs = new Vec2f[numVerts];
+    struct ImportChunk {
+        unsigned int mesh;
+        size_t begin, end;
+    };
+    std::vector<ImportChunk> chunks;
+    for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        const size_t size      = std::max<size_t>(scene->mMeshes[m]->mNumVertices, scene->mMeshes[m]->mNumFaces);
+        const size_t chunkSize = settings.chunkSize > 0 ? settings.chunkSize : std::max<size_t>(size, 1);
+        for (size_t begin = 0; begin < size; begin += chunkSize) {
+            chunks.push_back({m, begin, begin + std::min(size - begin, chunkSize)});
         }
+    }
 
-        for (size_t i = 0; i < numVerts; i++) {
-            aiVector3D v  = aiMeshPtr->mVertices[i];
-            finalVerts[i] = Vec3f(v.x, v.y, v.z);
+    std::atomic<size_t> nonTriangles = 0;
+    parallelForStealing(static_cast<int>(chunks.size()), settings.numThreads, [&](const int task, int) {
+        const auto [m, begin, end] = chunks[task];
+        const aiMesh *aiMeshPtr    = scene->mMeshes[m];
+        const Mesh &mesh           = meshes[firstMesh + m];
 
-            if (aiMeshPtr->HasNormals()) {
-                aiVector3D n    = aiMeshPtr->mNormals[i];
-                finalNormals[i] = Vec3f(n.x, n.y, n.z);
-            } else {
-                finalNormals[i] = Vec3f(0.0f, 1.0f, 0.0f);
+        const size_t vertBegin = std::min<size_t>(begin, aiMeshPtr->mNumVertices);
+        const size_t vertEnd   = std::min<size_t>(end, aiMeshPtr->mNumVertices);
+        const size_t numVerts  = vertEnd - vertBegin;
+        if constexpr (AI_VECTOR_MATCHES_VEC3F) {
+            std::memcpy(static_cast<void *>(mesh.vertices + vertBegin), aiMeshPtr->mVertices + vertBegin, numVerts * sizeof(Vec3f));
+            if (aiMeshPtr->HasNormals()) std::memcpy(static_cast<void *>(mesh.normals + vertBegin), aiMeshPtr->mNormals + vertBegin, numVerts * sizeof(Vec3f));
+        } else {
+            for (size_t i = vertBegin; i < vertEnd; i++) {
+                const aiVector3D v = aiMeshPtr->mVertices[i];
+                mesh.vertices[i]   = Vec3f(v.x, v.y, v.z);
             }
-
-            if (hasUV) {
-                aiVector3D uv = aiMeshPtr->mTextureCoords[0][i];
-                finalUVs[i]   = Vec2f(uv.x, uv.y);
-            } else if (finalUVs) {
-                finalUVs[i] = Vec2f(0.0f, 0.0f);
+            if (aiMeshPtr->HasNormals()) {
+                for (size_t i = vertBegin; i < vertEnd; i++) {
+                    const aiVector3D n = aiMeshPtr->mNormals[i];
+                    mesh.normals[i]    = Vec3f(n.x, n.y, n.z);
+                }
             }
         }
+        if (!aiMeshPtr->HasNormals()) std::fill(mesh.normals + vertBegin, mesh.normals + vertEnd, Vec3f(0.0f, 1.0f, 0.0f));
 
-        size_t numTriangles = aiMeshPtr->mNumFaces;
-        auto *finalIndices  = new Vec3i[numTriangles];
-        for (size_t i = 0; i < numTriangles; i++) {
-            aiFace face = aiMeshPtr->mFaces[i];
-            if (face.mNumIndices != 3) {
-                std::cerr << "Warning: mesh " << m << " has a face that isn't a triangle.\n";
-                continue;
+        if (mesh.uvs) {
+            // Assimp stores UVs as 3D vectors, so these are always copied one at a time
+            const aiVector3D *uvs = aiMeshPtr->mTextureCoords[0];
+            if (settings.flipUVs) {
+                for (size_t i = vertBegin; i < vertEnd; i++) mesh.uvs[i] = Vec2f(uvs[i].x, 1.0f - uvs[i].y);
+            } else {
+                for (size_t i = vertBegin; i < vertEnd; i++) mesh.uvs[i] = Vec2f(uvs[i].x, uvs[i].y);
             }
-            finalIndices[i] = Vec3i(face.mIndices[0], face.mIndices[1], face.mIndices[2]);
         }
 
-        meshes.push_back(Mesh{static_cast<int>(numVerts), static_cast<int>(numTriangles), finalIndices, finalVerts, finalNormals, finalUVs});
-
-        const int meshIndex = static_cast<int>(meshes.size()) - 1;
-        for (size_t t = 0; t < numTriangles; t++) {
-            Triangle tri;
-            tri.index     = static_cast<int>(t);
-            tri.meshIndex = meshIndex;
-            triangles.push_back(tri);
+        const size_t faceBegin = std::min<size_t>(begin, aiMeshPtr->mNumFaces);
+        const size_t faceEnd   = std::min<size_t>(end, aiMeshPtr->mNumFaces);
+        size_t skipped         = 0;
+        for (size_t i = faceBegin; i < faceEnd; i++) {
+            const aiFace &face = aiMeshPtr->mFaces[i];
+            if (face.mNumIndices == 3) {
+                mesh.indices[i] = Vec3i(face.mIndices[0], face.mIndices[1], face.mIndices[2]);
+            } else {
+                mesh.indices[i] = Vec3i(0, 0, 0);
+                ++skipped;
+            }
+            triangles[triangleOffsets[m] + i] = Triangle{static_cast<int>(i), static_cast<int>(firstMesh + m)};
         }
+        if (skipped) nonTriangles.fetch_add(skipped, std::memory_order_relaxed);
+    });
 
-        totalVertices += numVerts;
-        totalFaces += numTriangles;
-    }
-
+    if (nonTriangles > 0) std::cerr << "Warning: " << nonTriangles << " faces aren't triangles and were left degenerate.\n";
     std::cout << "Loaded scene with " << meshes.size() << " meshes.\n";
     std::cout << "Total vertices: " << totalVertices << "\n";
     std::cout << "Total faces: " << totalFaces << "\n";
@@ -4,6 +4,10 @@
 #include "mesh.hpp"
 #include "primitives.hpp"
 
+#include <memory>
+
+struct MappedFile;
+
 struct CameraProperties {
     Vec3f center;
     Vec3f target;
@@ -31,6 +35,23 @@ struct Material {
     int texId;
 };
 
+/**
+ * Import settings for Scene::loadMesh
+ */
+struct MeshImportSettings {
+    // Threads converting meshes; 0 uses all hardware threads
+    int numThreads = 0;
+    // Vertices and faces converted per task, so a single huge mesh still spreads across threads; 0 converts each
+    // mesh as a single task
+    size_t chunkSize = 1 << 16;
+    // Runs Assimp's triangulation step. Turn off for assets known to hold only triangles; other faces are then
+    // kept as degenerate triangles (never hit) and reported.
+    bool triangulate = true;
+    // Flips texture V to a top-left origin, done while converting rather than as an Assimp step
+    bool flipUVs = true;
+    // Extra Assimp postprocess flags (aiPostProcessSteps) to run after import
+    unsigned int extraPostProcess = 0;
+};
 
 struct Scene {
     std::string name;
@@ -39,14 +60,33 @@ struct Scene {
 
     std::vector<Triangle> triangles;
     std::vector<Mesh> meshes;
+    // Set when the mesh buffers point into a mapped cache file, which then owns them
+    std::shared_ptr<const MappedFile> mapping;
 
-    void loadMesh(const std::string &path);
+    /**
+     * Imports every mesh in a file with Assimp, appending to meshes and triangles
+     * @param path asset path
+     * @param settings import settings
+     */
+    void loadMesh(const std::string &path, const MeshImportSettings &settings = {});
 
     int numPrimitives() const {
         return triangles.size();
     }
 
+    /**
+     * Computes the shading data (point, normal, UV) of the final hit of a ray
+     * @param r ray
+     * @param hit closest hit found by traversal
+     * @param record output intersection
+     */
+    void finalizeIntersection(const Ray &r, const PrimitiveHit &hit, SurfaceIntersection &record) const {
+        const Triangle &triangle = triangles[hit.primIndex];
+        meshes[triangle.meshIndex].tSurfaceInteraction(r, triangle.index, hit.t, hit.b1, hit.b2, record);
+    }
+
     void destroy() const {
+        if (mapping) return;
         for (auto &mesh : meshes) {
             mesh.destroy();
         }
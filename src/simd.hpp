@@ -1,11 +1,20 @@
 #pragma once
 
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
 #ifdef USE_NEON
 #include <arm_neon.h>
 #elif defined(USE_SSE)
 #include <smmintrin.h>
 #endif
 
+#ifdef USE_AVX2
+#include <immintrin.h>
+#endif
+
 
 namespace simd {
 #ifdef USE_NEON
@@ -13,6 +22,14 @@ using float4 = float32x4_t;
 using uint4 = uint32x4_t;
 #elif defined(USE_SSE)
 using float4 = __m128;
+using uint4 = __m128i;
+
+// Helpers for the SSE backend, which has no native unsigned mask type
+namespace sse {
+inline __m128 signMask() { return _mm_castsi128_ps(_mm_set1_epi32(0x80000000)); }
+inline uint4 toMask(const __m128 m) { return _mm_castps_si128(m); }
+inline __m128 fromMask(const uint4 m) { return _mm_castsi128_ps(m); }
+} // namespace sse
 #endif
 
 /**
@@ -21,7 +38,11 @@ using float4 = __m128;
  * @return vector with all lanes set to x
  */
 inline float4 broadcast(const float x) {
+#ifdef USE_NEON
   return vdupq_n_f32(x);
+#else
+  return _mm_set1_ps(x);
+#endif
 }
 
 /**
@@ -30,7 +51,27 @@ inline float4 broadcast(const float x) {
  * @return vector loaded from memory
  */
 inline float4 load(const float *x) {
+#ifdef USE_NEON
   return vld1q_f32(x);
+#else
+  return _mm_loadu_ps(x);
+#endif
+}
+
+/**
+ * Load 4 unsigned bytes and convert them to a float4
+ * @param p pointer to memory (no alignment needed)
+ * @return vector of the bytes as floats [0, 255]
+ */
+inline float4 loadBytes(const uint8_t *p) {
+  uint32_t bytes;
+  std::memcpy(&bytes, p, sizeof(bytes));
+#ifdef USE_NEON
+  const uint16x8_t widened = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)));
+  return vcvtq_f32_u32(vmovl_u16(vget_low_u16(widened)));
+#else
+  return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(bytes))));
+#endif
 }
 
 /**
@@ -38,8 +79,40 @@ inline float4 load(const float *x) {
  * @param p pointer to memory
  * @param v vector to store
  */
-inline void store(float32_t *p, const float4 v) {
+inline void store(float *p, const float4 v) {
+#ifdef USE_NEON
   vst1q_f32(p, v);
+#else
+  _mm_storeu_ps(p, v);
+#endif
+}
+
+/**
+ * Stores a uint4 mask to memory
+ * @param p pointer to memory
+ * @param v mask to store
+ */
+inline void store(uint32_t *p, const uint4 v) {
+#ifdef USE_NEON
+  vst1q_u32(p, v);
+#else
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+#endif
+}
+
+/**
+ * Loads 4 floats from scattered positions
+ * @param base pointer to memory
+ * @param indices 4 indices into base
+ * @return vector with lane i set to base[indices[i]]
+ */
+inline float4 gather(const float *base, const int32_t *indices) {
+#ifdef USE_NEON
+  const float lanes[4] = {base[indices[0]], base[indices[1]], base[indices[2]], base[indices[3]]};
+  return vld1q_f32(lanes);
+#else
+  return _mm_setr_ps(base[indices[0]], base[indices[1]], base[indices[2]], base[indices[3]]);
+#endif
 }
 
 /**
@@ -49,7 +122,11 @@ inline void store(float32_t *p, const float4 v) {
  * @return vector sum
  */
 inline float4 add(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vaddq_f32(a, b);
+#else
+  return _mm_add_ps(a, b);
+#endif
 }
 
 /**
@@ -59,7 +136,11 @@ inline float4 add(const float4 a, const float4 b) {
  * @return vector difference
  */
 inline float4 sub(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vsubq_f32(a, b);
+#else
+  return _mm_sub_ps(a, b);
+#endif
 }
 
 /**
@@ -69,7 +150,11 @@ inline float4 sub(const float4 a, const float4 b) {
  * @return vector product
  */
 inline float4 mul(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vmulq_f32(a, b);
+#else
+  return _mm_mul_ps(a, b);
+#endif
 }
 
 /**
@@ -79,17 +164,26 @@ inline float4 mul(const float4 a, const float4 b) {
  * @return vector quotient
  */
 inline float4 div(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vdivq_f32(a, b);
+#else
+  return _mm_div_ps(a, b);
+#endif
 }
 
 /**
  * Extended vector multiplication
+ * On SSE this is a plain multiplication (0 * inf yields NaN instead of 2)
  * @param a LHS
  * @param b RHS
  * @return vector product
  */
 inline float4 mulExt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vmulxq_f32(a, b);
+#else
+  return _mm_mul_ps(a, b);
+#endif
 }
 
 /**
@@ -100,7 +194,11 @@ inline float4 mulExt(const float4 a, const float4 b) {
  * @return a + (b * c)
  */
 inline float4 mulAddAcc(const float4 a, const float4 b, const float4 c) {
+#ifdef USE_NEON
   return vmlaq_f32(a, b, c);
+#else
+  return _mm_add_ps(a, _mm_mul_ps(b, c));
+#endif
 }
 
 /**
@@ -111,29 +209,48 @@ inline float4 mulAddAcc(const float4 a, const float4 b, const float4 c) {
  * @return a - (b * c)
  */
 inline float4 mulSubAcc(const float4 a, const float4 b, const float4 c) {
+#ifdef USE_NEON
   return vmlsq_f32(a, b, c);
+#else
+  return _mm_sub_ps(a, _mm_mul_ps(b, c));
+#endif
 }
 
 /**
  * Computes fused multiply-add: a * b + c
+ * Falls back to an unfused multiply-add on SSE without FMA3
  * @param a vector
  * @param b vector
  * @param c vector
  * @return FMA result
  */
 inline float4 fma(const float4 a, const float4 b, const float4 c) {
+#ifdef USE_NEON
   return vfmaq_f32(c, a, b);
+#elif defined(__FMA__)
+  return _mm_fmadd_ps(a, b, c);
+#else
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
 }
 
 /**
  * Computes fused multiply-subtract: a * b - c
+ * Falls back to an unfused multiply-subtract on SSE without FMA3
  * @param a vector
  * @param b vector
  * @param c vector
  * @return FMS result
  */
 inline float4 fms(const float4 a, const float4 b, const float4 c) {
-  return vfmsq_f32(c, a, b);
+#ifdef USE_NEON
+  // vfmsq computes c - a * b
+  return vnegq_f32(vfmsq_f32(c, a, b));
+#elif defined(__FMA__)
+  return _mm_fmsub_ps(a, b, c);
+#else
+  return _mm_sub_ps(_mm_mul_ps(a, b), c);
+#endif
 }
 
 /**
@@ -143,7 +260,11 @@ inline float4 fms(const float4 a, const float4 b, const float4 c) {
  * @return absolute difference
  */
 inline float4 absDiff(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vabdq_f32(a, b);
+#else
+  return _mm_andnot_ps(sse::signMask(), _mm_sub_ps(a, b));
+#endif
 }
 
 /**
@@ -152,7 +273,11 @@ inline float4 absDiff(const float4 a, const float4 b) {
  * @return absolute value of the vector
  */
 inline float4 abs(const float4 a) {
+#ifdef USE_NEON
   return vabsq_f32(a);
+#else
+  return _mm_andnot_ps(sse::signMask(), a);
+#endif
 }
 
 /**
@@ -162,7 +287,11 @@ inline float4 abs(const float4 a) {
  * @return vector of max(a, b)
  */
 inline float4 max(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vmaxq_f32(a, b);
+#else
+  return _mm_max_ps(a, b);
+#endif
 }
 
 /**
@@ -172,7 +301,11 @@ inline float4 max(const float4 a, const float4 b) {
  * @return vector of min(a, b)
  */
 inline float4 min(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vminq_f32(a, b);
+#else
+  return _mm_min_ps(a, b);
+#endif
 }
 
 /**
@@ -182,7 +315,12 @@ inline float4 min(const float4 a, const float4 b) {
  * @return vector of max(a, b)
  */
 inline float4 maxNm(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vmaxnmq_f32(a, b);
+#else
+  // _mm_max_ps returns b if either operand is NaN, so patch up lanes where b is NaN
+  return _mm_blendv_ps(_mm_max_ps(a, b), a, _mm_cmpunord_ps(b, b));
+#endif
 }
 
 /**
@@ -192,7 +330,11 @@ inline float4 maxNm(const float4 a, const float4 b) {
  * @return vector of min(a, b)
  */
 inline float4 minNm(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vminnmq_f32(a, b);
+#else
+  return _mm_blendv_ps(_mm_min_ps(a, b), a, _mm_cmpunord_ps(b, b));
+#endif
 }
 
 /**
@@ -201,7 +343,11 @@ inline float4 minNm(const float4 a, const float4 b) {
  * @return
  */
 inline float4 truncate(const float4 a) {
+#ifdef USE_NEON
   return vrndq_f32(a);
+#else
+  return _mm_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+#endif
 }
 
 /**
@@ -210,7 +356,11 @@ inline float4 truncate(const float4 a) {
  * @return
  */
 inline float4 round(const float4 a) {
+#ifdef USE_NEON
   return vrndnq_f32(a);
+#else
+  return _mm_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+#endif
 }
 
 /**
@@ -219,7 +369,11 @@ inline float4 round(const float4 a) {
  * @return
  */
 inline float4 floor(const float4 a) {
+#ifdef USE_NEON
   return vrndmq_f32(a);
+#else
+  return _mm_floor_ps(a);
+#endif
 }
 
 /**
@@ -228,7 +382,11 @@ inline float4 floor(const float4 a) {
  * @return
  */
 inline float4 ceil(const float4 a) {
+#ifdef USE_NEON
   return vrndpq_f32(a);
+#else
+  return _mm_ceil_ps(a);
+#endif
 }
 
 /**
@@ -237,7 +395,11 @@ inline float4 ceil(const float4 a) {
  * @return reciprocal estimate of the vector
  */
 inline float4 reciprocal(const float4 a) {
+#ifdef USE_NEON
   return vrecpeq_f32(a);
+#else
+  return _mm_rcp_ps(a);
+#endif
 }
 
 /**
@@ -247,7 +409,11 @@ inline float4 reciprocal(const float4 a) {
  * @return reciprocal step
  */
 inline float4 reciprocal(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vrecpsq_f32(a, b);
+#else
+  return _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(a, b));
+#endif
 }
 
 /**
@@ -256,7 +422,11 @@ inline float4 reciprocal(const float4 a, const float4 b) {
  * @return reciprocal square root estimate of the vector
  */
 inline float4 reciprocalSqrt(const float4 a) {
+#ifdef USE_NEON
   return vrsqrteq_f32(a);
+#else
+  return _mm_rsqrt_ps(a);
+#endif
 }
 
 /**
@@ -266,7 +436,11 @@ inline float4 reciprocalSqrt(const float4 a) {
  * @return reciprocal square root step
  */
 inline float4 reciprocalSqrt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vrsqrtsq_f32(a, b);
+#else
+  return _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(a, b)), _mm_set1_ps(0.5f));
+#endif
 }
 
 /**
@@ -275,7 +449,11 @@ inline float4 reciprocalSqrt(const float4 a, const float4 b) {
  * @return square root of the vector
  */
 inline float4 sqrt(const float4 a) {
+#ifdef USE_NEON
   return vsqrtq_f32(a);
+#else
+  return _mm_sqrt_ps(a);
+#endif
 }
 
 /**
@@ -289,7 +467,11 @@ inline float4 sqrt(const float4 a) {
  * @return pairwise sum of the vectors
  */
 inline float4 pairwiseAdd(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vpaddq_f32(a, b);
+#else
+  return _mm_hadd_ps(a, b);
+#endif
 }
 
 /**
@@ -303,7 +485,11 @@ inline float4 pairwiseAdd(const float4 a, const float4 b) {
  * @return pairwise max of the vectors
  */
 inline float4 pairwiseMax(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vpmaxq_f32(a, b);
+#else
+  return _mm_max_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+#endif
 }
 
 /**
@@ -317,7 +503,11 @@ inline float4 pairwiseMax(const float4 a, const float4 b) {
  * @return pairwise min of the vectors
  */
 inline float4 pairwiseMin(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vpminq_f32(a, b);
+#else
+  return _mm_min_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+#endif
 }
 
 /**
@@ -331,7 +521,11 @@ inline float4 pairwiseMin(const float4 a, const float4 b) {
  * @return pairwise max of the vectors
  */
 inline float4 pairwiseMaxStrict(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vpmaxnmq_f32(a, b);
+#else
+  return maxNm(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+#endif
 }
 
 /**
@@ -345,7 +539,11 @@ inline float4 pairwiseMaxStrict(const float4 a, const float4 b) {
  * @return pairwise min of the vectors
  */
 inline float4 pairwiseMinStrict(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vpminnmq_f32(a, b);
+#else
+  return minNm(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+#endif
 }
 
 /**
@@ -353,8 +551,13 @@ inline float4 pairwiseMinStrict(const float4 a, const float4 b) {
  * @param a vector
  * @return horizontal sum of the vector
  */
-inline float32_t sum(const float4 a) {
+inline float sum(const float4 a) {
+#ifdef USE_NEON
   return vaddvq_f32(a);
+#else
+  const __m128 s = _mm_hadd_ps(a, a);
+  return _mm_cvtss_f32(_mm_hadd_ps(s, s));
+#endif
 }
 
 /**
@@ -362,8 +565,13 @@ inline float32_t sum(const float4 a) {
  * @param a vector
  * @return maximum element of the vector
  */
-inline float32_t max(const float4 a) {
+inline float max(const float4 a) {
+#ifdef USE_NEON
   return vmaxvq_f32(a);
+#else
+  const __m128 m = _mm_max_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(_mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1))));
+#endif
 }
 
 /**
@@ -371,8 +579,13 @@ inline float32_t max(const float4 a) {
  * @param a vector
  * @return minimum element of the vector
  */
-inline float32_t min(const float4 a) {
-  return vmaxvq_f32(a);
+inline float min(const float4 a) {
+#ifdef USE_NEON
+  return vminvq_f32(a);
+#else
+  const __m128 m = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(_mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1))));
+#endif
 }
 
 /**
@@ -380,8 +593,13 @@ inline float32_t min(const float4 a) {
  * @param a vector
  * @return maximum element of the vector
  */
-inline float32_t maxStrict(const float4 a) {
+inline float maxStrict(const float4 a) {
+#ifdef USE_NEON
   return vmaxnmvq_f32(a);
+#else
+  const __m128 m = maxNm(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(maxNm(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1))));
+#endif
 }
 
 /**
@@ -389,8 +607,13 @@ inline float32_t maxStrict(const float4 a) {
  * @param a vector
  * @return minimum element of the vector
  */
-inline float32_t minStrict(const float4 a) {
+inline float minStrict(const float4 a) {
+#ifdef USE_NEON
   return vminnmvq_f32(a);
+#else
+  const __m128 m = minNm(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(minNm(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1))));
+#endif
 }
 
 /**
@@ -400,7 +623,11 @@ inline float32_t minStrict(const float4 a) {
  * @return vector of equalities per pair
  */
 inline uint4 equal(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vceqq_f32(a, b);
+#else
+  return sse::toMask(_mm_cmpeq_ps(a, b));
+#endif
 }
 
 /**
@@ -408,8 +635,12 @@ inline uint4 equal(const float4 a, const float4 b) {
  * @param a vector
  * @return vector of equalities to zero
  */
-inline uint32x4_t equalZero(const float4 a) {
+inline uint4 equalZero(const float4 a) {
+#ifdef USE_NEON
   return vceqzq_f32(a);
+#else
+  return sse::toMask(_mm_cmpeq_ps(a, _mm_setzero_ps()));
+#endif
 }
 
 /**
@@ -418,8 +649,12 @@ inline uint32x4_t equalZero(const float4 a) {
  * @param b RHS
  * @return vector of comparisons per pair
  */
-inline uint4 geq (const float4 a, const float4 b) {
+inline uint4 geq(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcgeq_f32(a, b);
+#else
+  return sse::toMask(_mm_cmpge_ps(a, b));
+#endif
 }
 
 /**
@@ -428,7 +663,11 @@ inline uint4 geq (const float4 a, const float4 b) {
  * @return vector of comparisons to zero
  */
 inline uint4 geqZero(const float4 a) {
+#ifdef USE_NEON
   return vcgezq_f32(a);
+#else
+  return sse::toMask(_mm_cmpge_ps(a, _mm_setzero_ps()));
+#endif
 }
 
 /**
@@ -438,7 +677,11 @@ inline uint4 geqZero(const float4 a) {
  * @return vector of comparisons per pair
  */
 inline uint4 leq(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcleq_f32(a, b);
+#else
+  return sse::toMask(_mm_cmple_ps(a, b));
+#endif
 }
 
 /**
@@ -447,7 +690,11 @@ inline uint4 leq(const float4 a, const float4 b) {
  * @return vector of comparisons to zero
  */
 inline uint4 leqZero(const float4 a) {
+#ifdef USE_NEON
   return vclezq_f32(a);
+#else
+  return sse::toMask(_mm_cmple_ps(a, _mm_setzero_ps()));
+#endif
 }
 
 /**
@@ -457,7 +704,11 @@ inline uint4 leqZero(const float4 a) {
  * @return vector of comparisons per pair
  */
 inline uint4 gt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcgtq_f32(a, b);
+#else
+  return sse::toMask(_mm_cmpgt_ps(a, b));
+#endif
 }
 
 /**
@@ -466,7 +717,11 @@ inline uint4 gt(const float4 a, const float4 b) {
  * @return vector of comparisons to zero
  */
 inline uint4 gtZero(const float4 a) {
+#ifdef USE_NEON
   return vcgtzq_f32(a);
+#else
+  return sse::toMask(_mm_cmpgt_ps(a, _mm_setzero_ps()));
+#endif
 }
 
 /**
@@ -476,7 +731,11 @@ inline uint4 gtZero(const float4 a) {
  * @return vector of comparisons per pair
  */
 inline uint4 lt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcltq_f32(a, b);
+#else
+  return sse::toMask(_mm_cmplt_ps(a, b));
+#endif
 }
 
 /**
@@ -485,7 +744,11 @@ inline uint4 lt(const float4 a, const float4 b) {
  * @return vector of comparisons to zero
  */
 inline uint4 ltZero(const float4 a) {
+#ifdef USE_NEON
   return vcltzq_f32(a);
+#else
+  return sse::toMask(_mm_cmplt_ps(a, _mm_setzero_ps()));
+#endif
 }
 
 /**
@@ -495,7 +758,11 @@ inline uint4 ltZero(const float4 a) {
  * @return vector of comparisons per pair
  */
 inline uint4 absGeq(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcageq_f32(a, b);
+#else
+  return geq(abs(a), abs(b));
+#endif
 }
 
 /**
@@ -505,7 +772,11 @@ inline uint4 absGeq(const float4 a, const float4 b) {
  * @return vector of comparisons per pair
  */
 inline uint4 absLeq(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcaleq_f32(a, b);
+#else
+  return leq(abs(a), abs(b));
+#endif
 }
 
 /**
@@ -515,7 +786,11 @@ inline uint4 absLeq(const float4 a, const float4 b) {
  * @return vector of comparisons per pair
  */
 inline uint4 absGt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcagtq_f32(a, b);
+#else
+  return gt(abs(a), abs(b));
+#endif
 }
 
 /**
@@ -525,13 +800,249 @@ inline uint4 absGt(const float4 a, const float4 b) {
  * @return vector of comparisons per pair
  */
 inline uint4 absLt(const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vcaltq_f32(a, b);
+#else
+  return lt(abs(a), abs(b));
+#endif
+}
+
+/**
+ * Bitwise AND of two masks
+ * @param a LHS
+ * @param b RHS
+ * @return a & b
+ */
+inline uint4 maskAnd(const uint4 a, const uint4 b) {
+#ifdef USE_NEON
+  return vandq_u32(a, b);
+#else
+  return _mm_and_si128(a, b);
+#endif
+}
+
+/**
+ * Bitwise OR of two masks
+ * @param a LHS
+ * @param b RHS
+ * @return a | b
+ */
+inline uint4 maskOr(const uint4 a, const uint4 b) {
+#ifdef USE_NEON
+  return vorrq_u32(a, b);
+#else
+  return _mm_or_si128(a, b);
+#endif
 }
 
-inline float4 bitwiseSelect(const float mask, const float a, const float b) {
+/**
+ * Packs the top bit of each lane into an integer (lane i -> bit i)
+ * @param m mask
+ * @return 4-bit lane mask
+ */
+inline int moveMask(const uint4 m) {
+#ifdef USE_NEON
+  static constexpr int32_t shifts[4] = {0, 1, 2, 3};
+  return static_cast<int>(vaddvq_u32(vshlq_u32(vshrq_n_u32(m, 31), vld1q_s32(shifts))));
+#else
+  return _mm_movemask_ps(sse::fromMask(m));
+#endif
+}
+
+/**
+ * Selects bits from a where the mask is set, and from b otherwise
+ * @param mask selection mask
+ * @param a vector chosen where mask bits are 1
+ * @param b vector chosen where mask bits are 0
+ * @return (mask & a) | (~mask & b)
+ */
+inline float4 bitwiseSelect(const uint4 mask, const float4 a, const float4 b) {
+#ifdef USE_NEON
   return vbslq_f32(mask, a, b);
+#else
+  const __m128 m = sse::fromMask(mask);
+  return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+#endif
+}
+
+#ifdef USE_AVX2
+// 8-wide tier, only available on x86 with AVX2 (+FMA3)
+using float8 = __m256;
+using uint8 = __m256i;
+
+namespace avx {
+inline __m256 signMask() { return _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000)); }
+inline uint8 toMask(const __m256 m) { return _mm256_castps_si256(m); }
+inline __m256 fromMask(const uint8 m) { return _mm256_castsi256_ps(m); }
+} // namespace avx
+
+/**
+ * Broadcast a scalar to a float8
+ * @param x scalar
+ * @return vector with all lanes set to x
+ */
+inline float8 broadcast8(const float x) { return _mm256_set1_ps(x); }
+
+/**
+ * Load a float8 from memory
+ * @param x pointer to memory
+ * @return vector loaded from memory
+ */
+inline float8 load8(const float *x) { return _mm256_loadu_ps(x); }
+
+/**
+ * Stores a float8 to memory
+ * @param p pointer to memory
+ * @param v vector to store
+ */
+inline void store(float *p, const float8 v) { _mm256_storeu_ps(p, v); }
+
+/**
+ * Stores a uint8 mask to memory
+ * @param p pointer to memory
+ * @param v mask to store
+ */
+inline void store(uint32_t *p, const uint8 v) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+
+inline float8 add(const float8 a, const float8 b) { return _mm256_add_ps(a, b); }
+inline float8 sub(const float8 a, const float8 b) { return _mm256_sub_ps(a, b); }
+inline float8 mul(const float8 a, const float8 b) { return _mm256_mul_ps(a, b); }
+inline float8 div(const float8 a, const float8 b) { return _mm256_div_ps(a, b); }
+inline float8 mulExt(const float8 a, const float8 b) { return _mm256_mul_ps(a, b); }
+inline float8 mulAddAcc(const float8 a, const float8 b, const float8 c) { return _mm256_fmadd_ps(b, c, a); }
+inline float8 mulSubAcc(const float8 a, const float8 b, const float8 c) { return _mm256_fnmadd_ps(b, c, a); }
+inline float8 fma(const float8 a, const float8 b, const float8 c) { return _mm256_fmadd_ps(a, b, c); }
+inline float8 fms(const float8 a, const float8 b, const float8 c) { return _mm256_fmsub_ps(a, b, c); }
+inline float8 absDiff(const float8 a, const float8 b) { return _mm256_andnot_ps(avx::signMask(), _mm256_sub_ps(a, b)); }
+inline float8 abs(const float8 a) { return _mm256_andnot_ps(avx::signMask(), a); }
+inline float8 max(const float8 a, const float8 b) { return _mm256_max_ps(a, b); }
+inline float8 min(const float8 a, const float8 b) { return _mm256_min_ps(a, b); }
+inline float8 maxNm(const float8 a, const float8 b) { return _mm256_blendv_ps(_mm256_max_ps(a, b), a, _mm256_cmp_ps(b, b, _CMP_UNORD_Q)); }
+inline float8 minNm(const float8 a, const float8 b) { return _mm256_blendv_ps(_mm256_min_ps(a, b), a, _mm256_cmp_ps(b, b, _CMP_UNORD_Q)); }
+inline float8 truncate(const float8 a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+inline float8 round(const float8 a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+inline float8 floor(const float8 a) { return _mm256_floor_ps(a); }
+inline float8 ceil(const float8 a) { return _mm256_ceil_ps(a); }
+inline float8 reciprocal(const float8 a) { return _mm256_rcp_ps(a); }
+inline float8 reciprocal(const float8 a, const float8 b) { return _mm256_fnmadd_ps(a, b, _mm256_set1_ps(2.0f)); }
+inline float8 reciprocalSqrt(const float8 a) { return _mm256_rsqrt_ps(a); }
+inline float8 reciprocalSqrt(const float8 a, const float8 b) { return _mm256_mul_ps(_mm256_fnmadd_ps(a, b, _mm256_set1_ps(3.0f)), _mm256_set1_ps(0.5f)); }
+inline float8 sqrt(const float8 a) { return _mm256_sqrt_ps(a); }
+
+/**
+ * Sums the elements of a float8
+ * @param a vector
+ * @return horizontal sum of the vector
+ */
+inline float sum(const float8 a) { return sum(_mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1))); }
+
+/**
+ * Computes the maximum element of a float8
+ * @param a vector
+ * @return maximum element of the vector
+ */
+inline float max(const float8 a) { return max(_mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1))); }
+
+/**
+ * Computes the minimum element of a float8
+ * @param a vector
+ * @return minimum element of the vector
+ */
+inline float min(const float8 a) { return min(_mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1))); }
+
+inline float maxStrict(const float8 a) { return maxStrict(maxNm(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1))); }
+inline float minStrict(const float8 a) { return minStrict(minNm(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1))); }
+
+inline uint8 equal(const float8 a, const float8 b) { return avx::toMask(_mm256_cmp_ps(a, b, _CMP_EQ_OQ)); }
+inline uint8 equalZero(const float8 a) { return avx::toMask(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_EQ_OQ)); }
+inline uint8 geq(const float8 a, const float8 b) { return avx::toMask(_mm256_cmp_ps(a, b, _CMP_GE_OQ)); }
+inline uint8 geqZero(const float8 a) { return avx::toMask(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GE_OQ)); }
+inline uint8 leq(const float8 a, const float8 b) { return avx::toMask(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+inline uint8 leqZero(const float8 a) { return avx::toMask(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_LE_OQ)); }
+inline uint8 gt(const float8 a, const float8 b) { return avx::toMask(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+inline uint8 gtZero(const float8 a) { return avx::toMask(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GT_OQ)); }
+inline uint8 lt(const float8 a, const float8 b) { return avx::toMask(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+inline uint8 ltZero(const float8 a) { return avx::toMask(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_LT_OQ)); }
+inline uint8 absGeq(const float8 a, const float8 b) { return geq(abs(a), abs(b)); }
+inline uint8 absLeq(const float8 a, const float8 b) { return leq(abs(a), abs(b)); }
+inline uint8 absGt(const float8 a, const float8 b) { return gt(abs(a), abs(b)); }
+inline uint8 absLt(const float8 a, const float8 b) { return lt(abs(a), abs(b)); }
+
+inline uint8 maskAnd(const uint8 a, const uint8 b) { return _mm256_and_si256(a, b); }
+inline uint8 maskOr(const uint8 a, const uint8 b) { return _mm256_or_si256(a, b); }
+
+/**
+ * Packs the top bit of each lane into an integer (lane i -> bit i)
+ * @param m mask
+ * @return 8-bit lane mask
+ */
+inline int moveMask(const uint8 m) { return _mm256_movemask_ps(avx::fromMask(m)); }
+
+/**
+ * Selects bits from a where the mask is set, and from b otherwise
+ * @param mask selection mask
+ * @param a vector chosen where mask bits are 1
+ * @param b vector chosen where mask bits are 0
+ * @return (mask & a) | (~mask & b)
+ */
+inline float8 bitwiseSelect(const uint8 mask, const float8 a, const float8 b) {
+  const __m256 m = avx::fromMask(mask);
+  return _mm256_or_ps(_mm256_and_ps(m, a), _mm256_andnot_ps(m, b));
 }
 
+/**
+ * Load 8 ints from memory
+ * @param x pointer to 8 ints (no alignment needed)
+ * @return vector of the ints
+ */
+inline uint8 load8(const int32_t *x) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x)); }
+
+/**
+ * Loads 8 floats from scattered positions
+ * @param base pointer to memory
+ * @param indices 8 indices into base (no alignment needed)
+ * @return vector with lane i set to base[indices[i]]
+ */
+inline float8 gather8(const float *base, const int32_t *indices) { return _mm256_i32gather_ps(base, load8(indices), 4); }
+
+namespace avx {
+/**
+ * Permutation that moves the lanes selected by an 8-bit mask to the front: byte k of entry m is
+ * the index of the k-th set bit of m
+ */
+inline constexpr auto compressPermutations = [] {
+  std::array<uint64_t, 256> table{};
+  for (int m = 0; m < 256; ++m) {
+    int k = 0;
+    for (int i = 0; i < 8; ++i) {
+      if (m & (1 << i)) table[m] |= static_cast<uint64_t>(i) << (8 * k++);
+    }
+  }
+  return table;
+}();
+
+inline __m256i compressPermutation(const int mask) { return _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(static_cast<long long>(compressPermutations[mask]))); }
+} // namespace avx
+
+/**
+ * Stores the lanes selected by a mask contiguously, like an AVX-512 compressed store.
+ * All 8 lanes are written; the ones past the returned count are unspecified.
+ * @param p destination with room for 8 floats
+ * @param v vector
+ * @param mask 8-bit lane mask (lane i -> bit i)
+ * @return number of lanes selected
+ */
+inline int compressStore(float *p, const float8 v, const int mask) {
+  _mm256_storeu_ps(p, _mm256_permutevar8x32_ps(v, avx::compressPermutation(mask)));
+  return std::popcount(static_cast<unsigned>(mask));
+}
+
+inline int compressStore(int32_t *p, const uint8 v, const int mask) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), _mm256_permutevar8x32_epi32(v, avx::compressPermutation(mask)));
+  return std::popcount(static_cast<unsigned>(mask));
+}
+#endif
+
 // TODO: scalar operations if needed
 
-} // namespace simd
\ No newline at end of file
+} // namespace simd
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+
+/**
+ * Per-ray traversal counters.
+ * Traversals take the stats type as a template parameter, so passing NoTraversalStats
+ * compiles every hook away and the uninstrumented path is unchanged.
+ */
+struct TraversalStats {
+    // Interior nodes whose children were tested
+    uint32_t nodesVisited = 0;
+    // Bounding boxes tested (4 per BVH4 node, N per N-wide node)
+    uint32_t boxesTested = 0;
+    uint32_t leavesVisited = 0;
+    // Triangles tested, including BVH4 padding lanes
+    uint32_t trianglesTested = 0;
+    uint32_t maxStackDepth = 0;
+    // Subtrees skipped because a closer hit was already found, or traversals ended by the first hit
+    uint32_t earlyOuts = 0;
+
+    void boxes(const int n) { boxesTested += n; }
+    void node() { nodesVisited++; }
+    void leaf(const int numTriangles) {
+        leavesVisited++;
+        trianglesTested += numTriangles;
+    }
+    void stackDepth(const int depth) { maxStackDepth = std::max(maxStackDepth, static_cast<uint32_t>(depth)); }
+    void earlyOut() { earlyOuts++; }
+};
+
+struct NoTraversalStats {
+    void boxes(int) {}
+    void node() {}
+    void leaf(int) {}
+    void stackDepth(int) {}
+    void earlyOut() {}
+};
+
+/**
+ * Histogram of a counter with power-of-two buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i)
+ */
+struct TraversalHistogram {
+    static constexpr int NUM_BUCKETS = 24;
+
+    uint64_t buckets[NUM_BUCKETS] = {};
+    uint64_t total                = 0;
+
+    void add(const uint32_t value) {
+        buckets[std::min(static_cast<int>(std::bit_width(value)), NUM_BUCKETS - 1)]++;
+        total += value;
+    }
+
+    void merge(const TraversalHistogram &other) {
+        for (int i = 0; i < NUM_BUCKETS; ++i) buckets[i] += other.buckets[i];
+        total += other.total;
+    }
+};
+
+/**
+ * Sums and histograms of TraversalStats over many rays.
+ * Each thread keeps its own and they are merged at the end, so no atomics are needed.
+ */
+struct TraversalStatsAccumulator {
+    uint64_t numRays = 0;
+    TraversalHistogram nodesVisited;
+    TraversalHistogram boxesTested;
+    TraversalHistogram leavesVisited;
+    TraversalHistogram trianglesTested;
+    TraversalHistogram maxStackDepth;
+    TraversalHistogram earlyOuts;
+
+    void add(const TraversalStats &stats) {
+        numRays++;
+        nodesVisited.add(stats.nodesVisited);
+        boxesTested.add(stats.boxesTested);
+        leavesVisited.add(stats.leavesVisited);
+        trianglesTested.add(stats.trianglesTested);
+        maxStackDepth.add(stats.maxStackDepth);
+        earlyOuts.add(stats.earlyOuts);
+    }
+
+    void merge(const TraversalStatsAccumulator &other) {
+        numRays += other.numRays;
+        nodesVisited.merge(other.nodesVisited);
+        boxesTested.merge(other.boxesTested);
+        leavesVisited.merge(other.leavesVisited);
+        trianglesTested.merge(other.trianglesTested);
+        maxStackDepth.merge(other.maxStackDepth);
+        earlyOuts.merge(other.earlyOuts);
+    }
+};
@@ -1,5 +1,16 @@
 #include "tests.hpp"
+#include "bvhcache.hpp"
+#include "bvhn.hpp"
+#include "lbvh.hpp"
+#include "parallel.hpp"
+#include "testscene.hpp"
+#include "tlas.hpp"
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <limits>
 
 void test_BVH4Node_isLeaf() {
     LBVH4Node node{};
@@ -41,11 +52,1595 @@ void test_BVH4Node_getPrimitiveIndices() {
     assert(node.getPrimitiveIndices(0) == index);
 }
 
+// Scalar reference inputs shared by the simd:: backend tests
+static constexpr float SIMD_A[8] = {1.5f, -2.0f, 3.25f, -0.5f, 7.0f, -8.5f, 0.0f, 4.75f};
+static constexpr float SIMD_B[8] = {-1.0f, 2.0f, 0.75f, -3.5f, 7.0f, 2.5f, -1.0f, 0.25f};
+static constexpr float SIMD_C[8] = {0.5f, 4.0f, -2.0f, 1.0f, -6.0f, 3.0f, 9.0f, -0.75f};
+
+static bool approxEqual(const float a, const float b, const float eps = 1e-5f) {
+    return std::fabs(a - b) <= eps * std::fmax(1.0f, std::fabs(b));
+}
+
+void test_simd_arithmetic() {
+    const auto a = simd::load(SIMD_A);
+    const auto b = simd::load(SIMD_B);
+    const auto c = simd::load(SIMD_C);
+
+    float add[4], sub[4], mul[4], div[4], fma[4], fms[4], mla[4], mls[4], absDiff[4], abs[4], sqrt[4];
+    simd::store(add, simd::add(a, b));
+    simd::store(sub, simd::sub(a, b));
+    simd::store(mul, simd::mul(a, b));
+    simd::store(div, simd::div(a, b));
+    simd::store(fma, simd::fma(a, b, c));
+    simd::store(fms, simd::fms(a, b, c));
+    simd::store(mla, simd::mulAddAcc(a, b, c));
+    simd::store(mls, simd::mulSubAcc(a, b, c));
+    simd::store(absDiff, simd::absDiff(a, b));
+    simd::store(abs, simd::abs(a));
+    simd::store(sqrt, simd::sqrt(simd::abs(a)));
+
+    for (int i = 0; i < 4; ++i) {
+        assert(add[i] == SIMD_A[i] + SIMD_B[i]);
+        assert(sub[i] == SIMD_A[i] - SIMD_B[i]);
+        assert(mul[i] == SIMD_A[i] * SIMD_B[i]);
+        assert(approxEqual(div[i], SIMD_A[i] / SIMD_B[i]));
+        assert(approxEqual(fma[i], SIMD_A[i] * SIMD_B[i] + SIMD_C[i]));
+        assert(approxEqual(fms[i], SIMD_A[i] * SIMD_B[i] - SIMD_C[i]));
+        assert(approxEqual(mla[i], SIMD_A[i] + SIMD_B[i] * SIMD_C[i]));
+        assert(approxEqual(mls[i], SIMD_A[i] - SIMD_B[i] * SIMD_C[i]));
+        assert(absDiff[i] == std::fabs(SIMD_A[i] - SIMD_B[i]));
+        assert(abs[i] == std::fabs(SIMD_A[i]));
+        assert(approxEqual(sqrt[i], std::sqrt(std::fabs(SIMD_A[i]))));
+    }
+
+    // Estimates are only accurate to ~12 bits
+    float rcp[4];
+    simd::store(rcp, simd::reciprocal(simd::load(SIMD_C)));
+    for (int i = 0; i < 4; ++i) assert(approxEqual(rcp[i], 1 / SIMD_C[i], 1e-3f));
+}
+
+void test_simd_rounding() {
+    constexpr float x[4] = {1.5f, -1.5f, 2.5f, -0.25f};
+    const auto v         = simd::load(x);
+
+    float trunc[4], round[4], floor[4], ceil[4];
+    simd::store(trunc, simd::truncate(v));
+    simd::store(round, simd::round(v));
+    simd::store(floor, simd::floor(v));
+    simd::store(ceil, simd::ceil(v));
+
+    for (int i = 0; i < 4; ++i) {
+        assert(trunc[i] == std::trunc(x[i]));
+        assert(round[i] == std::nearbyint(x[i]));
+        assert(floor[i] == std::floor(x[i]));
+        assert(ceil[i] == std::ceil(x[i]));
+    }
+}
+
+void test_simd_minMax() {
+    const auto a = simd::load(SIMD_A);
+    const auto b = simd::load(SIMD_B);
+
+    float mn[4], mx[4], pmn[4], pmx[4], padd[4];
+    simd::store(mn, simd::min(a, b));
+    simd::store(mx, simd::max(a, b));
+    simd::store(pmn, simd::pairwiseMin(a, b));
+    simd::store(pmx, simd::pairwiseMax(a, b));
+    simd::store(padd, simd::pairwiseAdd(a, b));
+
+    for (int i = 0; i < 4; ++i) {
+        assert(mn[i] == std::fmin(SIMD_A[i], SIMD_B[i]));
+        assert(mx[i] == std::fmax(SIMD_A[i], SIMD_B[i]));
+
+        const float *src = i < 2 ? SIMD_A : SIMD_B;
+        const int j      = 2 * (i % 2);
+        assert(pmn[i] == std::fmin(src[j], src[j + 1]));
+        assert(pmx[i] == std::fmax(src[j], src[j + 1]));
+        assert(padd[i] == src[j] + src[j + 1]);
+    }
+
+    // IEEE variants ignore a single NaN operand
+    float withNaN[4] = {NAN, 1.0f, NAN, -1.0f};
+    float nm[4];
+    simd::store(nm, simd::maxNm(simd::load(withNaN), a));
+    assert(nm[0] == SIMD_A[0] && nm[2] == SIMD_A[2]);
+    simd::store(nm, simd::minNm(a, simd::load(withNaN)));
+    assert(nm[0] == SIMD_A[0] && nm[2] == SIMD_A[2]);
+}
+
+void test_simd_horizontal() {
+    const auto a = simd::load(SIMD_A);
+
+    float sum = 0, mn = INF, mx = -INF;
+    for (int i = 0; i < 4; ++i) {
+        sum += SIMD_A[i];
+        mn = std::fmin(mn, SIMD_A[i]);
+        mx = std::fmax(mx, SIMD_A[i]);
+    }
+
+    assert(approxEqual(simd::sum(a), sum));
+    assert(simd::min(a) == mn);
+    assert(simd::max(a) == mx);
+    assert(simd::minStrict(a) == mn);
+    assert(simd::maxStrict(a) == mx);
+}
+
+void test_simd_compare() {
+    const auto a = simd::load(SIMD_A);
+    const auto b = simd::load(SIMD_B);
+
+    int eq = 0, ge = 0, le = 0, gt = 0, lt = 0, absGe = 0, absLt = 0, ltZero = 0, geZero = 0;
+    for (int i = 0; i < 4; ++i) {
+        eq |= (SIMD_A[i] == SIMD_B[i]) << i;
+        ge |= (SIMD_A[i] >= SIMD_B[i]) << i;
+        le |= (SIMD_A[i] <= SIMD_B[i]) << i;
+        gt |= (SIMD_A[i] > SIMD_B[i]) << i;
+        lt |= (SIMD_A[i] < SIMD_B[i]) << i;
+        absGe |= (std::fabs(SIMD_A[i]) >= std::fabs(SIMD_B[i])) << i;
+        absLt |= (std::fabs(SIMD_A[i]) < std::fabs(SIMD_B[i])) << i;
+        ltZero |= (SIMD_A[i] < 0) << i;
+        geZero |= (SIMD_A[i] >= 0) << i;
+    }
+
+    assert(simd::moveMask(simd::equal(a, b)) == eq);
+    assert(simd::moveMask(simd::geq(a, b)) == ge);
+    assert(simd::moveMask(simd::leq(a, b)) == le);
+    assert(simd::moveMask(simd::gt(a, b)) == gt);
+    assert(simd::moveMask(simd::lt(a, b)) == lt);
+    assert(simd::moveMask(simd::absGeq(a, b)) == absGe);
+    assert(simd::moveMask(simd::absLt(a, b)) == absLt);
+    assert(simd::moveMask(simd::ltZero(a)) == ltZero);
+    assert(simd::moveMask(simd::geqZero(a)) == geZero);
+    assert(simd::moveMask(simd::maskAnd(simd::geq(a, b), simd::leq(a, b))) == (ge & le));
+    assert(simd::moveMask(simd::maskOr(simd::gt(a, b), simd::lt(a, b))) == (gt | lt));
+
+    // Masks are all-ones or all-zeros per lane
+    uint32_t lanes[4];
+    simd::store(lanes, simd::gt(a, b));
+    for (int i = 0; i < 4; ++i) assert(lanes[i] == ((gt >> i) & 1 ? 0xFFFFFFFFu : 0u));
+}
+
+void test_simd_bitwiseSelect() {
+    const auto a = simd::load(SIMD_A);
+    const auto b = simd::load(SIMD_B);
+
+    float sel[4];
+    simd::store(sel, simd::bitwiseSelect(simd::gt(a, b), a, b));
+    for (int i = 0; i < 4; ++i) assert(sel[i] == (SIMD_A[i] > SIMD_B[i] ? SIMD_A[i] : SIMD_B[i]));
+}
+
+void test_simd_loadBytes() {
+    // Unaligned, with values at both ends of the range
+    const uint8_t bytes[5] = {7, 0, 255, 128, 1};
+
+    float loaded[4];
+    simd::store(loaded, simd::loadBytes(bytes + 1));
+    for (int i = 0; i < 4; ++i) assert(loaded[i] == static_cast<float>(bytes[i + 1]));
+}
+
+void test_simd_gather() {
+    // Repeated and out-of-order indices
+    const int32_t indices[8] = {6, 0, 6, 3, 7, 1, 1, 4};
+
+    float gathered[4];
+    simd::store(gathered, simd::gather(SIMD_A, indices));
+    for (int i = 0; i < 4; ++i) assert(gathered[i] == SIMD_A[indices[i]]);
+
+#ifdef USE_AVX2
+    float gathered8[8];
+    simd::store(gathered8, simd::gather8(SIMD_A, indices));
+    for (int i = 0; i < 8; ++i) assert(gathered8[i] == SIMD_A[indices[i]]);
+#endif
+}
+
+#ifdef USE_AVX2
+void test_simd_float8() {
+    const auto a = simd::load8(SIMD_A);
+    const auto b = simd::load8(SIMD_B);
+    const auto c = simd::load8(SIMD_C);
+
+    float add[8], mul[8], fma[8], fms[8], mn[8], mx[8], sel[8];
+    simd::store(add, simd::add(a, b));
+    simd::store(mul, simd::mul(a, b));
+    simd::store(fma, simd::fma(a, b, c));
+    simd::store(fms, simd::fms(a, b, c));
+    simd::store(mn, simd::min(a, b));
+    simd::store(mx, simd::max(a, b));
+    simd::store(sel, simd::bitwiseSelect(simd::lt(a, b), a, b));
+
+    float sum = 0, hmin = INF, hmax = -INF;
+    int gt    = 0;
+    for (int i = 0; i < 8; ++i) {
+        assert(add[i] == SIMD_A[i] + SIMD_B[i]);
+        assert(mul[i] == SIMD_A[i] * SIMD_B[i]);
+        assert(approxEqual(fma[i], SIMD_A[i] * SIMD_B[i] + SIMD_C[i]));
+        assert(approxEqual(fms[i], SIMD_A[i] * SIMD_B[i] - SIMD_C[i]));
+        assert(mn[i] == std::fmin(SIMD_A[i], SIMD_B[i]));
+        assert(mx[i] == std::fmax(SIMD_A[i], SIMD_B[i]));
+        assert(sel[i] == (SIMD_A[i] < SIMD_B[i] ? SIMD_A[i] : SIMD_B[i]));
+
+        sum += SIMD_A[i];
+        hmin = std::fmin(hmin, SIMD_A[i]);
+        hmax = std::fmax(hmax, SIMD_A[i]);
+        gt |= (SIMD_A[i] > SIMD_B[i]) << i;
+    }
+
+    assert(approxEqual(simd::sum(a), sum));
+    assert(simd::min(a) == hmin);
+    assert(simd::max(a) == hmax);
+    assert(simd::moveMask(simd::gt(a, b)) == gt);
+
+    // Compressed stores keep the selected lanes in order
+    for (int mask = 0; mask < 256; mask += 37) {
+        float compressed[8];
+        int32_t indices[8];
+        const int32_t lanes[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+        const int count        = simd::compressStore(compressed, a, mask);
+        assert(simd::compressStore(indices, simd::load8(lanes), mask) == count);
+
+        int k = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (!(mask & (1 << i))) continue;
+            assert(compressed[k] == SIMD_A[i]);
+            assert(indices[k++] == i);
+        }
+        assert(k == count);
+    }
+}
+#endif
+
+static Ray makeTestRay(uint32_t &seed) {
+    const Vec3f origin{4 * testRandom(seed) - 2, 4 * testRandom(seed) - 2, 4 * testRandom(seed) - 2};
+    const Vec3f target{testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f};
+    return Ray{origin, target - origin};
+}
+
+/**
+ * Brute-force closest hit over every triangle in the scene
+ */
+static bool bruteForceClosestHit(const Scene &scene, const Ray &r, Interval t, float &tHit) {
+    bool hitAnything = false;
+    for (const auto &triangle: scene.triangles) {
+        float tPrim, u, v;
+        if (scene.meshes[triangle.meshIndex].tClosestHit(r, t, triangle.index, tPrim, u, v)) {
+            hitAnything = true;
+            t.max       = tPrim;
+        }
+    }
+    tHit = t.max;
+    return hitAnything;
+}
+
+void test_AABB4_hit4_matchesScalar() {
+    uint32_t seed = 3;
+    for (int n = 0; n < 64; ++n) {
+        AABB boxes[4];
+        AABB4 boxes4{};
+        for (int i = 0; i < 4; ++i) {
+            const Vec3f a{2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1};
+            const Vec3f b{2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1};
+            boxes[i] = AABB(a, b);
+            for (int j = 0; j < 3; ++j) {
+                boxes4.pmin[j][i] = boxes[i].pmin[j];
+                boxes4.pmax[j][i] = boxes[i].pmax[j];
+            }
+        }
+
+        // Each call must be independent of the previous ones
+        for (int k = 0; k < 8; ++k) {
+            const Ray r = makeTestRay(seed);
+            const Interval t(0, k % 2 == 0 ? INF : 2.0f);
+
+            float4 tEntry;
+            const int mask = boxes4.hit4(PrecomputedRay(r), t.min, t.max, tEntry);
+            for (int i = 0; i < 4; ++i) {
+                assert(((mask >> i) & 1) == boxes[i].hit(r.origin, r.dir, t));
+            }
+        }
+    }
+}
+
+void test_Triangle4_hit4_matchesScalar() {
+    const Scene scene = makeRandomScene(3, 11);
+    const Mesh &mesh  = scene.meshes[0];
+
+    Triangle4 block{};
+    for (int i = 0; i < 3; ++i) {
+        Vec3f v0, v1, v2;
+        mesh.getVertices(i, v0, v1, v2);
+        block.setLane(i, v0, v1, v2, i);
+    }
+    block.setPadding(3);
+
+    uint32_t seed = 5;
+    for (int k = 0; k < 256; ++k) {
+        const Ray r = makeTestRay(seed);
+        const Interval t(0.001f, INF);
+
+        float4 t4, b1, b2;
+        const int mask = block.hit4(PrecomputedRay(r), t.min, t.max, t4, b1, b2);
+        assert((mask & 0b1000) == 0);
+        for (int i = 0; i < 3; ++i) {
+            assert(((mask >> i) & 1) == mesh.tAnyHit(r, t, i));
+        }
+    }
+
+    scene.destroy();
+}
+
+void test_BVH4_traversalMatchesBruteForce() {
+    const Scene scene = makeRandomScene(500, 7);
+
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    uint32_t seed = 42;
+    int hits      = 0;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        SurfaceIntersection record{};
+        const bool hit = bvh4.closestHit(r, Interval(0.001f, INF), record);
+
+        assert(hit == expected);
+        assert(!hit || approxEqual(record.t, tExpected, 1e-4f));
+        assert(bvh4.anyHit(r, Interval(0.001f, INF)) == expected);
+        hits += hit;
+    }
+    assert(hits > 0);
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH2_traversalMatchesBruteForce() {
+    const Scene scene = makeRandomScene(500, 13);
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    bvh2.build();
+
+    uint32_t seed = 17;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit;
+        const bool found = bvh2.closestHit(r, Interval(0.001f, INF), hit);
+
+        assert(found == expected);
+        assert(!found || hit.t == tExpected);
+        assert(bvh2.anyHit(r, Interval(0.001f, INF)) == expected);
+
+        if (found) {
+            // Shading is deferred to a single finalize call
+            SurfaceIntersection record{};
+            scene.finalizeIntersection(r, hit, record);
+            assert(record.t == hit.t);
+            assert(approxEqual(std::fabs(record.normal.y), 1.0f));
+        }
+    }
+
+    bvh2.destroy();
+    scene.destroy();
+}
+
+void test_BVH2_leafTriangleLayoutsMatchIndexed() {
+    const Scene scene = makeRandomScene(500, 67);
+
+    BVH2 indexed{.maxPrimsInNode = 4, .scene = scene};
+    BVH2 vertices{.maxPrimsInNode = 4, .scene = scene, .triangleLayout = BVHTriangleLayout::Vertices};
+    BVH2 edges{.maxPrimsInNode = 4, .scene = scene, .triangleLayout = BVHTriangleLayout::Edges};
+    indexed.build();
+    vertices.build();
+    edges.build();
+    assert(indexed.leafTriangles.empty() && vertices.leafTriangles.size() == vertices.primIndices.size());
+
+    // Edges are computed with the same float subtractions the indexed path does per test, so hits are bit-identical
+    uint32_t seed = 71;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        PrimitiveHit expected, hit;
+        const bool found = indexed.closestHit(r, Interval(0.001f, INF), expected);
+        for (const BVH2 *bvh2: {&vertices, &edges}) {
+            assert(bvh2->closestHit(r, Interval(0.001f, INF), hit) == found);
+            assert(!found || (hit.t == expected.t && hit.primIndex == expected.primIndex && hit.b1 == expected.b1 && hit.b2 == expected.b2));
+            assert(bvh2->anyHit(r, Interval(0.001f, INF)) == found);
+        }
+    }
+
+    indexed.destroy();
+    vertices.destroy();
+    edges.destroy();
+    scene.destroy();
+}
+
+/**
+ * Hand-built BVH2 over a single-mesh scene shaped as a chain, as deep as a binary tree over its triangles can be:
+ * node 2k has leaf 2k + 1 (triangle k) and the rest of the chain
+ */
+static BVH2 makeChainBVH2(const Scene &scene) {
+    const int length = static_cast<int>(scene.triangles.size());
+    BVH2 chain{.maxPrimsInNode = 1, .scene = scene};
+    chain.primIndices = {new uint32_t[length], static_cast<size_t>(length)};
+    chain.nodes       = allocateBVHNodes<LBVH2Node>(2 * length - 1);
+    chain.numNodes    = 2 * length - 1;
+    for (int k = length - 1; k >= 0; --k) {
+        chain.primIndices[k]  = k;
+        LBVH2Node &leaf       = chain.nodes[k == length - 1 ? 2 * k : 2 * k + 1];
+        leaf.bbox             = scene.meshes[0].tBounds(k);
+        leaf.primitivesOffset = k;
+        leaf.numPrimitives    = 1;
+        if (k == length - 1) continue;
+
+        LBVH2Node &node        = chain.nodes[2 * k];
+        node.bbox              = AABB(chain.nodes[2 * k + 1].bbox, chain.nodes[2 * k + 2].bbox);
+        node.secondChildOffset = 2 * k + 2;
+        node.numPrimitives     = 0;
+        node.axis              = k % 3;
+    }
+    chain.linkParents();
+    return chain;
+}
+
+void test_BVH2_occludedMatchesAnyHit() {
+    const Scene scene = makeRandomScene(2000, 101);
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    bvh2.build();
+
+    // Random rays, then shadow rays from nearby points towards one light so the shadow cache gets hits;
+    // the count is not a multiple of 64 so the last mask word is partial
+    uint32_t seed = 103;
+    std::vector<Ray> rays(1000);
+    for (size_t i = 0; i < rays.size() / 2; ++i) rays[i] = makeTestRay(seed);
+    const Vec3f light(0.1f, 3, -0.2f);
+    for (size_t i = rays.size() / 2; i < rays.size(); ++i) {
+        const Vec3f origin{0.1f * testRandom(seed) - 0.05f, -1.5f, 0.1f * testRandom(seed) - 0.05f};
+        rays[i] = Ray{origin, light - origin};
+    }
+
+    const Interval t(0.001f, 0.999f);
+    std::vector<uint64_t> mask(occlusionMaskWords(rays.size()), ~uint64_t{0});
+    bvh2.occluded(rays, t, mask, 4);
+
+    int numOccluded = 0;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        const bool occluded = (mask[i / 64] >> (i % 64)) & 1;
+        assert(occluded == bvh2.anyHit(rays[i], t));
+        numOccluded += occluded;
+    }
+    assert(numOccluded > 0 && numOccluded < static_cast<int>(rays.size()));
+    assert((mask.back() >> (rays.size() % 64)) == 0);
+
+    // Forcing the short-stack path on the same nodes (the copy shares them and is not destroyed) must keep the larger
+    // box first order: the same nodes are visited and the same occluder is found
+    BVH2 forced     = bvh2;
+    forced.maxDepth = BVH2_STACK_SIZE + 1;
+    for (const Ray &r: rays) {
+        int fullLeaf = -1, shortLeaf = -1;
+        TraversalStats fullStats, shortStats;
+        assert(bvh2.occluded(r, t, fullLeaf, fullStats) == forced.occluded(r, t, shortLeaf, shortStats));
+        assert(fullLeaf == shortLeaf);
+        assert(fullStats.nodesVisited == shortStats.nodesVisited && fullStats.boxesTested == shortStats.boxesTested);
+    }
+
+    // A chain deeper than the full stack takes the short-stack path, which must still fill the shadow cache
+    const Scene chainScene = makeRandomScene(100, 127);
+    BVH2 chain             = makeChainBVH2(chainScene);
+    assert(chain.maxDepth > BVH2_STACK_SIZE);
+    std::fill(mask.begin(), mask.end(), ~uint64_t{0});
+    chain.occluded(rays, t, mask, 4);
+
+    numOccluded = 0;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        const bool occluded = (mask[i / 64] >> (i % 64)) & 1;
+        assert(occluded == chain.anyHit(rays[i], t));
+        numOccluded += occluded;
+
+        int occluderLeaf = -1;
+        assert(chain.occluded(rays[i], t, occluderLeaf) == occluded);
+        assert(occluded == (occluderLeaf >= 0));
+        assert(!occluded || chain.nodes[occluderLeaf].numPrimitives > 0);
+    }
+    assert(numOccluded > 0);
+
+    chain.destroy();
+    chainScene.destroy();
+    bvh2.destroy();
+    scene.destroy();
+}
+
+void test_BVH2_shortStackMatchesFullStack() {
+    const Scene scene = makeRandomScene(2000, 107);
+
+    // Single-triangle leaves make the tree deep enough for the short stack to drop entries
+    BVH2 bvh2{.maxPrimsInNode = 1, .scene = scene};
+    bvh2.build();
+    assert(bvh2.maxDepth > BVH2_SHORT_STACK_SIZE && bvh2.maxDepth <= BVH2_STACK_SIZE);
+
+    uint32_t seed = 109;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+        const Interval t(0.001f, INF);
+
+        PrimitiveHit expected, hit;
+        const bool found = bvh2.closestHit(r, t, expected);
+        assert(bvh2.closestHitShortStack(r, t, hit) == found);
+        assert(!found || (hit.t == expected.t && hit.primIndex == expected.primIndex));
+        assert(bvh2.anyHitShortStack(r, t) == found);
+    }
+    bvh2.destroy();
+
+    // A hand-built chain, deeper than the full stack
+    constexpr int CHAIN_LENGTH = 100;
+    const Scene chainScene     = makeRandomScene(CHAIN_LENGTH, 113);
+    BVH2 chain                 = makeChainBVH2(chainScene);
+    assert(chain.maxDepth == CHAIN_LENGTH - 1);
+
+    // closestHit and anyHit fall back to the short stack rather than overflowing
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(chainScene, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit;
+        assert(chain.closestHit(r, Interval(0.001f, INF), hit) == expected);
+        assert(!expected || hit.t == tExpected);
+        assert(chain.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+
+    chain.destroy();
+    chainScene.destroy();
+    scene.destroy();
+}
+
+/**
+ * Clusters of triangles on a staircase of points: the Morton code of point k is k one bits followed by zeros, so
+ * consecutive points share ever longer prefixes and a Morton-code build splits off one cluster per level.
+ * Each triangle's box is centred on its point, so a cluster shares one code.
+ */
+static Scene makeStaircaseScene(const int numPoints, const int trianglesPerPoint, uint32_t seed) {
+    const int numTriangles = numPoints * trianglesPerPoint;
+    const auto indices     = new Vec3i[numTriangles];
+    const auto vertices    = new Vec3f[numTriangles * 3];
+    const auto normals     = new Vec3f[numTriangles * 3];
+    const auto uvs         = new Vec2f[numTriangles * 3];
+
+    for (int k = 0; k < numPoints; ++k) {
+        // Morton bit j belongs to axis j % 3, so axis a has the leading (k - a + 2) / 3 bits of its coordinate set
+        Vec3f p;
+        for (int a = 0; a < 3; ++a) p[a] = 1 - std::ldexp(1.0f, -std::max(0, (k - a + 2) / 3));
+
+        for (int j = 0; j < trianglesPerPoint; ++j) {
+            // p + d, p - d and a third vertex inside their box
+            const int i = k * trianglesPerPoint + j;
+            const Vec3f d{0.05f * testRandom(seed) + 0.01f, 0.05f * testRandom(seed) + 0.01f, 0.05f * testRandom(seed) + 0.01f};
+            const Vec3f e{(2 * testRandom(seed) - 1) * d.x, (2 * testRandom(seed) - 1) * d.y, (2 * testRandom(seed) - 1) * d.z};
+            vertices[3 * i]     = p + d;
+            vertices[3 * i + 1] = p - d;
+            vertices[3 * i + 2] = p + e;
+            for (int v = 0; v < 3; ++v) {
+                normals[3 * i + v] = Vec3f(0, 1, 0);
+                uvs[3 * i + v]     = Vec2f(0, 0);
+            }
+            indices[i] = Vec3i(3 * i, 3 * i + 1, 3 * i + 2);
+        }
+    }
+
+    Scene scene;
+    scene.meshes.push_back(Mesh{numTriangles * 3, numTriangles, indices, vertices, normals, uvs});
+    scene.triangles.reserve(numTriangles);
+    for (int i = 0; i < numTriangles; ++i) scene.triangles.push_back(Triangle{i, 0});
+    return scene;
+}
+
+/**
+ * Ray down the staircase diagonal, through many clusters
+ */
+static Ray makeStaircaseRay(uint32_t &seed) {
+    const Vec3f jitter{testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f};
+    return Ray{Vec3f(3, 3.01f, 2.99f) + jitter * 0.2f, Vec3f(-1, -1, -1) + jitter * 0.05f};
+}
+
+void test_BVH4_deepTreeMatchesBruteForce() {
+    const Scene scene = makeStaircaseScene(63, 100, 131);
+    BVH4 bvh4{.scene = scene, .buildMethod = BVHBuildMethod::LBVH63};
+    BVH4 compressed{.scene = scene, .buildMethod = BVHBuildMethod::LBVH63, .compressNodes = true};
+    bvh4.build();
+    compressed.build();
+    // Deeper than the fixed stack, so traversals take the heap stack
+    assert(bvh4.stackSize > BVH4_STACK_SIZE && compressed.stackSize == bvh4.stackSize);
+
+    uint32_t seed = 137;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = i % 2 == 0 ? makeStaircaseRay(seed) : makeTestRay(seed);
+        const Interval t(0.001f, INF);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, t, tExpected);
+
+        PrimitiveHit hit, compressedHit;
+        assert(bvh4.closestHit(r, t, hit) == expected && (!expected || hit.t == tExpected));
+        assert(compressed.closestHit(r, t, compressedHit) == expected && (!expected || compressedHit.t == tExpected));
+        assert(bvh4.anyHit(r, t) == expected && compressed.anyHit(r, t) == expected);
+    }
+
+    // Coherent packets down the diagonal, and a stream whose single-ray fallback starts below the root
+    for (int k = 0; k < 32; ++k) {
+        const Ray base = makeStaircaseRay(seed);
+        const Interval t(0.001f, INF);
+        RayPacket8 packet;
+        Ray rays[8];
+        for (int i = 0; i < 8; ++i) {
+            const Vec3f jitter{testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f};
+            rays[i] = Ray{base.origin, base.dir + jitter * 0.02f};
+            packet.setRay(i, rays[i], t);
+        }
+
+        PrimitiveHit hits[8];
+        const int mask     = bvh4.closestHit8(packet, hits);
+        const int occluded = bvh4.anyHit8(packet);
+        for (int i = 0; i < 8; ++i) {
+            PrimitiveHit expected;
+            const bool hit = bvh4.closestHit(rays[i], t, expected);
+            assert(((mask >> i) & 1) == hit && ((occluded >> i) & 1) == hit);
+            assert(!hit || (hits[i].t == expected.t && hits[i].primIndex == expected.primIndex));
+        }
+    }
+
+    std::vector<Ray> rays(1024);
+    for (auto &r: rays) r = makeStaircaseRay(seed);
+    std::vector<PrimitiveHit> hits(rays.size());
+    bvh4.closestHitStream(rays, Interval(0.001f, INF), hits);
+    int numHits = 0;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        PrimitiveHit expected;
+        if (bvh4.closestHit(rays[i], Interval(0.001f, INF), expected)) {
+            assert(hits[i].primIndex == expected.primIndex && hits[i].t == expected.t);
+            ++numHits;
+        } else {
+            assert(hits[i].primIndex == -1);
+        }
+    }
+    assert(numHits > 0);
+
+    bvh4.destroy();
+    compressed.destroy();
+    scene.destroy();
+}
+
+void test_BVH2_parallelBuildMatchesSequential() {
+    // Large enough for the parallel binning path to kick in at the top levels
+    const Scene scene = makeRandomScene(80000, 19);
+
+    BVH2 sequential{.maxPrimsInNode = 4, .scene = scene, .numBuildThreads = 1};
+    BVH2 parallel{.maxPrimsInNode = 4, .scene = scene, .numBuildThreads = 4};
+    sequential.build();
+    parallel.build();
+
+    assert(computeSAHCost(sequential.nodes) == computeSAHCost(parallel.nodes));
+    // Partitioning is not stable, so only the leaf order's contents must match
+    std::vector sequentialIndices(sequential.primIndices.begin(), sequential.primIndices.end());
+    std::vector parallelIndices(parallel.primIndices.begin(), parallel.primIndices.end());
+    std::sort(sequentialIndices.begin(), sequentialIndices.end());
+    std::sort(parallelIndices.begin(), parallelIndices.end());
+    assert(sequentialIndices == parallelIndices);
+    for (size_t i = 0; i < sequentialIndices.size(); ++i) assert(sequentialIndices[i] == i);
+
+    sequential.destroy();
+    parallel.destroy();
+    scene.destroy();
+}
+
+void test_Morton_encode() {
+    // x occupies the highest bit of each triple
+    assert(encodeMorton30(Vec3f(0, 0, 0)) == 0);
+    assert(encodeMorton30(Vec3f(1, 1, 1)) == (1u << 30) - 1);
+    assert(encodeMorton30(Vec3f(0.5f, 0, 0)) == 1u << 29);
+    assert(encodeMorton30(Vec3f(0, 0.5f, 0)) == 1u << 28);
+    assert(encodeMorton30(Vec3f(0, 0, 0.5f)) == 1u << 27);
+
+    assert(encodeMorton63(Vec3f(1, 1, 1)) == (1ull << 63) - 1);
+    assert(encodeMorton63(Vec3f(0.5f, 0, 0)) == 1ull << 62);
+}
+
+void test_radixSortPairs() {
+    uint32_t seed = 23;
+    std::vector<uint64_t> keys(50000);
+    std::vector<uint32_t> values(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        // Few distinct keys, so stability matters
+        keys[i]   = static_cast<uint64_t>(testRandom(seed) * 64) << 40;
+        values[i] = static_cast<uint32_t>(i);
+    }
+    const auto original = keys;
+
+    radixSortPairs(keys, values, 63, 4);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(keys[i] == original[values[i]]);
+        if (i > 0) {
+            assert(keys[i - 1] <= keys[i]);
+            assert(keys[i - 1] < keys[i] || values[i - 1] < values[i]);
+        }
+    }
+}
+
+void test_LBVH_traversalMatchesBruteForce() {
+    const Scene scene = makeRandomScene(500, 29);
+
+    for (const auto method: {BVHBuildMethod::LBVH30, BVHBuildMethod::LBVH63}) {
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .buildMethod = method};
+        BVH4 bvh4{.scene = scene, .buildMethod = method};
+        bvh2.build();
+        bvh4.build();
+
+        uint32_t seed = 31;
+        for (int i = 0; i < 256; ++i) {
+            const Ray r = makeTestRay(seed);
+
+            float tExpected;
+            const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+            PrimitiveHit hit2, hit4;
+            assert(bvh2.closestHit(r, Interval(0.001f, INF), hit2) == expected);
+            assert(bvh4.closestHit(r, Interval(0.001f, INF), hit4) == expected);
+            assert(!expected || hit2.t == tExpected);
+            assert(!expected || approxEqual(hit4.t, tExpected, 1e-4f));
+        }
+
+        bvh2.destroy();
+        bvh4.destroy();
+    }
+
+    // Clustered centroids: each cluster shares one Morton code and clusters share long prefixes, which makes LBVH63
+    // trees far deeper than over uniform triangles
+    const Scene clustered = makeStaircaseScene(63, 40, 149);
+    BVH2 deep2{.maxPrimsInNode = 4, .scene = clustered, .buildMethod = BVHBuildMethod::LBVH63};
+    BVH4 deep4{.scene = clustered, .buildMethod = BVHBuildMethod::LBVH63};
+    BVH8 deep8{.scene = clustered, .buildMethod = BVHBuildMethod::LBVH63};
+    deep2.build();
+    deep4.build();
+    deep8.build();
+    // Deeper than every fixed traversal stack
+    assert(deep2.maxDepth > BVH2_STACK_SIZE && deep4.stackSize > BVH4_STACK_SIZE && deep8.stackSize > BVH8::STACK_SIZE);
+
+    uint32_t seed = 151;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = i % 2 == 0 ? makeStaircaseRay(seed) : makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(clustered, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit2, hit4, hit8;
+        assert(deep2.closestHit(r, Interval(0.001f, INF), hit2) == expected && (!expected || hit2.t == tExpected));
+        assert(deep4.closestHit(r, Interval(0.001f, INF), hit4) == expected && (!expected || approxEqual(hit4.t, tExpected, 1e-4f)));
+        assert(deep8.closestHit(r, Interval(0.001f, INF), hit8) == expected && (!expected || approxEqual(hit8.t, tExpected, 1e-4f)));
+        assert(deep4.anyHit(r, Interval(0.001f, INF)) == expected && deep8.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+
+    deep2.destroy();
+    deep4.destroy();
+    deep8.destroy();
+    clustered.destroy();
+    scene.destroy();
+}
+
+void test_LBVH_emptyInput() {
+    // No primitives means no tree, rather than a root that is neither a leaf nor a branch
+    ArenaSet arenas;
+    std::vector<Primitive> orderedPrimitives;
+    int totalNodes = 0, orderedPrimitiveOffset = 0;
+    assert(buildLBVH2Tree(arenas, {}, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, 4) == nullptr);
+    assert(totalNodes == 0 && orderedPrimitiveOffset == 0);
+
+    // BVHs over an empty scene have no nodes and miss every ray
+    const Scene scene;
+    for (const auto method: {BVHBuildMethod::SAH, BVHBuildMethod::LBVH30, BVHBuildMethod::SBVH}) {
+        BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .buildMethod = method};
+        BVH4 bvh4{.scene = scene, .buildMethod = method};
+        BVH8 bvh8{.scene = scene, .buildMethod = method};
+        bvh2.build();
+        bvh4.build();
+        bvh8.build();
+        assert(bvh2.numNodes == 0 && bvh4.numNodes == 0 && bvh8.numNodes == 0);
+
+        uint32_t seed = 131;
+        const Ray r   = makeTestRay(seed);
+        PrimitiveHit hit;
+        int occluderLeaf = -1;
+        assert(!bvh2.closestHit(r, Interval(0.001f, INF), hit) && !bvh2.anyHit(r, Interval(0.001f, INF)));
+        assert(!bvh2.occluded(r, Interval(0.001f, INF), occluderLeaf) && !bvh2.closestHitShortStack(r, Interval(0.001f, INF), hit));
+        assert(!bvh4.closestHit(r, Interval(0.001f, INF), hit) && !bvh4.anyHit(r, Interval(0.001f, INF)));
+        assert(!bvh8.closestHit(r, Interval(0.001f, INF), hit) && !bvh8.anyHit(r, Interval(0.001f, INF)));
+
+        RayPacket4 packet;
+        packet.setRay(0, r, Interval(0.001f, INF));
+        PrimitiveHit hits[4];
+        assert(bvh4.closestHit4(packet, hits) == 0 && bvh4.anyHit4(packet) == 0);
+        assert(bvh2.refit(2).rebuiltSubtrees == 0 && bvh4.refit(2).rebuiltSubtrees == 0);
+
+        bvh2.destroy();
+        bvh4.destroy();
+        bvh8.destroy();
+    }
+}
+
+void test_SBVH_traversalMatchesBruteForce() {
+    // Long triangles overlap a lot, so spatial splits are taken
+    const int numTriangles = 400;
+    const Scene scene      = makeRandomScene(numTriangles, 37, 1, 1.5f);
+
+    const SBVHSettings settings{.overlapThreshold = 1e-5f, .duplicationBudget = 0.5f};
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .buildMethod = BVHBuildMethod::SBVH, .sbvh = settings};
+    BVH4 bvh4{.scene = scene, .buildMethod = BVHBuildMethod::SBVH, .sbvh = settings};
+    bvh2.build();
+    bvh4.build();
+
+    assert(bvh2.primIndices.size() > static_cast<size_t>(numTriangles));
+    assert(bvh2.primIndices.size() <= static_cast<size_t>(numTriangles * 1.5f));
+
+    uint32_t seed = 41;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit2, hit4;
+        assert(bvh2.closestHit(r, Interval(0.001f, INF), hit2) == expected);
+        assert(bvh4.closestHit(r, Interval(0.001f, INF), hit4) == expected);
+        assert(!expected || hit2.t == tExpected);
+        assert(!expected || approxEqual(hit4.t, tExpected, 1e-4f));
+        assert(bvh2.anyHit(r, Interval(0.001f, INF)) == expected);
+        assert(bvh4.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH4_collapseFillsNodes() {
+    const Scene scene = makeRandomScene(2000, 43);
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    // Every node is reachable exactly once, so the array is sized exactly
+    std::vector<int> visits(bvh4.numNodes, 0);
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const LBVH4Node &node = bvh4.nodes[stack.back()];
+        visits[stack.back()]++;
+        stack.pop_back();
+
+        for (int c = 0; c < 4; ++c) {
+            if (node.children[c] != BVH4_INT_MIN && !node.isLeaf(c)) stack.push_back(node.children[c]);
+        }
+    }
+    for (const int v: visits) assert(v == 1);
+    assert(computeBVH4FillRate(bvh4.nodes, bvh4.numNodes) > 0.8f);
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH4_compressedNodesMatchFullPrecision() {
+    const Scene scene = makeRandomScene(2000, 47);
+    BVH4 full{.scene = scene};
+    BVH4 compressed{.scene = scene, .compressNodes = true};
+    full.build();
+    compressed.build();
+
+    assert(compressed.nodes == nullptr && compressed.numNodes == full.numNodes);
+    assert(compressed.nodeBytes() * 2 == full.nodeBytes());
+
+    // Dequantized bounds contain the full-precision bounds
+    for (int n = 0; n < full.numNodes; ++n) {
+        const LBVH4Node &node        = full.nodes[n];
+        const CompressedLBVH4Node &q = compressed.compressedNodes[n];
+        for (int c = 0; c < 4; ++c) {
+            assert(q.children[c] == node.children[c]);
+            if (node.children[c] == BVH4_INT_MIN) continue;
+            for (int a = 0; a < 3; ++a) {
+                assert(q.origin[a] + q.bounds[0][a][c] * q.scale(a) <= node.bbox.pmin[a][c]);
+                assert(q.origin[a] + q.bounds[1][a][c] * q.scale(a) >= node.bbox.pmax[a][c]);
+            }
+        }
+    }
+
+    uint32_t seed = 53;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit;
+        assert(compressed.closestHit(r, Interval(0.001f, INF), hit) == expected);
+        assert(!expected || approxEqual(hit.t, tExpected, 1e-4f));
+        assert(compressed.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+
+    full.destroy();
+    compressed.destroy();
+    scene.destroy();
+}
+
+/**
+ * Builds a BVHN and checks its traversals against brute force
+ * @return the tree's traversal stack size
+ */
+template<int N>
+static int checkBVHNMatchesBruteForce(const Scene &scene, const float minFillRate, const BVHBuildMethod method = BVHBuildMethod::SAH,
+                                      Ray (*makeRay)(uint32_t &) = makeTestRay) {
+    BVHN<N> bvh{.scene = scene, .buildMethod = method};
+    bvh.build();
+    assert(computeBVHNFillRate(bvh.nodes, bvh.numNodes) >= minFillRate);
+
+    uint32_t seed = 53;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        PrimitiveHit hit;
+        assert(bvh.closestHit(r, Interval(0.001f, INF), hit) == expected);
+        assert(!expected || approxEqual(hit.t, tExpected, 1e-4f));
+        assert(bvh.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+
+    bvh.destroy();
+    return bvh.stackSize;
+}
+
+void test_BVHN_traversalMatchesBruteForce() {
+    const Scene scene = makeRandomScene(2000, 51);
+    checkBVHNMatchesBruteForce<4>(scene, 0.8f);
+    checkBVHNMatchesBruteForce<8>(scene, 0.6f);
+    checkBVHNMatchesBruteForce<16>(scene, 0.5f);
+    scene.destroy();
+
+    // A single leaf still gets a root node
+    const Scene tiny = makeRandomScene(3, 52);
+    checkBVHNMatchesBruteForce<8>(tiny, 0);
+    tiny.destroy();
+
+    // Deep LBVH63 trees need more than the fixed stack
+    const Scene staircase = makeStaircaseScene(63, 100, 139);
+    const int stackSize4  = checkBVHNMatchesBruteForce<4>(staircase, 0, BVHBuildMethod::LBVH63, makeStaircaseRay);
+    const int stackSize8  = checkBVHNMatchesBruteForce<8>(staircase, 0, BVHBuildMethod::LBVH63, makeStaircaseRay);
+    const int stackSize16 = checkBVHNMatchesBruteForce<16>(staircase, 0, BVHBuildMethod::LBVH63, makeStaircaseRay);
+    assert(stackSize4 > BVHN<4>::STACK_SIZE && stackSize8 > BVH8::STACK_SIZE && stackSize16 > BVH16::STACK_SIZE);
+    staircase.destroy();
+}
+
+void test_Scene_loadMeshChunksMatchSequential() {
+    const std::string path = (std::filesystem::temp_directory_path() / "simd_bvh_test_import.obj").string();
+    const Scene source     = makeRandomScene(1000, 67);
+
+    // Distinct normals and UVs, so a chunk converting the wrong range shows up
+    const Mesh &sourceMesh = source.meshes[0];
+    for (int i = 0; i < sourceMesh.numVertices; ++i) {
+        sourceMesh.normals[i] = Vec3f(static_cast<float>(i), 1, -static_cast<float>(i));
+        sourceMesh.uvs[i]     = Vec2f(0.25f * static_cast<float>(i), 0.5f);
+    }
+    assert(writeSceneObj(source, path));
+
+    // One chunk on one thread is the sequential path; small chunks split the mesh across threads, and a chunk size
+    // of 0 converts each mesh as one task
+    Scene sequential, chunked, unchunked;
+    sequential.loadMesh(path, {.numThreads = 1, .chunkSize = std::numeric_limits<size_t>::max()});
+    chunked.loadMesh(path, {.numThreads = 4, .chunkSize = 37});
+    unchunked.loadMesh(path, {.numThreads = 4, .chunkSize = 0});
+
+    const auto assertSameImport = [](const Scene &x, const Scene &y) {
+        assert(x.meshes.size() == 1 && y.meshes.size() == 1);
+        assert(x.triangles.size() == y.triangles.size());
+        const Mesh &a = x.meshes[0];
+        const Mesh &b = y.meshes[0];
+        assert(a.numVertices == b.numVertices && a.numIndices == b.numIndices && a.uvs && b.uvs);
+        for (int i = 0; i < a.numVertices; ++i) {
+            assert(a.vertices[i].x == b.vertices[i].x && a.vertices[i].y == b.vertices[i].y && a.vertices[i].z == b.vertices[i].z);
+            assert(a.normals[i].x == b.normals[i].x && a.normals[i].y == b.normals[i].y && a.normals[i].z == b.normals[i].z);
+            assert(a.uvs[i].x == b.uvs[i].x && a.uvs[i].y == b.uvs[i].y);
+        }
+        for (int i = 0; i < a.numIndices; ++i) {
+            for (int j = 0; j < 3; ++j) assert(a.indices[i][j] == b.indices[i][j]);
+        }
+        for (size_t i = 0; i < x.triangles.size(); ++i) {
+            assert(x.triangles[i].index == y.triangles[i].index && x.triangles[i].meshIndex == y.triangles[i].meshIndex);
+        }
+    };
+    assert(sequential.triangles.size() == source.triangles.size());
+    assertSameImport(sequential, chunked);
+    assertSameImport(sequential, unchunked);
+    const Mesh &b = chunked.meshes[0];
+
+    // And both match what was written, with V flipped
+    for (int i = 0; i < sourceMesh.numIndices; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            const Vec3f &v = sourceMesh.vertices[sourceMesh.indices[i][j]];
+            const Vec3f &w = b.vertices[b.indices[i][j]];
+            assert(v.x == w.x && v.y == w.y && v.z == w.z);
+            assert(b.uvs[b.indices[i][j]].y == 1.0f - sourceMesh.uvs[sourceMesh.indices[i][j]].y);
+        }
+    }
+
+    sequential.destroy();
+    chunked.destroy();
+    unchunked.destroy();
+    source.destroy();
+    std::filesystem::remove(path);
+}
+
+void test_BVHCache_roundTrip() {
+    const std::string path = (std::filesystem::temp_directory_path() / "simd_bvh_test.bvhcache").string();
+    const Scene scene      = makeRandomScene(1000, 59);
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .triangleLayout = BVHTriangleLayout::Edges};
+    BVH4 bvh4{.scene = scene, .compressNodes = true};
+    bvh2.build();
+    bvh4.build();
+    const uint64_t key = bvhCacheKey(1234, &bvh2, &bvh4);
+    assert(saveBVHCache(path, key, scene, &bvh2, &bvh4));
+
+    // Build settings are part of the key
+    const BVH2 otherBVH2{.maxPrimsInNode = 2, .scene = scene};
+    assert(bvhCacheKey(1234, &otherBVH2, &bvh4) != key);
+    Scene rejected;
+    assert(!loadBVHCache(path, key + 1, rejected, nullptr, nullptr));
+    assert(rejected.meshes.empty());
+
+    Scene cached;
+    BVH2 cachedBVH2{.maxPrimsInNode = 4, .scene = cached, .triangleLayout = BVHTriangleLayout::Edges};
+    BVH4 cachedBVH4{.scene = cached, .compressNodes = true};
+    assert(loadBVHCache(path, key, cached, &cachedBVH2, &cachedBVH4));
+    assert(cached.triangles.size() == scene.triangles.size() && cachedBVH2.numNodes == bvh2.numNodes && cachedBVH4.numNodes == bvh4.numNodes);
+    // Refit reference costs come from the build, not from the (possibly since moved) vertices at load time
+    assert(cachedBVH2.refitReferenceCosts == bvh2.refitReferenceCosts && cachedBVH4.refitReferenceCosts.empty());
+
+    // Arrays point into the mapping rather than being copied
+    const auto inMapping = [&](const void *p) {
+        return p >= cached.mapping->data && p < cached.mapping->data + cached.mapping->size;
+    };
+    assert(inMapping(cached.meshes[0].vertices) && inMapping(cachedBVH2.nodes) && inMapping(cachedBVH2.primIndices.data()) && inMapping(cachedBVH2.leafTriangles.data()));
+    assert(inMapping(cachedBVH4.compressedNodes) && inMapping(cachedBVH4.triangles4.data()));
+
+    uint32_t seed = 61;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        SurfaceIntersection expected{}, record2{}, record4{};
+        const bool hit = bvh2.closestHit(r, Interval(0.001f, INF), expected);
+        assert(cachedBVH2.closestHit(r, Interval(0.001f, INF), record2) == hit);
+        assert(cachedBVH4.closestHit(r, Interval(0.001f, INF), record4) == hit);
+        assert(!hit || (record2.t == expected.t && approxEqual(record4.t, expected.t, 1e-4f)));
+        assert(cachedBVH4.anyHit(r, Interval(0.001f, INF)) == hit);
+    }
+
+    // A source that cannot be read has no hash, and must not pick up a cache written under any key
+    const std::string missing = (std::filesystem::temp_directory_path() / "simd_bvh_test_missing.obj").string();
+    std::filesystem::remove(missing);
+    assert(!hashFile(missing));
+    assert(saveBVHCache(path, bvhCacheKey(0, &bvh2, nullptr), scene, &bvh2, nullptr));
+    Scene unhashed;
+    BVH2 unhashedBVH2{.maxPrimsInNode = 4, .scene = unhashed, .triangleLayout = BVHTriangleLayout::Edges};
+    assert(!loadSceneCached(missing, path, unhashed, &unhashedBVH2, nullptr));
+    assert(unhashed.meshes.empty() && unhashedBVH2.numNodes == 0);
+
+    // Mapped arrays are released with the mapping, not by destroy()
+    cachedBVH2.destroy();
+    cachedBVH4.destroy();
+    cached.destroy();
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+    std::filesystem::remove(path);
+}
+
+/**
+ * Checks both traversals of a refit BVH against brute force over the scene's current vertices
+ */
+template<typename BVH>
+static void checkRefitMatchesBruteForce(const Scene &scene, const BVH &bvh, uint32_t seed) {
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        float tExpected;
+        const bool expected = bruteForceClosestHit(scene, r, Interval(0.001f, INF), tExpected);
+
+        SurfaceIntersection record{};
+        assert(bvh.closestHit(r, Interval(0.001f, INF), record) == expected);
+        assert(!expected || approxEqual(record.t, tExpected, 1e-4f));
+        assert(bvh.anyHit(r, Interval(0.001f, INF)) == expected);
+    }
+}
+
+void test_BVH_refitMatchesBruteForce() {
+    const Scene scene = makeRandomScene(4000, 73);
+    const Mesh &mesh  = scene.meshes[0];
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .triangleLayout = BVHTriangleLayout::Edges};
+    BVH4 bvh4{.scene = scene};
+    bvh2.build();
+    bvh4.build();
+
+    // A smooth deformation only loosens the tree a little
+    for (int i = 0; i < mesh.numVertices; ++i) {
+        Vec3f &v = mesh.vertices[i];
+        v        = v + Vec3f(0.1f * std::sin(3 * v.y), 0.1f * std::sin(3 * v.z), 0.1f * std::sin(3 * v.x));
+    }
+    const BVHRefitResult smooth2 = bvh2.refit(2);
+    const BVHRefitResult smooth4 = bvh4.refit(2);
+    assert(smooth2.rebuiltSubtrees == 0 && smooth4.rebuiltSubtrees == 0);
+    checkRefitMatchesBruteForce(scene, bvh2, 79);
+    checkRefitMatchesBruteForce(scene, bvh4, 79);
+
+    // Scattering the triangles leaves every refit node spanning much of the scene
+    uint32_t seed = 83;
+    for (int i = 0; i < mesh.numIndices; ++i) {
+        const Vec3f offset{2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1};
+        for (int j = 0; j < 3; ++j) mesh.vertices[3 * i + j] = mesh.vertices[3 * i + j] + offset;
+    }
+    const BVHRefitResult scattered2 = bvh2.refit();
+    const BVHRefitResult scattered4 = bvh4.refit();
+    assert(scattered2.sahGrowth > 2 && scattered4.sahGrowth > 2);
+    checkRefitMatchesBruteForce(scene, bvh2, 89);
+    checkRefitMatchesBruteForce(scene, bvh4, 89);
+
+    const BVHRefitResult rebuilt2 = bvh2.refit(2);
+    const BVHRefitResult rebuilt4 = bvh4.refit(2);
+    assert(rebuilt2.rebuiltSubtrees > 0 && rebuilt2.sahGrowth < scattered2.sahGrowth);
+    assert(rebuilt4.rebuiltSubtrees > 0 && rebuilt4.sahGrowth < scattered4.sahGrowth);
+    assert(bvh2.refitReferenceCosts.size() == static_cast<size_t>(bvh2.numNodes) && bvh4.refitReferenceCosts.size() == static_cast<size_t>(bvh4.numNodes));
+    checkRefitMatchesBruteForce(scene, bvh2, 97);
+    checkRefitMatchesBruteForce(scene, bvh4, 97);
+
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH_refitAfterRebuild() {
+    const Scene scene = makeRandomScene(4000, 101);
+    const Mesh &mesh  = scene.meshes[0];
+
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene, .nodeLayout = BVHNodeLayout::Treelets};
+    BVH4 bvh4{.scene = scene};
+    bvh2.build();
+    bvh4.build();
+    assert(bvh2.refitReferenceCosts.size() == static_cast<size_t>(bvh2.numNodes) && bvh4.refitReferenceCosts.size() == static_cast<size_t>(bvh4.numNodes));
+
+    // Moving the vertices before the first refit still measures growth from the build
+    uint32_t seed = 103;
+    const auto scatter = [&] {
+        for (int i = 0; i < mesh.numIndices; ++i) {
+            const Vec3f offset{2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1};
+            for (int j = 0; j < 3; ++j) mesh.vertices[3 * i + j] = mesh.vertices[3 * i + j] + offset;
+        }
+    };
+    scatter();
+    assert(bvh2.refit().sahGrowth > 2 && bvh4.refit().sahGrowth > 2);
+
+    // A fresh build over the moved vertices is the new reference, not the old tree's costs
+    bvh2.destroy();
+    bvh4.destroy();
+    assert(bvh2.refitReferenceCosts.empty() && bvh4.refitReferenceCosts.empty());
+    bvh2.build();
+    bvh4.build();
+    const BVHRefitResult rebuilt2 = bvh2.refit(2);
+    const BVHRefitResult rebuilt4 = bvh4.refit(2);
+    assert(approxEqual(rebuilt2.sahGrowth, 1) && rebuilt2.rebuiltSubtrees == 0);
+    assert(approxEqual(rebuilt4.sahGrowth, 1) && rebuilt4.rebuiltSubtrees == 0);
+    checkRefitMatchesBruteForce(scene, bvh2, 107);
+    checkRefitMatchesBruteForce(scene, bvh4, 107);
+
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH_treeletLayoutMatchesDepthFirst() {
+    const Scene scene = makeRandomScene(8000, 127);
+    const Mesh &mesh  = scene.meshes[0];
+
+    BVH2 depthFirst2{.maxPrimsInNode = 1, .scene = scene};
+    BVH2 treelets2{.maxPrimsInNode = 1, .scene = scene, .nodeLayout = BVHNodeLayout::Treelets};
+    BVH4 depthFirst4{.scene = scene};
+    BVH4 treelets4{.scene = scene, .nodeLayout = BVHNodeLayout::Treelets};
+    depthFirst2.build();
+    treelets2.build();
+    depthFirst4.build();
+    treelets4.build();
+    assert(treelets2.numNodes > static_cast<int>(BVH_TREELET_BYTES / sizeof(LBVH2Node)) && treelets4.numNodes > static_cast<int>(BVH_TREELET_BYTES / sizeof(LBVH4Node)));
+    assert(computeSAHCost(treelets2.nodes) == computeSAHCost(depthFirst2.nodes) && computeSAHCost(treelets4.nodes) == computeSAHCost(depthFirst4.nodes));
+    // Treelets end on page boundaries counted from the start of the array, which is itself page-aligned
+    assert(reinterpret_cast<uintptr_t>(treelets2.nodes) % BVH_TREELET_BYTES == 0 && reinterpret_cast<uintptr_t>(treelets4.nodes) % BVH_TREELET_BYTES == 0);
+
+    // Treelets reorder the nodes, and depth-first order is recovered exactly
+    const auto sameBVH2Nodes = [](const BVH2 &a, const BVH2 &b) {
+        for (int i = 0; i < a.numNodes; ++i) {
+            if (a.nodes[i].secondChildOffset != b.nodes[i].secondChildOffset || a.nodes[i].numPrimitives != b.nodes[i].numPrimitives) return false;
+        }
+        return true;
+    };
+    const auto sameBVH4Nodes = [](const BVH4 &a, const BVH4 &b) {
+        for (int i = 0; i < a.numNodes; ++i) {
+            if (!std::equal(a.nodes[i].children, a.nodes[i].children + 4, b.nodes[i].children)) return false;
+        }
+        return true;
+    };
+    assert(!sameBVH2Nodes(treelets2, depthFirst2) && !sameBVH4Nodes(treelets4, depthFirst4));
+    layoutLBVH2Nodes(treelets2.nodes, treelets2.numNodes, BVHNodeLayout::DepthFirst);
+    layoutLBVH4Nodes(treelets4.nodes, treelets4.numNodes, BVHNodeLayout::DepthFirst);
+    assert(sameBVH2Nodes(treelets2, depthFirst2) && sameBVH4Nodes(treelets4, depthFirst4));
+    layoutLBVH2Nodes(treelets2.nodes, treelets2.numNodes, BVHNodeLayout::Treelets);
+    layoutLBVH4Nodes(treelets4.nodes, treelets4.numNodes, BVHNodeLayout::Treelets);
+    treelets2.linkParents();
+
+    const auto checkSameHits = [&](const uint32_t seed) {
+        uint32_t raySeed = seed;
+        for (int i = 0; i < 256; ++i) {
+            const Ray r = makeTestRay(raySeed);
+            const Interval t(0.001f, INF);
+
+            PrimitiveHit expected2, expected4, hit;
+            const bool found2 = depthFirst2.closestHit(r, t, expected2);
+            assert(treelets2.closestHit(r, t, hit) == found2 && (!found2 || (hit.t == expected2.t && hit.primIndex == expected2.primIndex)));
+            assert(treelets2.closestHitShortStack(r, t, hit) == found2 && (!found2 || hit.primIndex == expected2.primIndex));
+            assert(treelets2.anyHit(r, t) == found2);
+
+            const bool found4 = depthFirst4.closestHit(r, t, expected4);
+            assert(treelets4.closestHit(r, t, hit) == found4 && (!found4 || (hit.t == expected4.t && hit.primIndex == expected4.primIndex)));
+            assert(treelets4.anyHit(r, t) == found4);
+        }
+    };
+    checkSameHits(131);
+
+    // Refits go through depth-first order and come back as treelets
+    for (int i = 0; i < mesh.numVertices; ++i) {
+        Vec3f &v = mesh.vertices[i];
+        v        = v + Vec3f(0.05f * std::sin(5 * v.z), 0, 0.05f * std::sin(5 * v.x));
+    }
+    depthFirst2.refit();
+    treelets2.refit();
+    depthFirst4.refit();
+    treelets4.refit();
+    checkSameHits(137);
+
+    depthFirst2.destroy();
+    treelets2.destroy();
+    depthFirst4.destroy();
+    treelets4.destroy();
+    scene.destroy();
+}
+
+/**
+ * Random rotation, non-uniform scale and translation keeping an instance of a test mesh near the [-1, 1] cube
+ */
+static AffineTransform makeTestInstanceTransform(uint32_t &seed) {
+    const Vec3f scale{0.3f + 0.4f * testRandom(seed), 0.3f + 0.4f * testRandom(seed), 0.3f + 0.4f * testRandom(seed)};
+    const Vec3f axis = jtx::normalize(Vec3f(testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f));
+    const Vec3f translation{2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1};
+    return AffineTransform::fromScaleRotateTranslate(scale, axis, 6.28f * testRandom(seed), translation);
+}
+
+void test_TLAS_matchesFlattenedScene() {
+    // Three meshes placed 40 times between them
+    Scene scene;
+    for (uint32_t m = 0; m < 3; ++m) {
+        const Scene part = makeRandomScene(60, 73 + m);
+        scene.meshes.push_back(part.meshes[0]);
+    }
+    uint32_t seed = 79;
+    std::vector<Instance> instances;
+    for (int i = 0; i < 40; ++i) instances.push_back(Instance{i % 3, makeTestInstanceTransform(seed)});
+
+    const AffineTransform moved = makeTestInstanceTransform(seed);
+    const AffineTransform back  = moved.inverse();
+    const Vec3f p(0.3f, -0.7f, 0.2f);
+    assert(approxEqual((back.point(moved.point(p)) - p).len(), 0, 1e-5f));
+
+    TLAS<BVH4> tlas4{.instances = instances, .scene = scene};
+    TLAS<BVH2> tlas2{.instances = instances, .scene = scene};
+    tlas4.build();
+    tlas2.build();
+    assert(tlas4.blases.size() == 3);
+
+    const Scene flat = flattenInstances(scene, instances);
+    BVH4 flatBVH{.scene = flat};
+    flatBVH.build();
+
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        SurfaceIntersection expected{}, record4{}, record2{};
+        const bool hit = flatBVH.closestHit(r, Interval(0.001f, INF), expected);
+        assert(tlas4.closestHit(r, Interval(0.001f, INF), record4) == hit);
+        assert(tlas2.closestHit(r, Interval(0.001f, INF), record2) == hit);
+        assert(tlas4.anyHit(r, Interval(0.001f, INF)) == hit);
+        if (hit) {
+            // Object-space rays round differently from baked vertices
+            assert(approxEqual(record4.t, expected.t, 1e-4f) && approxEqual(record2.t, expected.t, 1e-4f));
+            assert(approxEqual(record4.normal.dot(expected.normal), 1, 1e-4f));
+            assert(record4.frontFace == expected.frontFace);
+        }
+    }
+
+    // Moving every instance only needs a new top level
+    for (auto &instance: tlas4.instances) instance.objectToWorld.m[1][3] += 5;
+    tlas4.buildTopLevel();
+    assert(!tlas4.anyHit(Ray{Vec3f(0, -10, 0), Vec3f(0, 1, 0)}, Interval(0, 7)));
+    assert(tlas4.anyHit(Ray{Vec3f(0, -10, 0), Vec3f(0, 1, 0)}, Interval(0, INF)) == flatBVH.anyHit(Ray{Vec3f(0, -15, 0), Vec3f(0, 1, 0)}, Interval(0, INF)));
+
+    // A second full build replaces the BLASes (the old ones are freed, which ASan checks)
+    tlas2.build();
+    assert(tlas2.blases.size() == 3);
+    for (int i = 0; i < 64; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        SurfaceIntersection expected{}, record{};
+        const bool hit = flatBVH.closestHit(r, Interval(0.001f, INF), expected);
+        assert(tlas2.closestHit(r, Interval(0.001f, INF), record) == hit);
+        assert(!hit || approxEqual(record.t, expected.t, 1e-4f));
+    }
+
+    // A hand-built top level deeper than the traversal stack: node 2k has leaf 2k + 1 (instance k) and the rest of the chain
+    constexpr int CHAIN_LENGTH = 100;
+    std::vector<Instance> chainInstances;
+    for (int i = 0; i < CHAIN_LENGTH; ++i) chainInstances.push_back(Instance{i % 3, makeTestInstanceTransform(seed)});
+    TLAS<BVH2> chain{.instances = chainInstances, .scene = scene};
+    chain.build();
+
+    const Scene chainFlat = flattenInstances(scene, chainInstances);
+    freeBVHNodes(chain.nodes);
+    chain.nodes    = allocateBVHNodes<LBVH2Node>(2 * CHAIN_LENGTH - 1);
+    chain.numNodes = 2 * CHAIN_LENGTH - 1;
+    for (int k = CHAIN_LENGTH - 1; k >= 0; --k) {
+        chain.instanceIndices[k] = k;
+        LBVH2Node &leaf          = chain.nodes[k == CHAIN_LENGTH - 1 ? 2 * k : 2 * k + 1];
+        leaf.bbox                = AABB();
+        for (int i = 0; i < chainFlat.meshes[k].numIndices; ++i) leaf.bbox.expand(chainFlat.meshes[k].tBounds(i));
+        leaf.primitivesOffset = k;
+        leaf.numPrimitives    = 1;
+        if (k == CHAIN_LENGTH - 1) continue;
+
+        LBVH2Node &node        = chain.nodes[2 * k];
+        node.bbox              = AABB(chain.nodes[2 * k + 1].bbox, chain.nodes[2 * k + 2].bbox);
+        node.secondChildOffset = 2 * k + 2;
+        node.numPrimitives     = 0;
+        node.axis              = k % 3;
+    }
+    chain.computeMaxDepth();
+    assert(chain.maxDepth == CHAIN_LENGTH - 1 && chain.maxDepth > BVH2_STACK_SIZE);
+
+    // closestHit and anyHit switch to a heap stack rather than overflowing
+    BVH4 chainFlatBVH{.scene = chainFlat};
+    chainFlatBVH.build();
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+
+        SurfaceIntersection expected{}, record{};
+        const bool hit = chainFlatBVH.closestHit(r, Interval(0.001f, INF), expected);
+        assert(chain.closestHit(r, Interval(0.001f, INF), record) == hit);
+        assert(!hit || approxEqual(record.t, expected.t, 1e-4f));
+        assert(chain.anyHit(r, Interval(0.001f, INF)) == hit);
+    }
+
+    // No instances, over the same meshes or an empty scene
+    TLAS<BVH4> noInstances{.scene = scene};
+    noInstances.build();
+    const Scene emptyScene;
+    TLAS<BVH2> empty{.scene = emptyScene};
+    empty.build();
+    for (int i = 0; i < 16; ++i) {
+        const Ray r = makeTestRay(seed);
+        SurfaceIntersection record{};
+        assert(noInstances.numNodes == 0 && !noInstances.closestHit(r, Interval(0.001f, INF), record) && !noInstances.anyHit(r, Interval(0.001f, INF)));
+        assert(empty.numNodes == 0 && !empty.closestHit(r, Interval(0.001f, INF), record) && !empty.anyHit(r, Interval(0.001f, INF)));
+    }
+
+    // Emptying a built top level frees its nodes
+    tlas4.instances.clear();
+    tlas4.buildTopLevel();
+    assert(tlas4.numNodes == 0 && !tlas4.anyHit(Ray{Vec3f(0, -10, 0), Vec3f(0, 1, 0)}, Interval(0, INF)));
+
+    noInstances.destroy();
+    empty.destroy();
+    chain.destroy();
+    chainFlatBVH.destroy();
+    chainFlat.destroy();
+    tlas4.destroy();
+    tlas2.destroy();
+    flatBVH.destroy();
+    flat.destroy();
+    scene.destroy();
+}
+
+void test_BVH4_packetMatchesSingleRay() {
+    const Scene scene = makeRandomScene(500, 37);
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    uint32_t seed = 41;
+    for (int k = 0; k < 64; ++k) {
+        // Coherent packets share an origin and jitter the direction; every fourth is random
+        const bool coherent = k % 4 != 0;
+        const Ray base      = makeTestRay(seed);
+
+        RayPacket4 packet4;
+        RayPacket8 packet8;
+        Ray rays[8];
+        for (int i = 0; i < 8; ++i) {
+            const Vec3f jitter{testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f};
+            rays[i] = coherent ? Ray{base.origin, base.dir + jitter * 0.05f} : makeTestRay(seed);
+
+            const Interval t(0.001f, k % 3 == 0 ? 2.0f : INF);
+            // Leave a lane empty now and then
+            if (i == 5 && k % 5 == 0) continue;
+            if (i < 4) packet4.setRay(i, rays[i], t);
+            packet8.setRay(i, rays[i], t);
+        }
+
+        PrimitiveHit hits4[4], hits8[8];
+        const int mask4     = bvh4.closestHit4(packet4, hits4);
+        const int mask8     = bvh4.closestHit8(packet8, hits8);
+        const int occluded4 = bvh4.anyHit4(packet4);
+        const int occluded8 = bvh4.anyHit8(packet8);
+
+        for (int i = 0; i < 8; ++i) {
+            if (!(packet8.validMask & (1 << i))) {
+                assert(!(mask8 & (1 << i)) && !(occluded8 & (1 << i)));
+                continue;
+            }
+
+            const Interval t(packet8.tMin[i], packet8.tMax[i]);
+            PrimitiveHit expected;
+            const bool hit = bvh4.closestHit(rays[i], t, expected);
+
+            assert(((mask8 >> i) & 1) == hit);
+            assert(((occluded8 >> i) & 1) == bvh4.anyHit(rays[i], t));
+            assert(!hit || (hits8[i].t == expected.t && hits8[i].primIndex == expected.primIndex));
+            if (i < 4) {
+                assert(((mask4 >> i) & 1) == hit);
+                assert(((occluded4 >> i) & 1) == hit);
+                assert(!hit || (hits4[i].t == expected.t && hits4[i].primIndex == expected.primIndex));
+            }
+        }
+    }
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_BVH4_streamMatchesSingleRay() {
+    const Scene scene = makeRandomScene(2000, 43);
+    BVH4 bvh4{.scene = scene};
+    bvh4.build();
+
+    uint32_t seed = 47;
+    std::vector<Ray> rays(4096);
+    for (auto &r: rays) r = makeTestRay(seed);
+
+    const Interval t(0.001f, INF);
+    std::vector<PrimitiveHit> hits(rays.size());
+    bvh4.closestHitStream(rays, t, hits);
+
+    for (size_t i = 0; i < rays.size(); ++i) {
+        PrimitiveHit expected;
+        if (bvh4.closestHit(rays[i], t, expected)) {
+            assert(hits[i].primIndex == expected.primIndex && hits[i].t == expected.t);
+        } else {
+            assert(hits[i].primIndex == -1);
+        }
+    }
+
+    bvh4.destroy();
+    scene.destroy();
+}
+
+void test_parallelForStealing_visitsEveryTaskOnce() {
+    constexpr int NUM_TASKS = 1000;
+    std::vector<std::atomic<int>> visits(NUM_TASKS);
+
+    // Uneven task costs so threads run out of their own range and steal
+    parallelForStealing(NUM_TASKS, 4, [&](const int task, const int thread) {
+        assert(thread >= 0 && thread < 4);
+        if (task < NUM_TASKS / 4) std::this_thread::sleep_for(std::chrono::microseconds(50));
+        visits[task]++;
+    });
+
+    for (const auto &v: visits) assert(v == 1);
+}
+
+void test_traversalStats_matchUninstrumented() {
+    const Scene scene = makeRandomScene(500, 53);
+    BVH2 bvh2{.maxPrimsInNode = 4, .scene = scene};
+    BVH4 bvh4{.scene = scene};
+    bvh2.build();
+    bvh4.build();
+
+    uint32_t seed = 59;
+    for (int i = 0; i < 256; ++i) {
+        const Ray r = makeTestRay(seed);
+        const Interval t(0.001f, INF);
+
+        TraversalStats stats2, stats4, anyStats4;
+        PrimitiveHit hit2, hit4, plain;
+        assert(bvh2.closestHit(r, t, hit2, stats2) == bvh2.closestHit(r, t, plain));
+        assert(bvh4.closestHit(r, t, hit4, stats4) == bvh4.closestHit(r, t, plain));
+        assert(bvh4.anyHit(r, t, anyStats4) == bvh4.anyHit(r, t));
+
+        // Every BVH2 node popped is box tested; BVH4 tests 4 boxes per interior node
+        assert(stats2.boxesTested >= stats2.nodesVisited + stats2.leavesVisited);
+        assert(stats4.boxesTested == 4 * stats4.nodesVisited);
+        assert(stats4.trianglesTested % 4 == 0 && stats4.trianglesTested >= 4 * stats4.leavesVisited);
+        assert(stats4.nodesVisited >= 1 && stats4.maxStackDepth < 64);
+        // Any-hit never does more work than closest-hit
+        assert(anyStats4.nodesVisited <= stats4.nodesVisited);
+    }
+
+    TraversalStatsAccumulator accumulator;
+    TraversalStats stats;
+    stats.nodesVisited = 5;
+    accumulator.add(stats);
+    assert(accumulator.numRays == 1 && accumulator.nodesVisited.buckets[3] == 1 && accumulator.boxesTested.buckets[0] == 1);
+
+    bvh2.destroy();
+    bvh4.destroy();
+    scene.destroy();
+}
+
 const TestFnPtr TEST_FN_PTRS[] = {
     test_BVH4Node_isLeaf,
     test_BVH4Node_isInnerNode,
     test_BVH4Node_getNumPrimitives,
     test_BVH4Node_getPrimitiveIndices,
+    test_AABB4_hit4_matchesScalar,
+    test_Triangle4_hit4_matchesScalar,
+    test_BVH4_traversalMatchesBruteForce,
+    test_BVH2_traversalMatchesBruteForce,
+    test_BVH2_leafTriangleLayoutsMatchIndexed,
+    test_BVH2_occludedMatchesAnyHit,
+    test_BVH2_shortStackMatchesFullStack,
+    test_BVH4_deepTreeMatchesBruteForce,
+    test_BVH2_parallelBuildMatchesSequential,
+    test_Morton_encode,
+    test_radixSortPairs,
+    test_LBVH_traversalMatchesBruteForce,
+    test_LBVH_emptyInput,
+    test_SBVH_traversalMatchesBruteForce,
+    test_BVH4_collapseFillsNodes,
+    test_BVH4_compressedNodesMatchFullPrecision,
+    test_BVHN_traversalMatchesBruteForce,
+    test_Scene_loadMeshChunksMatchSequential,
+    test_BVHCache_roundTrip,
+    test_BVH_refitMatchesBruteForce,
+    test_BVH_refitAfterRebuild,
+    test_BVH_treeletLayoutMatchesDepthFirst,
+    test_TLAS_matchesFlattenedScene,
+    test_BVH4_packetMatchesSingleRay,
+    test_BVH4_streamMatchesSingleRay,
+    test_parallelForStealing_visitsEveryTaskOnce,
+    test_traversalStats_matchUninstrumented,
+    test_simd_arithmetic,
+    test_simd_rounding,
+    test_simd_minMax,
+    test_simd_horizontal,
+    test_simd_compare,
+    test_simd_bitwiseSelect,
+    test_simd_loadBytes,
+    test_simd_gather,
+#ifdef USE_AVX2
+    test_simd_float8,
+#endif
 };
 
 const std::size_t TEST_FN_PTRS_SIZE = sizeof(TEST_FN_PTRS) / sizeof(TestFnPtr);
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "testscene.hpp"
+
+#include <fstream>
+#include <limits>
+
+Scene makeRandomScene(const int numTriangles, uint32_t seed, const float extent, const float size) {
+    Scene scene;
+
+    const auto indices  = new Vec3i[numTriangles];
+    const auto vertices = new Vec3f[numTriangles * 3];
+    const auto normals  = new Vec3f[numTriangles * 3];
+    const auto uvs      = new Vec2f[numTriangles * 3];
+
+    for (int i = 0; i < numTriangles; ++i) {
+        const Vec3f c = Vec3f(2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1, 2 * testRandom(seed) - 1) * extent;
+        for (int j = 0; j < 3; ++j) {
+            const Vec3f o{testRandom(seed) - 0.5f, testRandom(seed) - 0.5f, testRandom(seed) - 0.5f};
+            vertices[3 * i + j] = c + o * size;
+            normals[3 * i + j]  = Vec3f(0, 1, 0);
+            uvs[3 * i + j]      = Vec2f(0, 0);
+        }
+        indices[i] = Vec3i(3 * i, 3 * i + 1, 3 * i + 2);
+    }
+
+    scene.meshes.push_back(Mesh{numTriangles * 3, numTriangles, indices, vertices, normals, uvs});
+    scene.triangles.reserve(numTriangles);
+    for (int i = 0; i < numTriangles; ++i) {
+        scene.triangles.push_back(Triangle{i, 0});
+    }
+    return scene;
+}
+
+bool writeSceneObj(const Scene &scene, const std::string &path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    // Enough digits for every float to read back exactly
+    out.precision(std::numeric_limits<float>::max_digits10);
+
+    // OBJ indices are 1-based and global across the file
+    int firstVertex = 1;
+    for (const Mesh &mesh: scene.meshes) {
+        for (int i = 0; i < mesh.numVertices; ++i) {
+            const Vec3f &v = mesh.vertices[i];
+            const Vec3f &n = mesh.normals[i];
+            const Vec2f uv = mesh.uvs ? mesh.uvs[i] : Vec2f(0, 0);
+            out << "v " << v.x << ' ' << v.y << ' ' << v.z << '\n';
+            out << "vn " << n.x << ' ' << n.y << ' ' << n.z << '\n';
+            out << "vt " << uv.x << ' ' << uv.y << '\n';
+        }
+        for (int i = 0; i < mesh.numIndices; ++i) {
+            out << 'f';
+            for (int j = 0; j < 3; ++j) {
+                const int index = firstVertex + mesh.indices[i][j];
+                out << ' ' << index << '/' << index << '/' << index;
+            }
+            out << '\n';
+        }
+        firstVertex += mesh.numVertices;
+    }
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "scene.hpp"
+
+#include <cstdint>
+#include <string>
+
+// Random scenes shared by the tests and benchmarks
+
+// Deterministic LCG so tests and benchmarks don't depend on <random> implementations
+inline float testRandom(uint32_t &state) {
+    state = state * 1664525u + 1013904223u;
+    return static_cast<float>(state >> 8) / static_cast<float>(1 << 24);
+}
+
+/**
+ * Builds a scene with a single mesh of randomly placed triangles, centered in [-extent, extent]^3
+ * @param size vertex spread around each triangle's center; large values give long, overlapping triangles
+ */
+Scene makeRandomScene(int numTriangles, uint32_t seed, float extent = 1, float size = 0.2f);
+
+/**
+ * Writes every mesh of a scene to one Wavefront OBJ file with positions, normals and UVs, so the import path can
+ * be run without an asset
+ * @return false if the file cannot be written
+ */
+bool writeSceneObj(const Scene &scene, const std::string &path);
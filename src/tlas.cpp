@@ -0,0 +1,250 @@
+#include "tlas.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <type_traits>
+
+static size_t blasBytes(const BVH2 &bvh2) {
+    return bvh2.numNodes * sizeof(LBVH2Node) + bvh2.primIndices.size_bytes() + bvh2.leafTriangles.size_bytes();
+}
+
+static size_t blasBytes(const BVH4 &bvh4) {
+    return bvh4.nodeBytes() + bvh4.triangles4.size_bytes();
+}
+
+template<typename BVH>
+void TLAS<BVH>::build() {
+    // BLASes keep a reference to their scene, so the scenes must not move once built
+    // A rebuild replaces the BLASes, so the previous ones are freed first
+    for (auto &blas: blases) blas.destroy();
+    meshScenes.clear();
+    meshScenes.reserve(scene.meshes.size());
+    blases.clear();
+    blases.reserve(scene.meshes.size());
+    meshBounds.resize(scene.meshes.size());
+
+    for (const Mesh &mesh: scene.meshes) {
+        Scene &meshScene = meshScenes.emplace_back();
+        meshScene.meshes.push_back(mesh);
+        meshScene.triangles.resize(mesh.numIndices);
+        for (int i = 0; i < mesh.numIndices; ++i) meshScene.triangles[i] = Triangle{i, 0};
+
+        if constexpr (std::is_same_v<BVH, BVH2>) {
+            blases.push_back(BVH2{.maxPrimsInNode = 4, .scene = meshScene, .numBuildThreads = 1});
+        } else {
+            blases.push_back(BVH{.scene = meshScene, .numBuildThreads = 1});
+        }
+    }
+
+    // Instanced scenes tend to have many small meshes, so BLASes are built side by side rather than one at a time
+    parallelForStealing(static_cast<int>(blases.size()), numBuildThreads, [&](const int m, int) {
+        const Mesh &mesh = scene.meshes[m];
+        meshBounds[m]    = AABB();
+        for (int i = 0; i < mesh.numIndices; ++i) meshBounds[m].expand(mesh.tBounds(i));
+        blases[m].build();
+    });
+
+    buildTopLevel();
+}
+
+template<typename BVH>
+void TLAS<BVH>::buildTopLevel() {
+    freeBVHNodes(nodes);
+    if (instances.empty()) {
+        // Nothing to build a tree over; traversals return before looking at the node array
+        nodes    = nullptr;
+        numNodes = 0;
+        maxDepth = 0;
+        worldToObject.clear();
+        instanceIndices.clear();
+        return;
+    }
+
+    std::vector<Primitive> bvhPrimitives(instances.size());
+    worldToObject.resize(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const Instance &instance = instances[i];
+        const AABB &bounds       = meshBounds[instance.meshIndex];
+
+        AABB worldBounds;
+        for (int corner = 0; corner < 8; ++corner) {
+            const Vec3f p(corner & 1 ? bounds.pmax.x : bounds.pmin.x, corner & 2 ? bounds.pmax.y : bounds.pmin.y, corner & 4 ? bounds.pmax.z : bounds.pmin.z);
+            worldBounds.expand(instance.objectToWorld.point(p));
+        }
+        bvhPrimitives[i] = Primitive{Primitive::INSTANCE, static_cast<uint32_t>(i), worldBounds};
+        worldToObject[i] = instance.objectToWorld.inverse();
+    }
+
+    std::vector<Primitive> orderedPrimitives(bvhPrimitives.size());
+    int totalNodes             = 0;
+    int orderedPrimitiveOffset = 0;
+    ArenaSet arenas;
+    const BVH2Node *root = buildBVH2Tree(arenas, bvhPrimitives, &totalNodes, &orderedPrimitiveOffset, orderedPrimitives, MAX_INSTANCES_IN_NODE, numBuildThreads);
+
+    instanceIndices.resize(orderedPrimitives.size());
+    for (size_t i = 0; i < orderedPrimitives.size(); ++i) instanceIndices[i] = orderedPrimitives[i].index;
+
+    nodes      = allocateBVHNodes<LBVH2Node>(totalNodes);
+    numNodes   = totalNodes;
+    int offset = 0;
+    flattenBVH2toLBVH2(root, nodes, &offset);
+    computeMaxDepth();
+}
+
+template<typename BVH>
+void TLAS<BVH>::computeMaxDepth() {
+    // Children come after their parent in depth-first order, so one forward pass sees every parent's depth first
+    maxDepth = 0;
+    std::vector<int> depths(numNodes, 0);
+    for (int i = 0; i < numNodes; ++i) {
+        const LBVH2Node &node = nodes[i];
+        if (node.numPrimitives > 0) {
+            maxDepth = std::max(maxDepth, depths[i]);
+            continue;
+        }
+        depths[i + 1]                  = depths[i] + 1;
+        depths[node.secondChildOffset] = depths[i] + 1;
+    }
+}
+
+template<typename BVH>
+size_t TLAS<BVH>::bytes() const {
+    size_t total = numNodes * sizeof(LBVH2Node) + instanceIndices.size() * sizeof(uint32_t) + instances.size() * sizeof(Instance) +
+                   worldToObject.size() * sizeof(AffineTransform);
+    for (size_t m = 0; m < blases.size(); ++m) total += blasBytes(blases[m]) + meshScenes[m].triangles.size() * sizeof(Triangle);
+    return total;
+}
+
+template<typename BVH>
+bool TLAS<BVH>::closestHit(const Ray &r, const Interval t, SurfaceIntersection &record) const {
+    InstanceHit hit;
+    if (!closestHit(r, t, hit)) return false;
+    finalizeIntersection(r, hit, record);
+    return true;
+}
+
+/**
+ * Front-to-back traversal of the top level
+ * @param stack at least maxDepth entries
+ * @param visitLeaf tests a leaf whose box the ray hits, shrinking t for closest hits; returns true to end the traversal
+ */
+template<typename VisitLeaf>
+static void traverseTopLevel(const LBVH2Node *nodes, const Ray &r, Interval &t, int *stack, VisitLeaf &&visitLeaf) {
+    const auto invDir     = 1 / r.dir;
+    const int dirIsNeg[3] = {static_cast<int>(invDir.x < 0), static_cast<int>(invDir.y < 0), static_cast<int>(invDir.z < 0)};
+
+    int toVisitOffset    = 0;
+    int currentNodeIndex = 0;
+
+    while (true) {
+        const LBVH2Node *node = &nodes[currentNodeIndex];
+        if (node->bbox.hit(r.origin, r.dir, t)) {
+            if (node->numPrimitives > 0) {
+                if (visitLeaf(*node)) return;
+                if (toVisitOffset == 0) return;
+                currentNodeIndex = stack[--toVisitOffset];
+            } else {
+                if (dirIsNeg[node->axis]) {
+                    stack[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex       = node->secondChildOffset;
+                } else {
+                    stack[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex       = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) return;
+            currentNodeIndex = stack[--toVisitOffset];
+        }
+    }
+}
+
+/**
+ * Runs traverseTopLevel with a BVH2_STACK_SIZE-entry stack, or a heap stack when the top level is deeper than that
+ * (thousands of single-instance leaves can get there)
+ */
+template<typename VisitLeaf>
+static void traverseTopLevel(const LBVH2Node *nodes, const int maxDepth, const Ray &r, Interval &t, VisitLeaf &&visitLeaf) {
+    if (maxDepth > BVH2_STACK_SIZE) {
+        std::vector<int> stack(maxDepth);
+        traverseTopLevel(nodes, r, t, stack.data(), visitLeaf);
+    } else {
+        int stack[BVH2_STACK_SIZE];
+        traverseTopLevel(nodes, r, t, stack, visitLeaf);
+    }
+}
+
+template<typename BVH>
+bool TLAS<BVH>::closestHit(const Ray &r, Interval t, InstanceHit &hit) const {
+    if (numNodes == 0) return false;
+    bool hitAnything = false;
+    traverseTopLevel(nodes, maxDepth, r, t, [&](const LBVH2Node &leaf) {
+        for (int i = 0; i < leaf.numPrimitives; ++i) {
+            const uint32_t instance = instanceIndices[leaf.primitivesOffset + i];
+            if (blases[instances[instance].meshIndex].closestHit(objectRay(r, instance), t, hit)) {
+                hitAnything  = true;
+                t.max        = hit.t;
+                hit.instance = static_cast<int>(instance);
+            }
+        }
+        return false;
+    });
+    return hitAnything;
+}
+
+template<typename BVH>
+bool TLAS<BVH>::anyHit(const Ray &r, Interval t) const {
+    if (numNodes == 0) return false;
+    bool hitAnything = false;
+    traverseTopLevel(nodes, maxDepth, r, t, [&](const LBVH2Node &leaf) {
+        for (int i = 0; i < leaf.numPrimitives; ++i) {
+            const uint32_t instance = instanceIndices[leaf.primitivesOffset + i];
+            if (blases[instances[instance].meshIndex].anyHit(objectRay(r, instance), t)) {
+                hitAnything = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return hitAnything;
+}
+
+template<typename BVH>
+void TLAS<BVH>::finalizeIntersection(const Ray &r, const InstanceHit &hit, SurfaceIntersection &record) const {
+    const AffineTransform &toObject = worldToObject[hit.instance];
+    const Ray rObject               = objectRay(r, hit.instance);
+    meshScenes[instances[hit.instance].meshIndex].finalizeIntersection(rObject, hit, record);
+
+    // Normals map by the inverse transpose of object-to-world, which is the transpose of world-to-object
+    const Vec3f objectNormal = record.frontFace ? record.normal : -record.normal;
+    record.point             = r.at(hit.t);
+    record.setFaceNormal(r, jtx::normalize(toObject.transposedVector(objectNormal)));
+}
+
+Scene flattenInstances(const Scene &scene, const std::vector<Instance> &instances) {
+    Scene flat;
+    flat.meshes.reserve(instances.size());
+    for (const Instance &instance: instances) {
+        const Mesh &mesh               = scene.meshes[instance.meshIndex];
+        const AffineTransform toObject = instance.objectToWorld.inverse();
+        const auto indices             = new Vec3i[mesh.numIndices];
+        const auto vertices            = new Vec3f[mesh.numVertices];
+        const auto normals             = new Vec3f[mesh.numVertices];
+        Vec2f *uvs                     = mesh.uvs ? new Vec2f[mesh.numVertices] : nullptr;
+
+        std::copy_n(mesh.indices, mesh.numIndices, indices);
+        for (int i = 0; i < mesh.numVertices; ++i) {
+            vertices[i] = instance.objectToWorld.point(mesh.vertices[i]);
+            normals[i]  = jtx::normalize(toObject.transposedVector(mesh.normals[i]));
+        }
+        if (uvs) std::copy_n(mesh.uvs, mesh.numVertices, uvs);
+
+        const int meshIndex = static_cast<int>(flat.meshes.size());
+        flat.meshes.push_back(Mesh{mesh.numVertices, mesh.numIndices, indices, vertices, normals, uvs});
+        for (int i = 0; i < mesh.numIndices; ++i) flat.triangles.push_back(Triangle{i, meshIndex});
+    }
+    return flat;
+}
+
+template struct TLAS<BVH2>;
+template struct TLAS<BVH4>;
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "bvh2.hpp"
+#include "bvh4.hpp"
+
+// Two-level acceleration structure: one bottom-level BVH (BLAS) per mesh, built once and shared by every instance of it,
+// under a top-level BVH2 (TLAS) over the instances' world bounds. Rays are moved into object space at TLAS leaves,
+// so a mesh placed thousands of times costs one BLAS plus one instance record per placement.
+
+/**
+ * Affine map p -> A p + b stored as a row-major 3x4 matrix [A | b]
+ */
+struct AffineTransform {
+    float m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    /**
+     * Reads the affine part of a transform through its point and vector maps
+     */
+    static AffineTransform fromTransform(const Transform &transform) {
+        const Vec3f axes[3] = {transform.applyToVec(Vec3f(1, 0, 0)), transform.applyToVec(Vec3f(0, 1, 0)), transform.applyToVec(Vec3f(0, 0, 1))};
+        const Vec3f origin  = transform.applyToPoint(Vec3f(0, 0, 0));
+
+        AffineTransform affine;
+        for (int i = 0; i < 3; ++i) {
+            affine.m[i][0] = axes[0][i];
+            affine.m[i][1] = axes[1][i];
+            affine.m[i][2] = axes[2][i];
+            affine.m[i][3] = origin[i];
+        }
+        return affine;
+    }
+
+    /**
+     * Scales per axis, rotates about an axis, then translates
+     * @param axis unit rotation axis
+     * @param angle rotation in radians
+     */
+    static AffineTransform fromScaleRotateTranslate(const Vec3f &scale, const Vec3f &axis, const float angle, const Vec3f &translation) {
+        // Rodrigues' rotation formula
+        const float c              = std::cos(angle);
+        const float s              = std::sin(angle);
+        const float k              = 1 - c;
+        const float rotation[3][3] = {
+                {c + axis.x * axis.x * k, axis.x * axis.y * k - axis.z * s, axis.x * axis.z * k + axis.y * s},
+                {axis.y * axis.x * k + axis.z * s, c + axis.y * axis.y * k, axis.y * axis.z * k - axis.x * s},
+                {axis.z * axis.x * k - axis.y * s, axis.z * axis.y * k + axis.x * s, c + axis.z * axis.z * k},
+        };
+
+        AffineTransform affine;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) affine.m[i][j] = rotation[i][j] * scale[j];
+            affine.m[i][3] = translation[i];
+        }
+        return affine;
+    }
+
+    [[nodiscard]]
+    Vec3f point(const Vec3f &p) const {
+        return {m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3], m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]};
+    }
+
+    [[nodiscard]]
+    Vec3f vector(const Vec3f &v) const {
+        return {m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z, m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z, m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z};
+    }
+
+    /**
+     * Applies the transpose of A. With the world-to-object map this takes object-space normals to world space.
+     */
+    [[nodiscard]]
+    Vec3f transposedVector(const Vec3f &v) const {
+        return {m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z, m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z, m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z};
+    }
+
+    /**
+     * Inverse map; A must be invertible
+     */
+    [[nodiscard]]
+    AffineTransform inverse() const {
+        // Cofactors of A, transposed
+        AffineTransform inv;
+        inv.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        inv.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        inv.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        inv.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        inv.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        inv.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        inv.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        inv.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        inv.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        const float invDet = 1 / (m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0]);
+        for (auto &row: inv.m) {
+            for (int j = 0; j < 3; ++j) row[j] *= invDet;
+        }
+
+        const Vec3f b = inv.vector(Vec3f(m[0][3], m[1][3], m[2][3]));
+        inv.m[0][3]   = -b.x;
+        inv.m[1][3]   = -b.y;
+        inv.m[2][3]   = -b.z;
+        return inv;
+    }
+};
+
+/**
+ * A placement of a scene mesh
+ */
+struct Instance {
+    // Index into Scene::meshes
+    int meshIndex;
+    AffineTransform objectToWorld;
+};
+
+/**
+ * Hit on an instanced mesh. primIndex is the triangle's index within its mesh.
+ */
+struct InstanceHit : PrimitiveHit {
+    int instance = -1;
+};
+
+/**
+ * Two-level BVH over instances of a scene's meshes. BVH is the BLAS type: BVH2 or BVH4.
+ * Meshes are not copied; each BLAS indexes the scene's mesh buffers directly.
+ */
+template<typename BVH>
+struct TLAS {
+    // Leaves hold a single instance: an instance test costs a ray transform and a BLAS traversal
+    static constexpr int MAX_INSTANCES_IN_NODE = 1;
+
+    std::vector<Instance> instances;
+    const Scene &scene;
+    // Threads used by build(); 0 uses all hardware threads
+    int numBuildThreads = 0;
+
+    // One single-mesh scene and BLAS per Scene::meshes entry; set by build()
+    std::vector<Scene> meshScenes;
+    std::vector<BVH> blases;
+    std::vector<AABB> meshBounds;
+
+    // Top level; set by build() and buildTopLevel()
+    std::vector<AffineTransform> worldToObject;
+    // Index into instances of each leaf entry, in leaf order
+    std::vector<uint32_t> instanceIndices;
+    LBVH2Node *nodes = nullptr;
+    int numNodes     = 0;
+    // Most interior nodes on any root-to-leaf path of the top level, set by computeMaxDepth()
+    int maxDepth = 0;
+
+    /**
+     * Builds a BLAS per mesh, then the top level. Calling it again frees and rebuilds everything.
+     */
+    void build();
+
+    /**
+     * Rebuilds only the top level over the current instances, reusing the BLASes (e.g. after moving instances)
+     */
+    void buildTopLevel();
+
+    /**
+     * Sets maxDepth from the top-level node array, which must be in depth-first order. Called by buildTopLevel();
+     * only needed again after nodes is replaced by hand.
+     */
+    void computeMaxDepth();
+
+    void destroy() {
+        freeBVHNodes(nodes);
+        for (auto &blas: blases) blas.destroy();
+    }
+
+    /**
+     * Memory held by the BLASes (nodes, leaf data, triangle lists) and the top level, excluding the shared mesh buffers
+     */
+    [[nodiscard]]
+    size_t bytes() const;
+
+    bool closestHit(const Ray &r, Interval t, SurfaceIntersection &record) const;
+    bool closestHit(const Ray &r, Interval t, InstanceHit &hit) const;
+    bool anyHit(const Ray &r, Interval t) const;
+
+    /**
+     * Computes world-space shading data for a hit found by closestHit
+     */
+    void finalizeIntersection(const Ray &r, const InstanceHit &hit, SurfaceIntersection &record) const;
+
+    /**
+     * Ray in an instance's object space. The direction is not renormalised, so hit distances carry over unchanged.
+     */
+    [[nodiscard]]
+    Ray objectRay(const Ray &r, const int instance) const {
+        return Ray{worldToObject[instance].point(r.origin), worldToObject[instance].vector(r.dir)};
+    }
+};
+
+/**
+ * Copies every instance into a scene of its own meshes in world space, as a single-level BVH would need.
+ * Free the result with Scene::destroy().
+ */
+Scene flattenInstances(const Scene &scene, const std::vector<Instance> &instances);